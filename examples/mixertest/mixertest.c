@@ -1,4 +1,5 @@
 #include <libdragon.h>
+#include <stdio.h>
 
 // Mixer channel allocation
 #define CHANNEL_SFX1    0
@@ -35,7 +36,22 @@ int main(void) {
 	bool music = false;
 	int music_frequency = sfx_monosample.wave.frequency;
 
+	// Time spent by the CPU to start the last mix, and waiting for RSP to
+	// finish it after drawing the frame (in ticks)
+	uint32_t mix_ticks = 0, wait_ticks = 0;
+
 	while (1) {
+		// Check whether one audio buffer is ready, otherwise wait for next
+		// frame to perform mixing. Mixing runs on RSP while we draw the
+		// frame and process input.
+		short *buf = NULL;
+		if (audio_can_write()) {
+			buf = audio_write_begin();
+			uint32_t t0 = TICKS_READ();
+			mixer_poll_async(buf, audio_get_buffer_length());
+			mix_ticks = TICKS_READ() - t0;
+		}
+
 		display_context_t disp = display_lock();
 		graphics_fill_screen(disp, 0);
 		graphics_draw_text(disp, 200-75, 10, "Audio mixer test");
@@ -44,6 +60,11 @@ int main(void) {
 		graphics_draw_text(disp, 50, 70, "B - Play laser (keep pressed)");
 		graphics_draw_text(disp, 50, 80, "Z - Start / stop background music");
 		graphics_draw_text(disp, 70, 90, "L/R - Change music frequency");
+		char sbuf[64];
+		sprintf(sbuf, "Mixer: %ld us CPU, %ld us waiting",
+			(long)((uint64_t)mix_ticks * 1000000 / TICKS_PER_SECOND),
+			(long)((uint64_t)wait_ticks * 1000000 / TICKS_PER_SECOND));
+		graphics_draw_text(disp, 50, 110, sbuf);
 		graphics_draw_text(disp, 50, 140, "Music courtesy of MishtaLu / indiegamemusic.com");
 		display_show(disp);
 
@@ -81,11 +102,11 @@ int main(void) {
 			mixer_ch_stop(CHANNEL_SFX2);
 		}
 
-		// Check whether one audio buffer is ready, otherwise wait for next
-		// frame to perform mixing.
-		if (audio_can_write()) {    	
-			short *buf = audio_write_begin();
-			mixer_poll(buf, audio_get_buffer_length());
+		// Submit the buffer once the mixing is done.
+		if (buf) {
+			uint32_t t0 = TICKS_READ();
+			mixer_wait();
+			wait_ticks = TICKS_READ() - t0;
 			audio_write_end();
 		}
 	}
@@ -8,6 +8,8 @@
 #define NUM_VECTORS       (NUM_VECTOR_SLOTS*2)
 #define NUM_MATRICES      4
 #define MTX_SLOT          30
+#define BENCH_FRAMES      60
+#define BENCH_RUNS        64
 
 vec4_t vectors[NUM_VECTORS];
 mtx4x4_t identity, scale, rotation, translation;
@@ -35,6 +37,44 @@ void print_output(const char* header)
     print_vectors(vectors, NUM_VECTORS);
 }
 
+// Amount of work done by the idle callback, as a stand-in for
+// anything useful a game could do while waiting for the RSP.
+volatile uint32_t idle_work;
+
+void idle_callback(void *ctx)
+{
+    for (int i = 0; i < 64; i++)
+        idle_work++;
+}
+
+void benchmark_waits(bool use_callback)
+{
+    rspq_set_wait_callback(use_callback ? idle_callback : NULL, NULL);
+    rspq_reset_wait_stats();
+    idle_work = 0;
+
+    for (int frame = 0; frame < BENCH_FRAMES; frame++)
+    {
+        // Queue a frame worth of RSP work, then wait for it like a game
+        // would do before using the results.
+        for (int i = 0; i < BENCH_RUNS; i++)
+        {
+            rspq_block_run(transform_vectors_block);
+        }
+        rspq_wait();
+    }
+
+    rspq_set_wait_callback(NULL, NULL);
+
+    rspq_wait_stats_t stats;
+    rspq_get_wait_stats(&stats);
+    printf("%-13s waited %5d us/frame, reclaimed %5d us/frame (%lu work units)\n",
+        use_callback ? "Idle callback:" : "Spinning:",
+        TIMER_MICROS(stats.wait_ticks / BENCH_FRAMES),
+        TIMER_MICROS(stats.idle_ticks / BENCH_FRAMES),
+        idle_work / BENCH_FRAMES);
+}
+
 int main()
 {
     // Initialize systems
@@ -128,6 +168,12 @@ int main()
     rspq_block_run(transform_vectors_block);
     print_output("Combined:");
 
+    // Measure the CPU time spent waiting for the RSP in each frame, and how
+    // much of it an idle callback can reclaim.
+    printf("CPU time waiting for the RSP:\n");
+    benchmark_waits(false);
+    benchmark_waits(true);
+
     // Clean up
     rspq_block_free(transform_vectors_block);
     free_uncached(matrices);
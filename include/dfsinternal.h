@@ -6,6 +6,9 @@
 #ifndef __LIBDRAGON_DFSINTERNAL_H
 #define __LIBDRAGON_DFSINTERNAL_H
 
+#include <stdbool.h>
+#include "dma.h"
+
 /**
  * @addtogroup dfs
  * @{
@@ -41,18 +44,119 @@ _Static_assert(sizeof(struct directory_entry) == SECTOR_SIZE, "invalid directory
 /** @brief Type definition */
 typedef struct directory_entry directory_entry_t;
 
+/**
+ * @brief Flag set in #directory_entry::flags for compressed files
+ *
+ * This is stored in the same nibble of the file type (see #FILETYPE), so
+ * it must be masked out before comparing types.
+ */
+#define FLAGS_COMPRESSED    0x4
+
+/** @brief Compression algorithm: LZH5 (the -lh5- method of LHA archives) */
+#define COMPRESS_LZH5       1
+
+/**
+ * @brief Header at the start of the data of a compressed file
+ *
+ * The size stored in the directory entry of a compressed file is the
+ * decompressed size. The compressed stream follows this header.
+ */
+typedef struct compressed_header
+{
+    /** @brief Compression algorithm (#COMPRESS_LZH5) */
+    uint32_t algorithm;
+    /** @brief Size in bytes of the compressed stream following the header */
+    uint32_t compressed_size;
+} compressed_header_t;
+
+/** @brief Magic value identifying the path table ("DFSP") */
+#define PATH_TABLE_MAGIC    0x44465350
+
+/**
+ * @brief Header of the optional path table
+ *
+ * The path table is a blob written by mkdfs, pointed to by the
+ * #directory_entry::file_pointer of the root sector (which is zero on
+ * images without a table). It maps every file in the filesystem, by its
+ * full path, to its directory entry, so that it can be loaded into RAM
+ * once and used to open files without walking directory sectors.
+ *
+ * The header is followed by #num_entries #path_table_entry_t, sorted by
+ * hash, and then by the NUL-terminated paths they refer to.
+ */
+typedef struct path_table_header
+{
+    /** @brief Must be #PATH_TABLE_MAGIC */
+    uint32_t magic;
+    /** @brief Number of entries in the table */
+    uint32_t num_entries;
+    /** @brief Total size of the table in bytes, including header and paths */
+    uint32_t size;
+} path_table_header_t;
+
+/** @brief An entry of the path table */
+typedef struct path_table_entry
+{
+    /** @brief Hash of the full path (see #path_table_hash) */
+    uint32_t hash;
+    /** @brief Offset of the full path string, from the start of the table */
+    uint32_t path_offset;
+    /** @brief Offset of the directory entry of the file */
+    uint32_t dirent;
+    /** @brief Copy of #directory_entry::flags */
+    uint32_t flags;
+    /** @brief Copy of #directory_entry::file_pointer */
+    uint32_t file_pointer;
+} path_table_entry_t;
+
+/**
+ * @brief Hash a full path for the path table (32-bit FNV-1a)
+ *
+ * Paths are hashed in canonical form: relative to the root, with no
+ * leading slash and no "." or ".." components (eg: "levels/1/map.dat").
+ */
+static inline uint32_t path_table_hash(const char *path)
+{
+    uint32_t hash = 0x811C9DC5;
+
+    while(*path)
+    {
+        hash ^= (uint8_t)*path++;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+/** @brief Default number of blocks of the block cache (see #dfs_cache_config) */
+#define CACHE_DEFAULT_BLOCKS        16
+/** @brief Default size in bytes of each block of the block cache */
+#define CACHE_DEFAULT_BLOCK_SIZE    1024
+
+/**
+ * @brief A block of the block cache
+ *
+ * The block cache is shared by all open files, directory lookups and
+ * memory-mapped files. Blocks are identified by their PI address, so the same
+ * data is never cached twice, even when it is reached through different paths.
+ */
+typedef struct cache_block
+{
+    /** @brief PI address of the block (aligned to the block size), or 0 if empty */
+    uint32_t addr;
+    /** @brief Time of last use of the block, for LRU replacement */
+    uint32_t used;
+    /** @brief DMA request used to load the block */
+    dma_request_t req;
+} cache_block_t;
+
 /** @brief Open file handle structure */
 typedef struct open_file
 {
-    /** @brief Cached data to speed up small reads.
-     *
-     *  We want this buffer to be 8-byte aligned for DMA, but also
-     *  16-byte aligned so that it doesn't share cachelines with other
-     *  members of the structure, so it's easier to handle coherency.
-     * */
-    uint8_t cached_data[512] __attribute__((aligned(16)));
-    /** @brief location of the cached data */
-    uint32_t cached_loc;
+    /** @brief Location at which a read would continue the previous one */
+    uint32_t sequential_loc;
+    /** @brief DMA request used by #dfs_read_async */
+    dma_request_t async_req;
     /** @brief The unique file handle to refer to this file by */
     uint32_t handle;
     /** @brief The size in bytes of this file */
@@ -61,6 +165,18 @@ typedef struct open_file
     uint32_t loc;
     /** @brief The offset within the filesystem where the file is stored */
     uint32_t cart_start_loc;
+    /** @brief The number of bytes stored in ROM for this file */
+    uint32_t data_size;
+    /** @brief True if the file is compressed */
+    bool compressed;
+    /** @brief Decompressor state for compressed files (allocated on first read) */
+    struct _LHANewDecoder *decoder;
+    /** @brief Offset in the decompressed stream reached by the decompressor */
+    uint32_t decoder_loc;
+    /** @brief Offset in the file data of the next compressed byte to decode */
+    uint32_t decoder_data_loc;
+    /** @brief Index of the path of the file in the access trace, or -1 */
+    int trace_path;
 } open_file_t;
 
 /** @} */ /* dfs */
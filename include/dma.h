@@ -6,10 +6,52 @@
 #ifndef __LIBDRAGON_DMA_H
 #define __LIBDRAGON_DMA_H
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** @brief Priority of a queued PI DMA transfer */
+typedef enum {
+    /** @brief Background transfers, such as prefetching or streaming large assets */
+    DMA_PRIORITY_LOW = 0,
+    /** @brief Normal transfers, such as filesystem reads */
+    DMA_PRIORITY_NORMAL,
+    /** @brief Latency-critical transfers, such as audio waveforms */
+    DMA_PRIORITY_HIGH,
+    /** @brief Number of priority levels */
+    DMA_PRIORITY_COUNT
+} dma_priority_t;
+
+/** @brief Callback invoked (under interrupt) when a queued transfer is finished */
+typedef void (*dma_callback_t)(void *ctx);
+
+/**
+ * @brief A queued PI DMA transfer
+ *
+ * The structure is owned by the caller and must stay valid until the
+ * transfer is finished. Its contents are private to the DMA module.
+ */
+typedef struct dma_request_s {
+    /** @brief Next request in the queue */
+    struct dma_request_s *next;
+    /** @brief Uncached RDRAM address of the remaining part of the transfer */
+    unsigned long ram_address;
+    /** @brief PI address of the remaining part of the transfer */
+    unsigned long pi_address;
+    /** @brief Remaining length of the transfer */
+    unsigned long len;
+    /** @brief Priority of the transfer */
+    dma_priority_t priority;
+    /** @brief Callback to invoke at the end of the transfer (or NULL) */
+    dma_callback_t callback;
+    /** @brief Argument of the callback */
+    void *ctx;
+    /** @brief True while the transfer is queued or in progress */
+    volatile bool pending;
+} dma_request_t;
+
 void dma_write_raw_async(const void *ram_address, unsigned long pi_address, unsigned long len);
 void dma_write(const void * ram_address, unsigned long pi_address, unsigned long len);
 
@@ -18,6 +60,12 @@ void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long l
 void dma_read(void * ram_address, unsigned long pi_address, unsigned long len);
 
 void dma_wait(void);
+bool dma_idle(void);
+
+void dma_read_queued(dma_request_t *req, void *ram_address, unsigned long pi_address, unsigned long len,
+    dma_priority_t priority, dma_callback_t callback, void *ctx);
+bool dma_request_done(dma_request_t *req);
+void dma_request_wait(dma_request_t *req);
 
 /* 32 bit IO read from PI device */
 uint32_t io_read(uint32_t pi_address);
@@ -6,6 +6,8 @@
 #ifndef __LIBDRAGON_DRAGONFS_H
 #define __LIBDRAGON_DRAGONFS_H
 
+#include "dma.h"
+
 /** 
  * @addtogroup dfs
  * @{
@@ -75,6 +77,57 @@
 #define FLAGS_EOF           0x2
 /** @} */
 
+/** @brief A file to load with #dfs_load_batch */
+typedef struct dfs_load_s
+{
+    /** @brief Path of the file to load */
+    const char *path;
+    /** @brief Destination buffer */
+    void *buf;
+    /** @brief On input, size of the buffer. On output, size of the file,
+     *         or a negative error if the file could not be loaded. */
+    int size;
+    /** @brief DMA request used for the transfer (private) */
+    dma_request_t req;
+    /** @brief Batch this load belongs to (private) */
+    struct dfs_batch_s *batch;
+} dfs_load_t;
+
+/** @brief State of a batch of loads started with #dfs_load_batch */
+typedef struct dfs_batch_s
+{
+    /** @brief Files being loaded */
+    dfs_load_t *loads;
+    /** @brief Number of files being loaded */
+    int count;
+    /** @brief Number of loads not finished yet */
+    volatile int pending;
+    /** @brief Function to call when the whole batch is finished */
+    dma_callback_t callback;
+    /** @brief Opaque argument to pass to the callback */
+    void *ctx;
+} dfs_batch_t;
+
+/** @brief Statistics of the block cache, see #dfs_cache_get_stats */
+typedef struct dfs_cache_stats_s
+{
+    /** @brief Number of accesses served from the cache */
+    uint32_t hits;
+    /** @brief Number of accesses that had to wait for a block to be loaded */
+    uint32_t misses;
+    /** @brief Number of blocks loaded in background by read-ahead */
+    uint32_t prefetches;
+} dfs_cache_stats_t;
+
+/** @brief Type of an event of the access trace, see #dfs_trace_get */
+typedef enum
+{
+    /** @brief A file was opened */
+    DFS_TRACE_OPEN,
+    /** @brief Data was read from a file */
+    DFS_TRACE_READ
+} dfs_trace_event_t;
+
 /** @} */
 
 #ifdef __cplusplus
@@ -88,6 +141,9 @@ int dfs_dir_findnext(char *buf);
 
 int dfs_open(const char * const path);
 int dfs_read(void * const buf, int size, int count, uint32_t handle);
+int dfs_read_async(void * const buf, int size, int count, uint32_t handle);
+int dfs_read_poll(uint32_t handle);
+int dfs_read_wait(uint32_t handle);
 int dfs_seek(uint32_t handle, int offset, int origin);
 int dfs_tell(uint32_t handle);
 int dfs_close(uint32_t handle);
@@ -95,6 +151,23 @@ int dfs_eof(uint32_t handle);
 int dfs_size(uint32_t handle);
 uint32_t dfs_rom_addr(const char *path);
 
+const void *dfs_mmap(const char *path, int *size);
+int dfs_mmap_read(const void *addr, void *buf, int len);
+const void *dfs_mmap_ptr(const void *addr, int len);
+
+int dfs_load_batch(dfs_batch_t *batch, dfs_load_t *loads, int count, dma_callback_t callback, void *ctx);
+bool dfs_load_batch_done(dfs_batch_t *batch);
+void dfs_load_batch_wait(dfs_batch_t *batch);
+
+int dfs_cache_config(int num_blocks, int block_size);
+void dfs_cache_get_stats(dfs_cache_stats_t *stats);
+void dfs_cache_reset_stats(void);
+
+int dfs_trace_start(int max_events);
+int dfs_trace_stop(void);
+void dfs_trace_dump(void);
+int dfs_trace_get(int index, const char **path, uint32_t *offset, uint32_t *len);
+
 #ifdef __cplusplus
 }
 #endif
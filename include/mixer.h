@@ -200,6 +200,9 @@ void mixer_ch_play(int ch, waveform_t *wave);
  * 
  * This function must be called after mixer_ch_play, as otherwise the
  * frequency is reset to the default of the waveform.
+ *
+ * If a mix started by #mixer_poll_async is running, this function waits
+ * for it to finish.
  * 
  * @param[in]   ch              Channel index
  * @param[in]   frequency       Playback frequency (in Hz / samples per second)
@@ -215,6 +218,9 @@ void mixer_ch_set_freq(int ch, float frequency);
  *
  * This function must be called after mixer_ch_play, as otherwise the
  * position is reset to the beginning of the waveform.
+ *
+ * If a mix started by #mixer_poll_async is running, this function waits
+ * for it to finish.
  * 
  * @param[in]   ch              Channel index
  * @param[in]   pos             Playback position (in number of samples)
@@ -283,6 +289,152 @@ bool mixer_ch_playing(int ch);
  */
 void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_sz);
 
+/** @brief Interpolation modes for #mixer_ch_set_interp */
+typedef enum {
+	MIXER_INTERP_NONE = 0,      ///< No interpolation: nearest preceding sample (default)
+	MIXER_INTERP_LINEAR,        ///< Linear interpolation (2 taps)
+	MIXER_INTERP_CUBIC,         ///< Cubic (Catmull-Rom) interpolation (4 taps)
+	MIXER_INTERP_SINC,          ///< Windowed sinc interpolation (8 taps)
+} mixer_interp_t;
+
+/**
+ * @brief Configure the interpolation used to resample the channel.
+ *
+ * By default, resampling picks the nearest preceding sample of the waveform,
+ * which is very fast (about 5-6 RSP cycles per sample) but adds audible
+ * aliasing when the waveform is played far from its original frequency
+ * (eg: instruments of XM modules). Interpolating the samples reduces it,
+ * at a higher RSP cost.
+ *
+ * All interpolation modes run the same RSP kernel. Its cost is estimated at
+ * about 40 RSP cycles per sample (so about 3% of the RSP time for each
+ * channel at 44100 Hz), plus a small overhead for each mix; this estimate
+ * comes from the latency of its chain of vector instructions, and has not
+ * been measured on hardware yet. The test_mixer_interp test of the testrom
+ * logs the measured cost of each mode when libdragon is built with
+ * RSPQ_PROFILE. The modes only differ in quality:
+ * linear interpolation is the smoothest (and dullest), while the windowed
+ * sinc preserves most of the high frequencies.
+ *
+ * The interpolation reads up to 3 samples before and 4 after the current
+ * position: the first samples of a waveform are interpolated with silence,
+ * and so are the last ones of a non-looping waveform. When a loop restarts,
+ * the samples before it are the last ones of the loop.
+ *
+ * Interpolation is only available for mono waveforms: stereo waveforms are
+ * always resampled without interpolation.
+ *
+ * @param[in]   ch              Channel index
+ * @param[in]   interp          Interpolation mode
+ */
+void mixer_ch_set_interp(int ch, mixer_interp_t interp);
+
+/** @brief Filter types for #mixer_ch_set_filter */
+typedef enum {
+	MIXER_FILTER_NONE = 0,      ///< No filter (default)
+	MIXER_FILTER_LOWPASS,       ///< Low-pass filter (12 dB/octave)
+	MIXER_FILTER_HIGHPASS,      ///< High-pass filter (12 dB/octave)
+	MIXER_FILTER_BANDPASS,      ///< Band-pass filter (0 dB peak gain)
+} mixer_filter_t;
+
+/**
+ * @brief Configure a filter on the specified channel.
+ *
+ * The filter is a biquad, applied by RSP to the channel samples after
+ * resampling (that is, at the output sample rate), and before
+ * volume and panning. The coefficients are calculated with the usual
+ * "Audio EQ Cookbook" formulas.
+ *
+ * Filtering is done by RSP on groups of 8 channels (0-7, 8-15, etc.): a
+ * group costs about 11 RSP cycles per sample if at least one of its channels
+ * has a filter, so it is better to allocate filtered channels next to each
+ * other. The filter state is kept across calls to #mixer_ch_play.
+ *
+ * The coefficients are 2.14 fixed point numbers, so very low cutoff
+ * frequencies (below ~1/200 of the output sample rate) are not accurate.
+ *
+ * For a stereo waveform, the filter must be configured on the first channel,
+ * and it is automatically applied to both.
+ *
+ * @param[in]   ch              Channel index
+ * @param[in]   type            Filter type (#MIXER_FILTER_NONE to disable)
+ * @param[in]   freq            Cutoff (or center) frequency in Hz
+ * @param[in]   q               Quality factor (0.707 is a flat response for
+ *                              low-pass and high-pass filters)
+ *
+ * @see #mixer_ch_set_biquad
+ */
+void mixer_ch_set_filter(int ch, mixer_filter_t type, float freq, float q);
+
+/**
+ * @brief Configure a custom biquad filter on the specified channel.
+ *
+ * This is the low-level version of #mixer_ch_set_filter, which allows
+ * to specify the coefficients of the filter directly (normalized so that
+ * a0 is 1):
+ *
+ *    y[n] = b0*x[n] + b1*x[n-1] + b2*x[n-2] - a1*y[n-1] - a2*y[n-2]
+ *
+ * All coefficients must be in the range [-2..2).
+ *
+ * @param[in]   ch              Channel index
+ * @param[in]   b0              Feed-forward coefficient for x[n]
+ * @param[in]   b1              Feed-forward coefficient for x[n-1]
+ * @param[in]   b2              Feed-forward coefficient for x[n-2]
+ * @param[in]   a1              Feedback coefficient for y[n-1]
+ * @param[in]   a2              Feedback coefficient for y[n-2]
+ */
+void mixer_ch_set_biquad(int ch, float b0, float b1, float b2, float a1, float a2);
+
+/**
+ * @brief Set the send level of a channel to the effects bus.
+ *
+ * The effects bus is a mono mix of all channels, each one with its own
+ * send level (0 by default). The bus is not directly audible: it is
+ * written into the delay lines (see #mixer_ch_play_delay), which are then
+ * played back as normal channels.
+ *
+ * The send level is applied to the channel samples after the filter, but
+ * before the channel volume (it is not affected by #mixer_ch_set_vol nor
+ * by the master volume). Notice also that changes of the send level
+ * are applied immediately, without the smoothing done for the volume.
+ *
+ * Mixing the bus costs about 4-7 RSP cycles per sample, and it is
+ * only active if any channel has a non-zero send level, or a delay line
+ * is playing.
+ *
+ * @param[in]   ch              Channel index
+ * @param[in]   send            Send level (range [0..1])
+ */
+void mixer_ch_set_send(int ch, float send);
+
+/**
+ * @brief Play a delay line of the effects bus on the specified channel.
+ *
+ * A delay line is a buffer in RDRAM (allocated by the mixer), where RSP
+ * continuously writes the effects bus (see #mixer_ch_set_send). The channel
+ * plays back the buffer, so that the bus is heard after the specified
+ * delay. The channel volume (#mixer_ch_set_vol) is thus the level of the
+ * effect, and its send level is the feedback (the amount of output that is
+ * sent back to the bus).
+ *
+ * This allows to implement several effects. For instance, an echo is a single
+ * delay line of 100-500 ms with some feedback (eg: 0.4). A simple reverb
+ * can be obtained with 3-4 delay lines of different, mutually prime, short
+ * delays (eg: 29, 37, 43 ms), with feedback 0.5-0.7, panned differently,
+ * and optionally with a low-pass filter on them (#mixer_ch_set_filter) to
+ * dampen the high frequencies. Notice that the total feedback must stay
+ * below 1, or the effect will not decay.
+ *
+ * The delay line is freed when the channel is stopped (#mixer_ch_stop), or
+ * another waveform is played on it.
+ *
+ * @param[in]   ch              Channel index
+ * @param[in]   delay           Delay in seconds (at least 64 samples at the
+ *                              output sample rate)
+ */
+void mixer_ch_play_delay(int ch, float delay);
+
 /**
  * @brief Run the mixer to produce output samples.
  * 
@@ -305,6 +457,80 @@ void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_
  */
 void mixer_poll(int16_t *out, int nsamples);
 
+/**
+ * @brief Run the mixer to produce output samples, without waiting for RSP.
+ *
+ * This function is similar to #mixer_poll, but it returns as soon as the
+ * mixing has been scheduled on RSP, so that the CPU can go on with other
+ * work (eg: the game logic, or the preparation of the next frame) while
+ * RSP mixes the audio in the background.
+ *
+ * The contents of the output buffer are only valid after the mixing is
+ * finished. Call #mixer_wait (or poll #mixer_poll_done) before handing the
+ * buffer over to the audio subsystem:
+ *
+ * @code{.c}
+ *      while (1) {
+ *          int16_t *buf = NULL;
+ *          if (audio_can_write()) {
+ *              buf = audio_write_begin();
+ *              mixer_poll_async(buf, audio_get_buffer_length());
+ *          }
+ *
+ *          // [...] game logic and rendering, overlapped with mixing
+ *
+ *          if (buf) {
+ *              mixer_wait();
+ *              audio_write_end();
+ *          }
+ *      }
+ * @endcode
+ *
+ * While the mix is running, the channel state is still in use by RSP. So the
+ * functions that read or modify it block until the mix is finished, as if
+ * #mixer_wait was called: #mixer_ch_play, #mixer_ch_play_delay,
+ * #mixer_ch_stop, #mixer_ch_playing, #mixer_ch_set_freq, #mixer_ch_set_pos,
+ * #mixer_ch_get_pos, #mixer_ch_set_limits and #mixer_close. It is always safe
+ * to call them, but calling them between this function and #mixer_wait
+ * loses the overlap: call them before starting the mix, or after waiting for
+ * it. The other setters (volume, filter, send level, interpolation) only
+ * affect the next mix, and do not block.
+ *
+ * Notice that if events (see #mixer_add_event) fall within the requested
+ * samples, the mixing up to each event must complete before its callback
+ * is invoked, so only the part after the last event is run asynchronously.
+ *
+ * This function cannot be used from the audio buffer callback (see
+ * #audio_set_buffer_callback), as the buffer is consumed as soon as the
+ * callback returns.
+ *
+ * @param[in]   out             Output buffer were samples will be written.
+ * @param[in]   nsamples        Number of stereo samples to generate.
+ *
+ * @see #mixer_wait
+ * @see #mixer_poll_done
+ */
+void mixer_poll_async(int16_t *out, int nsamples);
+
+/**
+ * @brief Wait for the mixing started by #mixer_poll_async to finish.
+ *
+ * After this function returns, the output buffer passed to #mixer_poll_async
+ * contains the mixed samples. If no mixing is in progress, this function
+ * returns immediately.
+ */
+void mixer_wait(void);
+
+/**
+ * @brief Check whether the mixing started by #mixer_poll_async has finished.
+ *
+ * This is a non-blocking version of #mixer_wait.
+ *
+ * @return      true if no mixing is in progress (so the output buffer is
+ *              ready), false otherwise.
+ */
+bool mixer_poll_done(void);
+
 /**
  * @brief Callback invoked by mixer_poll at a specified time
  * 
@@ -0,0 +1,253 @@
+/**
+ * @file rspmath.h
+ * @brief RSP vector math library
+ * @ingroup rspmath
+ */
+
+#ifndef __LIBDRAGON_RSPMATH_H
+#define __LIBDRAGON_RSPMATH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup rspmath RSP vector math library
+ * @ingroup rsp
+ * @brief Batched vector and matrix operations running on the RSP.
+ *
+ * This library provides an overlay for the RSP command queue (see rspq.h)
+ * that performs vector math on large arrays of vectors stored in RDRAM,
+ * using the RSP vector unit. The arrays are streamed through DMEM with
+ * double-buffered DMA, so they can be of any size. All the operations are
+ * enqueued in the current RSP queue like any other command, so they are
+ * executed asynchronously and in order with respect to the other RSP
+ * commands. To know when an operation has finished, use any of the
+ * synchronization primitives of rspq (eg: #rspq_syncpoint_new and
+ * #rspq_syncpoint_wait).
+ *
+ * ## Data format
+ *
+ * All numbers are s15.16 fixed point. To match the layout of the RSP vector
+ * registers, vectors are stored in pairs (#rspmath_vec4x2_t): each pair
+ * contains the integer parts of the 8 components of two 4-component vectors,
+ * followed by their fractional parts. Arrays of vectors are thus arrays of
+ * #rspmath_vec4x2_t, and the number of vectors is always even.
+ *
+ * A 4x4 matrix (#rspmath_mat4_t) is stored as two pairs holding its 4
+ * columns, so it can also be seen as an array of 4 vectors.
+ *
+ * Use #rspmath_vec4x2_from_floats, #rspmath_vec4x2_to_floats and
+ * #rspmath_mat4_from_floats to convert data from and to floating point.
+ *
+ * ## CPU reference
+ *
+ * Each operation also has a CPU implementation with the same arguments,
+ * suffixed by `_cpu`. For #rspmath_mat4_transform, #rspmath_mat4_mul and
+ * #rspmath_vec4_dot, the CPU implementation emulates the RSP arithmetic
+ * and returns exactly the same results. #rspmath_vec4_normalize instead
+ * uses an approximated reciprocal square root on RSP, so results differ
+ * slightly from the CPU version, which is computed in floating point.
+ *
+ * ## Memory
+ *
+ * Input and output arrays must be 8-byte aligned (the types are declared
+ * with the required alignment). The CPU cache is handled by the functions
+ * at enqueue time: the input arrays are written back, and the output arrays
+ * are invalidated. The CPU must not access the output arrays until the
+ * operation is finished. Output arrays can be the same as input arrays
+ * (in-place operation), but they must not partially overlap.
+ *
+ * The functions only enqueue the operation: the RSP reads the matrices and
+ * the input arrays via DMA later, when the queue reaches the command. Until
+ * then, they must stay allocated and must not be modified by the CPU (a
+ * matrix on the stack of the caller is not valid anymore when the function
+ * returns, and a matrix updated for the next batch would be used for the
+ * previous one too). Use #rspq_wait, or a syncpoint, before freeing or
+ * reusing them.
+ *
+ * @{
+ */
+
+/**
+ * @brief A pair of 4-component vectors, in s15.16 fixed point.
+ *
+ * Components 0-3 are the first vector (x, y, z, w), components 4-7
+ * are the second one.
+ */
+typedef struct {
+    int16_t i[8];       ///< Integer part of each component
+    uint16_t f[8];      ///< Fractional part of each component
+} __attribute__((aligned(16))) rspmath_vec4x2_t;
+
+/**
+ * @brief A 4x4 matrix, in s15.16 fixed point.
+ *
+ * The matrix is stored by column: c[0] contains columns 0 and 1, c[1]
+ * contains columns 2 and 3.
+ */
+typedef struct {
+    rspmath_vec4x2_t c[2];  ///< Columns of the matrix
+} __attribute__((aligned(16))) rspmath_mat4_t;
+
+/**
+ * @brief Initialize the RSP vector math library
+ *
+ * This registers the overlay into the RSP queue, initializing the queue
+ * itself if required.
+ */
+void rspmath_init(void);
+
+/**
+ * @brief Deinitialize the RSP vector math library
+ */
+void rspmath_close(void);
+
+/**
+ * @brief Enqueue the transformation of an array of vectors by a matrix
+ *
+ * Each vector v of the input array is transformed as M*v, and stored
+ * in the output array.
+ *
+ * The RSP reads @p mtx and @p in only when it runs the command: both must
+ * stay valid and unmodified until then (see the Memory section above).
+ *
+ * @param[out]  out     Output array
+ * @param[in]   mtx     Matrix to transform the vectors with
+ * @param[in]   in      Input array
+ * @param[in]   count   Number of pairs of vectors in the arrays
+ */
+void rspmath_mat4_transform(rspmath_vec4x2_t *out, const rspmath_mat4_t *mtx,
+    const rspmath_vec4x2_t *in, int count);
+
+/**
+ * @brief Enqueue the multiplication of a matrix by an array of matrices
+ *
+ * For each matrix B of the input array, the product A*B is stored in the
+ * output array. This can be used to compose transformations.
+ *
+ * @p a and @p b are read by the RSP when it runs the command, not at enqueue
+ * time, so they must stay valid and unmodified until then.
+ *
+ * @param[out]  out     Output array of matrices
+ * @param[in]   a       Matrix to multiply by (left operand)
+ * @param[in]   b       Input array of matrices (right operands)
+ * @param[in]   count   Number of matrices in the arrays
+ */
+void rspmath_mat4_mul(rspmath_mat4_t *out, const rspmath_mat4_t *a,
+    const rspmath_mat4_t *b, int count);
+
+/**
+ * @brief Enqueue the dot products between two arrays of vectors
+ *
+ * For each pair of vectors at the same position in the two input arrays,
+ * the dot product is computed on all 4 components, and stored in all the
+ * components of the vector at the same position in the output array.
+ *
+ * Both input arrays are read by the RSP later, when it runs the command:
+ * they must stay valid and unmodified until then.
+ *
+ * @param[out]  out     Output array
+ * @param[in]   a       First input array
+ * @param[in]   b       Second input array
+ * @param[in]   count   Number of pairs of vectors in the arrays
+ */
+void rspmath_vec4_dot(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *a,
+    const rspmath_vec4x2_t *b, int count);
+
+/**
+ * @brief Enqueue the normalization of an array of vectors
+ *
+ * Each vector is scaled so that its length (computed on all 4 components)
+ * becomes 1. To normalize 3D directions, set the w component to 0. The
+ * squared length must be less than 32768. Null vectors are left unchanged.
+ *
+ * Because of the limited precision of s15.16 numbers, the result is less
+ * accurate for very short or very long vectors. For lengths between 0.1
+ * and 100, the error is below 0.1%.
+ *
+ * @p in is read by the RSP when it runs the command, so it must stay valid
+ * and unmodified until then.
+ *
+ * @param[out]  out     Output array
+ * @param[in]   in      Input array
+ * @param[in]   count   Number of pairs of vectors in the arrays
+ */
+void rspmath_vec4_normalize(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *in, int count);
+
+/** @brief CPU reference implementation of #rspmath_mat4_transform */
+void rspmath_mat4_transform_cpu(rspmath_vec4x2_t *out, const rspmath_mat4_t *mtx,
+    const rspmath_vec4x2_t *in, int count);
+
+/** @brief CPU reference implementation of #rspmath_mat4_mul */
+void rspmath_mat4_mul_cpu(rspmath_mat4_t *out, const rspmath_mat4_t *a,
+    const rspmath_mat4_t *b, int count);
+
+/** @brief CPU reference implementation of #rspmath_vec4_dot */
+void rspmath_vec4_dot_cpu(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *a,
+    const rspmath_vec4x2_t *b, int count);
+
+/** @brief CPU reference implementation of #rspmath_vec4_normalize */
+void rspmath_vec4_normalize_cpu(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *in, int count);
+
+/**
+ * @brief Read a component of a pair of vectors as a raw s15.16 value
+ *
+ * @param[in]   v       Pair of vectors
+ * @param[in]   idx     Component index (0-7)
+ * @return              Raw s15.16 value
+ */
+static inline int32_t rspmath_vec4x2_get(const rspmath_vec4x2_t *v, int idx)
+{
+    return (int32_t)(((uint32_t)(uint16_t)v->i[idx] << 16) | v->f[idx]);
+}
+
+/**
+ * @brief Write a component of a pair of vectors as a raw s15.16 value
+ *
+ * @param[out]  v       Pair of vectors
+ * @param[in]   idx     Component index (0-7)
+ * @param[in]   value   Raw s15.16 value
+ */
+static inline void rspmath_vec4x2_set(rspmath_vec4x2_t *v, int idx, int32_t value)
+{
+    v->i[idx] = (int16_t)(value >> 16);
+    v->f[idx] = (uint16_t)value;
+}
+
+/**
+ * @brief Convert an array of floats into pairs of vectors
+ *
+ * @param[out]  dst         Output array (must hold at least num_floats/8 pairs,
+ *                          rounded up)
+ * @param[in]   src         Input array of floats (4 components per vector)
+ * @param[in]   num_floats  Number of floats to convert
+ */
+void rspmath_vec4x2_from_floats(rspmath_vec4x2_t *dst, const float *src, int num_floats);
+
+/**
+ * @brief Convert pairs of vectors into an array of floats
+ *
+ * @param[out]  dst         Output array of floats
+ * @param[in]   src         Input array of pairs of vectors
+ * @param[in]   num_floats  Number of floats to convert
+ */
+void rspmath_vec4x2_to_floats(float *dst, const rspmath_vec4x2_t *src, int num_floats);
+
+/**
+ * @brief Convert a floating point matrix into a #rspmath_mat4_t
+ *
+ * @param[out]  dst     Output matrix
+ * @param[in]   m       Input matrix, stored by column (m[column][row])
+ */
+void rspmath_mat4_from_floats(rspmath_mat4_t *dst, const float m[4][4]);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -85,6 +85,23 @@
  * The CPU just enqueues a single command that "calls" the block. It is thus
  * much faster than enqueuing the same commands every frame.
  * 
+ * When a block is finished, it is compiled into a single contiguous buffer,
+ * so that the RSP can fetch it sequentially. All commands are validated at
+ * this point (the overlays must already be registered), and redundant
+ * commands are dropped: see #rspq_overlay_set_state_command. Commands of
+ * overlays declared as batchable (see #rspq_overlay_set_affinity) are also
+ * grouped by overlay, to reduce the number of overlay switches.
+ * 
+ * ## Overlay switches
+ * 
+ * The RSP has room for only one overlay at a time: every time the command
+ * stream switches to a command of a different overlay, the queue engine must
+ * save the state of the current overlay to RDRAM, and load the code and data
+ * of the new one. Interleaving commands of different overlays (eg: audio
+ * commands in the high-priority queue while the low-priority queue is
+ * running graphics commands) can thus waste a lot of RSP time. The number of
+ * switches can be measured with #rspq_get_overlay_stats.
+ * 
  * Blocks can be used by higher-level libraries as an internal tool to efficiently
  * drive the RSP (without having to repeat common sequence of commands), or
  * they can be used by end-users to record and replay batch of commands, similar
@@ -94,6 +111,16 @@
  * Blocks must always be created at runtime once (eg: at init time) before
  * being used.
  * 
+ * ## Enqueuing from interrupt handlers
+ * 
+ * #rspq_write must only be called by the main thread (it is not reentrant).
+ * Code running in interrupt handlers (eg: timer or VI callbacks) can instead
+ * enqueue commands through a submission queue (#rspq_submitq_t): a small
+ * ring of commands with a single producer, created with #rspq_submitq_new.
+ * Commands are written with #rspq_submitq_write (or #rspq_submitq_reserve and
+ * #rspq_submitq_commit) without disabling interrupts, and are moved into
+ * the RSP queue by the main thread at the next #rspq_flush.
+ * 
  * ## Syncpoints
  * 
  * The RSP command queue is designed to be fully lockless, but sometimes it is
@@ -108,6 +135,49 @@
  * Syncpoints are implemented using RSP interrupts, so their overhead is small
  * but still measurable. They should not be abused.
  * 
+ * ## Fences
+ * 
+ * Syncpoints can only be created in the low-priority queue, and always refer
+ * to a position in it. Fences (#rspq_fence_t) are a finer-grained primitive,
+ * that works in both queues and in both directions:
+ * 
+ *   * The RSP can signal a fence when it reaches a certain command
+ *     (#rspq_fence_enqueue_signal), and the CPU can wait for it
+ *     (#rspq_fence_wait). For instance, a library can wait until its own
+ *     command in the high-priority queue has been run, without waiting for
+ *     the whole high-priority queue like #rspq_highpri_sync does.
+ *   * The CPU can signal a fence (#rspq_fence_signal), and the RSP can wait
+ *     for it before going on with the queue (#rspq_fence_enqueue_wait). For
+ *     instance, commands that consume data prepared by the CPU can be queued
+ *     in advance, and be released once the data is ready.
+ * 
+ * ## Waiting for the RSP
+ * 
+ * Some functions need to block until the RSP has made progress: waiting for
+ * a syncpoint, waiting for the high-priority queue to be executed, or writing
+ * a command when the queue is full and the RSP has not finished processing
+ * the older commands yet. By default, the CPU simply spins during these waits.
+ * 
+ * To reclaim that CPU time, it is possible to register an idle callback via
+ * #rspq_set_wait_callback. It will be called repeatedly while waiting, until
+ * the RSP signals (via interrupt) that the condition has been reached, so
+ * that the application can perform other work (eg: preparing the next frame,
+ * decompressing assets, polling inputs). The time spent waiting, and the time
+ * that was spent in the idle callback, can be measured with
+ * #rspq_get_wait_stats.
+ * 
+ * ## Profiling
+ * 
+ * When the library is built with RSPQ_PROFILE set to 1 (see rspq_constants.h),
+ * the queue engine measures how long each command takes to run on the RSP,
+ * using the RCP clock counter. The samples are accumulated by the CPU per
+ * overlay ID and command index, and can be read with #rspq_profile_get_data
+ * or printed to the debug log with #rspq_profile_dump. This makes it possible
+ * to find out which overlay commands are eating RSP time.
+ * 
+ * Profiling adds a small overhead to every command, so it is disabled
+ * by default.
+ * 
  * ## High-priority queue
  * 
  * This library offers a mechanism to preempt the execution of RSP to give
@@ -167,6 +237,90 @@ extern "C" {
  */
 typedef struct rspq_block_s rspq_block_t;
 
+/**
+ * @brief Callback invoked while the CPU waits for the RSP
+ * 
+ * @see #rspq_set_wait_callback
+ */
+typedef void (*rspq_wait_callback_t)(void *ctx);
+
+/**
+ * @brief A submission queue, used to enqueue commands from interrupt handlers
+ * 
+ * @see #rspq_submitq_new
+ */
+typedef struct rspq_submitq_s rspq_submitq_t;
+
+/**
+ * @brief A fence, used to synchronize CPU and RSP on a specific command
+ * 
+ * A fence holds a 32-bit counter, which is signalled (written) by either the
+ * CPU or the RSP, and waited for by the other one. A fence is considered
+ * reached when its counter is equal or greater (with wraparound) than the
+ * value being waited for.
+ * 
+ * @see #rspq_fence_new
+ */
+typedef struct rspq_fence_s rspq_fence_t;
+
+/**
+ * @brief Statistics about CPU waits for the RSP
+ * 
+ * @see #rspq_get_wait_stats
+ */
+typedef struct {
+    uint32_t waits;                     ///< Number of times the CPU had to wait for the RSP
+    uint32_t wait_ticks;                ///< Total time spent waiting (in ticks, see #TICKS_READ)
+    uint32_t idle_ticks;                ///< Part of wait_ticks spent running the idle callback
+} rspq_wait_stats_t;
+
+/**
+ * @brief Profiling counters of a single command
+ * 
+ * @see #rspq_profile_get_data
+ */
+typedef struct {
+    uint64_t cycles;                    ///< Total RCP clock cycles spent running the command
+    uint32_t count;                     ///< Number of times the command was run
+} rspq_profile_slot_t;
+
+/**
+ * @brief Profiling data collected by the RSP queue engine
+ * 
+ * @see #rspq_profile_get_data
+ */
+typedef struct {
+    /**
+     * @brief Counters for each command.
+     * 
+     * The first index is the overlay ID (top 4 bits of the command ID, so 0 for
+     * the internal commands), the second index is the command index within
+     * that ID. Notice that overlays with more than 16 commands span multiple
+     * consecutive IDs.
+     */
+    rspq_profile_slot_t slots[16][16];
+    uint64_t total_cycles;              ///< Sum of the cycles of all commands
+    uint32_t total_count;               ///< Number of commands that were profiled
+    uint32_t dropped;                   ///< Number of samples lost because they were not collected in time
+} rspq_profile_data_t;
+
+/**
+ * @brief Statistics about overlay switches
+ * 
+ * @see #rspq_get_overlay_stats
+ */
+typedef struct {
+    uint32_t switches;                  ///< Total number of overlay switches performed by RSP
+    uint32_t loads[16];                 ///< Number of times each overlay was loaded, indexed by overlay ID (top 4 bits)
+} rspq_overlay_stats_t;
+
+/** 
+ * @brief Affinity flag: commands of the overlay can be batched in blocks
+ * 
+ * @see #rspq_overlay_set_affinity
+ */
+#define RSPQ_AFFINITY_BATCH             (1 << 0)
+
 /**
  * @brief A syncpoint in the queue
  * 
@@ -206,6 +360,34 @@ void rspq_init(void);
  */
 void rspq_close(void);
 
+/**
+ * @brief Configure the size of the ring of buffers of the standard queue.
+ * 
+ * Commands are written into a ring of RDRAM buffers. When the CPU writes
+ * commands faster than the RSP can execute them, the ring grows (up to
+ * max_buffers) instead of blocking the CPU, so that bursty producers can
+ * run ahead of the RSP. When the RSP catches up, the ring shrinks back to
+ * min_buffers. Each buffer is RSPQ_DRAM_LOWPRI_BUFFER_SIZE words long.
+ * 
+ * Setting min_buffers and max_buffers to the same value gives a fixed-size
+ * ring. By default, the ring has RSPQ_LOWPRI_MIN_BUFFERS buffers and
+ * can grow up to RSPQ_LOWPRI_MAX_BUFFERS, which is also the upper limit.
+ * 
+ * The new limits are applied lazily, as the CPU goes through the ring.
+ * 
+ * @param[in]  min_buffers  Number of buffers to keep allocated (at least 2)
+ * @param[in]  max_buffers  Maximum number of buffers the ring can grow to
+ */
+void rspq_set_lowpri_buffers(int min_buffers, int max_buffers);
+
+/**
+ * @brief Return the current number of buffers in the ring of the standard queue.
+ * 
+ * This is mainly useful for profiling, to check how much the ring had to
+ * grow (see #rspq_set_lowpri_buffers).
+ */
+int rspq_get_lowpri_buffers(void);
+
 
 /**
  * @brief Register a rspq overlay into the RSP queue engine.
@@ -447,6 +629,104 @@ void* rspq_overlay_get_state(rsp_ucode_t *overlay_ucode);
  */
 void rspq_flush(void);
 
+/**
+ * @brief Create a submission queue, to enqueue commands from an interrupt handler.
+ * 
+ * A submission queue is a ring of commands with a single producer (normally
+ * an interrupt handler) which are moved into the RSP low-priority queue by
+ * the main thread, every time #rspq_flush is called. To wait for them to
+ * be executed, call #rspq_flush before #rspq_wait. Writing into a submission queue
+ * is lock-free: it never disables interrupts and never waits for the RSP.
+ * If the queue is full, the write fails instead.
+ * 
+ * Each source of commands must use its own submission queue: two interrupt
+ * handlers can share one only if they cannot interrupt each other, and the
+ * main thread can write into one only with interrupts disabled.
+ * 
+ * Commands are moved to the RSP queue in order of submission within each
+ * submission queue, but there is no ordering guarantee with respect to the
+ * commands written by the main thread via #rspq_write, or to other
+ * submission queues. Moreover, they are not moved while in high-priority mode
+ * or while recording a block.
+ * 
+ * @param[in]  size  Size of the queue in 32-bit words (rounded up to a power of two)
+ * @return The new submission queue
+ */
+rspq_submitq_t* rspq_submitq_new(int size);
+
+/**
+ * @brief Free a submission queue.
+ * 
+ * The commands still pending in the queue are discarded. Make sure that
+ * no interrupt handler is still writing into the queue.
+ * 
+ * @param[in]  q  Submission queue to free
+ */
+void rspq_submitq_free(rspq_submitq_t *q);
+
+/**
+ * @brief Reserve space for a command in a submission queue.
+ * 
+ * The command must be written into the returned buffer and then made
+ * visible with #rspq_submitq_commit. Only one command can be reserved
+ * at a time. The first word of the command contains the overlay ID and the
+ * command ID as in #rspq_write, and @p size must match the size of
+ * the command declared by the overlay.
+ * 
+ * @param[in]  q     Submission queue
+ * @param[in]  size  Size of the command in 32-bit words
+ * @return Pointer to the reserved space, or NULL if the queue is full
+ */
+uint32_t* rspq_submitq_reserve(rspq_submitq_t *q, int size);
+
+/**
+ * @brief Commit the command previously reserved with #rspq_submitq_reserve.
+ * 
+ * @param[in]  q  Submission queue
+ */
+void rspq_submitq_commit(rspq_submitq_t *q);
+
+/**
+ * @brief Write a command into a submission queue.
+ * 
+ * This is equivalent to #rspq_write, but the command is written into the
+ * specified submission queue (see #rspq_submitq_new), so it can be called
+ * from an interrupt handler.
+ * 
+ * @param      q        Submission queue
+ * @param      ovl_id   The overlay ID of the command to enqueue
+ * @param      cmd_id   Index of the command to call, within the overlay
+ * @param      ...      Optional arguments for the command
+ * @return True if the command was written, false if the queue was full
+ * 
+ * @see #rspq_write
+ */
+#define rspq_submitq_write(q, ovl_id, cmd_id, ...) \
+    __PPCAT(_rspq_submitq_write, __HAS_VARARGS(__VA_ARGS__)) (q, ovl_id, cmd_id, ##__VA_ARGS__)
+
+/// @cond
+
+#define _rspq_submitq_write0(q, ovl_id, cmd_id) ({ \
+    uint32_t *ptr = rspq_submitq_reserve(q, 1); \
+    if (ptr) { \
+        ptr[0] = (ovl_id) + ((cmd_id)<<24); \
+        rspq_submitq_commit(q); \
+    } \
+    ptr != NULL; \
+})
+
+#define _rspq_submitq_write1(q, ovl_id, cmd_id, arg0, ...) ({ \
+    uint32_t *ptr = rspq_submitq_reserve(q, 1 + __COUNT_VARARGS(__VA_ARGS__)); \
+    if (ptr) { \
+        *ptr++ = ((ovl_id) + ((cmd_id)<<24)) | (arg0); \
+        __CALL_FOREACH(_rspq_write_arg, ##__VA_ARGS__); \
+        rspq_submitq_commit(q); \
+    } \
+    ptr != NULL; \
+})
+
+/// @endcond
+
 /**
  * @brief Wait until all commands in the queue have been executed by RSP.
  *
@@ -512,6 +792,196 @@ bool rspq_syncpoint_check(rspq_syncpoint_t sync_id);
  */
 void rspq_syncpoint_wait(rspq_syncpoint_t sync_id);
 
+/**
+ * @brief Create a new fence, with its counter set to 0.
+ * 
+ * @return The new fence
+ */
+rspq_fence_t* rspq_fence_new(void);
+
+/**
+ * @brief Free a fence.
+ * 
+ * Make sure that no command referencing the fence is still in the queue.
+ * 
+ * @param[in]  f  Fence to free
+ */
+void rspq_fence_free(rspq_fence_t *f);
+
+/**
+ * @brief Enqueue a command that makes the RSP signal a fence.
+ * 
+ * When the RSP reaches this command, it sets the fence counter to a new
+ * value (one more than the value returned by the previous call for the same
+ * fence), which is returned. Use #rspq_fence_wait to wait for it.
+ * 
+ * This can be called in both the low-priority and the high-priority queue.
+ * If it is called while recording a block, the value is fixed at recording
+ * time, and will be signalled every time the block is run.
+ * 
+ * @param[in]  f  Fence to signal
+ * @return The value that will be written into the fence
+ */
+uint32_t rspq_fence_enqueue_signal(rspq_fence_t *f);
+
+/**
+ * @brief Enqueue a command that makes the RSP wait for a fence.
+ * 
+ * When the RSP reaches this command, it waits until the fence counter
+ * reaches @p value, which must be signalled by the CPU via #rspq_fence_signal.
+ * While the RSP is waiting, the high-priority queue can still be run.
+ * 
+ * @param[in]  f      Fence to wait for
+ * @param[in]  value  Value to wait for
+ */
+void rspq_fence_enqueue_wait(rspq_fence_t *f, uint32_t value);
+
+/**
+ * @brief Signal a fence from the CPU.
+ * 
+ * This releases the RSP waits enqueued with #rspq_fence_enqueue_wait for
+ * values up to @p value. It can be called from an interrupt handler.
+ * 
+ * @param[in]  f      Fence to signal
+ * @param[in]  value  New value of the fence counter
+ */
+void rspq_fence_signal(rspq_fence_t *f, uint32_t value);
+
+/**
+ * @brief Check whether a fence has reached the specified value.
+ * 
+ * @param[in]  f      Fence to check
+ * @param[in]  value  Value to check for
+ * @return True if the fence counter is equal or greater than @p value
+ */
+bool rspq_fence_check(rspq_fence_t *f, uint32_t value);
+
+/**
+ * @brief Wait until a fence reaches the specified value.
+ * 
+ * The wait runs the idle callback (see #rspq_set_wait_callback), like
+ * all other waits for the RSP.
+ * 
+ * @param[in]  f      Fence to wait for
+ * @param[in]  value  Value to wait for (normally returned by #rspq_fence_enqueue_signal)
+ */
+void rspq_fence_wait(rspq_fence_t *f, uint32_t value);
+
+/**
+ * @brief Register a callback to run while the CPU waits for the RSP.
+ * 
+ * Whenever the CPU would block waiting for the RSP (#rspq_syncpoint_wait,
+ * #rspq_wait, #rspq_highpri_sync, #rspq_fence_wait, or a #rspq_write into a
+ * full queue), the
+ * callback is invoked repeatedly until the RSP signals that the wait is over.
+ * It should thus do a small chunk of work and return, as the wait cannot
+ * complete while the callback is running: a few hundreds of microseconds
+ * at most is a good rule of thumb.
+ * 
+ * The callback must not call any rspq function. It is never invoked when
+ * the wait happens with interrupts disabled (eg: from an interrupt handler).
+ * 
+ * @param[in]  cb   Callback to invoke, or NULL to spin without doing anything
+ * @param[in]  ctx  Opaque argument passed to the callback
+ */
+void rspq_set_wait_callback(rspq_wait_callback_t cb, void *ctx);
+
+/**
+ * @brief Get statistics about the time the CPU spent waiting for the RSP.
+ * 
+ * The counters are accumulated since #rspq_init or the last call to
+ * #rspq_reset_wait_stats.
+ * 
+ * @param[out] stats  Structure to fill with the statistics
+ */
+void rspq_get_wait_stats(rspq_wait_stats_t *stats);
+
+/**
+ * @brief Reset the statistics returned by #rspq_get_wait_stats.
+ */
+void rspq_reset_wait_stats(void);
+
+/**
+ * @brief Reset the profiling data collected so far.
+ * 
+ * This is a no-op if the library was not built with RSPQ_PROFILE.
+ */
+void rspq_profile_reset(void);
+
+/**
+ * @brief Get the profiling data collected since #rspq_init or #rspq_profile_reset.
+ * 
+ * Only commands that the RSP has already finished are accounted for.
+ * Call #rspq_wait before this function to include all the queued commands.
+ * 
+ * If the library was not built with RSPQ_PROFILE, the data is all zeros.
+ * 
+ * @param[out] data  Structure to fill with the profiling data
+ */
+void rspq_profile_get_data(rspq_profile_data_t *data);
+
+/**
+ * @brief Print the profiling data to the debug log.
+ * 
+ * Commands are grouped by overlay, and for each command the number of runs,
+ * the total and the average cycles, and the percentage of the total RSP time
+ * are shown.
+ */
+void rspq_profile_dump(void);
+
+
+/**
+ * @brief Mark a command of an overlay as a "state command".
+ * 
+ * A state command is a command whose only effect is to overwrite some state
+ * of the overlay (eg: "set current color"), always the same state no matter
+ * its arguments. This means that if two instances of a state command follow
+ * each other in a block, the first one has no effect and can be dropped.
+ * This is done when blocks are compiled (see #rspq_block_end).
+ * 
+ * @param[in]  overlay_id  Overlay ID, as returned by #rspq_overlay_register
+ * @param[in]  cmd_id      Index of the command within the overlay
+ */
+void rspq_overlay_set_state_command(uint32_t overlay_id, uint32_t cmd_id);
+
+/**
+ * @brief Declare how an overlay can be scheduled to reduce overlay switches.
+ * 
+ * If #RSPQ_AFFINITY_BATCH is specified, the commands of the overlay have no
+ * ordering requirements with respect to the commands of other overlays that
+ * also have this flag: they do not read or write memory touched by them,
+ * nor use their results. When a block is compiled, each sequence of
+ * consecutive commands of batchable overlays is then reordered so that the
+ * commands of the same overlay are grouped together (keeping their relative
+ * order), which reduces the number of overlay switches when the block is run.
+ * Internal commands (such as DMAs, syncpoints and block calls) and commands
+ * of other overlays are never moved, and act as barriers.
+ * 
+ * The first group is always the one of the overlay that was used by the
+ * command just before the sequence, so that the switch is avoided entirely
+ * if it is part of the sequence.
+ * 
+ * @param[in]  overlay_id  Overlay ID, as returned by #rspq_overlay_register
+ * @param[in]  flags       Affinity flags (#RSPQ_AFFINITY_BATCH), or 0 for none
+ */
+void rspq_overlay_set_affinity(uint32_t overlay_id, uint32_t flags);
+
+/**
+ * @brief Get the number of overlay switches performed by the RSP.
+ * 
+ * The counters are accumulated since #rspq_init or the last call to
+ * #rspq_reset_overlay_stats: to get the number of switches per frame,
+ * call #rspq_reset_overlay_stats once per frame. Only commands that
+ * have already been run by RSP are accounted for.
+ * 
+ * @param[out] stats  Structure to fill with the statistics
+ */
+void rspq_get_overlay_stats(rspq_overlay_stats_t *stats);
+
+/**
+ * @brief Reset the statistics returned by #rspq_get_overlay_stats.
+ */
+void rspq_reset_overlay_stats(void);
 
 /**
  * @brief Begin creating a new block.
@@ -541,6 +1011,10 @@ void rspq_block_begin(void);
  * for immediate RSP execution.
  * 
  * To run the created block, use #rspq_block_run. 
+ * 
+ * The block is compiled into a single contiguous buffer. This function asserts
+ * if the block contains commands of overlays that are not registered, or
+ * commands that are not defined by their overlay.
  *
  * @return A reference to the just created block
  * 
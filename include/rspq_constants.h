@@ -3,9 +3,17 @@
 
 #define RSPQ_DEBUG                     1
 
+/** Set to 1 to build the queue engine with per-command profiling (see rspq_profile_get_data) */
+#define RSPQ_PROFILE                   0
+#define RSPQ_PROFILE_BLOCK_SIZE        0x80    ///< Size of the DMEM block of profiling samples (in bytes, 8 bytes per sample)
+#define RSPQ_PROFILE_RDRAM_SIZE        0x2000  ///< Size of the RDRAM ring of profiling samples (in bytes, power of two)
+
 #define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
 #define RSPQ_DRAM_HIGHPRI_BUFFER_SIZE  0x80    ///< Size of each RSPQ RDRAM buffer for highpri queue (in 32-bit words)
 
+#define RSPQ_LOWPRI_MIN_BUFFERS        3       ///< Default number of buffers in the lowpri ring (see rspq_set_lowpri_buffers)
+#define RSPQ_LOWPRI_MAX_BUFFERS        8       ///< Maximum number of buffers the lowpri ring can grow to
+
 #define RSPQ_DMEM_BUFFER_SIZE          0x100   ///< Size of the RSPQ DMEM buffer (in bytes)
 #define RSPQ_OVERLAY_TABLE_SIZE        0x10    ///< Number of overlay IDs (0-F)
 #define RSPQ_OVERLAY_DESC_SIZE         0x10    ///< Size of a single overlay descriptor
@@ -0,0 +1,137 @@
+/**
+ * @file rspq_mem.h
+ * @brief RSP bulk memory operations
+ * @ingroup rsp
+ */
+
+#ifndef __LIBDRAGON_RSPQ_MEM_H
+#define __LIBDRAGON_RSPQ_MEM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup rspq_mem RSP bulk memory operations
+ * @ingroup rsp
+ * @brief Asynchronous memcpy / memset of RDRAM buffers using the RSP.
+ *
+ * This module provides an overlay for the RSP command queue (see rspq.h)
+ * that uses the RSP DMA engine to copy or fill large regions of RDRAM, such
+ * as framebuffers or decompression outputs. The operations are enqueued
+ * in the current RSP queue like any other command, so they are executed
+ * asynchronously and in order with respect to the other RSP commands.
+ *
+ * To use it, call #rspq_mem_init. Then, use #rspq_memcpy,
+ * #rspq_memset and #rspq_memcpy2d to enqueue operations. To know when an
+ * operation has finished, use any of the synchronization primitives of
+ * rspq (eg: #rspq_syncpoint_new and #rspq_syncpoint_wait, or a fence).
+ *
+ * All operations are performed via DMA, so addresses, lengths and pitches
+ * must be multiple of 8 bytes. The CPU cache is handled by the functions
+ * at enqueue time: the source buffers are written back, and the destination
+ * buffers are invalidated. The CPU must not access the destination buffers
+ * until the operation is finished. To avoid corruption, the destination
+ * buffers should not share data cache lines (16 bytes) with other data that
+ * might be written by the CPU meanwhile.
+ *
+ * Once initialized, this module is also used by #graphics_fill_screen and
+ * #display_init to clear the framebuffers, which is much faster than
+ * writing them through the CPU.
+ *
+ * @{
+ */
+
+/**
+ * @brief Initialize the RSP bulk memory operations
+ *
+ * This registers the overlay into the RSP queue, initializing the queue
+ * itself if required.
+ */
+void rspq_mem_init(void);
+
+/**
+ * @brief Deinitialize the RSP bulk memory operations
+ */
+void rspq_mem_close(void);
+
+/**
+ * @brief Check whether the RSP bulk memory operations are available
+ *
+ * @return      true if #rspq_mem_init has been called, false otherwise.
+ */
+bool rspq_mem_is_initialized(void);
+
+/**
+ * @brief Enqueue a copy between two RDRAM buffers
+ *
+ * This is like the standard memcpy, but it is performed asynchronously
+ * by RSP. The two buffers must not overlap.
+ *
+ * @param[out]  dst     Destination buffer (8-byte aligned)
+ * @param[in]   src     Source buffer (8-byte aligned)
+ * @param[in]   len     Number of bytes to copy (multiple of 8)
+ */
+void rspq_memcpy(void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Enqueue a fill of a RDRAM buffer with a 32-bit pattern
+ *
+ * @param[out]  dst     Buffer to fill (8-byte aligned)
+ * @param[in]   pattern 32-bit value that will be repeated across the buffer
+ * @param[in]   len     Number of bytes to fill (multiple of 8)
+ *
+ * @see #rspq_memset
+ */
+void rspq_memset32(void *dst, uint32_t pattern, uint32_t len);
+
+/**
+ * @brief Enqueue a fill of a RDRAM buffer with a byte value
+ *
+ * This is like the standard memset, but it is performed asynchronously
+ * by RSP.
+ *
+ * @param[out]  dst     Buffer to fill (8-byte aligned)
+ * @param[in]   value   Value of each byte
+ * @param[in]   len     Number of bytes to fill (multiple of 8)
+ */
+static inline void rspq_memset(void *dst, uint8_t value, uint32_t len)
+{
+    rspq_memset32(dst, value * 0x01010101u, len);
+}
+
+/**
+ * @brief Enqueue a copy of a rectangular area between two RDRAM buffers
+ *
+ * This copies @p height lines of @p width bytes each. Each line begins
+ * @p src_pitch bytes after the previous one in the source buffer, and
+ * @p dst_pitch bytes after the previous one in the destination buffer.
+ * It can be used for instance to blit a portion of an image into a
+ * framebuffer.
+ *
+ * The RSP DMA can skip at most 4095 bytes between lines. If a pitch is
+ * larger than @p width by 4096 bytes or more, the copy is split into one
+ * command per line, which is slower.
+ *
+ * @param[out]  dst         Destination buffer (8-byte aligned)
+ * @param[in]   dst_pitch   Distance in bytes between lines in the destination
+ *                          buffer (multiple of 8, less than 65536)
+ * @param[in]   src         Source buffer (8-byte aligned)
+ * @param[in]   src_pitch   Distance in bytes between lines in the source
+ *                          buffer (multiple of 8, less than 65536)
+ * @param[in]   width       Number of bytes to copy for each line (multiple of 8)
+ * @param[in]   height      Number of lines to copy
+ */
+void rspq_memcpy2d(void *dst, uint32_t dst_pitch, const void *src, uint32_t src_pitch,
+    uint32_t width, uint32_t height);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
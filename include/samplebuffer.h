@@ -33,13 +33,13 @@ typedef uint32_t sample_ptr_t;
  * is not encoded in the tagged pointer. Notice that it is implemented with a
  * XOR because on MIPS it's faster than using a reverse mask.
  */
-#define SAMPLES_PTR(buf)            (void*)((buf)->ptr_and_flags ^ SAMPLES_BPS_SHIFT(buf))
+#define SAMPLES_PTR(buf)            (void*)(uintptr_t)((buf)->ptr_and_flags ^ SAMPLES_BPS_SHIFT(buf))
 
 /**
  * SAMPLES_PTR_MAKE create a tagged pointer, given a pointer to an array of
  * samples and a byte-per-sample value (encoded as shift value).
  */
-#define SAMPLES_PTR_MAKE(ptr, bps)  ((sample_ptr_t)(ptr) | (bps))
+#define SAMPLES_PTR_MAKE(ptr, bps)  ((sample_ptr_t)(uintptr_t)(ptr) | (bps))
 
 /**
  * samplebuffer_t is a circular buffer of samples. It is used by the mixer
@@ -20,6 +20,23 @@
  * 
  * Use #wav64_play to playback. For more advanced usage, call directly the
  * mixer functions, accessing the #wave structure field.
+ *
+ * WAV64 files can also be compressed with VADPCM (use `audioconv64
+ * --wav-compress vadpcm`), which makes them about 4 times smaller. Compressed
+ * files are decoded on the fly by the RSP, right before mixing. Notice that
+ * the decoder state is tied to the #wav64_t, so playing the same compressed
+ * file on multiple channels at the same time works but is very inefficient
+ * (decoding restarts from the beginning each time): open the file multiple
+ * times instead.
+ *
+ * For long music tracks, WAV64 files can be compressed with a MDCT transform
+ * codec (use `audioconv64 --wav-compress mdct`), which makes them about 13
+ * times smaller at the default bitrate (80 kbit/s for stereo at 32 kHz; use
+ * `--wav-mdct-bitrate` to change it). This is lossy and meant for background
+ * music rather than sound effects. Frames are parsed by the CPU, while the
+ * inverse transform runs on the RSP. The CPU cost is proportional to the
+ * number of samples played, and seeking (including looping) only costs the
+ * decoding of one additional frame.
  */
 typedef struct {
 	/** @brief #waveform_t for this WAV64. 
@@ -30,6 +47,12 @@ typedef struct {
 
 	/** @brief Absolute ROM address of WAV64 */
 	uint32_t rom_addr;
+
+	/** @brief Format of the samples in the file (raw or compressed) */
+	int format;
+
+	/** @brief Private data of the decoder (for compressed files) */
+	void *ext;
 } wav64_t;
 
 /** @brief Open a WAV64 file for playback.
@@ -43,6 +66,15 @@ typedef struct {
  */ 
 void wav64_open(wav64_t *wav, const char *fn);
 
+/** @brief Close a WAV64 file.
+ * 
+ * This function releases the memory allocated by #wav64_open (if any). The
+ * file must not be playing on any mixer channel.
+ * 
+ * @param   wav         Pointer to wav64_t structure
+ */
+void wav64_close(wav64_t *wav);
+
 /** @brief Configure a WAV64 file for looping playback. */
 void wav64_set_loop(wav64_t *wav, bool loop);
 
@@ -1,9 +1,27 @@
 #ifndef __LIBDRAGON_WAV64_INTERNAL_H
 #define __LIBDRAGON_WAV64_INTERNAL_H
 
+#include <stdint.h>
+
 #define WAV64_ID            "WV64"
 #define WAV64_FILE_VERSION  2
 #define WAV64_FORMAT_RAW    0
+#define WAV64_FORMAT_VADPCM 1
+#define WAV64_FORMAT_MDCT   2
+
+#define VADPCM_FRAME_SAMPLES    16   ///< Number of samples in a VADPCM frame (per channel)
+#define VADPCM_FRAME_BYTES      9    ///< Size of a VADPCM frame in bytes (per channel)
+#define VADPCM_MAX_PREDICTORS   8    ///< Maximum number of predictors in a codebook
+#define VADPCM_MAX_SCALE        12   ///< Maximum scale (shift) of the residuals of a frame
+#define VADPCM_BOOK_FRAC_BITS   11   ///< Fractional bits of the codebook coefficients
+
+#define MDCT_FRAME_SAMPLES      256  ///< Number of samples decoded from each MDCT frame (per channel)
+#define MDCT_NUM_BANDS          16   ///< Number of bands with a separate scale factor
+#define MDCT_MAX_BITS           8    ///< Maximum number of bits allocated to each coefficient
+#define MDCT_SF_BITS            6    ///< Size of an absolute scale factor in bits
+#define MDCT_MAX_SF             48   ///< Maximum scale factor (larger values are clamped)
+#define MDCT_MIN_EXPONENT       -9   ///< Minimum block exponent of the coefficients fed to the IMDCT
+#define MDCT_MAX_L1             31744 ///< Maximum sum of absolute values of the coefficients fed to the IMDCT
 
 /** @brief Header of a WAV64 file. */
 typedef struct __attribute__((packed)) {
@@ -20,6 +38,152 @@ typedef struct __attribute__((packed)) {
 
 _Static_assert(sizeof(wav64_header_t) == 24, "invalid wav64_header size");
 
+/**
+ * @brief Extended header of a WAV64 file in VADPCM format.
+ *
+ * This immediately follows #wav64_header_t. The samples are stored as a
+ * sequence of frames of #VADPCM_FRAME_BYTES bytes, each one encoding
+ * #VADPCM_FRAME_SAMPLES samples of a single channel. For stereo files,
+ * frames of the two channels are interleaved.
+ *
+ * The first byte of each frame contains the scale (high nibble) and the
+ * index of the predictor in the codebook (low nibble). The following 8 bytes
+ * contain the 4-bit residuals: the high nibble of byte N is the residual of
+ * sample N, and the low nibble is the residual of sample N+8.
+ *
+ * Each predictor of the codebook is a second-order predictor, expanded
+ * for a group of 8 samples (as in the N64 VADPCM format): book[p][0][i] and
+ * book[p][1][i] are the contributions of the second-to-last and last
+ * decoded samples to the i-th sample of the group, while book[p][1] is also
+ * used to propagate the residuals within the group. See #vadpcm_decode_frame.
+ */
+typedef struct __attribute__((packed)) {
+	int8_t npredictors;         ///< Number of predictors in the codebook (1-8)
+	int8_t padding[7];          ///< Padding (must be zero)
+	int16_t loop_state[2][2];   ///< Decoder state at the start of the frame containing the loop start, for each channel
+	int16_t book[VADPCM_MAX_PREDICTORS][2][8];  ///< Codebook (s4.11 fixed point)
+} wav64_header_vadpcm_t;
+
+_Static_assert(sizeof(wav64_header_vadpcm_t) == 272, "invalid wav64_header_vadpcm size");
+
+/** @brief Clamp a value to the range of a signed 16-bit sample */
+static inline int16_t vadpcm_clamp16(int64_t x) {
+	if (x > 32767) return 32767;
+	if (x < -32768) return -32768;
+	return x;
+}
+
+/**
+ * @brief Decode a VADPCM frame (reference implementation).
+ *
+ * This is the exact specification of the decoding process, which is shared
+ * by the encoder (audioconv64) and used to validate the RSP decoder.
+ *
+ * @param[in]     frame   Frame to decode (#VADPCM_FRAME_BYTES bytes)
+ * @param[in]     book    Codebook (in host endianness)
+ * @param[in,out] state   Decoder state: second-to-last and last decoded samples
+ * @param[out]    out     Decoded samples
+ * @param[in]     stride  Distance between decoded samples in @p out
+ */
+static inline void vadpcm_decode_frame(const uint8_t *frame,
+	const int16_t book[VADPCM_MAX_PREDICTORS][2][8], int16_t state[2],
+	int16_t *out, int stride)
+{
+	int scale = frame[0] >> 4;
+	const int16_t (*b)[8] = book[frame[0] & (VADPCM_MAX_PREDICTORS-1)];
+
+	int32_t r[VADPCM_FRAME_SAMPLES];
+	for (int i=0; i<8; i++) {
+		r[i]   = ((int8_t)(frame[1+i] & 0xF0) >> 4) * (1 << scale);
+		r[i+8] = ((int8_t)(frame[1+i] << 4) >> 4) * (1 << scale);
+	}
+
+	for (int g=0; g<VADPCM_FRAME_SAMPLES; g+=8) {
+		int16_t x[8];
+		for (int i=0; i<8; i++) {
+			int64_t acc = (int64_t)b[0][i] * state[0] + (int64_t)b[1][i] * state[1];
+			acc += (int64_t)r[g+i] * (1 << VADPCM_BOOK_FRAC_BITS);
+			for (int j=0; j<i; j++)
+				acc += (int64_t)b[1][i-1-j] * r[g+j];
+			x[i] = vadpcm_clamp16(acc >> VADPCM_BOOK_FRAC_BITS);
+			out[(g+i)*stride] = x[i];
+		}
+		state[0] = x[6];
+		state[1] = x[7];
+	}
+}
+
+/**
+ * @brief Extended header of a WAV64 file in MDCT format.
+ *
+ * This immediately follows #wav64_header_t. The samples are stored as a
+ * sequence of frames of @p frame_bytes bytes each (for all channels), so
+ * that any frame can be located without parsing the previous ones. Frame F
+ * contains the MDCT of the samples [(F-1)*N, (F+1)*N), where N is
+ * #MDCT_FRAME_SAMPLES, windowed with a sine window. Decoding frames F and
+ * F+1 thus produces the samples [F*N, (F+1)*N).
+ *
+ * Each frame is a bitstream (MSB first) containing, for each channel, the
+ * scale factors of the #MDCT_NUM_BANDS bands (see #mdct_decode_frame), and
+ * then the quantized coefficients. The number of bits used for the
+ * coefficients of each band is not stored: it is computed from the scale
+ * factors (see #mdct_allocate_bits). Stereo files are coded as mid/side.
+ */
+typedef struct __attribute__((packed)) {
+	uint16_t frame_bytes;       ///< Size of each frame in bytes (all channels)
+	uint16_t padding[3];        ///< Padding (must be zero)
+} wav64_header_mdct_t;
+
+_Static_assert(sizeof(wav64_header_mdct_t) == 8, "invalid wav64_header_mdct size");
+
+/** @brief First coefficient of each band (the last entry is #MDCT_FRAME_SAMPLES) */
+extern const uint16_t mdct_band_start[MDCT_NUM_BANDS+1];
+
+/**
+ * @brief Amplitude of a band given its scale factor: 2^(sf/2).
+ *
+ * Scale factor 0 means that the band is silent.
+ */
+static inline int32_t mdct_sf_amplitude(int sf) {
+	int32_t a = 1 << (sf >> 1);
+	if (sf & 1) a = ((int64_t)a * 46341) >> 15;   // sqrt(2) in 1.15
+	return a;
+}
+
+/** @brief Compute the number of bits allocated to each band (see wav64_mdct.c) */
+void mdct_allocate_bits(const uint8_t sf[2][MDCT_NUM_BANDS], int channels,
+	int budget, uint8_t bits[2][MDCT_NUM_BANDS]);
+
+/** @brief Decode the coefficients of a MDCT frame (see wav64_mdct.c) */
+void mdct_decode_frame(const uint8_t *frame, int frame_bytes, int channels,
+	uint32_t seed, int32_t coefs[2][MDCT_FRAME_SAMPLES]);
+
+/** @brief Prepare the coefficients of a channel for the fixed-point IMDCT (see wav64_mdct.c) */
+int mdct_prepare_coefs(const int32_t coefs[MDCT_FRAME_SAMPLES], int16_t out[MDCT_FRAME_SAMPLES]);
+
+/**
+ * @brief Tables used by the fixed-point IMDCT.
+ *
+ * The layout of this structure is shared with the RSP ucode (rsp_mdct.S),
+ * which loads each table in turn.
+ */
+typedef struct {
+	int16_t pre[2][MDCT_FRAME_SAMPLES/2];       ///< Pre-twiddle factors (real, imaginary)
+	int16_t fft[2][MDCT_FRAME_SAMPLES/2];       ///< Twiddle factors between the two FFT passes
+	int16_t post[2][MDCT_FRAME_SAMPLES/2];      ///< Post-twiddle factors
+	uint16_t perm_cur[MDCT_FRAME_SAMPLES];      ///< Offset (in bytes) of each sample of the first half of the output
+	int16_t win_cur[MDCT_FRAME_SAMPLES];        ///< Window for the first half of the output (with sign)
+	uint16_t perm_next[MDCT_FRAME_SAMPLES];     ///< Offset (in bytes) of each sample of the second half of the output
+	int16_t win_next[MDCT_FRAME_SAMPLES];       ///< Window for the second half of the output (with sign, halved)
+} mdct_tables_t;
+
+/** @brief Initialize the tables used by the fixed-point IMDCT (see wav64_mdct.c) */
+void mdct_init_tables(mdct_tables_t *t);
+
+/** @brief Fixed-point IMDCT with windowing and overlap-add, as run by rsp_mdct.S (see wav64_mdct.c) */
+void mdct_imdct(const int16_t in[MDCT_FRAME_SAMPLES], int shift,
+	int16_t ola[MDCT_FRAME_SAMPLES], int16_t *out, const mdct_tables_t *t);
+
 typedef struct samplebuffer_s samplebuffer_t;
 
 /**
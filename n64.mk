@@ -5,6 +5,7 @@ N64_ROM_TITLE = "Made with libdragon" # Override this with the name of your game
 N64_ROM_SAVETYPE = # Supported savetypes: none eeprom4k eeprom16 sram256k sram768k sram1m flashram
 N64_ROM_RTC = # Set to true to enable the Joybus Real-Time Clock
 N64_ROM_REGIONFREE = # Set to true to allow booting on any console region
+N64_DFS_INCREMENTAL = # Set to true to patch %.dfs images in place, writing only the files that changed
 
 N64_ROOTDIR = $(N64_INST)
 N64_BINDIR = $(N64_ROOTDIR)/bin
@@ -39,6 +40,7 @@ N64_TOOLFLAGS = --header $(N64_HEADERPATH) --title $(N64_ROM_TITLE)
 N64_ED64ROMCONFIGFLAGS =  $(if $(N64_ROM_SAVETYPE),--savetype $(N64_ROM_SAVETYPE))
 N64_ED64ROMCONFIGFLAGS += $(if $(N64_ROM_RTC),--rtc) 
 N64_ED64ROMCONFIGFLAGS += $(if $(N64_ROM_REGIONFREE),--regionfree)
+N64_MKDFSFLAGS = $(if $(N64_DFS_INCREMENTAL),--incremental) $(foreach pattern,$(N64_DFS_COMPRESS),--compress '$(pattern)')
 
 ifeq ($(D),1)
 CFLAGS+=-g3
@@ -85,7 +87,7 @@ N64_CFLAGS += -std=gnu99
 %.dfs:
 	@mkdir -p $(dir $@)
 	@echo "    [DFS] $@"
-	$(N64_MKDFS) $@ $(<D) >/dev/null
+	$(N64_MKDFS) $(N64_MKDFSFLAGS) $@ $(<D) >/dev/null
 
 # Assembly rule. We use .S for both RSP and MIPS assembly code, and we differentiate
 # using the prefix of the filename: if it starts with "rsp", it is RSP ucode, otherwise
@@ -28,7 +28,7 @@ static const float VOL_TABLE[16] = { V(0.0), V(0.002300939285824675), V(0.005554
 })
 
 #if AY8910_OUTPUT_STEREO
-#ifdef N64
+#if defined(N64) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 	// Store 32-bits at once. This is twice as faster when accessing uncached
 	// addresses like the audio buffers.
 	#define OUT(sl_, sr_) ({ \
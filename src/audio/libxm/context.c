@@ -461,6 +461,13 @@ int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
 	#endif
 	#if XM_STREAM_WAVEFORMS
 	alloc_bytes -= ctx_size_all_samples;
+	#if __SIZEOF_POINTER__ == 8
+	// On 64-bit hosts (see tools/audiorender64), the waveform pointer makes
+	// xm_sample_t and xm_context_t larger than in the size computed by
+	// audioconv64. Each sample takes at least XM_WAVEFORM_OVERREAD bytes, so
+	// this is a safe upper bound of the number of samples.
+	alloc_bytes += ctx_size_all_samples / XM_WAVEFORM_OVERREAD * 8 + 16;
+	#endif
 	#endif
 
 	char *mempool = malloc(alloc_bytes);
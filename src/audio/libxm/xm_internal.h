@@ -123,7 +123,12 @@ struct xm_sample_s {
 	};
 };
 typedef struct xm_sample_s xm_sample_t;
+#if XM_STREAM_WAVEFORMS && __SIZEOF_POINTER__ == 8
+// 64-bit host build of the N64 player (see tools/audiorender64)
+_Static_assert(sizeof(xm_sample_t) == 88, "invalid sizeof(sample_t)");
+#else
 _Static_assert(sizeof(xm_sample_t) == 80, "invalid sizeof(sample_t)");
+#endif
 _Static_assert(sizeof(xm_sample_t) % 8 == 0, "sizeof(xm_sample_t) must be multiple of 8");
 
 struct xm_instrument_s {
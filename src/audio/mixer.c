@@ -15,6 +15,7 @@
 #include "n64sys.h"
 #include <memory.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <math.h>
 #include <stdio.h>
 #include <assert.h>
@@ -63,6 +64,23 @@ DEFINE_RSP_UCODE(rsp_mixer);
 #define CH_FLAGS_16BIT      (1<<2)   ///< Set if the channel is 16 bit
 #define CH_FLAGS_STEREO     (1<<3)   ///< Set if the channel is stereo (left)
 #define CH_FLAGS_STEREO_SUB (1<<4)   ///< The channel is the second half of a stereo (right)
+#define CH_FLAGS_FX_DELAY   (1<<5)   ///< The channel plays a delay line of the effects bus
+#define CH_FLAGS_INTERP     (3<<6)   ///< Interpolation mode (see #mixer_interp_t), only for mono channels
+#define CH_FLAGS_INTERP_SHIFT  6     ///< Shift of the interpolation mode in the flags
+
+#define FX_FLAGS_FILTERS    0x0F     ///< Mask of groups of 8 channels with a filter
+#define FX_FLAGS_BUS        0x10     ///< Effects bus enabled
+
+/** @brief Number of samples before the position read by the interpolation kernel */
+#define MIXER_INTERP_HISTORY    3
+/** @brief Number of samples after the position read by the interpolation kernel */
+#define MIXER_INTERP_LOOKAHEAD  4
+/** @brief Silence placed before each sample buffer (in bytes).
+ *
+ * This is read as history by the interpolation kernel when a waveform
+ * starts playing, as there are no previous samples.
+ */
+#define MIXER_INTERP_GUARD      8
 
 /// @brief Fixed point value used in waveform position calculations.
 /// This is a signed 64-bit integer with the fractional part using
@@ -110,7 +128,7 @@ typedef struct rsp_mixer_channel_s {
 	uint32_t step;          ///< Step between samples (in bytes) to playback at the correct frequency
 	uint32_t len;           ///< Length of the waveform (in bytes)
 	uint32_t loop_len;      ///< Length of the loop in the waveform (in bytes)
-	void *ptr;              ///< Pointer to the waveform
+	uint32_t ptr;           ///< RDRAM address of the waveform
 	uint32_t flags;         ///< Misc flags (see CH_FLAGS_*)
 } __attribute__((packed)) rsp_mixer_channel_t;
 
@@ -118,16 +136,90 @@ typedef struct rsp_mixer_channel_s {
 _Static_assert(sizeof(rsp_mixer_channel_t) == 6*4);
 /// @endcond
 
+/** @brief Biquad filters of a group of 8 channels - RSP side
+ *
+ * Each array holds one value per channel of the group, so that they
+ * can be loaded into a vector register.
+ */
+typedef struct rsp_mixer_biquad_s {
+	int16_t b0[8];          ///< Coefficient for x[n] (2.14 fixed point)
+	int16_t b1[8];          ///< Coefficient for x[n-1] (2.14 fixed point)
+	int16_t b2[8];          ///< Coefficient for x[n-2] (2.14 fixed point)
+	int16_t na1[8];         ///< Negated coefficient for y[n-1] (2.14 fixed point)
+	int16_t na2[8];         ///< Negated coefficient for y[n-2] (2.14 fixed point)
+	int16_t x1[8];          ///< Filter state: x[n-1]
+	int16_t x2[8];          ///< Filter state: x[n-2]
+	int16_t y1[8];          ///< Filter state: y[n-1]
+	int16_t y2[8];          ///< Filter state: y[n-2]
+} rsp_mixer_biquad_t;
+
+/** @brief Effects settings - RSP side
+ *
+ * Unlike the other settings, these are not loaded into DMEM: the ucode
+ * accesses them directly in RDRAM, only if the effects are enabled.
+ */
+typedef struct rsp_mixer_fx_s {
+	int16_t send[MIXER_MAX_CHANNELS];                  ///< Send level to the effects bus
+	rsp_mixer_biquad_t filter[MIXER_MAX_CHANNELS/8];   ///< Filters of each group of 8 channels
+	int16_t interp[3][4][8];                           ///< Interpolation kernels (see #mixer_interp_kernels)
+} rsp_mixer_fx_t;
+
 /** @brief Mixer ucode settings. 
  *
- * This struct reflects the settings defined in rsp_mixer.S.
+ * This struct reflects the settings defined in rsp_mixer.S. The effects
+ * settings must immediately follow the settings that are loaded into DMEM.
  */
 typedef struct rsp_mixer_settings_s {
 	uint32_t lvol[MIXER_MAX_CHANNELS/2] __attribute__((aligned(16)));
 	uint32_t rvol[MIXER_MAX_CHANNELS/2];
 	rsp_mixer_channel_t channels[MIXER_MAX_CHANNELS] __attribute__((aligned(16)));
+	rsp_mixer_fx_t fx;
 } rsp_mixer_settings_t;
 
+/// @cond
+_Static_assert(sizeof(rsp_mixer_biquad_t) == 9*16);
+_Static_assert(offsetof(rsp_mixer_settings_t, fx) == 896);
+_Static_assert(offsetof(rsp_mixer_fx_t, interp) == 640);
+/// @endcond
+
+/**
+ * @brief Interpolation kernels used by RSP (one per #mixer_interp_t mode).
+ *
+ * The interpolated sample at position k+f (0 <= f < 1) is the dot product
+ * of the samples k-3...k+4 with 8 coefficients. Each coefficient is a cubic
+ * polynomial of f, whose terms (a, b, c, d for f^3, f^2, f, 1) are stored
+ * here, for each of the 8 coefficients, as 3.13 fixed point.
+ *
+ * Linear and cubic (Catmull-Rom) are exact. The windowed sinc is a Blackman
+ * windowed sinc spanning 8 samples, approximated on each coefficient by the
+ * cubic Hermite polynomial that matches its value and slope at f=0 and f=1
+ * (maximum error: 0.0064), so that the kernel is continuous and it
+ * reproduces the original samples when f=0.
+ */
+static const int16_t mixer_interp_kernels[3][4][8] = {
+	// MIXER_INTERP_LINEAR
+	{
+		{ 0, 0, 0, 0, 0, 0, 0, 0 },
+		{ 0, 0, 0, 0, 0, 0, 0, 0 },
+		{ 0, 0, 0, -8192, 8192, 0, 0, 0 },
+		{ 0, 0, 0, 8192, 0, 0, 0, 0 },
+	},
+	// MIXER_INTERP_CUBIC
+	{
+		{ 0, 0, -4096, 12288, -12288, 4096, 0, 0 },
+		{ 0, 0, 8192, -20480, 16384, -4096, 0, 0 },
+		{ 0, 0, -4096, 0, 4096, 0, 0, 0 },
+		{ 0, 0, 0, 8192, 0, 0, 0, 0 },
+	},
+	// MIXER_INTERP_SINC
+	{
+		{ -181, 1211, -4944, 10047, -10047, 4944, -1211, 181 },
+		{ 363, -2604, 11281, -18239, 11902, -3552, 1030, -181 },
+		{ -181, 1393, -6337, 0, 6337, -1393, 181, 0 },
+		{ 0, 0, 0, 8192, 0, 0, 0, 0 },
+	},
+};
+
 /** @brief Configured limits of a mixer channel. 
  *
  * This structure describes the playback limits for a mixer channel. The limits
@@ -163,8 +255,20 @@ static struct {
 	mixer_fx15_t lvol[MIXER_MAX_CHANNELS];
 	mixer_fx15_t rvol[MIXER_MAX_CHANNELS];
 
+	mixer_fx15_t send[MIXER_MAX_CHANNELS];
+	int16_t biquad[MIXER_MAX_CHANNELS][5];  ///< Filter coefficients (b0, b1, b2, -a1, -a2)
+	uint32_t filtered;                      ///< Mask of channels with a filter
+	uint32_t filter_groups;                 ///< Mask of groups whose filter state is valid (see #FX_FLAGS_FILTERS)
+	void *delay_line[MIXER_MAX_CHANNELS];   ///< Delay line played by each channel (if any)
+	uint8_t interp[MIXER_MAX_CHANNELS];     ///< Interpolation mode of each channel (see #mixer_interp_t)
+	uint32_t loop_mirrored;                 ///< Mask of channels with the loop tail mirrored before the loop start
+
 	rsp_mixer_settings_t ucode_settings __attribute__((aligned(8)));
 
+	rspq_fence_t *fence;
+	uint32_t fence_value;   ///< Fence value signaled when the pending mix is done
+	bool pending;           ///< True if a mix was submitted but not yet completed
+
 } Mixer;
 
 /** @brief Count of ticks spent in mixer RSP, used for debugging purposes. */
@@ -174,6 +278,16 @@ static uint32_t __mixer_overlay_id;
 
 static inline int mixer_initialized(void) { return Mixer.num_channels != 0; }
 
+static void mixer_complete(void);
+
+// Complete the pending asynchronous mix (if any). This must be called before
+// touching the channel state or the sample buffers, as they are still in use
+// by RSP until the mix is done.
+static inline void mixer_sync(void) {
+	if (Mixer.pending)
+		mixer_complete();
+}
+
 void mixer_init(int num_channels) {
 	memset(&Mixer, 0, sizeof(Mixer));
 
@@ -187,12 +301,18 @@ void mixer_init(int num_channels) {
 		mixer_ch_set_limits(ch, 16, Mixer.sample_rate, 0);
 	}
 
+	// The interpolation kernels never change, so they are written once
+	volatile rsp_mixer_fx_t *fx = &((rsp_mixer_settings_t*)UncachedAddr(&Mixer.ucode_settings))->fx;
+	data_cache_hit_writeback_invalidate(&Mixer.ucode_settings, sizeof(Mixer.ucode_settings));
+	memcpy((void*)fx->interp, mixer_interp_kernels, sizeof(mixer_interp_kernels));
+
 	void *mixer_state = rspq_overlay_get_state(&rsp_mixer);
 	memset(mixer_state, 0, MIXER_STATE_SIZE);
 	data_cache_hit_writeback(mixer_state, MIXER_STATE_SIZE);
 
 	rspq_init();
     __mixer_overlay_id = rspq_overlay_register(&rsp_mixer);
+	Mixer.fence = rspq_fence_new();
 }
 
 static void mixer_init_samplebuffers(void) {
@@ -216,8 +336,9 @@ static void mixer_init_samplebuffers(void) {
 			bufsize[i] = Mixer.limits[i].max_buf_sz;
 
 		assert((bufsize[i] % 8) == 0);
-		totsize += bufsize[i];
+		totsize += bufsize[i] + MIXER_INTERP_GUARD;
 	}
+	totsize += MIXER_INTERP_GUARD;
 
 	// Do one large allocations for all sample buffers
 	assert(Mixer.ch_buf_mem == NULL);
@@ -227,9 +348,15 @@ static void mixer_init_samplebuffers(void) {
 
 	// Initialize the sample buffers
 	for (int i=0;i<Mixer.num_channels;i++) {
+		memset(cur, 0, MIXER_INTERP_GUARD);
+		cur += MIXER_INTERP_GUARD;
 		samplebuffer_init(&Mixer.ch_buf[i], cur, bufsize[i]);
 		cur += bufsize[i];
 	}
+	// The guard after the last buffer is used by mixer_exec to
+	// terminate non-looping waveforms with silence.
+	memset(cur, 0, MIXER_INTERP_GUARD);
+	cur += MIXER_INTERP_GUARD;
 
 	assert(cur == Mixer.ch_buf_mem+totsize);
 }
@@ -240,19 +367,31 @@ void mixer_set_vol(float vol) {
 
 void mixer_close(void) {
 	assert(mixer_initialized());
+	mixer_sync();
 
 	rspq_overlay_unregister(__mixer_overlay_id);
 	__mixer_overlay_id = 0;
 
+	rspq_fence_free(Mixer.fence);
+	Mixer.fence = NULL;
+
 	if (Mixer.ch_buf_mem) {
 		free_uncached(Mixer.ch_buf_mem);
 		Mixer.ch_buf_mem = NULL;
 	}
 
+	for (int ch=0;ch<MIXER_MAX_CHANNELS;ch++) {
+		if (Mixer.delay_line[ch]) {
+			free_uncached(Mixer.delay_line[ch]);
+			Mixer.delay_line[ch] = NULL;
+		}
+	}
+
 	Mixer.num_channels = 0;
 }
 
 void mixer_ch_set_freq(int ch, float frequency) {
+	mixer_sync();
 	mixer_channel_t *c = &Mixer.channels[ch];
 	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_freq: cannot call on secondary stereo channel %d", ch);
 	c->step = MIXER_FX64(frequency / (float)Mixer.sample_rate) << (c->flags & CH_FLAGS_BPS_SHIFT);
@@ -362,9 +501,14 @@ static void waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, b
 }
 
 void mixer_ch_play(int ch, waveform_t *wave) {
+	mixer_sync();
 	samplebuffer_t *sbuf = &Mixer.ch_buf[ch];
 	mixer_channel_t *c = &Mixer.channels[ch];
 
+	// Free the delay line, if the channel was playing one
+	if (c->flags & CH_FLAGS_FX_DELAY)
+		mixer_ch_stop(ch);
+
 	if (!Mixer.ch_buf_mem) {
 		// If we have not yet allocated the memory for the sample buffers,
 		// this is a good moment to do so, as we might need the configure
@@ -372,6 +516,15 @@ void mixer_ch_play(int ch, waveform_t *wave) {
 		mixer_init_samplebuffers();
 	}
 
+	// If the end of a loop was mirrored before its start (see mixer_exec),
+	// the guard does not contain silence anymore, and the sample buffer might
+	// not match the waveform. Restore both before playing again.
+	if (Mixer.loop_mirrored & (1u << ch)) {
+		Mixer.loop_mirrored &= ~(1u << ch);
+		memset(SAMPLES_PTR(sbuf) - MIXER_INTERP_GUARD, 0, MIXER_INTERP_GUARD);
+		samplebuffer_flush(sbuf);
+	}
+
 	// Configure the waveform on this channel, if we have not
 	// already. This optimization is useful in case the caller
 	// wants to play the same waveform on the same channel multiple
@@ -411,12 +564,14 @@ void mixer_ch_play(int ch, waveform_t *wave) {
 }
 
 void mixer_ch_set_pos(int ch, float pos) {
+	mixer_sync();
 	mixer_channel_t *c = &Mixer.channels[ch];
 	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_pos: cannot call on secondary stereo channel %d", ch);
 	c->pos = MIXER_FX64(pos) << (c->flags & CH_FLAGS_BPS_SHIFT);
 }
 
 float mixer_ch_get_pos(int ch) {
+	mixer_sync();
 	mixer_channel_t *c = &Mixer.channels[ch];
 	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_get_pos: cannot call on secondary stereo channel %d", ch);
 	uint32_t pos = c->pos >> (c->flags & CH_FLAGS_BPS_SHIFT);
@@ -424,10 +579,16 @@ float mixer_ch_get_pos(int ch) {
 }
 
 void mixer_ch_stop(int ch) {
+	mixer_sync();
 	mixer_channel_t *c = &Mixer.channels[ch];
 	c->ptr = 0;
 	if (c->flags & CH_FLAGS_STEREO)
 		c[1].flags &= ~CH_FLAGS_STEREO_SUB;
+	if (c->flags & CH_FLAGS_FX_DELAY) {
+		free_uncached(Mixer.delay_line[ch]);
+		Mixer.delay_line[ch] = NULL;
+		c->flags &= ~CH_FLAGS_FX_DELAY;
+	}
 
 	// Restart caching if played again. We need this guarantee
 	// because after calling stop(), the caller must be able
@@ -437,6 +598,7 @@ void mixer_ch_stop(int ch) {
 }
 
 bool mixer_ch_playing(int ch) {
+	mixer_sync();
 	mixer_channel_t *c = &Mixer.channels[ch];
 	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_playing: cannot call on secondary stereo channel %d", ch);
 	return c->ptr != 0;
@@ -447,6 +609,7 @@ void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_
 	assert(max_frequency >= 0);
 	assert(max_buf_sz >= 0 && max_buf_sz % 8 == 0);
 	tracef("mixer_ch_set_limits: ch=%d bits=%d maxfreq:%.2f bufsz:%d\n", ch, max_bits, max_frequency, max_buf_sz);
+	mixer_sync();
 
 	Mixer.limits[ch] = (channel_limit_t){
 		.max_bits = max_bits ? max_bits : 16,
@@ -464,7 +627,119 @@ void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_
 	}
 }
 
-static void mixer_exec(int32_t *out, int num_samples) {
+// Convert a filter coefficient to 2.14 fixed point (as used by rsp_mixer.S)
+static int16_t mixer_biquad_coeff(float c) {
+	c = roundf(c * (1<<14));
+	if (c > 32767) c = 32767;
+	if (c < -32768) c = -32768;
+	return c;
+}
+
+void mixer_ch_set_biquad(int ch, float b0, float b1, float b2, float a1, float a2) {
+	mixer_channel_t *c = &Mixer.channels[ch];
+	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_biquad: cannot call on secondary stereo channel %d", ch);
+	int16_t *k = Mixer.biquad[ch];
+	k[0] = mixer_biquad_coeff(b0);
+	k[1] = mixer_biquad_coeff(b1);
+	k[2] = mixer_biquad_coeff(b2);
+	k[3] = mixer_biquad_coeff(-a1);
+	k[4] = mixer_biquad_coeff(-a2);
+	Mixer.filtered |= 1u << ch;
+}
+
+void mixer_ch_set_filter(int ch, mixer_filter_t type, float freq, float q) {
+	if (type == MIXER_FILTER_NONE) {
+		mixer_channel_t *c = &Mixer.channels[ch];
+		assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_filter: cannot call on secondary stereo channel %d", ch);
+		Mixer.filtered &= ~(1u << ch);
+		return;
+	}
+
+	assertf(freq > 0 && freq < Mixer.sample_rate * 0.5f, "mixer_ch_set_filter: invalid frequency %.1f", freq);
+	assertf(q > 0, "mixer_ch_set_filter: invalid Q %.3f", q);
+
+	// Coefficients from Robert Bristow-Johnson's "Audio EQ Cookbook"
+	float w0 = 2.0f * M_PI * freq / Mixer.sample_rate;
+	float cosw0 = cosf(w0);
+	float alpha = sinf(w0) / (2.0f * q);
+	float a0 = 1.0f + alpha;
+	float b0, b1, b2;
+
+	switch (type) {
+	case MIXER_FILTER_LOWPASS:
+		b1 = 1.0f - cosw0;
+		b0 = b2 = b1 * 0.5f;
+		break;
+	case MIXER_FILTER_HIGHPASS:
+		b1 = -(1.0f + cosw0);
+		b0 = b2 = -b1 * 0.5f;
+		break;
+	case MIXER_FILTER_BANDPASS:
+		b0 = alpha;
+		b1 = 0;
+		b2 = -alpha;
+		break;
+	default:
+		assertf(0, "mixer_ch_set_filter: invalid filter type %d", type);
+		return;
+	}
+
+	mixer_ch_set_biquad(ch, b0/a0, b1/a0, b2/a0, -2.0f*cosw0/a0, (1.0f-alpha)/a0);
+}
+
+void mixer_ch_set_send(int ch, float send) {
+	mixer_channel_t *c = &Mixer.channels[ch];
+	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_send: cannot call on secondary stereo channel %d", ch);
+	Mixer.send[ch] = MIXER_FX15(send);
+}
+
+void mixer_ch_set_interp(int ch, mixer_interp_t interp) {
+	mixer_channel_t *c = &Mixer.channels[ch];
+	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_set_interp: cannot call on secondary stereo channel %d", ch);
+	assertf(interp >= MIXER_INTERP_NONE && interp <= MIXER_INTERP_SINC, "mixer_ch_set_interp: invalid mode %d", interp);
+	Mixer.interp[ch] = interp;
+}
+
+// Interpolation mode actually used for a channel. Stereo waveforms and
+// delay lines are never interpolated.
+static inline int mixer_ch_interp(int ch) {
+	if (Mixer.channels[ch].flags & (CH_FLAGS_STEREO | CH_FLAGS_FX_DELAY))
+		return MIXER_INTERP_NONE;
+	return Mixer.interp[ch];
+}
+
+void mixer_ch_play_delay(int ch, float delay) {
+	mixer_sync();
+	mixer_ch_stop(ch);
+	mixer_channel_t *c = &Mixer.channels[ch];
+	assertf(!(c->flags & CH_FLAGS_STEREO_SUB), "mixer_ch_play_delay: cannot call on secondary stereo channel %d", ch);
+
+	// The delay line is a looping 16-bit mono waveform, which is written by
+	// RSP as it is played. Its length must be a multiple of the DMA alignment.
+	int len = ROUND_UP((int)(delay * Mixer.sample_rate), 4);
+	assertf(len >= 64, "mixer_ch_play_delay: delay too short (%.4f s)", delay);
+
+	void *line = malloc_uncached(len*2 + MIXER_LOOP_OVERREAD);
+	assert(line);
+	memset(line, 0, len*2 + MIXER_LOOP_OVERREAD);
+	Mixer.delay_line[ch] = line;
+
+	c->flags = 1 | CH_FLAGS_16BIT | CH_FLAGS_FX_DELAY;
+	c->len = c->loop_len = MIXER_FX64((int64_t)len) << 1;
+	c->step = MIXER_FX64(1) << 1;
+	c->ptr = line;
+	c->pos = 0;
+	if (ch != Mixer.num_channels-1)
+		Mixer.channels[ch+1].flags &= ~CH_FLAGS_STEREO_SUB;
+
+	tracef("mixer_ch_play_delay: ch=%d len=%x\n", ch, len);
+}
+
+static void mixer_exec(int32_t *out, int num_samples, bool async) {
+	// The previous mix must be finished before we can update channels
+	// and sample buffers for this one.
+	mixer_sync();
+
 	if (!Mixer.ch_buf_mem) {
 		// If we have not yet allocated the memory for the sample buffers,
 		// this is a good moment to do so.
@@ -480,13 +755,20 @@ static void mixer_exec(int32_t *out, int num_samples) {
 		mixer_channel_t *ch = &Mixer.channels[i];
 		int bps = ch->flags & CH_FLAGS_BPS_SHIFT;
 		int bps_fx64 = bps + MIXER_FX64_FRAC;
-
-		if (ch->ptr) {
+		// Samples around the position also read by the interpolation kernel
+		int hist = mixer_ch_interp(i) ? MIXER_INTERP_HISTORY : 0;
+		int ahead = mixer_ch_interp(i) ? MIXER_INTERP_LOOKAHEAD : 0;
+		// Start of the loop, if it is fully cached and the history before it
+		// must be mirrored from the end of the loop (-1 otherwise).
+		int mirror_pos = -1;
+
+		// Delay lines are fully in RDRAM, written by RSP itself.
+		if (ch->ptr && !(ch->flags & CH_FLAGS_FX_DELAY)) {
 			int len = ch->len >> bps_fx64;
 			int loop_len = ch->loop_len >> bps_fx64;
 			int wpos = ch->pos >> bps_fx64;
 			int wlast = (ch->pos + ch->step*(num_samples-1)) >> bps_fx64;
-			int wlen = wlast-wpos+1;
+			int wlen = wlast-wpos+1+ahead;
 			assertf(wlen >= 0, "channel %d: wpos overflow", i);
 			tracef("ch:%d wpos:%x wlen:%x len:%x loop_len:%x sbuf_size:%x\n", i, wpos, wlen, len, loop_len, sbuf->size);
 
@@ -504,16 +786,20 @@ static void mixer_exec(int32_t *out, int num_samples) {
 				if (wpos+wlen > len)
 					wlen = len-wpos;
 				assert(wlen >= 0);
-			} else if (loop_len < sbuf->size) {
+			} else if (loop_len + hist < sbuf->size) {
 				// If the whole loop fits the sample buffer, we just need to
 				// make sure that it is aligned at the start of the buffer, so
 				// that it can be fully cached.
 				// To do so, we discard everything that comes before the loop 
-				// (once we enter the loop).
+				// (once we enter the loop). With interpolation, the history
+				// read when the loop restarts must be the end of the loop,
+				// so it is mirrored before the loop start (see below).
 				int loop_pos = len - loop_len;
 				if (wpos >= loop_pos) {
 					tracef("ch:%d discard to align loop wpos:%x loop_pos:%x\n", i, wpos, loop_pos);
 					samplebuffer_discard(sbuf, loop_pos);
+					if (hist)
+						mirror_pos = loop_pos;
 				}
 
 				// Do not ask more samples than the end of waveform. When we
@@ -554,9 +840,38 @@ static void mixer_exec(int32_t *out, int num_samples) {
 				fake_loop |= 1<<i;
 			}
 
-			void* ptr = samplebuffer_get(sbuf, wpos, &wlen);
+			// Keep the history of the interpolation kernel in the sample
+			// buffer, if it is still there (otherwise, this is the start
+			// of the waveform or a seek, and the guard is read instead).
+			int gpos = wpos;
+			if (hist && sbuf->widx && wpos - hist >= sbuf->wpos && wpos <= sbuf->wpos + sbuf->widx)
+				gpos = wpos - hist;
+			wlen += wpos - gpos;
+
+			int prev_wpos = sbuf->wpos, prev_end = sbuf->wpos + sbuf->widx;
+			void* ptr = samplebuffer_get(sbuf, gpos, &wlen);
 			assert(ptr);
-			ch->ptr = (uint8_t*)ptr - (wpos<<bps);
+			ch->ptr = (uint8_t*)ptr - (gpos<<bps);
+
+			// Mirror the last samples of a cached loop before its start (in
+			// the guard, or over the samples kept for 2-byte alignment), like
+			// MIXER_LOOP_OVERREAD does after its end. This way, the history
+			// of the interpolation kernel is correct when the loop restarts.
+			if (mirror_pos >= 0 && sbuf->wpos <= mirror_pos && sbuf->wpos + sbuf->widx >= len) {
+				// Samples just read might still be written by a RSP decoder.
+				if (sbuf->wpos != prev_wpos || sbuf->wpos + sbuf->widx != prev_end)
+					rspq_highpri_sync();
+				uint8_t *samples = ch->ptr;
+				int loop_bytes = loop_len << bps;
+				for (int j = (mirror_pos<<bps) - 1; j >= (mirror_pos-hist)<<bps; j--)
+					samples[j] = samples[j + loop_bytes];
+				Mixer.loop_mirrored |= 1u << i;
+			}
+
+			// Terminate a non-looping waveform with silence, so that the
+			// interpolation kernel does not read stale samples after it.
+			if (ahead && !loop_len && gpos+wlen >= len)
+				memset(ch->ptr + (len<<bps), 0, ahead<<bps);
 		}
 	}
 
@@ -596,8 +911,8 @@ static void mixer_exec(int32_t *out, int num_samples) {
 		// 32nd bit later to correctly update the position without overflow bugs.
 		rsp_wv[ch].pos = (uint32_t)c->pos & 0x7FFFFFFF;
 		rsp_wv[ch].step = (uint32_t)c->step & 0x7FFFFFFF;
-		rsp_wv[ch].ptr = c->ptr + ((c->pos & ~0x7FFFFFFF) >> MIXER_FX64_FRAC);
-		rsp_wv[ch].flags = c->flags;
+		rsp_wv[ch].ptr = PhysicalAddr(c->ptr + ((c->pos & ~0x7FFFFFFF) >> MIXER_FX64_FRAC));
+		rsp_wv[ch].flags = c->flags | (mixer_ch_interp(ch) << CH_FLAGS_INTERP_SHIFT);
 
 		// If the loop is fake (i.e. we are unrolling it), or the current
 		// position has been truncated but it's far from the end of the waveform,
@@ -630,27 +945,83 @@ static void mixer_exec(int32_t *out, int num_samples) {
 		settings->rvol[ch] = rvol32[ch];
 	}
 
+	// Configure the effects. Stereo sub-channels use the settings of the
+	// main channel (halving the send level, as both halves are sent).
+	volatile rsp_mixer_fx_t *fx = &settings->fx;
+	uint32_t fx_flags = 0;
+	for (int ch=0;ch<Mixer.num_channels;ch++) {
+		mixer_channel_t *c = &Mixer.channels[ch];
+		int src = (c->flags & CH_FLAGS_STEREO_SUB) ? ch-1 : ch;
+		int16_t send = Mixer.send[src];
+		if (Mixer.channels[src].flags & CH_FLAGS_STEREO)
+			send >>= 1;
+		fx->send[ch] = send;
+
+		if (Mixer.channels[src].ptr && (send || (c->flags & CH_FLAGS_FX_DELAY)))
+			fx_flags |= FX_FLAGS_BUS;
+		if (Mixer.filtered & (1u << src))
+			fx_flags |= 1 << (ch/8);
+	}
+
+	for (int g=0;g<MIXER_MAX_CHANNELS/8;g++) {
+		if (!(fx_flags & (1 << g)))
+			continue;
+		volatile rsp_mixer_biquad_t *bq = &fx->filter[g];
+		for (int i=0;i<8;i++) {
+			int ch = g*8+i;
+			int src = (Mixer.channels[ch].flags & CH_FLAGS_STEREO_SUB) ? ch-1 : ch;
+			// Channels without filter in the group just pass through
+			const int16_t *k = (Mixer.filtered & (1u << src)) ? Mixer.biquad[src] : (int16_t[5]){ 1<<14 };
+			bq->b0[i] = k[0]; bq->b1[i] = k[1]; bq->b2[i] = k[2];
+			bq->na1[i] = k[3]; bq->na2[i] = k[4];
+			// Reset the state if the group was not filtered in the previous mix
+			if (!(Mixer.filter_groups & (1 << g)))
+				bq->x1[i] = bq->x2[i] = bq->y1[i] = bq->y2[i] = 0;
+		}
+	}
+	Mixer.filter_groups = fx_flags & FX_FLAGS_FILTERS;
+
 	uint32_t t0 = TICKS_READ();
 
 	rspq_highpri_begin();
 	rspq_write(__mixer_overlay_id, 0,
-		(((uint32_t)MIXER_FX16(Mixer.vol)) & 0xFFFF),
+		(((uint32_t)MIXER_FX16(Mixer.vol)) & 0xFFFF) | (fx_flags << 16),
 		(num_samples << 16) | Mixer.num_channels,
 		PhysicalAddr(out),
 		PhysicalAddr(&Mixer.ucode_settings));
+	Mixer.fence_value = rspq_fence_enqueue_signal(Mixer.fence);
 	rspq_highpri_end();
+	Mixer.pending = true;
+
+	__mixer_profile_rsp += TICKS_READ() - t0;
 
-	rspq_highpri_sync();
+	// Ticks only depend on the number of samples, so they can be advanced
+	// right away even if the mix is still running.
+	Mixer.ticks += num_samples;
+
+	if (!async)
+		mixer_complete();
+}
+
+// Wait for the pending mix to finish, and update the CPU-side channel
+// positions with those written back by RSP.
+static void mixer_complete(void) {
+	assert(Mixer.pending);
+	uint32_t t0 = TICKS_READ();
+
+	// Wait only for the mixer command, not for the whole highpri queue
+	// (which might contain other libraries' commands).
+	rspq_fence_wait(Mixer.fence, Mixer.fence_value);
+	Mixer.pending = false;
 
 	__mixer_profile_rsp += TICKS_READ() - t0;
 
+	volatile rsp_mixer_channel_t *rsp_wv = ((volatile rsp_mixer_settings_t*)UncachedAddr(&Mixer.ucode_settings))->channels;
 	for (int i=0;i<Mixer.num_channels;i++) {
 		mixer_channel_t *ch = &Mixer.channels[i];
 		if (ch->ptr)
 			ch->pos += (uint64_t)rsp_wv[i].pos - (uint64_t)(ch->pos & 0x7FFFFFFF);
 	}
-
-	Mixer.ticks += num_samples;
 }
 
 static mixer_event_t* mixer_next_event(void) {
@@ -681,7 +1052,7 @@ void mixer_remove_event(MixerEvent cb, void *ctx) {
 	assertf("mixer_remove_event: specified event does not exist\ncb:%p ctx:%p", (void*)cb, ctx);
 }
 
-void mixer_poll(int16_t *out16, int num_samples) {
+static void mixer_poll_internal(int16_t *out16, int num_samples, bool async) {
 	int32_t *out = (int32_t*)out16;
 
 	// Since the AI can only play an even number of samples,
@@ -694,7 +1065,9 @@ void mixer_poll(int16_t *out16, int num_samples) {
 
 		int ns = MIN(num_samples, e ? e->ticks - Mixer.ticks : num_samples);
 		if (ns > 0) {
-			mixer_exec(out, ns);
+			// Only the last segment can be left running: the previous ones
+			// will be completed anyway by the next mixer_exec.
+			mixer_exec(out, ns, async && ns == num_samples);
 			out += ns;
 			num_samples -= ns;
 		}
@@ -707,3 +1080,21 @@ void mixer_poll(int16_t *out16, int num_samples) {
 		}
 	}
 }
+
+void mixer_poll(int16_t *out16, int num_samples) {
+	mixer_poll_internal(out16, num_samples, false);
+}
+
+void mixer_poll_async(int16_t *out16, int num_samples) {
+	mixer_poll_internal(out16, num_samples, true);
+}
+
+bool mixer_poll_done(void) {
+	if (Mixer.pending && rspq_fence_check(Mixer.fence, Mixer.fence_value))
+		mixer_complete();
+	return !Mixer.pending;
+}
+
+void mixer_wait(void) {
+	mixer_sync();
+}
@@ -11,9 +11,14 @@
 #include "n64sys.h"
 #include "dma.h"
 #include "samplebuffer.h"
+#include "rspq.h"
 #include "debug.h"
+#include "utils.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <malloc.h>
 #include <assert.h>
 
 /** ID of a standard WAV file */
@@ -21,6 +26,91 @@
 /** ID of a WAVX file (big-endian WAV) */
 #define WAV_RIFX_ID   "RIFX"
 
+/** @brief Maximum number of frames decoded by a single RSP command (see rsp_vadpcm.S) */
+#define VADPCM_MAX_FRAMES       32
+/** @brief Number of staging buffers for compressed frames */
+#define VADPCM_STAGING_SLOTS    4
+/** @brief Size of a staging buffer (including room for misalignment) */
+#define VADPCM_STAGING_SIZE     ROUND_UP(VADPCM_MAX_FRAMES * VADPCM_FRAME_BYTES + 8, 16)
+
+/** @brief Flags of the RSP decode command (see rsp_vadpcm.S) */
+enum {
+	VADPCM_FLAG_STEREO      = 1<<27,    ///< Frames are stereo (interleaved)
+	VADPCM_FLAG_RESET       = 1<<28,    ///< Reset the decoder state before decoding
+	VADPCM_FLAG_LOOP        = 1<<29,    ///< Load the loop state before decoding
+	VADPCM_FLAG_NO_OUTPUT   = 1<<30,    ///< Only advance the decoder state
+};
+
+/**
+ * @brief Decoder context of the RSP ucode, in RDRAM.
+ *
+ * Each predictor of the codebook is expanded in 32 coefficients: the
+ * contributions of the second-to-last sample, followed by a sequence T[-8..15]
+ * such as the contribution of the j-th residual to the i-th sample of a
+ * group is T[i-j]. This allows the ucode to load each column with a single
+ * unaligned vector load.
+ */
+typedef struct {
+	int16_t state[2][2];                        ///< Current decoder state (per channel)
+	int16_t loop_state[2][2];                   ///< Decoder state at the loop start (per channel)
+	int16_t book[VADPCM_MAX_PREDICTORS][32];    ///< Expanded codebook
+} vadpcm_rsp_ctx_t;
+
+/** @brief Private state of a WAV64 in VADPCM format */
+typedef struct {
+	vadpcm_rsp_ctx_t *ctx;                      ///< RSP decoder context (uncached)
+	uint8_t *staging;                           ///< Staging buffers for compressed frames (uncached)
+	rspq_fence_t *fence;                        ///< Fence signalled when a staging buffer is consumed
+	uint32_t slot_fence[VADPCM_STAGING_SLOTS];  ///< Fence value to wait for before reusing each staging buffer
+	int slot;                                   ///< Next staging buffer to use
+	uint32_t out_fence;                         ///< Fence value signalled when the last decoded samples are written
+	int npredictors;                            ///< Number of predictors in the codebook
+	int loop_start;                             ///< Loop start stored in the file (-1 if none)
+	int next_wpos;                              ///< Position of the next sample to decode (-1 if unknown)
+} wav64_vadpcm_t;
+
+/** @brief Number of staging buffers for MDCT coefficients (one per channel of each frame) */
+#define MDCT_STAGING_SLOTS      4
+
+/** @brief Command IDs of the MDCT overlay (see rsp_mdct.S) */
+enum {
+	MDCT_CMD_IMDCT          = 0x0,
+	MDCT_CMD_OUTPUT         = 0x1,
+	MDCT_CMD_SET_TABLES     = 0x2,
+};
+
+/** @brief Flags of the RSP IMDCT command (see rsp_mdct.S) */
+enum {
+	MDCT_FLAG_NO_OUTPUT     = 1<<24,    ///< Only compute the overlap-add state
+};
+
+/** @brief Private state of a WAV64 in MDCT format */
+typedef struct {
+	int frame_bytes;                            ///< Size of each compressed frame (all channels)
+	uint8_t *frame;                             ///< Buffer for a compressed frame (cached)
+	int16_t *staging;                           ///< Staging buffers for the coefficients (cached)
+	rspq_fence_t *fence;                        ///< Fence signalled when a staging buffer is consumed
+	uint32_t slot_fence[MDCT_STAGING_SLOTS];    ///< Fence value to wait for before reusing each staging buffer
+	int slot;                                   ///< Next staging buffer to use
+	uint32_t out_fence;                         ///< Fence value signalled when the last output samples are written
+	int16_t *ola;                               ///< Overlap-add state of each channel (uncached)
+	int16_t *pcm;                               ///< Last decoded block of each channel (uncached)
+	int ola_frame;                              ///< Frame whose second half is in the overlap-add state (-1 if none)
+	int pcm_block;                              ///< Block of samples currently in pcm (-1 if none)
+} wav64_mdct_t;
+
+DEFINE_RSP_UCODE(rsp_vadpcm);
+DEFINE_RSP_UCODE(rsp_mdct);
+
+/** @brief Overlay ID of the VADPCM decoder (0 if not registered yet) */
+static uint32_t vadpcm_overlay_id;
+
+/** @brief Overlay ID of the MDCT decoder (0 if not registered yet) */
+static uint32_t mdct_overlay_id;
+
+/** @brief Tables used by the MDCT decoder (uncached, shared by all files) */
+static mdct_tables_t *mdct_tables;
+
 /** @brief Profile of DMA usage by WAV64, used for debugging purposes. */
 int64_t __wav64_profile_dma = 0;
 
@@ -34,7 +124,11 @@ void raw_waveform_read(samplebuffer_t *sbuf, int base_rom_addr, int wpos, int wl
 	// also for misaligned addresses and odd lengths.
 	// The mixer/samplebuffer guarantees that ROM/RAM addresses are always
 	// on the same 2-byte phase, as the only requirement of dma_read.
-	dma_read(ram_addr, rom_addr, bytes);
+	// The transfer is queued at high priority so that the mixer is never
+	// stuck waiting behind large asset loads.
+	dma_request_t req;
+	dma_read_queued(&req, ram_addr, rom_addr, bytes, DMA_PRIORITY_HIGH, NULL, NULL);
+	dma_request_wait(&req);
 	__wav64_profile_dma += TICKS_READ() - t0;
 }
 
@@ -44,6 +138,307 @@ static void waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, b
 	raw_waveform_read(sbuf, wav->rom_addr, wpos, wlen, bps);
 }
 
+/**
+ * @brief Append samples that will be written by the RSP to a sample buffer.
+ *
+ * If there is not enough space, samplebuffer_append compacts the buffer
+ * with a CPU copy. This can happen while the samples enqueued by a previous
+ * call are still being decoded (eg: the mixer reads twice when a loop wraps),
+ * in which case the RSP would write them at their old position after the
+ * copy. So wait for them first.
+ *
+ * @param sbuf      Sample buffer
+ * @param wlen      Number of samples to append
+ * @param fence     Fence of the decoder
+ * @param out_fence Fence value signalled when the previous samples are written
+ * @return Pointer where the RSP must write the samples
+ */
+static void* rsp_samplebuffer_append(samplebuffer_t *sbuf, int wlen, rspq_fence_t *fence, uint32_t out_fence) {
+	if (sbuf->widx + wlen > sbuf->size)
+		rspq_fence_wait(fence, out_fence);
+	return samplebuffer_append(sbuf, wlen);
+}
+
+/**
+ * @brief Enqueue the decoding of VADPCM samples on the RSP.
+ *
+ * Decoding starts from the decoder state saved in the context, which must
+ * refer to the beginning of the frame containing @p wpos (unless @p flags
+ * requests to reset it).
+ *
+ * @param wav       WAV64 to decode
+ * @param sbuf      Sample buffer to append the samples to, or NULL to
+ *                  just advance the decoder state.
+ * @param wpos      Position of the first sample to decode
+ * @param wlen      Number of samples to decode
+ * @param flags     Flags for the first command (VADPCM_FLAG_RESET or VADPCM_FLAG_LOOP)
+ */
+static void vadpcm_decode(wav64_t *wav, samplebuffer_t *sbuf, int wpos, int wlen, uint32_t flags) {
+	wav64_vadpcm_t *vad = (wav64_vadpcm_t*)wav->ext;
+	int nch = wav->wave.channels;
+	int bps = nch == 2 ? 2 : 1;
+	uint8_t *dst = sbuf ? (uint8_t*)rsp_samplebuffer_append(sbuf, wlen, vad->fence, vad->out_fence) : NULL;
+
+	uint32_t ctx = PhysicalAddr(vad->ctx) | ((vad->npredictors-1) << 24);
+	if (nch == 2) ctx |= VADPCM_FLAG_STEREO;
+	if (!sbuf) ctx |= VADPCM_FLAG_NO_OUTPUT;
+
+	while (wlen > 0) {
+		int frame = wpos / VADPCM_FRAME_SAMPLES;
+		int skip = wpos % VADPCM_FRAME_SAMPLES;
+		int n = MIN(wlen, VADPCM_MAX_FRAMES / nch * VADPCM_FRAME_SAMPLES - skip);
+		int nframes = (skip + n + VADPCM_FRAME_SAMPLES - 1) / VADPCM_FRAME_SAMPLES;
+		uint32_t rom_addr = wav->rom_addr + frame * nch * VADPCM_FRAME_BYTES;
+
+		// Wait until the RSP has consumed the previous contents of the
+		// staging buffer. Normally this never blocks.
+		int slot = vad->slot;
+		vad->slot = (slot + 1) % VADPCM_STAGING_SLOTS;
+		rspq_fence_wait(vad->fence, vad->slot_fence[slot]);
+
+		// Fetch the compressed frames. The staging buffer has the same
+		// 8-byte misalignment of the ROM address, so that dma_read does
+		// not need to go through the CPU.
+		uint8_t *staging = vad->staging + slot * VADPCM_STAGING_SIZE + (rom_addr & 7);
+		uint32_t t0 = TICKS_READ();
+		dma_request_t req;
+		dma_read_queued(&req, staging, rom_addr, nframes * nch * VADPCM_FRAME_BYTES,
+			DMA_PRIORITY_HIGH, NULL, NULL);
+		dma_request_wait(&req);
+		__wav64_profile_dma += TICKS_READ() - t0;
+
+		// Decode on the RSP. This must run in the highpri queue, as the mixer
+		// command that consumes the samples will be enqueued there.
+		rspq_highpri_begin();
+		rspq_write(vadpcm_overlay_id, 0, PhysicalAddr(dst), PhysicalAddr(staging),
+			ctx | flags, (skip << 16) | n);
+		vad->slot_fence[slot] = rspq_fence_enqueue_signal(vad->fence);
+		rspq_highpri_end();
+		if (dst) vad->out_fence = vad->slot_fence[slot];
+
+		flags = 0;
+		wpos += n;
+		wlen -= n;
+		if (dst) dst += n << bps;
+	}
+
+	vad->next_wpos = wpos;
+}
+
+static void vadpcm_waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking) {
+	wav64_t *wav = (wav64_t*)ctx;
+	wav64_vadpcm_t *vad = (wav64_vadpcm_t*)wav->ext;
+	uint32_t flags = 0;
+
+	// The decoder state is only known at the position where the previous
+	// decode stopped. For any other position, restart decoding from the closest
+	// point where the state is known (the loop start or the beginning of the
+	// waveform), and advance it without producing output up to the frame
+	// containing wpos.
+	if (seeking || wpos != vad->next_wpos) {
+		int start = 0;
+		flags = VADPCM_FLAG_RESET;
+		if (vad->loop_start >= 0 && wpos >= vad->loop_start) {
+			start = vad->loop_start - vad->loop_start % VADPCM_FRAME_SAMPLES;
+			flags = VADPCM_FLAG_LOOP;
+		}
+		int end = wpos - wpos % VADPCM_FRAME_SAMPLES;
+		if (end > start) {
+			vadpcm_decode(wav, NULL, start, end - start, flags);
+			flags = 0;
+		}
+	}
+
+	vadpcm_decode(wav, sbuf, wpos, wlen, flags);
+}
+
+/** @brief Load the VADPCM extended header and allocate the decoder state */
+static void vadpcm_open(wav64_t *wav, int fh, const wav64_header_t *head) {
+	wav64_header_vadpcm_t vhead;
+	dfs_read(&vhead, 1, sizeof(vhead), fh);
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Swap the loop state and the codebook (all int16_t)
+	for (uint8_t *p = (uint8_t*)&vhead + offsetof(wav64_header_vadpcm_t, loop_state); p < (uint8_t*)(&vhead + 1); p += 2) {
+		uint8_t t = p[0]; p[0] = p[1]; p[1] = t;
+	}
+	#endif
+	assertf(vhead.npredictors >= 1 && vhead.npredictors <= VADPCM_MAX_PREDICTORS,
+		"wav64 %s: invalid number of predictors: %d\n", wav->wave.name, vhead.npredictors);
+	assertf(head->channels == 1 || head->channels == 2,
+		"wav64 %s: invalid number of channels: %d\n", wav->wave.name, head->channels);
+
+	if (!vadpcm_overlay_id) {
+		rspq_init();
+		vadpcm_overlay_id = rspq_overlay_register(&rsp_vadpcm);
+	}
+
+	wav64_vadpcm_t *vad = malloc(sizeof(wav64_vadpcm_t));
+	memset(vad, 0, sizeof(*vad));
+	vad->npredictors = vhead.npredictors;
+	vad->loop_start = head->loop_len ? head->len - head->loop_len : -1;
+	vad->next_wpos = -1;
+	vad->fence = rspq_fence_new();
+	vad->staging = malloc_uncached(VADPCM_STAGING_SLOTS * VADPCM_STAGING_SIZE);
+
+	// Build the RSP context, expanding the codebook as described in
+	// vadpcm_rsp_ctx_t. The header is already in native order.
+	vadpcm_rsp_ctx_t *rctx = malloc_uncached(sizeof(vadpcm_rsp_ctx_t));
+	memset(rctx, 0, sizeof(*rctx));
+	memcpy(rctx->loop_state, vhead.loop_state, sizeof(rctx->loop_state));
+	for (int p=0; p<vhead.npredictors; p++) {
+		int16_t *book = rctx->book[p];
+		for (int i=0; i<8; i++) {
+			book[i] = vhead.book[p][0][i];
+			book[17+i] = vhead.book[p][1][i];
+		}
+		book[16] = 1 << VADPCM_BOOK_FRAC_BITS;
+	}
+	vad->ctx = rctx;
+
+	wav->ext = vad;
+	wav->wave.bits = 16;
+	wav->wave.read = vadpcm_waveform_read;
+}
+
+/**
+ * @brief Enqueue the decoding of a MDCT frame on the RSP.
+ *
+ * The frame is parsed and dequantized on the CPU, and then the RSP runs
+ * the IMDCT of each channel, producing the block of samples that precedes
+ * the frame (overlapped with the previous frame, whose second half is in the
+ * overlap-add state), and the new overlap-add state.
+ *
+ * @param wav       WAV64 to decode
+ * @param frame     Index of the frame to decode
+ * @param flags     Flags for the commands (MDCT_FLAG_NO_OUTPUT to only
+ *                  compute the overlap-add state)
+ */
+static void mdct_decode(wav64_t *wav, int frame, uint32_t flags) {
+	wav64_mdct_t *mdct = (wav64_mdct_t*)wav->ext;
+	const int N = MDCT_FRAME_SAMPLES;
+	int nch = wav->wave.channels;
+	uint32_t rom_addr = wav->rom_addr + frame * mdct->frame_bytes;
+
+	// Fetch the compressed frame. The buffer has the same 8-byte misalignment
+	// of the ROM address, so that dma_read does not need to go through the CPU.
+	uint8_t *buf = mdct->frame + (rom_addr & 7);
+	data_cache_hit_writeback_invalidate(mdct->frame, mdct->frame_bytes + 8);
+	uint32_t t0 = TICKS_READ();
+	dma_request_t req;
+	dma_read_queued(&req, buf, rom_addr, mdct->frame_bytes, DMA_PRIORITY_HIGH, NULL, NULL);
+	dma_request_wait(&req);
+	__wav64_profile_dma += TICKS_READ() - t0;
+
+	int32_t coefs[2][MDCT_FRAME_SAMPLES];
+	mdct_decode_frame(buf, mdct->frame_bytes, nch, frame, coefs);
+
+	for (int c=0; c<nch; c++) {
+		// Wait until the RSP has consumed the previous contents of the
+		// staging buffer. Normally this never blocks.
+		int slot = mdct->slot;
+		mdct->slot = (slot + 1) % MDCT_STAGING_SLOTS;
+		rspq_fence_wait(mdct->fence, mdct->slot_fence[slot]);
+
+		int16_t *staging = mdct->staging + slot * N;
+		int shift = mdct_prepare_coefs(coefs[c], staging);
+		data_cache_hit_writeback(staging, N * sizeof(int16_t));
+
+		// Decode on the RSP. This must run in the highpri queue, as the mixer
+		// command that consumes the samples will be enqueued there.
+		rspq_highpri_begin();
+		rspq_write(mdct_overlay_id, MDCT_CMD_IMDCT, PhysicalAddr(staging),
+			PhysicalAddr(mdct->pcm + c * N), PhysicalAddr(mdct->ola + c * N) | flags, shift);
+		mdct->slot_fence[slot] = rspq_fence_enqueue_signal(mdct->fence);
+		rspq_highpri_end();
+	}
+}
+
+static void mdct_waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking) {
+	wav64_t *wav = (wav64_t*)ctx;
+	wav64_mdct_t *mdct = (wav64_mdct_t*)wav->ext;
+	const int N = MDCT_FRAME_SAMPLES;
+	int nch = wav->wave.channels;
+	uint8_t *dst = (uint8_t*)rsp_samplebuffer_append(sbuf, wlen, mdct->fence, mdct->out_fence);
+
+	while (wlen > 0) {
+		int block = wpos / N;
+		int start = wpos % N;
+		int n = MIN(wlen, N - start);
+
+		// Block B is produced by decoding frame B+1 on top of the overlap-add
+		// state of frame B. After a seek, the state is not available, so
+		// frame B must be decoded first (without output). Apart from this, each
+		// frame is decoded only once, so the CPU cost is bounded by the number
+		// of samples requested.
+		if (block != mdct->pcm_block) {
+			if (mdct->ola_frame != block)
+				mdct_decode(wav, block, MDCT_FLAG_NO_OUTPUT);
+			mdct_decode(wav, block+1, 0);
+			mdct->ola_frame = block+1;
+			mdct->pcm_block = block;
+		}
+
+		// Copy the samples into the sample buffer. The RSP executes the
+		// commands in order, so this runs after the decode above, and before
+		// any later decode overwrites the block.
+		rspq_highpri_begin();
+		rspq_write(mdct_overlay_id, MDCT_CMD_OUTPUT, PhysicalAddr(dst),
+			PhysicalAddr(mdct->pcm + start), PhysicalAddr(mdct->pcm + N + start),
+			n | (nch == 2 ? 1<<16 : 0));
+		rspq_highpri_end();
+
+		wpos += n;
+		wlen -= n;
+		dst += n * nch * 2;
+	}
+
+	rspq_highpri_begin();
+	mdct->out_fence = rspq_fence_enqueue_signal(mdct->fence);
+	rspq_highpri_end();
+}
+
+/** @brief Load the MDCT extended header and allocate the decoder state */
+static void mdct_open(wav64_t *wav, int fh, const wav64_header_t *head) {
+	wav64_header_mdct_t mhead;
+	dfs_read(&mhead, 1, sizeof(mhead), fh);
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	mhead.frame_bytes = __builtin_bswap16(mhead.frame_bytes);
+	#endif
+	assertf(head->channels == 1 || head->channels == 2,
+		"wav64 %s: invalid number of channels: %d\n", wav->wave.name, head->channels);
+	assertf(mhead.frame_bytes > 0, "wav64 %s: invalid frame size: %d\n",
+		wav->wave.name, mhead.frame_bytes);
+
+	if (!mdct_overlay_id) {
+		rspq_init();
+		mdct_overlay_id = rspq_overlay_register(&rsp_mdct);
+
+		// The tables are shared by all files. Set them in the highpri
+		// queue, so that they are available to the decode commands.
+		mdct_tables = malloc_uncached(sizeof(mdct_tables_t));
+		mdct_init_tables(mdct_tables);
+		rspq_highpri_begin();
+		rspq_write(mdct_overlay_id, MDCT_CMD_SET_TABLES, PhysicalAddr(mdct_tables));
+		rspq_highpri_end();
+	}
+
+	const int N = MDCT_FRAME_SAMPLES;
+	wav64_mdct_t *mdct = malloc(sizeof(wav64_mdct_t));
+	memset(mdct, 0, sizeof(*mdct));
+	mdct->frame_bytes = mhead.frame_bytes;
+	mdct->frame = memalign(16, ROUND_UP(mhead.frame_bytes + 8, 16));
+	mdct->staging = memalign(16, MDCT_STAGING_SLOTS * N * sizeof(int16_t));
+	mdct->fence = rspq_fence_new();
+	mdct->ola = malloc_uncached(2 * N * sizeof(int16_t));
+	mdct->pcm = malloc_uncached(2 * N * sizeof(int16_t));
+	mdct->ola_frame = -1;
+	mdct->pcm_block = -1;
+
+	wav->ext = mdct;
+	wav->wave.bits = 16;
+	wav->wave.read = mdct_waveform_read;
+}
+
 void wav64_open(wav64_t *wav, const char *fn) {
 	memset(wav, 0, sizeof(*wav));
 
@@ -60,6 +455,13 @@ void wav64_open(wav64_t *wav, const char *fn) {
 
 	wav64_header_t head;
 	dfs_read(&head, 1, sizeof(head), fh);
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Host build (see tools/audiorender64): headers are big-endian.
+	head.freq = __builtin_bswap32(head.freq);
+	head.len = __builtin_bswap32(head.len);
+	head.loop_len = __builtin_bswap32(head.loop_len);
+	head.start_offset = __builtin_bswap32(head.start_offset);
+	#endif
 	if (memcmp(head.id, WAV64_ID, 4) != 0) {
 		assertf(memcmp(head.id, WAV_RIFF_ID, 4) != 0 && memcmp(head.id, WAV_RIFX_ID, 4) != 0,
 			"wav64 %s: use audioconv64 to convert to wav64 format", fn);
@@ -68,8 +470,9 @@ void wav64_open(wav64_t *wav, const char *fn) {
 	}
 	assertf(head.version == WAV64_FILE_VERSION, "wav64 %s: invalid version: %02x\n",
 		fn, head.version);
-	assertf(head.format == WAV64_FORMAT_RAW, "wav64 %s: invalid format: %02x\n",
-		fn, head.format);
+	assertf(head.format == WAV64_FORMAT_RAW || head.format == WAV64_FORMAT_VADPCM ||
+		head.format == WAV64_FORMAT_MDCT,
+		"wav64 %s: invalid format: %02x\n", fn, head.format);
 
 	wav->wave.name = fn;
 	wav->wave.channels = head.channels;
@@ -78,10 +481,43 @@ void wav64_open(wav64_t *wav, const char *fn) {
 	wav->wave.len = head.len;
 	wav->wave.loop_len = head.loop_len; 
 	wav->rom_addr = dfs_rom_addr(fn) + head.start_offset;
-	dfs_close(fh);
-
+	wav->format = head.format;
 	wav->wave.read = waveform_read;
 	wav->wave.ctx = wav;
+
+	if (head.format == WAV64_FORMAT_VADPCM)
+		vadpcm_open(wav, fh, &head);
+	else if (head.format == WAV64_FORMAT_MDCT)
+		mdct_open(wav, fh, &head);
+	dfs_close(fh);
+}
+
+void wav64_close(wav64_t *wav)
+{
+	if (wav->format == WAV64_FORMAT_VADPCM) {
+		wav64_vadpcm_t *vad = (wav64_vadpcm_t*)wav->ext;
+
+		// Make sure the RSP is not using the buffers anymore
+		for (int i=0; i<VADPCM_STAGING_SLOTS; i++)
+			rspq_fence_wait(vad->fence, vad->slot_fence[i]);
+		rspq_fence_free(vad->fence);
+		free_uncached(vad->staging);
+		free_uncached(vad->ctx);
+		free(vad);
+	} else if (wav->format == WAV64_FORMAT_MDCT) {
+		wav64_mdct_t *mdct = (wav64_mdct_t*)wav->ext;
+
+		// Make sure the RSP is not using the buffers anymore. The last
+		// output command is followed by the most recent fence signal.
+		rspq_fence_wait(mdct->fence, mdct->out_fence);
+		rspq_fence_free(mdct->fence);
+		free_uncached(mdct->ola);
+		free_uncached(mdct->pcm);
+		free(mdct->staging);
+		free(mdct->frame);
+		free(mdct);
+	}
+	memset(wav, 0, sizeof(*wav));
 }
 
 void wav64_play(wav64_t *wav, int ch)
@@ -0,0 +1,378 @@
+/**
+ * @file wav64_mdct.c
+ * @brief MDCT codec of WAV64 files (shared by the decoder and audioconv64)
+ * @ingroup mixer
+ *
+ * This is built both into libdragon (see wav64.c) and into audioconv64, so
+ * that the encoder and the decoder share the exact same bit allocation and
+ * bitstream format. It also contains the reference implementation of the
+ * fixed-point IMDCT run by the RSP ucode (rsp_mdct.S).
+ */
+
+#include "wav64internal.h"
+#include <string.h>
+#include <math.h>
+
+/** @brief First coefficient of each band (the last entry is #MDCT_FRAME_SAMPLES) */
+const uint16_t mdct_band_start[MDCT_NUM_BANDS+1] = {
+	0, 4, 8, 12, 16, 20, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, 256,
+};
+
+/**
+ * @brief Perceptual bias of each band for bit allocation (in 1.5 dB units).
+ *
+ * Lower bands are favored, as quantization noise is more audible there.
+ */
+static const int8_t mdct_band_bias[MDCT_NUM_BANDS] = {
+	2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, -1, -2, -3, -4,
+};
+
+/**
+ * @brief Compute the number of bits allocated to each band.
+ *
+ * Bits are assigned greedily, one bit per coefficient at a time, to the band
+ * with the highest noise level (estimated from its scale factor and the bits
+ * already allocated), until the budget is exhausted. Both the encoder and the
+ * decoder run this, so it must be fully deterministic.
+ *
+ * @param[in]  sf         Scale factors of each channel
+ * @param[in]  channels   Number of channels
+ * @param[in]  budget     Number of bits available for the coefficients
+ * @param[out] bits       Number of bits per coefficient of each band
+ */
+void mdct_allocate_bits(const uint8_t sf[2][MDCT_NUM_BANDS], int channels,
+	int budget, uint8_t bits[2][MDCT_NUM_BANDS])
+{
+	memset(bits, 0, 2*MDCT_NUM_BANDS);
+	while (1) {
+		int best_c = -1, best_b = 0, best_prio = 0;
+		for (int c=0; c<channels; c++) {
+			for (int b=0; b<MDCT_NUM_BANDS; b++) {
+				int width = mdct_band_start[b+1] - mdct_band_start[b];
+				if (sf[c][b] == 0 || bits[c][b] == MDCT_MAX_BITS || width > budget)
+					continue;
+				// Each bit lowers the quantization noise by 6 dB
+				int prio = sf[c][b]*2 + mdct_band_bias[b] - bits[c][b]*4;
+				if (best_c < 0 || prio > best_prio) {
+					best_c = c; best_b = b; best_prio = prio;
+				}
+			}
+		}
+		if (best_c < 0)
+			break;
+		bits[best_c][best_b]++;
+		budget -= mdct_band_start[best_b+1] - mdct_band_start[best_b];
+	}
+}
+
+/** @brief Bitstream reader for MDCT frames */
+typedef struct {
+	const uint8_t *buf;     ///< Frame data
+	int pos;                ///< Current position (in bits)
+	int size;               ///< Size of the frame (in bits)
+} mdct_bitreader_t;
+
+/** @brief Read a value from a MDCT frame (zeros are returned past the end) */
+static inline uint32_t mdct_read_bits(mdct_bitreader_t *br, int n) {
+	uint32_t v = 0;
+	for (int i=0; i<n; i++, br->pos++) {
+		v <<= 1;
+		if (br->pos < br->size)
+			v |= (br->buf[br->pos >> 3] >> (7 - (br->pos & 7))) & 1;
+	}
+	return v;
+}
+
+/**
+ * @brief Decode the coefficients of a MDCT frame (reference implementation).
+ *
+ * The scale factor of the first band is stored as an absolute value
+ * (#MDCT_SF_BITS bits), the others as a difference from the previous band:
+ * '0' (same), '10s' (±1), '110s' (±2), '1110s' (±3), or '1111' followed by
+ * the absolute value.
+ *
+ * The coefficients of a band with scale factor sf and B allocated bits are
+ * quantized with a mid-rise quantizer: index q is decoded as
+ * (2q+1-2^B) * A / 2^B, where A is #mdct_sf_amplitude(sf). Bands with no
+ * allocated bits are filled with noise at a quarter of their amplitude.
+ *
+ * @param[in]  frame        Frame data
+ * @param[in]  frame_bytes  Size of the frame in bytes
+ * @param[in]  channels     Number of channels
+ * @param[in]  seed         Seed for the noise filling (the frame index)
+ * @param[out] coefs        Decoded coefficients of each channel (left/right)
+ */
+void mdct_decode_frame(const uint8_t *frame, int frame_bytes, int channels,
+	uint32_t seed, int32_t coefs[2][MDCT_FRAME_SAMPLES])
+{
+	mdct_bitreader_t br = { frame, 0, frame_bytes * 8 };
+	uint8_t sf[2][MDCT_NUM_BANDS];
+	uint8_t bits[2][MDCT_NUM_BANDS];
+
+	for (int c=0; c<channels; c++) {
+		int v = mdct_read_bits(&br, MDCT_SF_BITS);
+		if (v > MDCT_MAX_SF) v = MDCT_MAX_SF;
+		sf[c][0] = v;
+		for (int b=1; b<MDCT_NUM_BANDS; b++) {
+			int n = 0;
+			while (n < 4 && mdct_read_bits(&br, 1)) n++;
+			if (n == 4)
+				v = mdct_read_bits(&br, MDCT_SF_BITS);
+			else if (n > 0)
+				v += mdct_read_bits(&br, 1) ? -n : n;
+			v &= (1 << MDCT_SF_BITS) - 1;
+			if (v > MDCT_MAX_SF) v = MDCT_MAX_SF;
+			sf[c][b] = v;
+		}
+	}
+
+	mdct_allocate_bits(sf, channels, br.size - br.pos, bits);
+
+	uint32_t rnd = seed;
+	for (int c=0; c<channels; c++) {
+		for (int b=0; b<MDCT_NUM_BANDS; b++) {
+			int32_t amp = sf[c][b] ? mdct_sf_amplitude(sf[c][b]) : 0;
+			int nbits = bits[c][b];
+			for (int k=mdct_band_start[b]; k<mdct_band_start[b+1]; k++) {
+				if (nbits) {
+					int q = mdct_read_bits(&br, nbits);
+					coefs[c][k] = ((int64_t)(2*q + 1 - (1 << nbits)) * amp) >> nbits;
+				} else {
+					rnd = rnd * 1664525 + 1013904223;
+					coefs[c][k] = ((int64_t)((int32_t)rnd >> 16) * amp) >> 17;
+				}
+			}
+		}
+	}
+
+	// Convert mid/side to left/right
+	if (channels == 2) {
+		for (int k=0; k<MDCT_FRAME_SAMPLES; k++) {
+			int32_t m = coefs[0][k], s = coefs[1][k];
+			coefs[0][k] = m + s;
+			coefs[1][k] = m - s;
+		}
+	}
+}
+
+/**
+ * @brief Prepare the coefficients of a channel for the fixed-point IMDCT.
+ *
+ * The coefficients are scaled by a power of two (block floating point), so
+ * that the sum of their absolute values fits 15 bits. This guarantees that
+ * no intermediate value of the IMDCT can overflow. They are then reordered
+ * as 128 complex values (real parts first, then imaginary parts), as
+ * expected by the first stage of the transform.
+ *
+ * @param[in]  coefs    Coefficients of the channel
+ * @param[out] out      Scaled and reordered coefficients
+ * @return              Shift to apply to the IMDCT output (see #mdct_imdct)
+ */
+int mdct_prepare_coefs(const int32_t coefs[MDCT_FRAME_SAMPLES], int16_t out[MDCT_FRAME_SAMPLES])
+{
+	const int N = MDCT_FRAME_SAMPLES;
+	int64_t l1 = 0;
+	for (int k=0; k<N; k++)
+		l1 += coefs[k] < 0 ? -(int64_t)coefs[k] : coefs[k];
+
+	int e = MDCT_MIN_EXPONENT;
+	while ((e < 0 ? l1 * (1 << -e) : l1 >> e) > MDCT_MAX_L1)
+		e++;
+
+	for (int n=0; n<N/2; n++) {
+		int32_t re = coefs[2*n], im = coefs[N-1-2*n];
+		out[n] = e < 0 ? re * (1 << -e) : re >> e;
+		out[N/2+n] = e < 0 ? im * (1 << -e) : im >> e;
+	}
+
+	// The IMDCT output must be scaled by 2/N (2^-7), on top of the exponent.
+	return e - 7;
+}
+
+/** @brief Reverse the lowest @p nbits bits of @p x */
+static inline int mdct_bitrev(int x, int nbits) {
+	int r = 0;
+	for (int i=0; i<nbits; i++)
+		r |= ((x >> i) & 1) << (nbits-1-i);
+	return r;
+}
+
+/**
+ * @brief Initialize the tables used by the fixed-point IMDCT.
+ *
+ * The IMDCT of N coefficients is computed via a DCT-IV, using a complex FFT of
+ * N/2=128 points. The FFT is split in two passes (16x8): the first one runs
+ * over the 16 rows of 8 values, the second one over the columns after a
+ * transposition, so that each butterfly always operates on whole rows.
+ * The output of the FFT is thus in a scrambled order, which is handled by the
+ * post-twiddle table and the final permutations.
+ */
+void mdct_init_tables(mdct_tables_t *t)
+{
+	const int N = MDCT_FRAME_SAMPLES;
+	#define MDCT_Q15(x)   ((int16_t)lround((x) * 32767.0))
+
+	for (int n=0; n<N/2; n++) {
+		double phi = M_PI * (n + 0.25) / N;
+		t->pre[0][n] = MDCT_Q15(cos(phi));
+		t->pre[1][n] = MDCT_Q15(-sin(phi));
+	}
+
+	// After the first pass, row p contains the frequency bitrev(p) of the
+	// 16-point FFTs, and lane l the index of the input column.
+	for (int p=0; p<16; p++) {
+		for (int l=0; l<8; l++) {
+			double phi = -2.0 * M_PI * l * mdct_bitrev(p, 4) / (N/2);
+			t->fft[0][p*8+l] = MDCT_Q15(cos(phi));
+			t->fft[1][p*8+l] = MDCT_Q15(sin(phi));
+		}
+	}
+
+	// After the transposition and the second pass, row h*8+q and lane j
+	// contain the FFT output at index bitrev(h*8+j) + 16*bitrev(q).
+	int pos[N/2];
+	for (int h=0; h<2; h++) {
+		for (int q=0; q<8; q++) {
+			for (int j=0; j<8; j++) {
+				int idx = (h*8+q)*8 + j;
+				int k = mdct_bitrev(h*8+j, 4) + 16*mdct_bitrev(q, 3);
+				double phi = -M_PI * k / N;
+				t->post[0][idx] = MDCT_Q15(cos(phi));
+				t->post[1][idx] = MDCT_Q15(sin(phi));
+				pos[k] = idx;
+			}
+		}
+	}
+
+	// The DCT-IV output u[m] is the real part of FFT output m/2 (m even),
+	// or the opposite of the imaginary part of FFT output (N-1-m)/2 (m odd).
+	// The IMDCT output y[n] (2N samples) is then u[n+N/2], -u[3N/2-1-n] or
+	// -u[n-3N/2], depending on n.
+	for (int n=0; n<2*N; n++) {
+		int m, sign;
+		if (n < N/2)          { m = n + N/2;     sign = 1;  }
+		else if (n < 3*N/2)   { m = 3*N/2-1-n;   sign = -1; }
+		else                  { m = n - 3*N/2;   sign = -1; }
+
+		int off;
+		if (m % 2 == 0) off = pos[m/2] * 2;
+		else            { off = (N/2 + pos[(N-1-m)/2]) * 2; sign = -sign; }
+
+		double w = sin(M_PI * (n + 0.5) / (2*N));
+		if (n < N) {
+			t->perm_cur[n] = off;
+			t->win_cur[n] = MDCT_Q15(w * sign);
+		} else {
+			t->perm_next[n-N] = off;
+			t->win_next[n-N] = MDCT_Q15(w * sign * 0.5);
+		}
+	}
+	#undef MDCT_Q15
+}
+
+/** @brief Twiddle factors of the 16-point FFTs (real, imaginary), as in rsp_mdct.S */
+static const int16_t mdct_w16[2][8] = {
+	{ 32767, 30273, 23170, 12539, 0, -12539, -23170, -30273 },
+	{ 0, -12539, -23170, -30273, -32767, -30273, -23170, -12539 },
+};
+
+/** @brief Emulate a RSP VMULF/VMACF sequence: round and clamp a sum of products */
+static inline int16_t mdct_mulf(int64_t acc) {
+	return vadpcm_clamp16((acc * 2 + 0x8000) >> 16);
+}
+
+/** @brief Multiply each complex value of a buffer by a table of complex values */
+static inline void mdct_cmul(int16_t *buf, const int16_t tbl[2][MDCT_FRAME_SAMPLES/2]) {
+	const int N2 = MDCT_FRAME_SAMPLES/2;
+	for (int i=0; i<N2; i++) {
+		int32_t xr = buf[i], xi = buf[N2+i];
+		int32_t tr = tbl[0][i], ti = tbl[1][i];
+		buf[i]    = mdct_mulf((int64_t)xr*tr - (int64_t)xi*ti);
+		buf[N2+i] = mdct_mulf((int64_t)xr*ti + (int64_t)xi*tr);
+	}
+}
+
+/**
+ * @brief Run a radix-2 DIF stage of the 16-point FFTs over the rows of a buffer.
+ *
+ * @param buf   Buffer of 16 rows of 8 complex values (real parts first)
+ * @param d     Distance between the rows of each butterfly (8, 4, 2 or 1)
+ */
+static inline void mdct_fft_stage(int16_t *buf, int d) {
+	const int N2 = MDCT_FRAME_SAMPLES/2;
+	for (int k=0; k<8; k++) {
+		int j = k & (d-1);
+		int a = (2*k - j) * 8, b = a + d*8;
+		int tw = j * (8/d);
+		int16_t wr = mdct_w16[0][tw], wi = mdct_w16[1][tw];
+		for (int l=0; l<8; l++) {
+			int16_t ar = buf[a+l], ai = buf[N2+a+l];
+			int16_t br = buf[b+l], bi = buf[N2+b+l];
+			buf[a+l] = vadpcm_clamp16(ar + br);
+			buf[N2+a+l] = vadpcm_clamp16(ai + bi);
+			int16_t dr = vadpcm_clamp16(ar - br), di = vadpcm_clamp16(ai - bi);
+			if (tw == 0) {
+				buf[b+l] = dr;
+				buf[N2+b+l] = di;
+			} else {
+				buf[b+l] = mdct_mulf((int64_t)dr*wr - (int64_t)di*wi);
+				buf[N2+b+l] = mdct_mulf((int64_t)dr*wi + (int64_t)di*wr);
+			}
+		}
+	}
+}
+
+/** @brief Scale an IMDCT output value by 2^shift into the RSP accumulator (16.16) */
+static inline int64_t mdct_scale(int16_t x, int shift) {
+	return (int64_t)x * ((int64_t)1 << (16 + shift));
+}
+
+/**
+ * @brief Fixed-point IMDCT with windowing and overlap-add (reference implementation).
+ *
+ * This is the exact specification of the RSP ucode (rsp_mdct.S): the output
+ * of the ucode is bit-exact with it.
+ *
+ * @param[in]     in        Coefficients, as prepared by #mdct_prepare_coefs
+ * @param[in]     shift     Shift returned by #mdct_prepare_coefs
+ * @param[in,out] ola       Overlap-add state of the channel (second half of the
+ *                          previous frame, windowed and halved)
+ * @param[out]    out       Decoded samples (or NULL to only update the state)
+ * @param[in]     t         Tables initialized by #mdct_init_tables
+ */
+void mdct_imdct(const int16_t in[MDCT_FRAME_SAMPLES], int shift,
+	int16_t ola[MDCT_FRAME_SAMPLES], int16_t *out, const mdct_tables_t *t)
+{
+	const int N = MDCT_FRAME_SAMPLES;
+	int16_t buf[N], tmp[N];
+
+	memcpy(buf, in, sizeof(buf));
+	mdct_cmul(buf, t->pre);
+	for (int d=8; d>=1; d/=2)
+		mdct_fft_stage(buf, d);
+	mdct_cmul(buf, t->fft);
+
+	// Transpose each 8x8 block of rows and lanes
+	for (int c=0; c<2; c++)
+		for (int h=0; h<2; h++)
+			for (int j=0; j<8; j++)
+				for (int l=0; l<8; l++)
+					tmp[c*N/2 + h*64 + l*8 + j] = buf[c*N/2 + (h*8+j)*8 + l];
+
+	for (int d=4; d>=1; d/=2)
+		mdct_fft_stage(tmp, d);
+	mdct_cmul(tmp, t->post);
+
+	for (int n=0; n<N; n++) {
+		int16_t x = tmp[t->perm_cur[n] / 2];
+		if (out) {
+			int16_t a = mdct_mulf((int64_t)x * t->win_cur[n]);
+			out[n] = vadpcm_clamp16((mdct_scale(a, shift) + ((int64_t)ola[n] * 2 << 16)) >> 16);
+		}
+	}
+	for (int n=0; n<N; n++) {
+		int16_t x = tmp[t->perm_next[n] / 2];
+		int16_t b = mdct_mulf((int64_t)x * t->win_next[n]);
+		ola[n] = vadpcm_clamp16(mdct_scale(b, shift) >> 16);
+	}
+}
@@ -33,7 +33,7 @@ static int ymread(ym64player_t *player, void *buf, int sz) {
 	return fread(buf, 1, sz, player->f);
 }
 
-static unsigned int lha_callback(void *buf, size_t buf_len, void *user_data) {
+static size_t lha_callback(void *buf, size_t buf_len, void *user_data) {
 	FILE* f = (FILE*)user_data;
 	return fread(buf, 1, buf_len, f);
 }
@@ -98,6 +98,11 @@ static void ym_wave_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bo
 		// Generate the required number of samples, and store them into the
 		// sample buffer.
 		ay8910_gen(&player->ay, out, samples_per_frame);
+		#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// Samples in the sample buffer are big-endian, as seen by RSP.
+		for (int j=0;j<samples_per_frame*num_channels;j++)
+			out[j] = __builtin_bswap16(out[j]);
+		#endif
 		out += (int)samples_per_frame * num_channels;
 		player->curframe++;
 	}
@@ -141,6 +146,15 @@ void ym64player_open(ym64player_t *player, const char *fn, ym64player_songinfo_t
 
 		ym5header h; char buf[512];
 		_ymread(&h, sizeof(h));
+		#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		h.nframes = __builtin_bswap32(h.nframes);
+		h.attrs = __builtin_bswap32(h.attrs);
+		h.ndigidrums = __builtin_bswap16(h.ndigidrums);
+		h.chipfreq = __builtin_bswap32(h.chipfreq);
+		h.playfreq = __builtin_bswap16(h.playfreq);
+		h.loop = __builtin_bswap32(h.loop);
+		h.sizeext = __builtin_bswap16(h.sizeext);
+		#endif
 
 		// Interleaved format is hard to support while streaming (especially compressed)
 		// so let's punt for now.
@@ -157,6 +171,9 @@ void ym64player_open(ym64player_t *player, const char *fn, ym64player_songinfo_t
 			for (int i=0;i<h.ndigidrums;i++) {
 				uint32_t sz;
 				_ymread(&sz, 4);
+				#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				sz = __builtin_bswap32(sz);
+				#endif
 				while (sz > 0)
 					sz -= _ymread(buf, MIN(sz, sizeof(buf)));
 			}
@@ -434,9 +434,15 @@ void display_init( resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma
         __safe_buffer[i] = UNCACHED_ADDR( buffer[i] );
 
         /* Baseline is blank */
-        memset( __safe_buffer[i], 0, __width * __height * __bitdepth );
+        if( rspq_mem_is_initialized() )
+            rspq_memset( __safe_buffer[i], 0, __width * __height * __bitdepth );
+        else
+            memset( __safe_buffer[i], 0, __width * __height * __bitdepth );
     }
 
+    if( rspq_mem_is_initialized() )
+        rspq_syncpoint_wait( rspq_syncpoint_new() );
+
     /* Set the first buffer as the displaying buffer */
     now_showing = 0;
     now_drawing = -1;
@@ -24,6 +24,15 @@
  * manipulating registers on a cartridge such as a gameshark.  Code should never
  * make raw 32-bit reads or writes in the cartridge domain as it could collide with
  * an in-progress DMA transfer or run into caching issues.
+ *
+ * Transfers started with #dma_read or #dma_read_async are executed
+ * immediately (after waiting for the in-progress one, if any). When several
+ * subsystems compete for the PI, it is preferable to use #dma_read_queued:
+ * it enqueues the transfer with a priority, and completion is signalled
+ * through a callback invoked by the PI interrupt. Queued transfers are split
+ * into chunks of #DMA_QUEUE_CHUNK_SIZE bytes, and after each chunk the
+ * transfer with the highest priority is resumed, so that latency-critical
+ * transfers (eg: audio waveforms) are never stuck behind a large asset load.
  * @{
  */
 
@@ -39,9 +48,28 @@
 #define PI_STATUS_ERROR    ( 1 << 2 )
 /** @} */
 
+/**
+ * @brief Maximum size of a single DMA transfer issued by the queue
+ *
+ * This bounds the time a high-priority transfer might have to wait before
+ * being started. It must be a multiple of 8 to preserve alignment.
+ */
+#define DMA_QUEUE_CHUNK_SIZE    8192
+
 /** @brief Structure used to interact with the PI registers */
 static volatile struct PI_regs_s * const PI_regs = (struct PI_regs_s *)0xa4600000;
 
+/** @brief Queued transfers, one FIFO list per priority */
+static dma_request_t *queue_head[DMA_PRIORITY_COUNT];
+/** @brief Last queued transfer for each priority */
+static dma_request_t *queue_tail[DMA_PRIORITY_COUNT];
+/** @brief Transfer whose chunk is currently being executed by the PI, if any */
+static dma_request_t *queue_cur;
+/** @brief Length of the chunk currently being executed by the PI */
+static unsigned long queue_cur_len;
+/** @brief True once the PI interrupt handler has been installed */
+static bool queue_initialized;
+
 static volatile int __dma_busy(void)
 {
     return PI_regs->status & (PI_STATUS_DMA_BUSY | PI_STATUS_IO_BUSY);
@@ -198,41 +226,26 @@ static uint8_t __io_read8(unsigned long pi_address) {
 }
 
 /**
- * @brief Start reading data from a peripheral through PI DMA
+ * @brief Prepare an arbitrary PI DMA read for the raw DMA engine
  *
- * This function must be used when reading a chunk of data from a cartridge 
- * peripheral (typically, ROM). It is a wrapper over #dma_read_raw_async that allows
- * arbitrary aligned addresses and any length (including odd sizes). For
- * fully-aligned addresses it quickly falls back to #dma_read_raw_async, so it can
- * be used generically as "default" PI DMA transfer function.
- * 
- * The only constraint on alignment is that the RAM and PI addresses must have
- * the same 1-bit misalignment, that is they must either be even addresses or
- * odd addresses. Notice that this function will assert if this constraint is
- * not respected.
- * 
- * Use #dma_wait to wait for the end of the transfer.
+ * Performs with CPU accesses the parts of the transfer that the raw PI DMA
+ * cannot do (misaligned head bytes, odd tail byte), and adjusts the transfer
+ * so that the rest can be done via #dma_read_raw_async.
  *
- * For non performance sensitive tasks such as reading and parsing data from
- * ROM at loading time, a better option is to use DragonFS, where #dfs_read
- * falls back to a CPU memory copy to realign the data when required.
- * 
- * @param[out] ram_address
- *             Pointer to a buffer to place read data
- * @param[in]  pi_address
- *             Memory address of the peripheral to read from
- * @param[in]  len
- *             Length in bytes to read into ram_address
+ * @note This function must be called with interrupts disabled.
+ *
+ * @param[in,out] ram_address  Uncached RDRAM address of the transfer
+ * @param[in,out] pi_address   PI address of the transfer
+ * @param[in,out] length       Length of the transfer
+ *
+ * @return true if a raw DMA transfer is still required, false if the
+ *         transfer was completed by the CPU.
  */
-void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len)
+static bool __dma_read_prepare(unsigned long *ram_address, unsigned long *pi_address, unsigned long *length)
 {
-    unsigned long ram = (unsigned long)UncachedAddr(ram_address);
-    unsigned long rom = pi_address;
-
-    assert(len > 0);
-    assert(((ram ^ rom) & 1) == 0); 
-
-    disable_interrupts();
+    unsigned long ram = *ram_address;
+    unsigned long rom = *pi_address;
+    unsigned long len = *length;
     union { uint64_t mem64; uint32_t mem32[2]; uint16_t mem16[4]; uint8_t mem8[8]; } val;
 
     // Check if the RDRAM address is misaligned. If so, this requires some
@@ -288,8 +301,51 @@ void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long l
         len -= 3;
     }
 
+    *ram_address = ram;
+    *pi_address = rom;
+    *length = len;
+    return len != 0;
+}
+
+/**
+ * @brief Start reading data from a peripheral through PI DMA
+ *
+ * This function must be used when reading a chunk of data from a cartridge 
+ * peripheral (typically, ROM). It is a wrapper over #dma_read_raw_async that allows
+ * arbitrary aligned addresses and any length (including odd sizes). For
+ * fully-aligned addresses it quickly falls back to #dma_read_raw_async, so it can
+ * be used generically as "default" PI DMA transfer function.
+ * 
+ * The only constraint on alignment is that the RAM and PI addresses must have
+ * the same 1-bit misalignment, that is they must either be even addresses or
+ * odd addresses. Notice that this function will assert if this constraint is
+ * not respected.
+ * 
+ * Use #dma_wait to wait for the end of the transfer.
+ *
+ * For non performance sensitive tasks such as reading and parsing data from
+ * ROM at loading time, a better option is to use DragonFS, where #dfs_read
+ * falls back to a CPU memory copy to realign the data when required.
+ * 
+ * @param[out] ram_address
+ *             Pointer to a buffer to place read data
+ * @param[in]  pi_address
+ *             Memory address of the peripheral to read from
+ * @param[in]  len
+ *             Length in bytes to read into ram_address
+ */
+void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    unsigned long ram = (unsigned long)UncachedAddr(ram_address);
+    unsigned long rom = pi_address;
+
+    assert(len > 0);
+    assert(((ram ^ rom) & 1) == 0); 
+
+    disable_interrupts();
+
     // Start the actual DMA transfer, if still needed.
-    if (len)
+    if (__dma_read_prepare(&ram, &rom, &len))
         dma_read_raw_async((void*)ram, (unsigned long)rom, len);
 
     enable_interrupts();
@@ -301,6 +357,19 @@ void dma_wait(void)
     while (__dma_busy()) {}
 }
 
+/**
+ * @brief Check whether all the DMA transfers started so far are finished
+ *
+ * This is the non-blocking counterpart of #dma_wait: it can be used to poll
+ * for the end of an asynchronous transfer while doing other work.
+ *
+ * @return true if the PI is idle, false if a transfer is still in progress
+ */
+bool dma_idle(void)
+{
+    return !__dma_busy();
+}
+
 
 /** @brief Read data from a peripheral through PI DMA, waiting for completion. */
 void dma_read(void *ram_address, unsigned long pi_address, unsigned long len)
@@ -370,4 +439,185 @@ void io_write(uint32_t pi_address, uint32_t data)
     enable_interrupts();
 }
 
+/**
+ * @brief Start the next chunk of the queue with the highest priority
+ *
+ * @note This function must be called with interrupts disabled, and
+ *       with no chunk in progress.
+ */
+static void __dma_queue_start(void)
+{
+    for (int prio = DMA_PRIORITY_COUNT-1; prio >= 0; prio--) {
+        dma_request_t *req = queue_head[prio];
+        if (!req)
+            continue;
+
+        queue_cur = req;
+        queue_cur_len = req->len;
+        if (queue_cur_len > DMA_QUEUE_CHUNK_SIZE)
+            queue_cur_len = DMA_QUEUE_CHUNK_SIZE;
+
+        dma_read_raw_async((void*)req->ram_address, req->pi_address, queue_cur_len);
+        return;
+    }
+}
+
+/**
+ * @brief Account for the end of the chunk in progress, and start the next one
+ *
+ * @note This function must be called with interrupts disabled.
+ */
+static void __dma_queue_advance(void)
+{
+    // Nothing to do if the queue is idle, or if the PI is still busy with
+    // our chunk or with a transfer started after it via dma_read_async
+    // (in which case, we will get another interrupt when it finishes).
+    if (!queue_cur || (PI_regs->status & PI_STATUS_DMA_BUSY))
+        return;
+
+    dma_request_t *req = queue_cur;
+    queue_cur = NULL;
+
+    req->ram_address += queue_cur_len;
+    req->pi_address += queue_cur_len;
+    req->len -= queue_cur_len;
+
+    if (req->len == 0) {
+        // Transfer finished: remove it from the head of its queue
+        queue_head[req->priority] = req->next;
+        if (!req->next)
+            queue_tail[req->priority] = NULL;
+
+        req->pending = false;
+        if (req->callback)
+            req->callback(req->ctx);
+    }
+
+    __dma_queue_start();
+}
+
+/** @brief PI interrupt handler that drives the transfer queue */
+static void __dma_queue_interrupt(void)
+{
+    __dma_queue_advance();
+}
+
+/**
+ * @brief Enqueue a read from a peripheral through PI DMA
+ *
+ * This function has the same semantic and alignment constraints as
+ * #dma_read_async, but instead of starting the transfer immediately, it
+ * adds it to a queue. Transfers are executed in order of priority (and in
+ * FIFO order for the same priority), and large transfers are split into
+ * chunks so that higher priority transfers can be executed inbetween.
+ *
+ * The callback (if any) is invoked under interrupt when the transfer is
+ * finished, so it must be short. Alternatively, use #dma_request_done
+ * or #dma_request_wait to check for completion.
+ *
+ * As with #dma_read_async, cache coherency is responsibility of the caller:
+ * the destination buffer must be invalidated before calling this function.
+ *
+ * @param[out] req
+ *             Request structure, which must stay valid (and must not be reused)
+ *             until the transfer is finished
+ * @param[out] ram_address
+ *             Pointer to a buffer to place read data
+ * @param[in]  pi_address
+ *             Memory address of the peripheral to read from
+ * @param[in]  len
+ *             Length in bytes to read into ram_address
+ * @param[in]  priority
+ *             Priority of the transfer
+ * @param[in]  callback
+ *             Function to call when the transfer is finished, or NULL
+ * @param[in]  ctx
+ *             Opaque argument to pass to the callback
+ */
+void dma_read_queued(dma_request_t *req, void *ram_address, unsigned long pi_address, unsigned long len,
+    dma_priority_t priority, dma_callback_t callback, void *ctx)
+{
+    unsigned long ram = (unsigned long)UncachedAddr(ram_address);
+    unsigned long rom = pi_address;
+
+    assert(len > 0);
+    assert(((ram ^ rom) & 1) == 0);
+    assert(priority >= 0 && priority < DMA_PRIORITY_COUNT);
+
+    disable_interrupts();
+
+    if (!queue_initialized) {
+        register_PI_handler(__dma_queue_interrupt);
+        set_PI_interrupt(1);
+        queue_initialized = true;
+    }
+
+    req->callback = callback;
+    req->ctx = ctx;
+    req->priority = priority;
+
+    // Do the misaligned parts of the transfer now with the CPU, so that
+    // only well-aligned chunks are queued.
+    if (!__dma_read_prepare(&ram, &rom, &len)) {
+        req->len = 0;
+        req->pending = false;
+        enable_interrupts();
+        if (callback)
+            callback(ctx);
+        return;
+    }
+
+    req->ram_address = ram;
+    req->pi_address = rom;
+    req->len = len;
+    req->next = NULL;
+    req->pending = true;
+
+    if (queue_tail[priority])
+        queue_tail[priority]->next = req;
+    else
+        queue_head[priority] = req;
+    queue_tail[priority] = req;
+
+    // Start the transfer immediately if the queue is idle. Otherwise, it
+    // will be started by the interrupt handler at the end of the current chunk.
+    if (!queue_cur) {
+        while (__dma_busy()) {}
+        __dma_queue_start();
+    }
+
+    enable_interrupts();
+}
+
+/**
+ * @brief Check whether a queued transfer is finished
+ *
+ * @param[in] req
+ *            Request structure passed to #dma_read_queued
+ *
+ * @return true if the transfer is finished (or was never started)
+ */
+bool dma_request_done(dma_request_t *req)
+{
+    return !req->pending;
+}
+
+/**
+ * @brief Wait for a queued transfer to finish
+ *
+ * The queue is driven by polling the PI while waiting, so this function
+ * can also be called with interrupts disabled or from an interrupt handler.
+ *
+ * @param[in] req
+ *            Request structure passed to #dma_read_queued
+ */
+void dma_request_wait(dma_request_t *req)
+{
+    while (req->pending) {
+        disable_interrupts();
+        __dma_queue_advance();
+        enable_interrupts();
+    }
+}
+
 /** @} */ /* dma */
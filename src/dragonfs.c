@@ -4,12 +4,15 @@
  * @ingroup dfs
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include "libdragon.h"
 #include "system.h"
 #include "dfsinternal.h"
+#include "audio/lzh5.h"
 
 /**
  * @defgroup dfs DragonFS
@@ -40,6 +43,20 @@
  * Files can be accessed either with standard POSIX functions and the 'rom:/' prefix or
  * with DFS API calls and no prefix.  Files can be opened using both sets of API calls
  * simultaneously as long as no more than four files are open at any one time.
+ *
+ * By default, mkdfs also writes a path table listing the full path of every file
+ * in the filesystem. If present, #dfs_init loads it into RAM, so that opening files
+ * by absolute path (or relative to the root directory, which is always the case
+ * through the 'rom:/' prefix) requires no ROM access at all. Filesystems built
+ * with 'mkdfs --no-index' (or by older versions of mkdfs) are still supported,
+ * and files are then found by walking the directory structure in ROM.
+ *
+ * Files can also be stored compressed, by passing 'mkdfs --compress <pattern>'.
+ * Compression is transparent to the application: compressed files are
+ * decompressed on the fly by #dfs_read (with the LZH5 algorithm), and report
+ * their decompressed size. They trade CPU time for ROM space and PI bandwidth,
+ * so they are best read sequentially: seeking backward restarts the
+ * decompression from the beginning of the file.
  * @{
  */
 
@@ -77,12 +94,233 @@ static uint32_t directories[MAX_DIRECTORY_DEPTH];
 static uint32_t directory_top = 0;
 /** @brief Pointer to next directory entry set when doing a directory walk */
 static directory_entry_t *next_entry = 0;
+/** @brief Path table loaded from ROM, or NULL if the filesystem has none */
+static path_table_header_t *path_table = NULL;
+/** @brief Canonical path of the current directory (see #dfs_chdir), NULL for the root */
+static char *current_dir = NULL;
+/** @brief Blocks of the block cache (allocated by #cache_alloc) */
+static cache_block_t *cache_blocks = NULL;
+/** @brief Data of the blocks of the block cache, 16-byte aligned */
+static uint8_t *cache_data = NULL;
+/** @brief Number of blocks in the block cache */
+static int cache_num_blocks = CACHE_DEFAULT_BLOCKS;
+/** @brief Size in bytes of each block of the block cache */
+static int cache_block_size = CACHE_DEFAULT_BLOCK_SIZE;
+/** @brief Clock used to timestamp block accesses */
+static uint32_t cache_clock = 0;
+/** @brief Statistics of the block cache */
+static dfs_cache_stats_t cache_stats;
+
+/**
+ * @brief Allocate the block cache
+ *
+ * Any previously allocated cache is discarded. If there is not enough memory,
+ * the previous cache is kept unchanged.
+ *
+ * @param[in] num_blocks
+ *            Number of blocks
+ * @param[in] block_size
+ *            Size in bytes of each block
+ *
+ * @return DFS_ESUCCESS on success or DFS_ENOMEM if out of memory.
+ */
+static int cache_alloc(int num_blocks, int block_size)
+{
+    /* The data must be 16-byte aligned so that the blocks don't share
+       cachelines with other variables, so it's easier to handle coherency. */
+    cache_block_t *blocks = calloc(num_blocks, sizeof(cache_block_t));
+    uint8_t *data = memalign(16, num_blocks * block_size);
+
+    if(!blocks || !data)
+    {
+        free(blocks);
+        free(data);
+        return DFS_ENOMEM;
+    }
+
+    if(cache_blocks)
+    {
+        /* Make sure no DMA is still writing into the blocks */
+        for(int i = 0; i < cache_num_blocks; i++)
+        {
+            dma_request_wait(&cache_blocks[i].req);
+        }
+
+        free(cache_blocks);
+        free(cache_data);
+    }
+
+    cache_blocks = blocks;
+    cache_data = data;
+    cache_num_blocks = num_blocks;
+    cache_block_size = block_size;
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Return the data of a block of the block cache
+ *
+ * @param[in] blk
+ *            Block of the cache
+ *
+ * @return Pointer to the data of the block.
+ */
+static inline uint8_t *cache_block_data(cache_block_t *blk)
+{
+    return cache_data + (blk - cache_blocks) * cache_block_size;
+}
+
+/**
+ * @brief Find a block in the block cache
+ *
+ * @param[in] addr
+ *            PI address of any byte of the block
+ *
+ * @return The block, or NULL if it is not cached.
+ */
+static cache_block_t *cache_find(uint32_t addr)
+{
+    addr &= ~(cache_block_size - 1);
+
+    for(int i = 0; i < cache_num_blocks; i++)
+    {
+        if(cache_blocks[i].addr == addr)
+        {
+            return &cache_blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Load a block into the block cache, replacing the least recently used one
+ *
+ * @param[in] addr
+ *            PI address of the block (aligned to the block size)
+ * @param[in] async
+ *            If true, do not wait for the DMA to finish, and queue it at low priority
+ *
+ * @return The block being loaded.
+ */
+static cache_block_t *cache_load(uint32_t addr, bool async)
+{
+    cache_block_t *blk = &cache_blocks[0];
+
+    for(int i = 1; i < cache_num_blocks; i++)
+    {
+        if(cache_blocks[i].used < blk->used)
+        {
+            blk = &cache_blocks[i];
+        }
+    }
+
+    /* The block might still be loading from a previous read-ahead */
+    dma_request_wait(&blk->req);
+
+    /* Invalidate the cached data. No need to writeback here because
+       the block size is a multiple of 16 bytes and the data is aligned,
+       so the cachelines are not shared with other variables. */
+    uint8_t *data = cache_block_data(blk);
+    data_cache_hit_invalidate(data, cache_block_size);
+
+    blk->addr = addr;
+    blk->used = ++cache_clock;
+    dma_read_queued(&blk->req, data, addr, cache_block_size,
+        async ? DMA_PRIORITY_LOW : DMA_PRIORITY_NORMAL, NULL, NULL);
+
+    return blk;
+}
+
+/**
+ * @brief Return the cached data of a block, loading it if necessary
+ *
+ * @param[in] addr
+ *            PI address of the block (aligned to the block size)
+ *
+ * @return Pointer to the data of the block.
+ */
+static uint8_t *cache_get(uint32_t addr)
+{
+    cache_block_t *blk = cache_find(addr);
+
+    if(blk && !blk->req.pending)
+    {
+        cache_stats.hits++;
+        blk->used = ++cache_clock;
+    }
+    else
+    {
+        /* Either not cached, or still being prefetched: we must wait */
+        cache_stats.misses++;
+
+        if(!blk)
+        {
+            blk = cache_load(addr, false);
+        }
+        else
+        {
+            blk->used = ++cache_clock;
+        }
+
+        dma_request_wait(&blk->req);
+    }
+
+    return cache_block_data(blk);
+}
+
+/**
+ * @brief Start loading a block in background, if it is not cached yet
+ *
+ * @param[in] addr
+ *            PI address of the block (aligned to the block size)
+ */
+static void cache_prefetch(uint32_t addr)
+{
+    if(!cache_find(addr))
+    {
+        cache_stats.prefetches++;
+        cache_load(addr, true);
+    }
+}
+
+/**
+ * @brief Read data from ROM through the block cache
+ *
+ * @param[in]  addr
+ *             PI address to read from
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  len
+ *             Number of bytes to read
+ */
+static void cache_read(uint32_t addr, void *buf, int len)
+{
+    uint8_t *dst = buf;
+
+    while(len > 0)
+    {
+        uint32_t offset = addr & (cache_block_size - 1);
+        uint8_t *data = cache_get(addr - offset);
+
+        /* Pull as much data as we can from the current block */
+        int copy = cache_block_size - offset;
+        if(copy > len) { copy = len; }
+
+        memcpy(dst, data + offset, copy);
+
+        addr += copy;
+        dst += copy;
+        len -= copy;
+    }
+}
 
 /**
  * @brief Read a sector from cartspace
  *
- * This function handles fetching a sector from cartspace into RDRAM using
- * DMA.
+ * This function handles fetching a sector from cartspace into RDRAM. Sectors
+ * are read through the block cache, so that walking the same directories
+ * again does not require any further ROM access.
  *
  * @param[in]  cart_loc
  *             Pointer to cartridge location
@@ -91,10 +329,7 @@ static directory_entry_t *next_entry = 0;
  */
 static inline void grab_sector(void *cart_loc, void *ram_loc)
 {
-    /* Make sure we have fresh cache */
-    data_cache_hit_writeback_invalidate(ram_loc, SECTOR_SIZE);
-
-    dma_read((void *)(((uint32_t)ram_loc) & 0x1FFFFFFF), (uint32_t)cart_loc, SECTOR_SIZE);
+    cache_read((uint32_t)cart_loc, ram_loc, SECTOR_SIZE);
 }
 
 /**
@@ -456,6 +691,131 @@ static directory_entry_t *find_dirent(char *name, directory_entry_t *cur_node)
     return 0;
 }
 
+/**
+ * @brief Canonicalize a path relative to the root directory
+ *
+ * Strips the leading slash, "." and ".." components and redundant slashes
+ * (eg: "/levels/./1//../2/map.dat" becomes "levels/2/map.dat").
+ *
+ * @param[in]  path
+ *             Path to canonicalize
+ * @param[out] norm
+ *             Buffer for the canonical path, at least as large as path
+ */
+static void canonicalize_path(const char * const path, char *norm)
+{
+    const char *cur = path;
+    int len = 0;
+
+    while(*cur)
+    {
+        if(*cur == '/') { cur++; continue; }
+
+        const char *end = strchr(cur, '/');
+        if(!end) { end = cur + strlen(cur); }
+        int toklen = end - cur;
+
+        if(toklen == 1 && cur[0] == '.')
+        {
+            /* Current directory, ignore */
+        }
+        else if(toklen == 2 && cur[0] == '.' && cur[1] == '.')
+        {
+            /* Up one directory, stopping at the root */
+            while(len > 0 && norm[len-1] != '/') { len--; }
+            if(len > 0) { len--; }
+        }
+        else
+        {
+            if(len > 0) { norm[len++] = '/'; }
+            memcpy(norm + len, cur, toklen);
+            len += toklen;
+        }
+
+        cur = end;
+    }
+    norm[len] = 0;
+}
+
+/**
+ * @brief Resolve a path against the current directory
+ *
+ * @param[in]  path
+ *             Absolute path, or path relative to the current directory
+ * @param[out] norm
+ *             Buffer for the canonical path relative to the root, at least
+ *             #resolve_path_size bytes
+ */
+static void resolve_path(const char * const path, char *norm)
+{
+    const char *dir = (path[0] != '/' && current_dir) ? current_dir : "";
+    char full[strlen(dir) + strlen(path) + 2];
+
+    strcpy(full, dir);
+    strcat(full, "/");
+    strcat(full, path);
+    canonicalize_path(full, norm);
+}
+
+/**
+ * @brief Size of the buffer needed by #resolve_path for a path
+ */
+static int resolve_path_size(const char * const path)
+{
+    return (path[0] != '/' && current_dir ? strlen(current_dir) : 0) + strlen(path) + 2;
+}
+
+/**
+ * @brief Look up a file in the path table
+ *
+ * The path table can only resolve absolute paths, or relative paths while
+ * the current directory is the root. In all other cases, or if the filesystem
+ * has no path table, the caller must fall back to walking the directories.
+ *
+ * @param[in]  path
+ *             Path of the file to look up
+ * @param[out] entry
+ *             Path table entry of the file, or NULL if it does not exist
+ *
+ * @return true if the path table could be used, false otherwise.
+ */
+static bool path_table_lookup(const char * const path, const path_table_entry_t **entry)
+{
+    if(!path_table || !path || (path[0] != '/' && directory_top != 0))
+    {
+        return false;
+    }
+
+    char norm[strlen(path)+1];
+    canonicalize_path(path, norm);
+
+    /* Binary search the first entry with a matching hash */
+    const path_table_entry_t *entries = (const path_table_entry_t *)(path_table + 1);
+    uint32_t hash = path_table_hash(norm);
+    int lo = 0, hi = path_table->num_entries;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(entries[mid].hash < hash) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+
+    /* Check all the entries with the same hash */
+    *entry = NULL;
+    for(; lo < path_table->num_entries && entries[lo].hash == hash; lo++)
+    {
+        if(strcmp((const char *)path_table + entries[lo].path_offset, norm) == 0)
+        {
+            *entry = &entries[lo];
+            break;
+        }
+    }
+
+    return true;
+}
+
 /**
  * @brief Walk a path string, either changing directories or finding the right path
  *
@@ -613,6 +973,98 @@ static int recurse_path(const char * const path, int mode, directory_entry_t **d
     return ret;
 }
 
+/**
+ * @brief Find a file given its path
+ *
+ * Uses the path table if possible, otherwise walks the directory structure.
+ *
+ * @param[in]  path
+ *             Path of the file to find
+ * @param[out] size
+ *             Size of the file in bytes
+ * @param[out] start
+ *             Location of the start of the file in ROM
+ * @param[out] compressed
+ *             Set to true if the file is compressed (optional)
+ *
+ * @return DFS_ESUCCESS on success or a negative error on failure.
+ */
+static int find_file(const char * const path, uint32_t *size, uint32_t *start, bool *compressed)
+{
+    const path_table_entry_t *entry;
+
+    if(path_table_lookup(path, &entry))
+    {
+        if(!entry)
+        {
+            return DFS_ENOFILE;
+        }
+
+        *size = entry->flags & 0x0FFFFFFF;
+        *start = entry->file_pointer + base_ptr;
+        if(compressed) { *compressed = (entry->flags >> 28) & FLAGS_COMPRESSED; }
+        return DFS_ESUCCESS;
+    }
+
+    directory_entry_t *dirent;
+    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        /* File not found, or other error */
+        return ret;
+    }
+
+    /* We now have the pointer to the file entry */
+    directory_entry_t t_node;
+    grab_sector(dirent, &t_node);
+
+    *size = get_size(&t_node);
+    *start = get_start_location(&t_node);
+    if(compressed) { *compressed = get_flags(&t_node) & FLAGS_COMPRESSED; }
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Load the path table of the filesystem into RAM, if there is one
+ *
+ * @param[in] id_node
+ *            Root sector of the filesystem
+ */
+static void load_path_table(directory_entry_t *id_node)
+{
+    free(path_table);
+    path_table = NULL;
+
+    if(!id_node->file_pointer)
+    {
+        /* Filesystem without path table */
+        return;
+    }
+
+    uint32_t table_loc = base_ptr + id_node->file_pointer;
+    path_table_header_t header __attribute__((aligned(16)));
+
+    data_cache_hit_writeback_invalidate(&header, sizeof(header));
+    dma_read(&header, table_loc, sizeof(header));
+
+    if(header.magic != PATH_TABLE_MAGIC || header.size < sizeof(header) +
+       header.num_entries * sizeof(path_table_entry_t))
+    {
+        /* Unknown format, ignore it and walk directories */
+        return;
+    }
+
+    path_table = malloc(header.size);
+    if(!path_table)
+    {
+        return;
+    }
+
+    data_cache_hit_writeback_invalidate(path_table, header.size);
+    dma_read(path_table, table_loc, header.size);
+}
+
 /**
  * @brief Helper functioner to initialize the filesystem
  *
@@ -633,9 +1085,14 @@ static int __dfs_init(uint32_t base_fs_loc)
         /* Passes, set up the FS */
         base_ptr = base_fs_loc;
         clear_directory();
+        free(current_dir);
+        current_dir = NULL;
 
         memset(open_files, 0, sizeof(open_files));
 
+        /* Load the path table, if mkdfs wrote one */
+        load_path_table(&id_node);
+
         /* Good FS */
         return DFS_ESUCCESS;
     }
@@ -665,7 +1122,23 @@ int dfs_chdir(const char * const path)
         return DFS_EBADINPUT;
     }
 
-    return recurse_path(path, WALK_CHDIR, 0, TYPE_ANY);
+    int ret = recurse_path(path, WALK_CHDIR, 0, TYPE_ANY);
+
+    if(ret == DFS_ESUCCESS)
+    {
+        /* Remember the path of the new directory, to resolve relative paths
+           in the access trace */
+        char *dir = malloc(resolve_path_size(path));
+        if(dir)
+        {
+            resolve_path(path, dir);
+        }
+
+        free(current_dir);
+        current_dir = dir;
+    }
+
+    return ret;
 }
 
 /**
@@ -707,7 +1180,7 @@ int dfs_dir_findfirst(const char * const path, char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
 /**
@@ -740,54 +1213,269 @@ int dfs_dir_findnext(char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
+/** @brief An event of the access trace */
+typedef struct
+{
+    /** @brief Type of the event (see #dfs_trace_event_t) */
+    uint8_t type;
+    /** @brief Index of the path of the file in #trace_paths */
+    uint16_t path;
+    /** @brief Offset of the data read */
+    uint32_t offset;
+    /** @brief Size of the data read */
+    uint32_t len;
+} trace_event_t;
+
+/** @brief Recorded events, or NULL if tracing was never started */
+static trace_event_t *trace_events = NULL;
+/** @brief Number of recorded events */
+static int trace_count = 0;
+/** @brief Maximum number of events that can be recorded */
+static int trace_max = 0;
+/** @brief True while recording */
+static bool trace_enabled = false;
+/** @brief Canonical paths of the files in the trace */
+static char **trace_paths = NULL;
+/** @brief Number of paths in #trace_paths */
+static int trace_num_paths = 0;
+
 /**
- * @brief Open a file given a path
- *
- * Check if we have any free file handles, and if we do, try
- * to open the file specified.  Supports absolute and relative
- * paths
+ * @brief Record an event in the access trace
  *
+ * @param[in] type
+ *            Type of the event
  * @param[in] path
- *            Path of the file to open
- *
- * @return A valid file handle to reference the file by or a negative error on failure.
+ *            Index of the path of the file
+ * @param[in] offset
+ *            Offset of the data read
+ * @param[in] len
+ *            Size of the data read
  */
-int dfs_open(const char * const path)
+static void trace_event(int type, int path, uint32_t offset, uint32_t len)
 {
-    /* Ensure we always open with a unique handle */
-    static uint32_t next_handle = 1;
+    if(!trace_enabled || path < 0 || trace_count == trace_max)
+    {
+        return;
+    }
 
-    /* Try to find a free slot */
-    open_file_t *file = find_free_file();
+    trace_events[trace_count++] = (trace_event_t){ type, path, offset, len };
+}
 
-    if(!file)
+/**
+ * @brief Find or add a path to the access trace
+ *
+ * @param[in] path
+ *            Path of the file, as passed to #dfs_open
+ *
+ * @return The index of the path, or -1 if not tracing.
+ */
+static int trace_path(const char * const path)
+{
+    if(!trace_enabled)
     {
-        return DFS_ENOMEM;        
+        return -1;
     }
 
-    /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    /* Record the path relative to the root, as mkdfs knows it */
+    char norm[resolve_path_size(path)];
+    resolve_path(path, norm);
 
-    if(ret != DFS_ESUCCESS)
+    for(int i = 0; i < trace_num_paths; i++)
     {
-        /* File not found, or other error */
-        return ret;
+        if(strcmp(trace_paths[i], norm) == 0)
+        {
+            return i;
+        }
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
+    char **paths = realloc(trace_paths, (trace_num_paths + 1) * sizeof(char *));
+    if(!paths)
+    {
+        return -1;
+    }
+
+    trace_paths = paths;
+    trace_paths[trace_num_paths] = strdup(norm);
+
+    return trace_paths[trace_num_paths] ? trace_num_paths++ : -1;
+}
+
+/**
+ * @brief Start recording an access trace
+ *
+ * The trace records the sequence of files opened and read, so that mkdfs can
+ * lay out the filesystem accordingly (see #dfs_trace_dump). Any previously
+ * recorded trace is discarded.
+ *
+ * @param[in] max_events
+ *            Maximum number of events to record. Further events are dropped.
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_trace_start(int max_events)
+{
+    trace_enabled = false;
+
+    for(int i = 0; i < trace_num_paths; i++)
+    {
+        free(trace_paths[i]);
+    }
+
+    free(trace_paths);
+    free(trace_events);
+    trace_paths = NULL;
+    trace_num_paths = 0;
+    trace_count = 0;
+    trace_max = 0;
+
+    if(max_events <= 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    trace_events = malloc(max_events * sizeof(trace_event_t));
+    if(!trace_events)
+    {
+        return DFS_ENOMEM;
+    }
+
+    trace_max = max_events;
+    trace_enabled = true;
+
+    /* Files opened before starting the trace are not recorded */
+    for(int i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        open_files[i].trace_path = -1;
+    }
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Stop recording the access trace
+ *
+ * @return The number of events recorded.
+ */
+int dfs_trace_stop(void)
+{
+    trace_enabled = false;
+    return trace_count;
+}
+
+/**
+ * @brief Dump the recorded access trace over the debug channel
+ *
+ * Each event is written on its own line, prefixed by "DFSTRACE" so that it
+ * can be found within other debug output:
+ *
+ *     DFSTRACE open <path>
+ *     DFSTRACE read <offset> <size> <path>
+ *
+ * Save the log to a file and pass it to 'mkdfs --trace <file>': files will
+ * be laid out in the order they were first read, so that assets loaded
+ * together are contiguous in ROM.
+ */
+void dfs_trace_dump(void)
+{
+    for(int i = 0; i < trace_count; i++)
+    {
+        trace_event_t *ev = &trace_events[i];
+
+        if(ev->type == DFS_TRACE_OPEN)
+        {
+            debugf("DFSTRACE open %s\n", trace_paths[ev->path]);
+        }
+        else
+        {
+            debugf("DFSTRACE read %lu %lu %s\n", ev->offset, ev->len, trace_paths[ev->path]);
+        }
+    }
+}
+
+/**
+ * @brief Get an event of the recorded access trace
+ *
+ * This allows to save the trace in other ways than #dfs_trace_dump (eg: to a
+ * file on the SD card). Paths are relative to the root of the filesystem.
+ *
+ * @param[in]  index
+ *             Index of the event (from 0 to the value returned by #dfs_trace_stop)
+ * @param[out] path
+ *             Path of the file (can be NULL)
+ * @param[out] offset
+ *             Offset of the data read, 0 for #DFS_TRACE_OPEN (can be NULL)
+ * @param[out] len
+ *             Size of the data read, 0 for #DFS_TRACE_OPEN (can be NULL)
+ *
+ * @return The type of the event (see #dfs_trace_event_t), or DFS_EBADINPUT
+ *         if there is no such event.
+ */
+int dfs_trace_get(int index, const char **path, uint32_t *offset, uint32_t *len)
+{
+    if(index < 0 || index >= trace_count)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    trace_event_t *ev = &trace_events[index];
+
+    if(path) { *path = trace_paths[ev->path]; }
+    if(offset) { *offset = ev->offset; }
+    if(len) { *len = ev->len; }
+
+    return ev->type;
+}
+
+/**
+ * @brief Open a file given a path
+ *
+ * Check if we have any free file handles, and if we do, try
+ * to open the file specified.  Supports absolute and relative
+ * paths
+ *
+ * @param[in] path
+ *            Path of the file to open
+ *
+ * @return A valid file handle to reference the file by or a negative error on failure.
+ */
+int dfs_open(const char * const path)
+{
+    /* Ensure we always open with a unique handle */
+    static uint32_t next_handle = 1;
+
+    /* Try to find a free slot */
+    open_file_t *file = find_free_file();
+
+    if(!file)
+    {
+        return DFS_ENOMEM;        
+    }
+
+    /* Try to find file */
+    uint32_t size, start;
+    bool compressed;
+    int ret = find_file(path, &size, &start, &compressed);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        /* File not found, or other error */
+        return ret;
+    }
 
     /* Set up file handle */
     file->handle = next_handle++;
-    file->size = get_size(&t_node);
+    file->size = size;
     file->loc = 0;
-    file->cart_start_loc = get_start_location(&t_node);
-    file->cached_loc = 0xFFFFFFFF;
+    file->cart_start_loc = start;
+    file->data_size = size;
+    file->compressed = compressed;
+    file->sequential_loc = 0xFFFFFFFF;
+
+    file->trace_path = trace_path(path);
+    trace_event(DFS_TRACE_OPEN, file->trace_path, 0, 0);
 
     return file->handle;
 }
@@ -809,6 +1497,11 @@ int dfs_close(uint32_t handle)
         return DFS_EBADHANDLE;
     }
 
+    /* Make sure no DMA is still writing into the destination buffer */
+    dma_request_wait(&file->async_req);
+
+    free(file->decoder);
+
     /* Closing the handle is easy as zeroing out the file */
     memset(file, 0, sizeof(open_file_t));
 
@@ -913,9 +1606,280 @@ int dfs_tell(uint32_t handle)
     return file->loc;
 }
 
+/**
+ * @brief Start prefetching the data that follows a location
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[in] loc
+ *            Offset in the file data where the next read will start
+ */
+static void read_ahead(open_file_t *file, uint32_t loc)
+{
+    if(loc >= file->data_size)
+    {
+        /* Nothing left to prefetch */
+        return;
+    }
+
+    /* Prefetch the block containing the next read, or the one after it if
+       it is already cached */
+    uint32_t addr = (file->cart_start_loc + loc) & ~(cache_block_size - 1);
+    if(cache_find(addr))
+    {
+        addr += cache_block_size;
+    }
+
+    if(addr < file->cart_start_loc + file->data_size)
+    {
+        cache_prefetch(addr);
+    }
+}
+
+/**
+ * @brief Check whether a read can be done with a DMA directly into the destination buffer
+ *
+ * @param[in] loc
+ *            Offset in the file to read from
+ * @param[in] buf
+ *            Destination buffer
+ * @param[in] len
+ *            Number of bytes to read
+ *
+ * @return true if the read can bypass the block cache.
+ */
+static inline bool can_read_direct(uint32_t loc, void *buf, int len)
+{
+    /* If possible, we want to DMA directly into the destination
+     * buffer, without using any intermediate buffers. The rules are convoluted
+     * because we try to squeeze maximum performance here and thus we rely also
+     * on undocumented behaviors of PI DMA.
+     * The rules we follow are:
+     *
+     *   * The RDRAM destination pointer must be 8-bytes aligned.
+     *   * The ROM location must be 2-bytes aligned.
+     *   * The length must be either less than 0x7F (all values accepted),
+     *     or even.
+     */
+    bool rom_aligned = (loc & 1) == 0;
+    bool ram_aligned = ((uint32_t)buf & 7) == 0;
+    bool len_aligned = (len < 0x7F) || ((len & 1) == 0);
+    return rom_aligned && ram_aligned && len_aligned;
+}
+
+/**
+ * @brief Start a DMA directly into the destination buffer
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[out] req
+ *            DMA request to use for the transfer
+ * @param[in] loc
+ *            Offset in the file data to read from
+ * @param[out] buf
+ *            Destination buffer, which must satisfy #can_read_direct
+ * @param[in] len
+ *            Number of bytes to read
+ */
+static void read_direct_async(open_file_t *file, dma_request_t *req, uint32_t loc, void *buf, int len)
+{
+    /* 16-byte alignment: we can simply invalidate the buffer.
+     * 8-byte alignment: we need to also writeback in case the partial
+     *  cachelines have hot data to write back. */
+    if ((((uint32_t)buf | len) & 15) == 0)
+        data_cache_hit_invalidate(buf, len);
+    else
+        data_cache_hit_writeback_invalidate(buf, len);
+
+    dma_read_queued(req, buf, file->cart_start_loc + loc, len,
+        DMA_PRIORITY_NORMAL, NULL, NULL);
+}
+
+/**
+ * @brief Read data stored in ROM for a file
+ *
+ * For uncompressed files, this is the file contents. For compressed
+ * files, this is the compressed stream.
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[in] loc
+ *            Offset in the file data to read from
+ * @param[out] buf
+ *            Buffer to read into
+ * @param[in] len
+ *            Number of bytes to read
+ * @param[in] sequential
+ *            True if this read continues the previous one, so that
+ *            the following data should be prefetched.
+ */
+static void read_file_data(open_file_t *file, uint32_t loc, uint8_t *buf, int len, bool sequential)
+{
+    while(len)
+    {
+        uint32_t addr = file->cart_start_loc + loc;
+
+        /* Fast-path: DMA directly into the destination buffer. Small reads
+           go through the cache anyway, as they are likely to be followed by
+           other small reads of nearby data. */
+        if(len >= cache_block_size && !cache_find(addr) && can_read_direct(loc, buf, len))
+        {
+            dma_request_t req;
+            read_direct_async(file, &req, loc, buf, len);
+            dma_request_wait(&req);
+
+            loc += len;
+            break;
+        }
+
+        /* Pull as much data as we can from the current block */
+        int copy = cache_block_size - (addr & (cache_block_size - 1));
+        if (copy > len)
+            copy = len;
+
+        cache_read(addr, buf, copy);
+
+        loc += copy;
+        buf += copy;
+        len -= copy;
+    }
+
+    /* Prefetch what comes next, but only if the file is being streamed */
+    if(sequential)
+    {
+        read_ahead(file, loc);
+    }
+}
+
+/**
+ * @brief Feed the decompressor with compressed data
+ *
+ * @param[out] buf
+ *             Buffer to fill
+ * @param[in]  buf_len
+ *             Number of bytes requested
+ * @param[in]  ctx
+ *             Open file structure
+ *
+ * @return The number of bytes provided (0 at the end of the stream)
+ */
+static size_t decoder_read(void *buf, size_t buf_len, void *ctx)
+{
+    open_file_t *file = ctx;
+
+    if(buf_len > file->data_size - file->decoder_data_loc)
+    {
+        buf_len = file->data_size - file->decoder_data_loc;
+    }
+
+    if(buf_len)
+    {
+        read_file_data(file, file->decoder_data_loc, buf, buf_len, true);
+        file->decoder_data_loc += buf_len;
+    }
+
+    return buf_len;
+}
+
+/**
+ * @brief Restart the decompressor from the beginning of a compressed file
+ *
+ * @param[in] file
+ *            Open file structure
+ *
+ * @return DFS_ESUCCESS on success or a negative error on failure.
+ */
+static int decoder_reset(open_file_t *file)
+{
+    if(!file->decoder)
+    {
+        /* Read the header to know the size of the compressed stream */
+        compressed_header_t header;
+        file->data_size = sizeof(header);
+        read_file_data(file, 0, (uint8_t *)&header, sizeof(header), false);
+
+        if(header.algorithm != COMPRESS_LZH5)
+        {
+            return DFS_EBADFS;
+        }
+
+        file->decoder = malloc(sizeof(LHANewDecoder));
+        if(!file->decoder)
+        {
+            return DFS_ENOMEM;
+        }
+
+        file->data_size = sizeof(header) + header.compressed_size;
+    }
+
+    lha_lh_new_init(file->decoder, decoder_read, file);
+    file->decoder_loc = 0;
+    file->decoder_data_loc = sizeof(compressed_header_t);
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Read data from a compressed file at the current location
+ *
+ * The decompressor is a stream, so seeking backward requires restarting
+ * from the beginning of the file, and seeking forward requires
+ * decompressing (and discarding) the data inbetween.
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[out] buf
+ *            Buffer to read into
+ * @param[in] len
+ *            Number of bytes to read
+ *
+ * @return The actual number of bytes read or a negative value on failure.
+ */
+static int read_compressed(open_file_t *file, uint8_t *buf, int len)
+{
+    if(!file->decoder || file->loc < file->decoder_loc)
+    {
+        int ret = decoder_reset(file);
+        if(ret != DFS_ESUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    while(file->decoder_loc < file->loc)
+    {
+        uint8_t skip[128];
+        int sz = file->loc - file->decoder_loc;
+        if(sz > sizeof(skip)) { sz = sizeof(skip); }
+
+        if(lha_lh_new_read(file->decoder, skip, sz) != sz)
+        {
+            return DFS_EBADFS;
+        }
+
+        file->decoder_loc += sz;
+    }
+
+    if(lha_lh_new_read(file->decoder, buf, len) != len)
+    {
+        return DFS_EBADFS;
+    }
+
+    file->decoder_loc += len;
+    file->loc += len;
+
+    return len;
+}
+
 /**
  * @brief Read data from a file
  *
+ * Small or misaligned reads go through the block cache (see #dfs_cache_config),
+ * which is shared by all open files. When a file is being read sequentially,
+ * the data following each read is prefetched into the cache in background,
+ * so that the PI transfer
+ * overlaps with whatever the caller does with the data (eg: decompression).
+ *
  * @param[out] buf
  *             Buffer to read into
  * @param[in]  size
@@ -944,7 +1908,6 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
     }
 
     int to_read = size * count;
-    int did_read = 0;
 
     /* Bounds check to make sure we don't read past the end */
     if(file->loc + to_read > file->size)
@@ -956,73 +1919,133 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
     if (!to_read)
         return 0;
 
-    /* Fast-path. If possibly, we want to DMA directly into the destination
-     * buffer, without using any intermediate buffers. The rules are convoluted
-     * because we try to squeeze maximum performance here and thus we rely also
-     * on undocumented behaviors of PI DMA.
-     * The rules we follow are:
-     *
-     *   * The RDRAM destination pointer must be 8-bytes aligned.
-     *   * The ROM location must be 2-bytes aligned.
-     *   * The length must be either less than 0x7F (all values accepted),
-     *     or even.
-     */
-    bool rom_aligned = (file->loc & 1) == 0;
-    bool ram_aligned = ((uint32_t)buf & 7) == 0;
-    bool len_aligned = (to_read < 0x7F) || ((to_read & 1) == 0);
-    if (rom_aligned && ram_aligned && len_aligned)
-    {
-        /* 16-byte alignment: we can simply invalidate the buffer.
-         * 8-byte alignment: we need to also writeback in case the partial
-         *  cachelines have hot data to write back. */
-        if ((((uint32_t)buf | to_read) & 15) == 0)
-            data_cache_hit_invalidate(buf, to_read);
-        else
-            data_cache_hit_writeback_invalidate(buf, to_read);
+    trace_event(DFS_TRACE_READ, file->trace_path, file->loc, to_read);
+
+    if(file->compressed)
+    {
+        return read_compressed(file, buf, to_read);
+    }
+
+    /* Prefetch the following data if this read continues the previous one */
+    read_file_data(file, file->loc, buf, to_read, file->loc == file->sequential_loc);
+
+    file->loc += to_read;
+    file->sequential_loc = file->loc;
 
-        dma_read((void *)(((uint32_t)buf) & 0x1FFFFFFF),
-            file->cart_start_loc + file->loc, to_read);
+    return to_read;
+}
+
+/**
+ * @brief Start reading data from a file asynchronously
+ *
+ * This function works like #dfs_read, but it does not wait for the data
+ * to be transferred: it returns as soon as the PI DMA is queued, so that
+ * the CPU can do other work in the meantime. Use #dfs_read_poll or
+ * #dfs_read_wait to know when the data is available. The buffer must not
+ * be accessed until then.
+ *
+ * Only one asynchronous read can be in progress for each file handle.
+ * Reads that cannot be done with a single DMA transfer into the destination
+ * buffer (see #dfs_read for the alignment rules), and reads from compressed
+ * files, are completed synchronously before returning.
+ *
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  size
+ *             Size of each element to read
+ * @param[in]  count
+ *             Number of elements to read
+ * @param[in]  handle
+ *             A valid file handle as returned from #dfs_open.
+ *
+ * @return The number of bytes that will be read or a negative value on failure.
+ */
+int dfs_read_async(void * const buf, int size, int count, uint32_t handle)
+{
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
 
-        file->loc += to_read;
-        return to_read;
+    if(!buf)
+    {
+        return DFS_EBADINPUT;
     }
 
-    /* Something we can actually increment! */
-    uint8_t *data = buf;
-    const int CACHED_SIZE = sizeof(file->cached_data);
+    /* Wait for the previous asynchronous read, if any */
+    dfs_read_wait(handle);
+
+    int to_read = size * count;
 
-    /* Loop in, reading data in the cached buffer */
-    while(to_read)
+    /* Bounds check to make sure we don't read past the end */
+    if(file->loc + to_read > file->size)
     {
-        /* Check if we need to read into the cached buffer */
-        if (file->loc < file->cached_loc || file->loc >= file->cached_loc+CACHED_SIZE)
-        {
-            /* We need to read from a 8-byte aligned location, so calculate it */
-            file->cached_loc = file->loc & ~7;
+        to_read = file->size - file->loc;
+    }
 
-            /* Invalidate the cached data. No need to writeback here because
-               CACHE_SIZE is a multiple of 16 bytes and the data is aligned,
-               so the cachelines are not shared with other variables. */
-            data_cache_hit_invalidate(file->cached_data, CACHED_SIZE);
+    if(!to_read)
+        return 0;
 
-            dma_read((void *)(((uint32_t)file->cached_data) & 0x1FFFFFFF),
-                file->cart_start_loc + file->cached_loc, CACHED_SIZE);
-        }
+    /* Data already in the cache is faster to copy, misaligned data
+       requires copying anyway, and compressed data must go through
+       the decompressor: use the synchronous path. */
+    if(file->compressed || !can_read_direct(file->loc, buf, to_read) ||
+       cache_find(file->cart_start_loc + file->loc))
+    {
+        return dfs_read(buf, 1, to_read, handle);
+    }
 
-        /* Pull as much data as we can from the current buffer */
-        int copy = file->cached_loc+CACHED_SIZE - file->loc;
-        if (copy > to_read)
-            copy = to_read;
+    trace_event(DFS_TRACE_READ, file->trace_path, file->loc, to_read);
+    read_direct_async(file, &file->async_req, file->loc, buf, to_read);
+    file->loc += to_read;
+    file->sequential_loc = file->loc;
 
-        memcpy(data, file->cached_data + (file->loc - file->cached_loc), copy);
+    return to_read;
+}
 
-        file->loc += copy;
-        data += copy;
-        to_read -= copy;
-        did_read += copy;
+/**
+ * @brief Check whether an asynchronous read is finished
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ *
+ * @return 1 if the last read started with #dfs_read_async is finished, 0 if it
+ *         is still in progress, or a negative value on error.
+ */
+int dfs_read_poll(uint32_t handle)
+{
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
     }
 
-    return did_read;
+    return dma_request_done(&file->async_req) ? 1 : 0;
+}
+
+/**
+ * @brief Wait for an asynchronous read to finish
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_read_wait(uint32_t handle)
+{
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    dma_request_wait(&file->async_req);
+
+    return DFS_ESUCCESS;
 }
 
 /**
@@ -1057,31 +2080,413 @@ int dfs_size(uint32_t handle)
  * Direct access to ROM data must go through io_read or dma_read. Do not
  * dereference directly as the console might hang if the PI is busy.
  *
+ * Compressed files (see 'mkdfs --compress') are not stored as-is in ROM,
+ * so they have no usable physical address and 0 is returned for them.
+ *
  * @param[in] path
  *            Name of the file
  *
  * @return A pointer to the physical address of the file body, or 0
- *         if the file was not found.
+ *         if the file was not found or is compressed.
  * 
  */
 uint32_t dfs_rom_addr(const char *path)
 {
     /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    uint32_t size, start;
+    bool compressed;
+    int ret = find_file(path, &size, &start, &compressed);
 
-    if(ret != DFS_ESUCCESS)
+    if(ret != DFS_ESUCCESS || compressed)
     {
         /* File not found, or other error */
         return 0;
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
-
     /* Return the starting location in ROM */
-    return get_start_location(&t_node);
+    return start;
+}
+
+/**
+ * @brief Map a file into memory
+ *
+ * This function returns the address of the file in the PI address space, so
+ * that read-only data which is accessed randomly (lookup tables, level
+ * geometry, etc.) can be used in-place, without copying it into RDRAM.
+ *
+ * ROM must not be dereferenced directly, as the console might hang if the PI
+ * is busy: single words can be read with io_read, while #dfs_mmap_read and
+ * #dfs_mmap_ptr go through the block cache, so that repeated accesses to the
+ * same areas do not cost a PI access each.
+ *
+ * The mapping stays valid forever, as ROM is immutable: there is no need to
+ * unmap it. Compressed files (see 'mkdfs --compress') cannot be mapped.
+ *
+ * @param[in]  path
+ *             Path of the file to map
+ * @param[out] size
+ *             If not NULL, set to the size of the file
+ *
+ * @return The PI address of the file, or NULL if the file was not found or
+ *         is compressed.
+ */
+const void *dfs_mmap(const char *path, int *size)
+{
+    uint32_t fsize, start;
+    bool compressed;
+
+    if(find_file(path, &fsize, &start, &compressed) != DFS_ESUCCESS || compressed)
+    {
+        return NULL;
+    }
+
+    if(size)
+    {
+        *size = fsize;
+    }
+
+    return (const void *)start;
+}
+
+/**
+ * @brief Read data from a memory-mapped file
+ *
+ * The data is read through the block cache, so this is best suited to
+ * random accesses of small records. To read large chunks of data, #dfs_read
+ * or a DMA are more efficient.
+ *
+ * @param[in]  addr
+ *             Address within a file mapped with #dfs_mmap
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  len
+ *             Number of bytes to read
+ *
+ * @return The number of bytes read, or a negative value on failure.
+ */
+int dfs_mmap_read(const void *addr, void *buf, int len)
+{
+    if(!buf || len < 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    cache_read((uint32_t)addr, buf, len);
+    return len;
+}
+
+/**
+ * @brief Access data of a memory-mapped file in-place
+ *
+ * This is a zero-copy variant of #dfs_mmap_read: it returns a pointer to the
+ * data in the block cache. The requested range must not cross a block
+ * boundary of the PI address space (1 KiB by default, see #dfs_cache_config),
+ * so this is meant for small records whose alignment is known. As the cache
+ * is shared, the pointer is only valid until the next call to a DragonFS
+ * function.
+ *
+ * @param[in] addr
+ *            Address within a file mapped with #dfs_mmap
+ * @param[in] len
+ *            Number of bytes that will be accessed
+ *
+ * @return A pointer to the data in RDRAM.
+ */
+const void *dfs_mmap_ptr(const void *addr, int len)
+{
+    uint32_t offset = (uint32_t)addr & (cache_block_size - 1);
+
+    assertf(offset + len <= cache_block_size, "range crosses a block boundary: %p (%d bytes)", addr, len);
+
+    return cache_get((uint32_t)addr - offset) + offset;
+}
+
+/**
+ * @brief Configure the block cache
+ *
+ * DragonFS keeps recently accessed ROM data in a global cache of fixed-size
+ * blocks, shared by all open files, directory lookups and memory-mapped files.
+ * It serves small and misaligned reads (large aligned reads bypass it), and
+ * holds the data prefetched by sequential reads. When it is full, the least
+ * recently used block is replaced.
+ *
+ * By default, the cache has 16 blocks of 1 KiB each. Games doing many small
+ * random reads from several files can benefit from more blocks, while games
+ * streaming a few big files can use less memory. Use #dfs_cache_get_stats to
+ * measure the hit rate.
+ *
+ * This can be called before or after #dfs_init. Any cached data is discarded.
+ * If there is not enough memory for the new cache, the previous one is kept.
+ *
+ * @param[in] num_blocks
+ *            Number of blocks of the cache (at least 2)
+ * @param[in] block_size
+ *            Size in bytes of each block: a power of two, at least 256.
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_cache_config(int num_blocks, int block_size)
+{
+    if(num_blocks < 2 || block_size < SECTOR_SIZE || (block_size & (block_size - 1)))
+    {
+        return DFS_EBADINPUT;
+    }
+
+    return cache_alloc(num_blocks, block_size);
+}
+
+/**
+ * @brief Get statistics of the block cache
+ *
+ * Counters are accumulated since boot or the last call to
+ * #dfs_cache_reset_stats.
+ *
+ * @param[out] stats
+ *             Structure to fill with the statistics
+ */
+void dfs_cache_get_stats(dfs_cache_stats_t *stats)
+{
+    *stats = cache_stats;
+}
+
+/**
+ * @brief Reset the statistics of the block cache
+ */
+void dfs_cache_reset_stats(void)
+{
+    memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+/**
+ * @brief Mark one load of a batch as finished
+ *
+ * @param[in] batch
+ *            Batch the load belongs to
+ */
+static void batch_load_finished(dfs_batch_t *batch)
+{
+    disable_interrupts();
+    bool last = --batch->pending == 0;
+    enable_interrupts();
+
+    if(last && batch->callback)
+    {
+        batch->callback(batch->ctx);
+    }
+}
+
+/**
+ * @brief DMA completion callback of a load of a batch
+ *
+ * @param[in] ctx
+ *            The finished load
+ */
+static void batch_dma_finished(void *ctx)
+{
+    dfs_load_t *load = ctx;
+    batch_load_finished(load->batch);
+}
+
+/** @brief A load of a batch, with its location in ROM (for sorting) */
+typedef struct
+{
+    /** @brief Location of the file in ROM */
+    uint32_t start;
+    /** @brief The load */
+    dfs_load_t *load;
+} batch_item_t;
+
+/**
+ * @brief Compare two loads by their location in ROM
+ */
+static int batch_item_compare(const void *a, const void *b)
+{
+    const batch_item_t *ia = a;
+    const batch_item_t *ib = b;
+
+    return (ia->start > ib->start) - (ia->start < ib->start);
+}
+
+/**
+ * @brief Load several whole files at once
+ *
+ * This is a faster alternative to calling #dfs_open, #dfs_read and #dfs_close
+ * for each file, for instance to load all the assets of a level. All paths are
+ * resolved first (using the path table, if the filesystem has one), then the
+ * transfers are sorted by ROM address and queued back-to-back to the PI DMA, so
+ * that the cartridge is read as sequentially as possible. No file handle is used.
+ *
+ * The function returns as soon as the transfers are queued. The callback, if
+ * any, is called once when all the files are loaded; note that it might be
+ * called under interrupt. Alternatively, use #dfs_load_batch_done or
+ * #dfs_load_batch_wait. The loads and the batch structure must stay valid, and
+ * the destination buffers must not be accessed, until the batch is finished.
+ *
+ * Compressed files cannot be transferred with a DMA: they are decompressed
+ * synchronously before returning.
+ *
+ * @param[out]   batch
+ *               Batch structure to initialize, used to track completion
+ * @param[inout] loads
+ *               Files to load. For each of them, size is updated with the size
+ *               of the file, or a negative error (DFS_ENOFILE if it was not found,
+ *               DFS_ENOMEM if it does not fit the buffer, DFS_EBADINPUT if the
+ *               buffer is not at least 2-byte aligned). Files that are not
+ *               loaded because of an error do not prevent the others from loading.
+ * @param[in]    count
+ *               Number of files to load
+ * @param[in]    callback
+ *               Function to call when the batch is finished, or NULL
+ * @param[in]    ctx
+ *               Opaque argument to pass to the callback
+ *
+ * @return The number of files being loaded, or a negative value on failure.
+ */
+int dfs_load_batch(dfs_batch_t *batch, dfs_load_t *loads, int count, dma_callback_t callback, void *ctx)
+{
+    if(!batch || (!loads && count) || count < 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    batch->loads = loads;
+    batch->count = count;
+    batch->callback = callback;
+    batch->ctx = ctx;
+
+    /* Keep the batch pending until all the transfers are queued */
+    batch->pending = 1;
+
+    if(count == 0)
+    {
+        /* Nothing to load: the batch is already finished */
+        batch_load_finished(batch);
+        return 0;
+    }
+
+    /* Resolve all the paths */
+    batch_item_t items[count];
+    batch_item_t compressed_items[count];
+    int num_items = 0;
+    int num_compressed = 0;
+    int num_loading = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        dfs_load_t *load = &loads[i];
+        uint32_t size, start;
+        bool compressed;
+
+        memset(&load->req, 0, sizeof(load->req));
+        load->batch = batch;
+
+        int ret = find_file(load->path, &size, &start, &compressed);
+
+        if(ret != DFS_ESUCCESS || (int)size > load->size)
+        {
+            load->size = (ret != DFS_ESUCCESS) ? ret : DFS_ENOMEM;
+            continue;
+        }
+
+        if(!compressed && ((uint32_t)load->buf & 1))
+        {
+            /* PI DMA cannot transfer to odd addresses from the (aligned) file start */
+            load->size = DFS_EBADINPUT;
+            continue;
+        }
+
+        load->size = size;
+        num_loading++;
+
+        if(trace_enabled)
+        {
+            int path = trace_path(load->path);
+            trace_event(DFS_TRACE_OPEN, path, 0, 0);
+            trace_event(DFS_TRACE_READ, path, 0, size);
+        }
+
+        if(compressed)
+        {
+            /* Handled below, after the DMAs are queued */
+            compressed_items[num_compressed++] = (batch_item_t){ start, load };
+            continue;
+        }
+
+        items[num_items++] = (batch_item_t){ start, load };
+    }
+
+    qsort(items, num_items, sizeof(batch_item_t), batch_item_compare);
+
+    batch->pending += num_items;
+
+    for(int i = 0; i < num_items; i++)
+    {
+        dfs_load_t *load = items[i].load;
+
+        /* See read_direct_async for the rationale */
+        if ((((uint32_t)load->buf | load->size) & 15) == 0)
+            data_cache_hit_invalidate(load->buf, load->size);
+        else
+            data_cache_hit_writeback_invalidate(load->buf, load->size);
+
+        dma_read_queued(&load->req, load->buf, items[i].start, load->size,
+            DMA_PRIORITY_NORMAL, batch_dma_finished, load);
+    }
+
+    /* Decompress compressed files while the DMAs are running. They are read
+       through a temporary file structure, so that they do not take one of
+       the open file handles (and are not traced twice). */
+    for(int i = 0; i < num_compressed; i++)
+    {
+        dfs_load_t *load = compressed_items[i].load;
+        open_file_t file = {
+            .size = load->size,
+            .cart_start_loc = compressed_items[i].start,
+            .data_size = load->size,
+            .compressed = true,
+            .sequential_loc = 0xFFFFFFFF,
+        };
+
+        int ret = read_compressed(&file, load->buf, load->size);
+        free(file.decoder);
+
+        if(ret != load->size)
+        {
+            load->size = (ret < 0) ? ret : DFS_EBADFS;
+            num_loading--;
+        }
+    }
+
+    batch_load_finished(batch);
+
+    return num_loading;
+}
+
+/**
+ * @brief Check whether a batch started with #dfs_load_batch is finished
+ *
+ * @param[in] batch
+ *            Batch to check
+ *
+ * @return true if all the files of the batch are loaded.
+ */
+bool dfs_load_batch_done(dfs_batch_t *batch)
+{
+    return batch->pending == 0;
+}
+
+/**
+ * @brief Wait for a batch started with #dfs_load_batch to finish
+ *
+ * @param[in] batch
+ *            Batch to wait for
+ */
+void dfs_load_batch_wait(dfs_batch_t *batch)
+{
+    for(int i = 0; i < batch->count; i++)
+    {
+        dma_request_wait(&batch->loads[i].req);
+    }
 }
 
 /**
@@ -1346,6 +2751,12 @@ int dfs_init(uint32_t base_fs_loc)
     /* Detect if we are running on emulator accurate enough to emulate DragonFS. */
     __dfs_check_emulation();
 
+    /* Allocate the block cache, unless it was already configured */
+    if(!cache_blocks && cache_alloc(cache_num_blocks, cache_block_size) != DFS_ESUCCESS)
+    {
+        return DFS_ENOMEM;
+    }
+
     /* Try normal (works on doctor v64) */
     int ret = __dfs_init( base_fs_loc );
 
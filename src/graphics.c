@@ -9,6 +9,8 @@
 #include "display.h"
 #include "graphics.h"
 #include "font.h"
+#include "rspq.h"
+#include "rspq_mem.h"
 
 /**
  * @defgroup graphics 2D Graphics
@@ -622,6 +624,16 @@ void graphics_fill_screen( display_context_t disp, uint32_t c )
 
     uint64_t c64 = ((uint64_t)c << 32) | c;
     uint64_t *buffer = (uint64_t *)__get_buffer(disp);
+
+    /* The framebuffer is uncached, so it is much faster to let the RSP
+       fill it via DMA, if it is available. */
+    if( rspq_mem_is_initialized() )
+    {
+        rspq_memset32( buffer, c, len * sizeof(uint64_t) );
+        rspq_syncpoint_wait( rspq_syncpoint_new() );
+        return;
+    }
+
     for( int i = 0; i < len; i++ )
         buffer[i] = c64;
 }
@@ -0,0 +1,225 @@
+/**
+ * @file rspmath.c
+ * @brief RSP vector math library
+ * @ingroup rspmath
+ */
+
+#include "rspmath.h"
+#include "rspq.h"
+#include "rsp.h"
+#include "n64sys.h"
+#include "debug.h"
+#include "utils.h"
+#include <math.h>
+
+/** @brief Number of items processed by RSP for each DMEM chunk (see rsp_math.S) */
+#define CHUNK_ITEMS         16
+
+/**
+ * @brief Maximum number of items processed by a single command.
+ *
+ * Longer arrays are split into multiple commands, so that a highpri
+ * queue does not have to wait for the whole array to be processed before
+ * being able to run.
+ */
+#define MAX_CMD_ITEMS       (CHUNK_ITEMS * 16)
+
+/** @brief Command IDs of the overlay (see rsp_math.S) */
+enum {
+    MATH_CMD_TRANSFORM = 0x0,
+    MATH_CMD_DOT       = 0x1,
+    MATH_CMD_NORMALIZE = 0x2,
+};
+
+DEFINE_RSP_UCODE(rsp_math);
+
+/** @brief Overlay ID of the registered overlay (0 if not initialized) */
+static uint32_t rspmath_overlay_id;
+
+void rspmath_init(void)
+{
+    if (rspmath_overlay_id)
+        return;
+
+    rspq_init();
+    rspmath_overlay_id = rspq_overlay_register(&rsp_math);
+}
+
+void rspmath_close(void)
+{
+    if (!rspmath_overlay_id)
+        return;
+
+    rspq_overlay_unregister(rspmath_overlay_id);
+    rspmath_overlay_id = 0;
+}
+
+/** @brief Returns true if the address is accessed via the CPU data cache */
+static inline bool is_cached(const void *ptr)
+{
+    return ((uint32_t)ptr & 0xE0000000) == 0x80000000;
+}
+
+static void rspmath_prepare_input(const void *ptr, int count)
+{
+    assertf(((uint32_t)ptr & 7) == 0, "rspmath: input array %p is not 8-byte aligned", ptr);
+    if (is_cached(ptr))
+        data_cache_hit_writeback(ptr, count * sizeof(rspmath_vec4x2_t));
+}
+
+static void rspmath_prepare_output(void *ptr, int count)
+{
+    assertf(((uint32_t)ptr & 7) == 0, "rspmath: output array %p is not 8-byte aligned", ptr);
+    if (is_cached(ptr))
+        data_cache_hit_writeback_invalidate(ptr, count * sizeof(rspmath_vec4x2_t));
+}
+
+/** @brief Enqueue commands for a kernel, splitting the arrays as required */
+static void rspmath_stream(uint32_t cmd, void *out, const void *in, int count, uint32_t arg)
+{
+    assertf(rspmath_overlay_id, "rspmath_init() must be called first");
+    assert(count >= 0);
+
+    uint32_t out_addr = PhysicalAddr(out);
+    uint32_t in_addr = PhysicalAddr(in);
+    while (count > 0) {
+        int n = MIN(count, MAX_CMD_ITEMS);
+        rspq_write(rspmath_overlay_id, cmd, out_addr, in_addr, n, arg);
+        out_addr += n * sizeof(rspmath_vec4x2_t);
+        in_addr += n * sizeof(rspmath_vec4x2_t);
+        // The second input array (if any) advances as the first one.
+        if (cmd == MATH_CMD_DOT)
+            arg += n * sizeof(rspmath_vec4x2_t);
+        count -= n;
+    }
+}
+
+void rspmath_mat4_transform(rspmath_vec4x2_t *out, const rspmath_mat4_t *mtx,
+    const rspmath_vec4x2_t *in, int count)
+{
+    rspmath_prepare_input(mtx, 2);
+    rspmath_prepare_input(in, count);
+    rspmath_prepare_output(out, count);
+    rspmath_stream(MATH_CMD_TRANSFORM, out, in, count, PhysicalAddr(mtx));
+}
+
+void rspmath_mat4_mul(rspmath_mat4_t *out, const rspmath_mat4_t *a,
+    const rspmath_mat4_t *b, int count)
+{
+    // Multiplying by a matrix means transforming each of its columns.
+    rspmath_mat4_transform(out->c, a, b->c, count * 2);
+}
+
+void rspmath_vec4_dot(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *a,
+    const rspmath_vec4x2_t *b, int count)
+{
+    rspmath_prepare_input(a, count);
+    rspmath_prepare_input(b, count);
+    rspmath_prepare_output(out, count);
+    rspmath_stream(MATH_CMD_DOT, out, a, count, PhysicalAddr(b));
+}
+
+void rspmath_vec4_normalize(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *in, int count)
+{
+    rspmath_prepare_input(in, count);
+    rspmath_prepare_output(out, count);
+    rspmath_stream(MATH_CMD_NORMALIZE, out, in, count, 0);
+}
+
+/**
+ * @brief Clamp a value to s15.16, as done by RSP when reading the accumulator
+ */
+static int32_t clamp_fx32(int64_t x)
+{
+    if (x > INT32_MAX) return INT32_MAX;
+    if (x < INT32_MIN) return INT32_MIN;
+    return x;
+}
+
+/**
+ * @brief Multiply two s15.16 numbers, as done by the RSP accumulator.
+ *
+ * The result is not clamped, and it is still scaled by 2^16 (same format
+ * of the inputs).
+ */
+static int64_t mul_fx32(int32_t a, int32_t b)
+{
+    return ((int64_t)a * (int64_t)b) >> 16;
+}
+
+void rspmath_mat4_transform_cpu(rspmath_vec4x2_t *out, const rspmath_mat4_t *mtx,
+    const rspmath_vec4x2_t *in, int count)
+{
+    for (int n = 0; n < count; n++) {
+        rspmath_vec4x2_t res;
+        for (int v = 0; v < 8; v += 4) {
+            for (int j = 0; j < 4; j++) {
+                int64_t acc = 0;
+                for (int k = 0; k < 4; k++) {
+                    int32_t m = rspmath_vec4x2_get(&mtx->c[k/2], (k%2)*4 + j);
+                    acc += mul_fx32(m, rspmath_vec4x2_get(&in[n], v + k));
+                }
+                rspmath_vec4x2_set(&res, v + j, clamp_fx32(acc));
+            }
+        }
+        out[n] = res;
+    }
+}
+
+void rspmath_mat4_mul_cpu(rspmath_mat4_t *out, const rspmath_mat4_t *a,
+    const rspmath_mat4_t *b, int count)
+{
+    rspmath_mat4_transform_cpu(out->c, a, b->c, count * 2);
+}
+
+void rspmath_vec4_dot_cpu(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *a,
+    const rspmath_vec4x2_t *b, int count)
+{
+    for (int n = 0; n < count; n++) {
+        rspmath_vec4x2_t res;
+        for (int v = 0; v < 8; v += 4) {
+            // Products are clamped on each component before being summed.
+            int64_t acc = 0;
+            for (int k = 0; k < 4; k++)
+                acc += clamp_fx32(mul_fx32(rspmath_vec4x2_get(&a[n], v + k), rspmath_vec4x2_get(&b[n], v + k)));
+            for (int j = 0; j < 4; j++)
+                rspmath_vec4x2_set(&res, v + j, clamp_fx32(acc));
+        }
+        out[n] = res;
+    }
+}
+
+void rspmath_vec4_normalize_cpu(rspmath_vec4x2_t *out, const rspmath_vec4x2_t *in, int count)
+{
+    for (int n = 0; n < count; n++) {
+        rspmath_vec4x2_t res;
+        for (int v = 0; v < 8; v += 4) {
+            float c[4], len2 = 0;
+            for (int k = 0; k < 4; k++) {
+                c[k] = rspmath_vec4x2_get(&in[n], v + k) / 65536.0f;
+                len2 += c[k] * c[k];
+            }
+            float scale = len2 > 0 ? 1.0f / sqrtf(len2) : 0;
+            for (int k = 0; k < 4; k++)
+                rspmath_vec4x2_set(&res, v + k, (int32_t)(c[k] * scale * 65536.0f));
+        }
+        out[n] = res;
+    }
+}
+
+void rspmath_vec4x2_from_floats(rspmath_vec4x2_t *dst, const float *src, int num_floats)
+{
+    for (int i = 0; i < num_floats; i++)
+        rspmath_vec4x2_set(&dst[i/8], i%8, (int32_t)(src[i] * 65536.0f));
+}
+
+void rspmath_vec4x2_to_floats(float *dst, const rspmath_vec4x2_t *src, int num_floats)
+{
+    for (int i = 0; i < num_floats; i++)
+        dst[i] = rspmath_vec4x2_get(&src[i/8], i%8) / 65536.0f;
+}
+
+void rspmath_mat4_from_floats(rspmath_mat4_t *dst, const float m[4][4])
+{
+    rspmath_vec4x2_from_floats(dst->c, &m[0][0], 16);
+}
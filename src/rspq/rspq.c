@@ -105,18 +105,81 @@
  * 
  * ## Buffer swapping
  * 
- * Internally, double buffering is used to implement the queue. The size of
+ * Internally, a ring of buffers is used to implement the queue. The size of
  * each of the buffers is RSPQ_DRAM_LOWPRI_BUFFER_SIZE. When a buffer is full,
  * the queue engine writes a RSPQ_CMD_JUMP command with the address of the
- * other buffer, to tell the RSP to jump there when it is done. 
+ * next buffer in the ring, to tell the RSP to jump there when it is done. 
  * 
- * Moreover, just before the jump, the engine also enqueue a RSPQ_CMD_WRITE_STATUS
- * command that sets the SP_STATUS_SIG_BUFDONE_LOW signal. This is used to
- * keep track when the RSP has finished processing a buffer, so that we know
- * it becomes free again for more commands.
+ * The highpri queue uses a fixed ring of two buffers (double buffering). The
+ * lowpri ring is elastic instead: it starts with RSPQ_LOWPRI_MIN_BUFFERS
+ * buffers, and if the CPU fills all of them before the RSP has executed
+ * the oldest one, a new buffer is inserted in the ring rather than waiting
+ * (up to RSPQ_LOWPRI_MAX_BUFFERS). When the pressure is over, the extra
+ * buffers are freed one at a time, as the CPU goes through the ring and
+ * finds them already executed. Since the RSP follows the JUMPs written by
+ * the CPU, the ring can be reshaped freely, as long as a buffer is not
+ * freed while the RSP can still read it. The limits can be changed at
+ * runtime with #rspq_set_lowpri_buffers.
+ * 
+ * Moreover, just before the jump, the engine also enqueue a syncpoint
+ * (for the lowpri queue) or a RSPQ_CMD_WRITE_STATUS command that sets the
+ * SP_STATUS_SIG_BUFDONE_HIGH signal (for the highpri queue, where syncpoints
+ * are not available). This is used to keep track when the RSP has finished
+ * processing a buffer, so that we know it becomes free again for more commands.
+ * Using a syncpoint means that the CPU is notified via interrupt, so that
+ * while it waits it can run the idle callback (see #rspq_set_wait_callback)
+ * instead of polling SP_STATUS.
  * 
  * This logic is implemented in #rspq_next_buffer.
  *
+ * ## Waits
+ *
+ * All the places where the CPU blocks waiting for the RSP go through
+ * #rspq_wait_internal, which runs the idle callback, accounts the time spent
+ * for #rspq_get_wait_stats, and detects RSP crashes via a timeout. If
+ * interrupts are disabled, the SP interrupt handler is polled manually,
+ * so that syncpoints can still be reached.
+ *
+ * ## Profiling
+ *
+ * When built with RSPQ_PROFILE, the main loop in rsp_queue.inc reads the
+ * RCP clock counter (DP_CLOCK, 24 bits) just before jumping to each command,
+ * and again when the command returns to the main loop. Each command produces
+ * a 8-byte sample (command ID + start clock, end clock) which is stored in a
+ * small block in DMEM. When the block is full, or when the RSP goes to sleep
+ * waiting for new commands, it is written via DMA into a ring in RDRAM, and
+ * the RSP advances a write pointer in DMEM (RSPQ_PROFILE_WPTR).
+ *
+ * The CPU collects the samples in #rspq_profile_collect, which is called by
+ * the SP interrupt handler (so at least once per lowpri buffer) and by the
+ * profiling APIs, and aggregates them per command ID. If the CPU falls behind
+ * more than a full ring, the overwritten samples are counted as dropped.
+ *
+ * ## Submission queues
+ *
+ * A submission queue (#rspq_submitq_t) is a power-of-two ring of 32-bit words
+ * with a single producer (an interrupt handler) and a single consumer (the
+ * main thread, in #rspq_flush). The read and write positions are free-running
+ * counters, each written by only one side, so no locking is required: the
+ * producer publishes a command by advancing the write position after having
+ * written it, and the consumer frees the space by advancing the read position
+ * after having copied the command into the lowpri queue.
+ *
+ * Commands are always contiguous in the ring: if a command does not fit in
+ * the space left before the end of the ring, a zero word (which is not a valid
+ * command) is written as padding, and the command starts again from the
+ * beginning of the ring.
+ *
+ * ## Fences
+ *
+ * A fence (#rspq_fence_t) is an 8-byte uncached buffer in RDRAM whose first
+ * word holds a counter. The RSP writes it with RSPQ_CMD_FENCE_SIGNAL (via
+ * DMA, which is why the buffer is 8 bytes), and polls it with
+ * RSPQ_CMD_FENCE_WAIT, calling RSPQ_CheckHighpri between polls so that the
+ * highpri queue is never blocked by a waiting lowpri queue. The CPU
+ * reads and writes it directly. Values are compared with wraparound,
+ * like syncpoints.
+ *
  * ## Blocks
  * 
  * Blocks are implemented by redirecting rspq_write to a different memory buffer,
@@ -143,6 +206,20 @@
  * is then used as call slot in both all future calls to the block, and by
  * the RSPQ_CMD_RET command placed at the end of the block itself.
  * 
+ * When the block is finished (#rspq_block_end), it is compiled into its final
+ * form by #rspq_block_compile: all the chunks are compacted into a single
+ * contiguous buffer, so that the RSP can fetch it sequentially without
+ * following any jump. While doing so, every command is validated (its overlay
+ * must be registered and define the command), and redundant commands are
+ * removed: no-ops, and "state commands" (see #rspq_overlay_set_state_command)
+ * that are immediately followed by another instance of the same command,
+ * which would overwrite the same state anyway.
+ * 
+ * Finally, #rspq_block_batch reorders the sequences of consecutive commands
+ * of overlays declared with #RSPQ_AFFINITY_BATCH, grouping them by overlay,
+ * to reduce the number of overlay switches performed by RSP. The RSP counts
+ * the switches in DMEM (RSPQ_OVERLAY_LOADS), see #rspq_get_overlay_stats.
+ * 
  * ## Highpri queue
  * 
  * The high priority queue is implemented as an alternative couple of buffers,
@@ -172,6 +249,7 @@
 #include "interrupt.h"
 #include "utils.h"
 #include "n64sys.h"
+#include "cop0.h"
 #include "debug.h"
 #include <stdlib.h>
 #include <stdint.h>
@@ -275,7 +353,24 @@ enum {
      * interrupt to be processed (coalescing interrupts would cause syncpoints
      * to be missed).
      */
-    RSPQ_CMD_TEST_WRITE_STATUS = 0x08
+    RSPQ_CMD_TEST_WRITE_STATUS = 0x08,
+
+    /**
+     * @brief RSPQ Command: Signal a fence
+     * 
+     * This command writes a value into a fence in RDRAM, to notify the CPU
+     * that the RSP has reached it (see #rspq_fence_enqueue_signal).
+     */
+    RSPQ_CMD_FENCE_SIGNAL      = 0x09,
+
+    /**
+     * @brief RSPQ Command: Wait for a fence
+     * 
+     * This command makes the RSP wait until a fence in RDRAM, signalled by
+     * the CPU, reaches a certain value (see #rspq_fence_enqueue_wait). The
+     * highpri queue can still preempt the RSP while it is waiting.
+     */
+    RSPQ_CMD_FENCE_WAIT        = 0x0A
 };
 
 
@@ -390,8 +485,8 @@ typedef struct rsp_queue_s {
  * 
  * This structure contains the state of a RSP queue as it is built by the CPU.
  * It is instantiated two times: one for the lwopri queue, and one for the
- * highpri queue. It contains the two buffers used in the double buffering
- * scheme, and some metadata about the queue.
+ * highpri queue. It contains the ring of buffers used to build the queue,
+ * and some metadata about the queue.
  * 
  * The current write pointer is stored in the "cur" field. The "sentinel" field
  * contains the pointer to the last byte at which a new command can start,
@@ -414,7 +509,11 @@ typedef struct rsp_queue_s {
  * pointers point inside the block memory.
  */
 typedef struct {
-    void *buffers[2];                   ///< The two buffers used to build the RSP queue
+    void *buffers[RSPQ_LOWPRI_MAX_BUFFERS];  ///< The ring of buffers used to build the RSP queue
+    int buf_sync[RSPQ_LOWPRI_MAX_BUFFERS];   ///< Syncpoint reached when each buffer has been run by RSP (lowpri only)
+    int num_buffers;                    ///< Number of buffers currently in the ring
+    int min_buffers;                    ///< Number of buffers to shrink back to after growing (lowpri only)
+    int max_buffers;                    ///< Maximum number of buffers the ring can grow to (lowpri only)
     int buf_size;                       ///< Size of each buffer in 32-bit words
     int buf_idx;                        ///< Index of the buffer currently being written to.
     uint32_t sp_status_bufdone;         ///< SP status bit to signal that one buffer has been run by RSP
@@ -442,18 +541,128 @@ static rspq_block_t *rspq_block;
 /** @brief Size of the current block memory buffer (in 32-bit words). */
 static int rspq_block_size;
 
+/** @brief Bitmap of the command IDs marked as state commands (see #rspq_overlay_set_state_command). */
+static uint32_t rspq_state_commands[256 / 32];
+
 /** @brief ID that will be used for the next syncpoint that will be created. */
 static int rspq_syncpoints_genid;
 /** @brief ID of the last syncpoint reached by RSP. */
 static volatile int rspq_syncpoints_done;
 
+/** @brief Callback invoked while waiting for the RSP (see #rspq_set_wait_callback). */
+static rspq_wait_callback_t rspq_wait_cb;
+/** @brief Opaque argument of #rspq_wait_cb. */
+static void *rspq_wait_cb_ctx;
+/** @brief True while #rspq_wait_cb is running, to avoid reentrancy. */
+static bool rspq_wait_cb_running;
+/** @brief Statistics about waits (see #rspq_get_wait_stats). */
+static rspq_wait_stats_t rspq_wait_stats;
+
+/** @brief Timeout of RSP waits in milliseconds, excluding the time spent in the idle callback. */
+#define RSPQ_WAIT_TIMEOUT_MS    200
+
 /** @brief True if the RSP queue engine is running in the RSP. */
 static bool rspq_is_running;
 
+/** @brief DMEM address of RSPQ_DMEM_BUFFER (see rsp_queue.inc) */
+#define RSPQ_DMEM_BUFFER_ADDR   (RSPQ_DEBUG ? 0x140 : 0x100)
+/** @brief DMEM address of RSPQ_OVERLAY_LOADS, which follows RSPQ_DMEM_BUFFER (see rsp_queue.inc) */
+#define RSPQ_OVERLAY_LOADS_ADDR (RSPQ_DMEM_BUFFER_ADDR + RSPQ_DMEM_BUFFER_SIZE)
+
+/** @brief Affinity flags of each overlay, by overlay index (see #rspq_overlay_set_affinity) */
+static uint32_t rspq_overlay_affinity[RSPQ_MAX_OVERLAY_COUNT];
+/** @brief Value of RSPQ_OVERLAY_LOADS at the last reset, by overlay index (see #rspq_reset_overlay_stats) */
+static uint32_t rspq_overlay_loads_base[RSPQ_MAX_OVERLAY_COUNT];
+
+#if RSPQ_PROFILE
+/** @brief DMEM address of the profiling state, which follows RSPQ_OVERLAY_LOADS (see rsp_queue.inc) */
+#define RSPQ_PROFILE_DMEM_ADDR  (RSPQ_OVERLAY_LOADS_ADDR + RSPQ_MAX_OVERLAY_COUNT*4)
+
+/** @brief Profiling state in DMEM (RSPQ_PROFILE_* in rsp_queue.inc) */
+typedef struct {
+    uint32_t rdram;             ///< RDRAM address of the ring of samples
+    uint32_t wptr;              ///< Bytes written so far by RSP into the ring
+    uint32_t cur;               ///< Command ID and start clock of the current command
+    uint32_t idx;               ///< Write index in the DMEM block of samples
+} __attribute__((aligned(8))) rspq_profile_dmem_t;
+
+/** @brief Ring of profiling samples written by RSP (uncached) */
+static uint32_t *rspq_profile_ring;
+/** @brief Bytes read so far by CPU from #rspq_profile_ring */
+static uint32_t rspq_profile_rptr;
+/** @brief Profiling data aggregated so far */
+static rspq_profile_data_t rspq_profile_data;
+#endif
+
+/** @brief A submission queue (see #rspq_submitq_new) */
+struct rspq_submitq_s {
+    uint32_t *buffer;                   ///< Ring of commands
+    uint32_t mask;                      ///< Size of the ring in words, minus one
+    volatile uint32_t wpos;             ///< Write position (updated by the producer)
+    volatile uint32_t rpos;             ///< Read position (updated by the consumer)
+    uint32_t reserved_pos;              ///< Position of the currently reserved command
+    uint32_t reserved_size;             ///< Size of the currently reserved command (0 if none)
+    struct rspq_submitq_s *next;        ///< Next submission queue in #rspq_submitqs
+};
+
+/** @brief A fence (see #rspq_fence_new) */
+struct rspq_fence_s {
+    volatile uint32_t *mem;             ///< Uncached buffer written by RSP (8 bytes, value in the first word)
+    uint32_t last_signal;               ///< Last value enqueued with #rspq_fence_enqueue_signal
+    uint32_t wait_value;                ///< Value being waited for by #rspq_fence_wait
+};
+
+/** @brief List of all submission queues, drained by #rspq_flush */
+static rspq_submitq_t *rspq_submitqs;
+
 /** @brief Dummy state used for overlay 0 */
 static uint64_t dummy_overlay_state;
 
 static void rspq_flush_internal(void);
+static void rspq_wait_internal(bool (*cond)(uint32_t), uint32_t arg);
+static bool rspq_check_syncpoint(uint32_t sync_id);
+static bool rspq_check_status_set(uint32_t mask);
+static int rspq_command_size(uint32_t cmd);
+
+#if RSPQ_PROFILE
+/**
+ * @brief Aggregate the profiling samples written by RSP since the last call.
+ * 
+ * Must be called with interrupts disabled (or from the SP interrupt handler).
+ */
+static void rspq_profile_collect(void)
+{
+    uint32_t wptr = SP_DMEM[RSPQ_PROFILE_DMEM_ADDR/4 + 1];
+    uint32_t avail = wptr - rspq_profile_rptr;
+
+    if (avail > RSPQ_PROFILE_RDRAM_SIZE) {
+        // The RSP went past the samples we did not read yet, so they
+        // were overwritten. Skip them.
+        rspq_profile_data.dropped += (avail - RSPQ_PROFILE_RDRAM_SIZE) / 8;
+        rspq_profile_rptr = wptr - RSPQ_PROFILE_RDRAM_SIZE;
+    }
+
+    while (rspq_profile_rptr != wptr) {
+        uint32_t *sample = &rspq_profile_ring[(rspq_profile_rptr & (RSPQ_PROFILE_RDRAM_SIZE-1)) / 4];
+        uint32_t start = sample[0];
+        uint32_t end = sample[1];
+        rspq_profile_rptr += 8;
+
+        // Empty samples are used to pad partial blocks
+        if (!start)
+            continue;
+
+        // The clock counter is 24-bit, so compute the difference modulo 2^24
+        uint32_t cycles = (end - start) & 0xFFFFFF;
+        uint32_t cmd_id = start >> 24;
+        rspq_profile_slot_t *slot = &rspq_profile_data.slots[cmd_id >> 4][cmd_id & 0xF];
+        slot->cycles += cycles;
+        slot->count++;
+        rspq_profile_data.total_cycles += cycles;
+        rspq_profile_data.total_count++;
+    }
+}
+#endif
 
 /** @brief RSP interrupt handler, used for syncpoints. */
 static void rspq_sp_interrupt(void) 
@@ -472,6 +681,10 @@ static void rspq_sp_interrupt(void)
 
     if (wstatus)
         *SP_STATUS = wstatus;
+
+#if RSPQ_PROFILE
+    rspq_profile_collect();
+#endif
 }
 
 /** @brief Extract the current overlay index and name from the RSP queue state */
@@ -491,7 +704,7 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
 {
     rsp_queue_t *rspq = (rsp_queue_t*)state->dmem;
     uint32_t cur = rspq->rspq_dram_addr + state->gpr[28];
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x140 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDR;
 
     int ovl_idx; const char *ovl_name;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_name);
@@ -527,7 +740,7 @@ static void rspq_assert_invalid_command(rsp_snapshot_t *state)
     int ovl_idx; const char *ovl_name;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_name);
 
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x140 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDR;
     uint32_t cur = dmem_buffer + state->gpr[28];
     printf("Invalid command\nCommand %02x not found in overlay %s (0x%01x)\n", state->dmem[cur], ovl_name, ovl_idx);
 }
@@ -624,6 +837,16 @@ static void rspq_start(void)
     uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
     rsp_load_data(&dummy_header, sizeof(dummy_header), rspq_data_size);
 
+#if RSPQ_PROFILE
+    // Point the RSP to the ring of profiling samples. Both the RSP write
+    // pointer and the CPU read pointer restart from the beginning.
+    static rspq_profile_dmem_t profile_dmem;
+    profile_dmem = (rspq_profile_dmem_t){ .rdram = PhysicalAddr(rspq_profile_ring) };
+    data_cache_hit_writeback(&profile_dmem, sizeof(profile_dmem));
+    rsp_load_data(&profile_dmem, sizeof(profile_dmem), RSPQ_PROFILE_DMEM_ADDR);
+    rspq_profile_rptr = 0;
+#endif
+
     MEMORY_BARRIER();
 
     // Set initial value of all signals.
@@ -647,24 +870,35 @@ static void rspq_start(void)
     *SP_STATUS = SP_WSTATUS_CLEAR_INTR_BREAK;
 }
 
+/** @brief Allocate a new (cleared) buffer for a rspq_ctx_t */
+static void *rspq_alloc_buffer(rspq_ctx_t *ctx)
+{
+    void *buf = malloc_uncached(ctx->buf_size * sizeof(uint32_t));
+    if (buf) memset(buf, 0, ctx->buf_size * sizeof(uint32_t));
+    return buf;
+}
+
 /** @brief Initialize a rspq_ctx_t structure */
-static void rspq_init_context(rspq_ctx_t *ctx, int buf_size)
+static void rspq_init_context(rspq_ctx_t *ctx, int buf_size, int num_buffers)
 {
     memset(ctx, 0, sizeof(rspq_ctx_t));
-    ctx->buffers[0] = malloc_uncached(buf_size * sizeof(uint32_t));
-    ctx->buffers[1] = malloc_uncached(buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[0], 0, buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[1], 0, buf_size * sizeof(uint32_t));
-    ctx->buf_idx = 0;
     ctx->buf_size = buf_size;
+    ctx->num_buffers = num_buffers;
+    ctx->min_buffers = num_buffers;
+    ctx->max_buffers = num_buffers;
+    for (int i = 0; i < num_buffers; i++) {
+        ctx->buffers[i] = rspq_alloc_buffer(ctx);
+        assertf(ctx->buffers[i], "out of memory allocating the RSP queue");
+    }
+    ctx->buf_idx = 0;
     ctx->cur = ctx->buffers[0];
     ctx->sentinel = ctx->cur + buf_size - RSPQ_MAX_COMMAND_SIZE;
 }
 
 static void rspq_close_context(rspq_ctx_t *ctx)
 {
-    free_uncached(ctx->buffers[1]);
-    free_uncached(ctx->buffers[0]);
+    for (int i = ctx->num_buffers - 1; i >= 0; i--)
+        free_uncached(ctx->buffers[i]);
 }
 
 void rspq_init(void)
@@ -678,12 +912,13 @@ void rspq_init(void)
     rspq_cur_sentinel = NULL;
 
     // Allocate RSPQ contexts
-    rspq_init_context(&lowpri, RSPQ_DRAM_LOWPRI_BUFFER_SIZE);
+    rspq_init_context(&lowpri, RSPQ_DRAM_LOWPRI_BUFFER_SIZE, RSPQ_LOWPRI_MIN_BUFFERS);
+    lowpri.max_buffers = RSPQ_LOWPRI_MAX_BUFFERS;
     lowpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_LOW;
     lowpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_LOW;
     lowpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_LOW;
 
-    rspq_init_context(&highpri, RSPQ_DRAM_HIGHPRI_BUFFER_SIZE);
+    rspq_init_context(&highpri, RSPQ_DRAM_HIGHPRI_BUFFER_SIZE, 2);
     highpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_HIGH;
     highpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_HIGH;
     highpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_HIGH;
@@ -704,8 +939,26 @@ void rspq_init(void)
     rspq_syncpoints_genid = 0;
     rspq_syncpoints_done = 0;
 
+    // Init waits
+    rspq_wait_cb = NULL;
+    rspq_wait_cb_ctx = NULL;
+    rspq_wait_cb_running = false;
+    memset(&rspq_wait_stats, 0, sizeof(rspq_wait_stats));
+
+#if RSPQ_PROFILE
+    // Init profiling
+    rspq_profile_ring = malloc_uncached(RSPQ_PROFILE_RDRAM_SIZE);
+    assertf(rspq_profile_ring, "out of memory allocating the RSP profiling ring");
+    memset(&rspq_profile_data, 0, sizeof(rspq_profile_data));
+#endif
+
     // Init blocks
     rspq_block = NULL;
+    memset(rspq_state_commands, 0, sizeof(rspq_state_commands));
+    memset(rspq_overlay_affinity, 0, sizeof(rspq_overlay_affinity));
+
+    // Overlay switch counters in DMEM restart from zero
+    memset(rspq_overlay_loads_base, 0, sizeof(rspq_overlay_loads_base));
     rspq_is_running = false;
 
     // Activate SP interrupt (used for syncpoints)
@@ -738,6 +991,11 @@ void rspq_close(void)
 
     set_SP_interrupt(0);
     unregister_SP_handler(rspq_sp_interrupt);
+
+#if RSPQ_PROFILE
+    free_uncached(rspq_profile_ring);
+    rspq_profile_ring = NULL;
+#endif
 }
 
 void* rspq_overlay_get_state(rsp_ucode_t *overlay_ucode)
@@ -912,6 +1170,11 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
     // Save the overlay pointer
     rspq_overlay_ucodes[overlay_index] = overlay_ucode;
 
+    // The overlay index might have been used by a previous overlay: reset
+    // affinity and switch counter.
+    rspq_overlay_affinity[overlay_index] = 0;
+    rspq_overlay_loads_base[overlay_index] = SP_DMEM[RSPQ_OVERLAY_LOADS_ADDR/4 + overlay_index];
+
     rspq_update_tables(true);
 
     return id << 28;
@@ -946,6 +1209,13 @@ void rspq_overlay_unregister(uint32_t overlay_id)
 
     // Reset the overlay descriptor
     memset(overlay, 0, sizeof(rspq_overlay_t));
+    rspq_overlay_affinity[overlay_index] = 0;
+
+    // Forget about its state commands
+    for (uint32_t i = 0; i < slot_count; i++)
+    {
+        rspq_state_commands[(unshifted_id + i) >> 1] &= ~(0xFFFFu << (((unshifted_id + i) & 1) * 16));
+    }
 
     // Remove all registered ids
     for (uint32_t i = unshifted_id; i < slot_count; i++)
@@ -960,6 +1230,63 @@ void rspq_overlay_unregister(uint32_t overlay_id)
     rspq_update_tables(false);
 }
 
+/**
+ * @brief Select the next buffer of the lowpri ring, reshaping the ring if needed.
+ * 
+ * If the ring has grown beyond its minimum size and the RSP has already
+ * gone past the next buffer, that buffer is freed. Then, if the next buffer
+ * is still waiting to be executed by the RSP, a new buffer is inserted in
+ * the ring (if allowed by the maximum size), so that the CPU can go on
+ * writing commands without blocking. Otherwise, this waits for the RSP
+ * to finish executing the next buffer.
+ * 
+ * @param[in,out] prev_idx  Index of the buffer being left. It is updated
+ *                          if the ring is reshaped.
+ * @return Index of the buffer to switch to.
+ */
+static int rspq_lowpri_next_buffer(int *prev_idx)
+{
+    rspq_ctx_t *ctx = &lowpri;
+    int next_idx = (*prev_idx + 1) % ctx->num_buffers;
+
+    // Shrink the ring. We can only free the next buffer once the RSP has
+    // reached the end of the buffer that follows it: this guarantees that
+    // it has also executed the final JUMP of the next buffer.
+    if (ctx->num_buffers > ctx->min_buffers) {
+        int after_idx = (next_idx + 1) % ctx->num_buffers;
+        if (after_idx != *prev_idx && rspq_syncpoint_check(ctx->buf_sync[after_idx])) {
+            free_uncached(ctx->buffers[next_idx]);
+            int tail = ctx->num_buffers - next_idx - 1;
+            memmove(&ctx->buffers[next_idx], &ctx->buffers[next_idx+1], tail * sizeof(void*));
+            memmove(&ctx->buf_sync[next_idx], &ctx->buf_sync[next_idx+1], tail * sizeof(int));
+            ctx->num_buffers--;
+            if (next_idx < *prev_idx) (*prev_idx)--;
+            next_idx = (*prev_idx + 1) % ctx->num_buffers;
+        }
+    }
+
+    // Grow the ring, if the next buffer is still busy.
+    if (ctx->num_buffers < ctx->min_buffers ||
+        (ctx->num_buffers < ctx->max_buffers && !rspq_syncpoint_check(ctx->buf_sync[next_idx]))) {
+        void *buf = rspq_alloc_buffer(ctx);
+        if (buf) {
+            next_idx = *prev_idx + 1;
+            int tail = ctx->num_buffers - next_idx;
+            memmove(&ctx->buffers[next_idx+1], &ctx->buffers[next_idx], tail * sizeof(void*));
+            memmove(&ctx->buf_sync[next_idx+1], &ctx->buf_sync[next_idx], tail * sizeof(int));
+            ctx->buffers[next_idx] = buf;
+            ctx->buf_sync[next_idx] = 0;
+            ctx->num_buffers++;
+            return next_idx;
+        }
+    }
+
+    // Wait until the next buffer has been executed by the RSP.
+    // We cannot write to it if it's still being executed.
+    rspq_wait_internal(rspq_check_syncpoint, ctx->buf_sync[next_idx]);
+    return next_idx;
+}
+
 /**
  * @brief Switch to the next write buffer for the current RSP queue.
  * 
@@ -971,8 +1298,9 @@ void rspq_overlay_unregister(uint32_t overlay_id)
  * 
  * If we're creating a block, we need to allocate a new buffer from the heap.
  * Otherwise, if we're writing into either the lowpri or the highpri queue,
- * we need to switch buffer (double buffering strategy), making sure the
- * other buffer has been already fully executed by the RSP.
+ * we need to switch to the next buffer of the ring, making sure it has
+ * been already fully executed by the RSP (or, for the lowpri queue, growing
+ * the ring with a new buffer, see #rspq_lowpri_next_buffer).
  */
 __attribute__((noinline))
 void rspq_next_buffer(void) {
@@ -992,34 +1320,38 @@ void rspq_next_buffer(void) {
         return;
     }
 
-    // Wait until the previous buffer is executed by the RSP.
-    // We cannot write to it if it's still being executed.
-    // FIXME: this should probably transition to a sync-point,
-    // so that the kernel can switch away while waiting. Even
-    // if the overhead of an interrupt is obviously higher.
-    MEMORY_BARRIER();
-    if (!(*SP_STATUS & rspq_ctx->sp_status_bufdone)) {
-        rspq_flush_internal();
-        RSP_WAIT_LOOP(200) {
-            if (*SP_STATUS & rspq_ctx->sp_status_bufdone)
-                break;
-        }
+    int prev_idx = rspq_ctx->buf_idx;
+    int next_idx = (prev_idx + 1) % rspq_ctx->num_buffers;
+    if (rspq_ctx == &lowpri) {
+        // Pick the next buffer of the elastic ring, possibly reshaping it.
+        next_idx = rspq_lowpri_next_buffer(&prev_idx);
+    } else {
+        // Wait until the next buffer has been executed by the RSP.
+        // We cannot write to it if it's still being executed.
+        rspq_wait_internal(rspq_check_status_set, rspq_ctx->sp_status_bufdone);
+        MEMORY_BARRIER();
+        *SP_STATUS = rspq_ctx->sp_wstatus_clear_bufdone;
+        MEMORY_BARRIER();
     }
-    MEMORY_BARRIER();
-    *SP_STATUS = rspq_ctx->sp_wstatus_clear_bufdone;
-    MEMORY_BARRIER();
 
     // Switch current buffer
-    rspq_ctx->buf_idx = 1-rspq_ctx->buf_idx;
-    uint32_t *new = rspq_ctx->buffers[rspq_ctx->buf_idx];
+    rspq_ctx->buf_idx = next_idx;
+    uint32_t *new = rspq_ctx->buffers[next_idx];
     volatile uint32_t *prev = rspq_switch_buffer(new, rspq_ctx->buf_size, true);
 
-    // Terminate the previous buffer with an op to set SIG_BUFDONE
-    // (to notify when the RSP finishes the buffer), plus a jump to
-    // the new buffer.
-    rspq_append1(prev, RSPQ_CMD_WRITE_STATUS, rspq_ctx->sp_wstatus_set_bufdone);
+    // Terminate the previous buffer with an op to notify when the RSP
+    // finishes the buffer, plus a jump to the new buffer. In the lowpri
+    // queue we use a syncpoint, so that a later wait is interrupt-driven.
+    if (rspq_ctx == &lowpri) {
+        rspq_append2(prev, RSPQ_CMD_TEST_WRITE_STATUS,
+            SP_WSTATUS_SET_INTR | SP_WSTATUS_SET_SIG_SYNCPOINT,
+            SP_STATUS_SIG_SYNCPOINT);
+        rspq_ctx->buf_sync[prev_idx] = ++rspq_syncpoints_genid;
+    } else {
+        rspq_append1(prev, RSPQ_CMD_WRITE_STATUS, rspq_ctx->sp_wstatus_set_bufdone);
+    }
     rspq_append1(prev, RSPQ_CMD_JUMP, PhysicalAddr(new));
-    assert(prev+1 < (uint32_t*)(rspq_ctx->buffers[1-rspq_ctx->buf_idx]) + rspq_ctx->buf_size);
+    assert(prev <= (uint32_t*)(rspq_ctx->buffers[prev_idx]) + rspq_ctx->buf_size);
     rspq_flush_internal();
 }
 
@@ -1049,11 +1381,207 @@ static void rspq_flush_internal(void)
     MEMORY_BARRIER();
 }
 
+/** @brief Wait condition: syncpoint reached */
+static bool rspq_check_syncpoint(uint32_t sync_id)
+{
+    return rspq_syncpoint_check(sync_id);
+}
+
+/** @brief Wait condition: all the specified SP_STATUS bits are set */
+static bool rspq_check_status_set(uint32_t mask)
+{
+    return (*SP_STATUS & mask) == mask;
+}
+
+/** @brief Wait condition: all the specified SP_STATUS bits are clear */
+static bool rspq_check_status_clear(uint32_t mask)
+{
+    return (*SP_STATUS & mask) == 0;
+}
+
+/**
+ * @brief Block until a condition on the RSP state becomes true.
+ * 
+ * While waiting, the idle callback registered with #rspq_set_wait_callback is
+ * invoked repeatedly (only if interrupts are enabled, so never from an
+ * interrupt handler). If interrupts are disabled, the SP interrupt handler is
+ * instead polled manually, so that syncpoints are still processed.
+ * 
+ * If the condition is not reached within #RSPQ_WAIT_TIMEOUT_MS (not counting
+ * the time spent in the idle callback), the RSP is assumed to have crashed.
+ * 
+ * @param[in]  cond   Function that checks the condition
+ * @param[in]  arg    Argument passed to the condition function
+ */
+static void rspq_wait_internal(bool (*cond)(uint32_t), uint32_t arg)
+{
+    if (cond(arg))
+        return;
+
+    // Make sure the RSP is running, otherwise we might be blocking forever.
+    rspq_flush_internal();
+
+    uint32_t t0 = TICKS_READ();
+    uint32_t deadline = t0 + TICKS_FROM_MS(RSPQ_WAIT_TIMEOUT_MS);
+    // Check whether interrupts can be serviced: they must be enabled and
+    // we must not be running within an interrupt handler.
+    bool irq = get_interrupts_state() == INTERRUPTS_ENABLED && !(C0_STATUS() & C0_STATUS_EXL);
+
+    while (!cond(arg)) {
+        if (!irq) {
+            // No interrupts: run the handler ourselves to process syncpoints.
+            rspq_sp_interrupt();
+        } else if (rspq_wait_cb && !rspq_wait_cb_running) {
+            uint32_t t = TICKS_READ();
+            rspq_wait_cb_running = true;
+            rspq_wait_cb(rspq_wait_cb_ctx);
+            rspq_wait_cb_running = false;
+            t = TICKS_READ() - t;
+
+            // Time spent in the callback is not RSP time, so it does
+            // not count towards the timeout.
+            rspq_wait_stats.idle_ticks += t;
+            deadline += t;
+        }
+
+        if (!TICKS_BEFORE(TICKS_READ(), deadline))
+            rsp_crashf("wait loop timed out (%d ms)", RSPQ_WAIT_TIMEOUT_MS);
+        __rsp_check_assert(__FILE__, __LINE__, __func__);
+    }
+
+    rspq_wait_stats.waits++;
+    rspq_wait_stats.wait_ticks += TICKS_READ() - t0;
+}
+
+void rspq_set_lowpri_buffers(int min_buffers, int max_buffers)
+{
+    assertf(2 <= min_buffers && min_buffers <= max_buffers && max_buffers <= RSPQ_LOWPRI_MAX_BUFFERS,
+        "invalid number of buffers: min=%d max=%d (limit: %d)", min_buffers, max_buffers, RSPQ_LOWPRI_MAX_BUFFERS);
+
+    // The ring is reshaped lazily, as buffers are switched
+    lowpri.min_buffers = min_buffers;
+    lowpri.max_buffers = max_buffers;
+}
+
+int rspq_get_lowpri_buffers(void)
+{
+    return lowpri.num_buffers;
+}
+
+rspq_submitq_t* rspq_submitq_new(int size)
+{
+    int ring_size = RSPQ_MAX_COMMAND_SIZE * 2;
+    while (ring_size < size) ring_size *= 2;
+
+    rspq_submitq_t *q = malloc(sizeof(rspq_submitq_t));
+    assertf(q, "out of memory allocating a submission queue");
+    memset(q, 0, sizeof(rspq_submitq_t));
+    q->buffer = malloc(ring_size * sizeof(uint32_t));
+    assertf(q->buffer, "out of memory allocating a submission queue");
+    q->mask = ring_size - 1;
+
+    // Link it in the list of queues to drain. This is only walked by
+    // the main thread, so it does not need to be protected.
+    q->next = rspq_submitqs;
+    rspq_submitqs = q;
+    return q;
+}
+
+void rspq_submitq_free(rspq_submitq_t *q)
+{
+    for (rspq_submitq_t **prev = &rspq_submitqs; *prev; prev = &(*prev)->next) {
+        if (*prev == q) {
+            *prev = q->next;
+            break;
+        }
+    }
+    free(q->buffer);
+    free(q);
+}
+
+uint32_t* rspq_submitq_reserve(rspq_submitq_t *q, int size)
+{
+    assertf(size > 0 && size <= RSPQ_MAX_COMMAND_SIZE, "invalid command size: %d", size);
+    assertf(q->reserved_size == 0, "a command was already reserved");
+
+    uint32_t pos = q->wpos;
+    uint32_t tail = q->mask + 1 - (pos & q->mask);
+
+    // If the command does not fit before the end of the ring, skip the tail
+    uint32_t needed = size <= tail ? size : tail + size;
+    if (pos + needed - q->rpos > q->mask + 1)
+        return NULL;
+
+    if (size > tail) {
+        q->buffer[pos & q->mask] = 0;
+        pos += tail;
+    }
+
+    q->reserved_pos = pos;
+    q->reserved_size = size;
+    return &q->buffer[pos & q->mask];
+}
+
+void rspq_submitq_commit(rspq_submitq_t *q)
+{
+    assertf(q->reserved_size != 0, "no command was reserved");
+    assertf(rspq_command_size(q->buffer[q->reserved_pos & q->mask]) == q->reserved_size,
+        "size of command %02lx does not match the reserved size (%ld)",
+        q->buffer[q->reserved_pos & q->mask] >> 24, q->reserved_size);
+
+    // Make sure the command is in memory before publishing it
+    MEMORY_BARRIER();
+    q->wpos = q->reserved_pos + q->reserved_size;
+    q->reserved_size = 0;
+}
+
+/** @brief Move the commands of all submission queues into the lowpri queue */
+static void rspq_submitq_drain(void)
+{
+    for (rspq_submitq_t *q = rspq_submitqs; q; q = q->next) {
+        uint32_t wpos = q->wpos;
+        uint32_t rpos = q->rpos;
+        MEMORY_BARRIER();
+
+        while (rpos != wpos) {
+            uint32_t *cmd = &q->buffer[rpos & q->mask];
+
+            // Zero is the padding at the end of the ring
+            if (cmd[0] == 0) {
+                rpos += q->mask + 1 - (rpos & q->mask);
+                q->rpos = rpos;
+                continue;
+            }
+
+            // Copy the command, writing the first word last as #rspq_write does,
+            // so that the RSP never sees a partial command.
+            int size = rspq_command_size(cmd[0]);
+            for (int i = 1; i < size; i++)
+                rspq_cur_pointer[i] = cmd[i];
+            rspq_cur_pointer[0] = cmd[0];
+            rspq_cur_pointer += size;
+
+            // Free the space as soon as possible, as switching buffer
+            // might wait for the RSP.
+            rpos += size;
+            MEMORY_BARRIER();
+            q->rpos = rpos;
+
+            if (rspq_cur_pointer > rspq_cur_sentinel)
+                rspq_next_buffer();
+        }
+    }
+}
+
 void rspq_flush(void)
 {
     // If we are recording a block, flushes can be ignored.
     if (rspq_block) return;
 
+    // Commands from submission queues only go to the lowpri queue
+    if (rspq_ctx == &lowpri && rspq_submitqs)
+        rspq_submitq_drain();
+
     rspq_flush_internal();
 }
 
@@ -1120,46 +1648,90 @@ void rspq_highpri_sync(void)
 {
     assertf(rspq_ctx != &highpri, "this function can only be called outside of highpri mode");
 
-    RSP_WAIT_LOOP(200) {
-        if (!(*SP_STATUS & (SP_STATUS_SIG_HIGHPRI_REQUESTED | SP_STATUS_SIG_HIGHPRI_RUNNING)))
-            break;
-    }
+    rspq_wait_internal(rspq_check_status_clear, SP_STATUS_SIG_HIGHPRI_REQUESTED | SP_STATUS_SIG_HIGHPRI_RUNNING);
 }
 
-void rspq_block_begin(void)
+void rspq_overlay_set_state_command(uint32_t overlay_id, uint32_t cmd_id)
 {
-    assertf(!rspq_block, "a block was already being created");
-    assertf(rspq_ctx != &highpri, "cannot create a block in highpri mode");
+    uint32_t id = (overlay_id >> 24) + cmd_id;
+    assertf(overlay_id != 0 && id < 256, "invalid state command: overlay %lx, command %lx", overlay_id, cmd_id);
+    rspq_state_commands[id >> 5] |= 1u << (id & 31);
+}
 
-    // Allocate a new block (at minimum size) and initialize it.
-    rspq_block_size = RSPQ_BLOCK_MIN_SIZE;
-    rspq_block = malloc_uncached(sizeof(rspq_block_t) + rspq_block_size*sizeof(uint32_t));
-    rspq_block->nesting_level = 0;
+void rspq_overlay_set_affinity(uint32_t overlay_id, uint32_t flags)
+{
+    uint32_t ovl_index = rspq_data.tables.overlay_table[overlay_id >> 28] / sizeof(rspq_overlay_t);
+    assertf(overlay_id != 0 && ovl_index != 0, "overlay %lx is not registered", overlay_id >> 28);
+    rspq_overlay_affinity[ovl_index] = flags;
+}
 
-    // Switch to the block buffer. From now on, all rspq_writes will
-    // go into the block.
-    rspq_switch_context(NULL);
-    rspq_switch_buffer(rspq_block->cmds, rspq_block_size, true);
+void rspq_get_overlay_stats(rspq_overlay_stats_t *stats)
+{
+    memset(stats, 0, sizeof(rspq_overlay_stats_t));
+
+    for (int i = 1; i < RSPQ_MAX_OVERLAY_COUNT; i++) {
+        uint32_t loads = SP_DMEM[RSPQ_OVERLAY_LOADS_ADDR/4 + i] - rspq_overlay_loads_base[i];
+        stats->switches += loads;
+
+        // Report the loads under the primary ID of the overlay
+        rspq_overlay_t *overlay = &rspq_data.tables.overlay_descriptors[i];
+        if (overlay->code) {
+            rspq_overlay_header_t *header = (rspq_overlay_header_t*)(overlay->data | 0x80000000);
+            stats->loads[header->command_base >> 5] += loads;
+        }
+    }
 }
 
-rspq_block_t* rspq_block_end(void)
+void rspq_reset_overlay_stats(void)
 {
-    assertf(rspq_block, "a block was not being created");
+    for (int i = 0; i < RSPQ_MAX_OVERLAY_COUNT; i++)
+        rspq_overlay_loads_base[i] = SP_DMEM[RSPQ_OVERLAY_LOADS_ADDR/4 + i];
+}
 
-    // Terminate the block with a RET command, encoding
-    // the nesting level which is used as stack slot by RSP.
-    rspq_append1(rspq_cur_pointer, RSPQ_CMD_RET, rspq_block->nesting_level<<2);
+/** @brief Check whether a command ID was marked as state command */
+static bool rspq_is_state_command(uint32_t id)
+{
+    return rspq_state_commands[id >> 5] & (1u << (id & 31));
+}
 
-    // Switch back to the normal display list
-    rspq_switch_context(&lowpri);
+/**
+ * @brief Return the size of a command, validating it.
+ * 
+ * This looks up the command in the descriptors of its overlay, and asserts
+ * if the overlay is not registered or does not define the command.
+ * 
+ * @param[in]  cmd  First word of the command
+ * @return Size of the command in 32-bit words
+ */
+static int rspq_command_size(uint32_t cmd)
+{
+    uint32_t id = cmd >> 24;
+
+    if ((id >> 4) == 0) {
+        // Sizes of internal commands, as defined in rsp_queue.inc
+        static const uint8_t internal_sizes[] = { 0, 1, 1, 2, 1, 4, 1, 3, 2, 2, 2 };
+        assertf(id != RSPQ_CMD_INVALID && id < sizeof(internal_sizes),
+            "invalid internal command %02lx in block", id);
+        return internal_sizes[id];
+    }
 
-    // Return the created block
-    rspq_block_t *b = rspq_block;
-    rspq_block = NULL;
-    return b;
+    uint32_t ovl_index = rspq_data.tables.overlay_table[id >> 4] / sizeof(rspq_overlay_t);
+    assertf(ovl_index != 0 && rspq_overlay_ucodes[ovl_index],
+        "block contains command %02lx but overlay %lx is not registered", id, id >> 4);
+
+    uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
+    rspq_overlay_header_t *header = (rspq_overlay_header_t*)(rspq_overlay_ucodes[ovl_index]->data + rspq_data_size);
+    uint32_t cmd_index = id - ((header->command_base >> 5) << 4);
+    assertf(cmd_index < rspq_overlay_get_command_count(header),
+        "block contains command %02lx not defined by overlay %s", id, rspq_overlay_ucodes[ovl_index]->name);
+
+    int size = header->commands[cmd_index] >> 12;
+    assertf(size > 0, "block contains command %02lx of invalid size", id);
+    return size;
 }
 
-void rspq_block_free(rspq_block_t *block)
+/** @brief Free the chunks of a block that is still in the format built by #rspq_next_buffer */
+static void rspq_block_free_chunks(rspq_block_t *block)
 {
     // Start from the commands in the first chunk of the block
     int size = RSPQ_BLOCK_MIN_SIZE;
@@ -1192,6 +1764,222 @@ void rspq_block_free(rspq_block_t *block)
     }
 }
 
+/**
+ * @brief Walk the commands of a block being compiled, copying them
+ * 
+ * The chunks of the block are walked following their JUMP commands, and all
+ * commands are validated. No-ops are dropped, and so are state commands
+ * that are immediately followed by another instance of the same command.
+ * 
+ * @param[in]  block  Block as built by #rspq_block_begin / #rspq_write
+ * @param[out] out    Buffer where the commands are copied, or NULL to
+ *                    just compute the size.
+ * @return Size of the compiled commands in 32-bit words
+ */
+static int rspq_block_copy(rspq_block_t *block, uint32_t *out)
+{
+    int words = 0;
+    volatile uint32_t *ptr = block->cmds;
+
+    // Each command is copied only after looking at the following one,
+    // to know whether it is redundant.
+    volatile uint32_t *pending = NULL;
+    int pending_size = 0;
+
+    while (1) {
+        uint32_t cmd = *ptr;
+        uint32_t id = cmd >> 24;
+
+        // Follow the jumps between chunks
+        if (id == RSPQ_CMD_JUMP) {
+            ptr = (volatile uint32_t*)UncachedAddr(0x80000000 | (cmd & 0xFFFFFF));
+            continue;
+        }
+
+        int size = rspq_command_size(cmd);
+
+        if (pending && !(id == (pending[0] >> 24) && rspq_is_state_command(id))) {
+            if (out) {
+                for (int i = 0; i < pending_size; i++)
+                    out[words + i] = pending[i];
+            }
+            words += pending_size;
+        }
+        pending = NULL;
+
+        if (id == RSPQ_CMD_RET) {
+            if (out) out[words] = cmd;
+            return words + 1;
+        }
+
+        if (id != RSPQ_CMD_NOOP) {
+            pending = ptr;
+            pending_size = size;
+        }
+        ptr += size;
+    }
+}
+
+/** @brief Return the index of the overlay of a command if it is batchable, or 0 otherwise */
+static uint32_t rspq_batch_overlay(uint32_t cmd)
+{
+    uint32_t ovl_index = rspq_data.tables.overlay_table[cmd >> 28] / sizeof(rspq_overlay_t);
+    if (ovl_index != 0 && (rspq_overlay_affinity[ovl_index] & RSPQ_AFFINITY_BATCH))
+        return ovl_index;
+    return 0;
+}
+
+/**
+ * @brief Group the commands of a sequence of batchable commands by overlay.
+ * 
+ * @param[in,out] cmds      Commands of the sequence
+ * @param[in]     words     Size of the sequence in 32-bit words
+ * @param[in]     prev_ovl  Index of the overlay used before the sequence (or 0)
+ * @param[in]     tmp       Temporary buffer of at least @p words words
+ * @return Index of the overlay of the last command of the sequence
+ */
+static uint32_t rspq_block_batch_group(uint32_t *cmds, int words, uint32_t prev_ovl, uint32_t *tmp)
+{
+    // List the overlays in order of first appearance, but start with
+    // the one that was already loaded, if any.
+    uint32_t order[RSPQ_MAX_OVERLAY_COUNT];
+    int num_ovl = 0;
+    bool seen[RSPQ_MAX_OVERLAY_COUNT] = {0};
+    for (int i = 0; i < words; i += rspq_command_size(cmds[i])) {
+        uint32_t ovl = rspq_batch_overlay(cmds[i]);
+        if (!seen[ovl]) {
+            seen[ovl] = true;
+            order[num_ovl++] = ovl;
+        }
+    }
+    if (num_ovl < 2)
+        return order[0];
+    for (int j = 1; j < num_ovl; j++) {
+        if (order[j] == prev_ovl) {
+            memmove(&order[1], &order[0], j * sizeof(uint32_t));
+            order[0] = prev_ovl;
+            break;
+        }
+    }
+
+    // Copy the commands of each overlay in turn, keeping their relative order
+    int out = 0;
+    for (int j = 0; j < num_ovl; j++) {
+        for (int i = 0; i < words; ) {
+            int size = rspq_command_size(cmds[i]);
+            if (rspq_batch_overlay(cmds[i]) == order[j]) {
+                memcpy(&tmp[out], &cmds[i], size * sizeof(uint32_t));
+                out += size;
+            }
+            i += size;
+        }
+    }
+    assert(out == words);
+    memcpy(cmds, tmp, words * sizeof(uint32_t));
+    return order[num_ovl-1];
+}
+
+/**
+ * @brief Reorder the commands of a compiled block to reduce overlay switches.
+ * 
+ * Every sequence of consecutive commands of overlays declared with
+ * #RSPQ_AFFINITY_BATCH is grouped by overlay (see #rspq_block_batch_group).
+ * 
+ * @param[in,out] cmds   Commands of the compiled block
+ * @param[in]     words  Size of the compiled block in 32-bit words
+ */
+static void rspq_block_batch(uint32_t *cmds, int words)
+{
+    uint32_t *tmp = NULL;
+    uint32_t prev_ovl = 0;
+
+    for (int i = 0; i < words; ) {
+        int start = i;
+        while (i < words && rspq_batch_overlay(cmds[i]))
+            i += rspq_command_size(cmds[i]);
+
+        if (i == start) {
+            // Not batchable: it is a barrier. Remember which overlay it
+            // leaves loaded (internal commands do not switch overlay).
+            if (cmds[i] >> 28)
+                prev_ovl = rspq_data.tables.overlay_table[cmds[i] >> 28] / sizeof(rspq_overlay_t);
+            i += rspq_command_size(cmds[i]);
+            continue;
+        }
+
+        if (!tmp) {
+            tmp = malloc(words * sizeof(uint32_t));
+            assertf(tmp, "out of memory compiling a block");
+        }
+        prev_ovl = rspq_block_batch_group(cmds + start, i - start, prev_ovl, tmp);
+    }
+
+    free(tmp);
+}
+
+/**
+ * @brief Compile a block into its final, contiguous form.
+ * 
+ * The commands are copied (see #rspq_block_copy) into a single uncached
+ * buffer, and the chunks used while recording the block are freed.
+ * Batchable commands are then grouped by overlay (see #rspq_block_batch).
+ * 
+ * @param[in]  block  Block as built by #rspq_block_begin / #rspq_write
+ * @return The compiled block
+ */
+static rspq_block_t* rspq_block_compile(rspq_block_t *block)
+{
+    int words = rspq_block_copy(block, NULL);
+
+    rspq_block_t *compiled = malloc_uncached(sizeof(rspq_block_t) + words*sizeof(uint32_t));
+    assertf(compiled, "out of memory compiling a block");
+    compiled->nesting_level = block->nesting_level;
+    rspq_block_copy(block, compiled->cmds);
+    rspq_block_batch(compiled->cmds, words);
+
+    rspq_block_free_chunks(block);
+    return compiled;
+}
+
+void rspq_block_begin(void)
+{
+    assertf(!rspq_block, "a block was already being created");
+    assertf(rspq_ctx != &highpri, "cannot create a block in highpri mode");
+
+    // Allocate a new block (at minimum size) and initialize it.
+    rspq_block_size = RSPQ_BLOCK_MIN_SIZE;
+    rspq_block = malloc_uncached(sizeof(rspq_block_t) + rspq_block_size*sizeof(uint32_t));
+    rspq_block->nesting_level = 0;
+
+    // Switch to the block buffer. From now on, all rspq_writes will
+    // go into the block.
+    rspq_switch_context(NULL);
+    rspq_switch_buffer(rspq_block->cmds, rspq_block_size, true);
+}
+
+rspq_block_t* rspq_block_end(void)
+{
+    assertf(rspq_block, "a block was not being created");
+
+    // Terminate the block with a RET command, encoding
+    // the nesting level which is used as stack slot by RSP.
+    rspq_append1(rspq_cur_pointer, RSPQ_CMD_RET, rspq_block->nesting_level<<2);
+
+    // Switch back to the normal display list
+    rspq_switch_context(&lowpri);
+
+    // Compile the block into its final form, and return it
+    rspq_block_t *b = rspq_block_compile(rspq_block);
+    rspq_block = NULL;
+    return b;
+}
+
+void rspq_block_free(rspq_block_t *block)
+{
+    // Blocks are compiled into a single buffer by rspq_block_end
+    free_uncached(block);
+}
+
 void rspq_block_run(rspq_block_t *block)
 {
     // TODO: add support for block execution in highpri mode. This would be
@@ -1225,10 +2013,13 @@ rspq_syncpoint_t rspq_syncpoint_new(void)
 {   
     assertf(!rspq_block, "cannot create syncpoint in a block");
     assertf(rspq_ctx != &highpri, "cannot create syncpoint in highpri mode");
+    // Allocate the ID before writing the command: if the queue buffer becomes
+    // full, rspq_next_buffer will append another syncpoint after this one.
+    rspq_syncpoint_t id = ++rspq_syncpoints_genid;
     rspq_int_write(RSPQ_CMD_TEST_WRITE_STATUS, 
         SP_WSTATUS_SET_INTR | SP_WSTATUS_SET_SIG_SYNCPOINT,
         SP_STATUS_SIG_SYNCPOINT);
-    return ++rspq_syncpoints_genid;
+    return id;
 }
 
 bool rspq_syncpoint_check(rspq_syncpoint_t sync_id) 
@@ -1239,22 +2030,141 @@ bool rspq_syncpoint_check(rspq_syncpoint_t sync_id)
 
 void rspq_syncpoint_wait(rspq_syncpoint_t sync_id)
 {
-    if (rspq_syncpoint_check(sync_id))
-        return;
+    rspq_wait_internal(rspq_check_syncpoint, sync_id);
+}
 
-    assertf(get_interrupts_state() == INTERRUPTS_ENABLED,
-        "deadlock: interrupts are disabled");
+rspq_fence_t* rspq_fence_new(void)
+{
+    rspq_fence_t *f = malloc(sizeof(rspq_fence_t));
+    assertf(f, "out of memory allocating a fence");
+    f->mem = malloc_uncached(8);
+    assertf(f->mem, "out of memory allocating a fence");
+    f->mem[0] = f->mem[1] = 0;
+    f->last_signal = 0;
+    f->wait_value = 0;
+    return f;
+}
 
-    // Make sure the RSP is running, otherwise we might be blocking forever.
-    rspq_flush_internal();
+void rspq_fence_free(rspq_fence_t *f)
+{
+    free_uncached((void*)f->mem);
+    free(f);
+}
 
-    // Spinwait until the the syncpoint is reached.
-    // TODO: with the kernel, it will be possible to wait for the RSP interrupt
-    // to happen, without spinwaiting.
-    RSP_WAIT_LOOP(200) {
-        if (rspq_syncpoint_check(sync_id))
-            break;
+uint32_t rspq_fence_enqueue_signal(rspq_fence_t *f)
+{
+    uint32_t value = ++f->last_signal;
+    rspq_int_write(RSPQ_CMD_FENCE_SIGNAL, PhysicalAddr(f->mem), value);
+    return value;
+}
+
+void rspq_fence_enqueue_wait(rspq_fence_t *f, uint32_t value)
+{
+    rspq_int_write(RSPQ_CMD_FENCE_WAIT, PhysicalAddr(f->mem), value);
+}
+
+void rspq_fence_signal(rspq_fence_t *f, uint32_t value)
+{
+    MEMORY_BARRIER();
+    f->mem[0] = value;
+}
+
+bool rspq_fence_check(rspq_fence_t *f, uint32_t value)
+{
+    return (int32_t)(value - f->mem[0]) <= 0;
+}
+
+/** @brief Wait condition: fence reached the value stored in its wait_value */
+static bool rspq_check_fence(uint32_t fence)
+{
+    rspq_fence_t *f = (rspq_fence_t*)fence;
+    return rspq_fence_check(f, f->wait_value);
+}
+
+void rspq_fence_wait(rspq_fence_t *f, uint32_t value)
+{
+    f->wait_value = value;
+    rspq_wait_internal(rspq_check_fence, (uint32_t)f);
+}
+
+void rspq_set_wait_callback(rspq_wait_callback_t cb, void *ctx)
+{
+    rspq_wait_cb = cb;
+    rspq_wait_cb_ctx = ctx;
+}
+
+void rspq_get_wait_stats(rspq_wait_stats_t *stats)
+{
+    *stats = rspq_wait_stats;
+}
+
+void rspq_reset_wait_stats(void)
+{
+    memset(&rspq_wait_stats, 0, sizeof(rspq_wait_stats));
+}
+
+void rspq_profile_reset(void)
+{
+#if RSPQ_PROFILE
+    disable_interrupts();
+    // Discard the samples that were not collected yet
+    rspq_profile_collect();
+    memset(&rspq_profile_data, 0, sizeof(rspq_profile_data));
+    enable_interrupts();
+#endif
+}
+
+void rspq_profile_get_data(rspq_profile_data_t *data)
+{
+#if RSPQ_PROFILE
+    disable_interrupts();
+    rspq_profile_collect();
+    *data = rspq_profile_data;
+    enable_interrupts();
+#else
+    memset(data, 0, sizeof(rspq_profile_data_t));
+#endif
+}
+
+void rspq_profile_dump(void)
+{
+#if RSPQ_PROFILE
+    rspq_profile_data_t data;
+    rspq_profile_get_data(&data);
+
+    debugf("RSPQ profile: %lu commands, %llu cycles, %lu dropped samples\n",
+        data.total_count, data.total_cycles, data.dropped);
+
+    for (int id = 0; id < RSPQ_OVERLAY_ID_COUNT; id++) {
+        // Find the overlay that owns this ID, and the index of its first
+        // command, so that commands can be shown as indices within the overlay.
+        const char *name = "builtin";
+        int cmd_base = 0;
+        if (id != 0) {
+            int ovl_idx = rspq_data.tables.overlay_table[id] / sizeof(rspq_overlay_t);
+            if (ovl_idx != 0 && rspq_overlay_ucodes[ovl_idx]) {
+                uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
+                rspq_overlay_header_t *header = (rspq_overlay_header_t*)(rspq_overlay_ucodes[ovl_idx]->data + rspq_data_size);
+                name = rspq_overlay_ucodes[ovl_idx]->name;
+                cmd_base = (id << 4) - (header->command_base >> 1);
+            } else {
+                name = "?";
+            }
+        }
+
+        for (int i = 0; i < 16; i++) {
+            rspq_profile_slot_t *slot = &data.slots[id][i];
+            if (!slot->count)
+                continue;
+            debugf("  %-16s 0x%02x (#%-2d) %8lu runs %12llu cycles %8llu avg %5.1f%%\n",
+                name, (id << 4) | i, cmd_base + i, slot->count, slot->cycles,
+                slot->cycles / slot->count,
+                data.total_cycles ? 100.0f * slot->cycles / data.total_cycles : 0.0f);
+        }
     }
+#else
+    debugf("RSPQ profile: not available (build with RSPQ_PROFILE=1)\n");
+#endif
 }
 
 void rspq_signal(uint32_t signal)
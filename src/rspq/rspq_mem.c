@@ -0,0 +1,157 @@
+/**
+ * @file rspq_mem.c
+ * @brief RSP bulk memory operations
+ * @ingroup rspq_mem
+ */
+
+#include "rspq.h"
+#include "rspq_mem.h"
+#include "rsp.h"
+#include "n64sys.h"
+#include "debug.h"
+#include "utils.h"
+
+/** @brief Size of the DMEM buffer used by the overlay (see rsp_mem.S) */
+#define MEM_BUFFER_SIZE     2048
+
+/**
+ * @brief Maximum number of bytes transferred by a single command.
+ *
+ * Longer operations are split into multiple commands, so that a highpri
+ * queue does not have to wait for a whole large transfer to finish before
+ * being able to run.
+ */
+#define MEM_MAX_CMD_LEN     (32*1024)
+
+/** @brief Largest gap between lines that a RSP DMA can skip, plus one (12-bit field) */
+#define DMA_MAX_SKIP        4096
+
+/** @brief Command IDs of the overlay (see rsp_mem.S) */
+enum {
+    MEM_CMD_MEMSET   = 0x0,
+    MEM_CMD_MEMCPY   = 0x1,
+    MEM_CMD_MEMCPY2D = 0x2,
+};
+
+DEFINE_RSP_UCODE(rsp_mem);
+
+/** @brief Overlay ID of the registered overlay (0 if not initialized) */
+static uint32_t rspq_mem_overlay_id;
+
+void rspq_mem_init(void)
+{
+    if (rspq_mem_overlay_id)
+        return;
+
+    rspq_init();
+    rspq_mem_overlay_id = rspq_overlay_register(&rsp_mem);
+}
+
+void rspq_mem_close(void)
+{
+    if (!rspq_mem_overlay_id)
+        return;
+
+    rspq_overlay_unregister(rspq_mem_overlay_id);
+    rspq_mem_overlay_id = 0;
+}
+
+bool rspq_mem_is_initialized(void)
+{
+    return rspq_mem_overlay_id != 0;
+}
+
+/** @brief Returns true if the address is accessed via the CPU data cache */
+static inline bool is_cached(const void *ptr)
+{
+    return ((uint32_t)ptr & 0xE0000000) == 0x80000000;
+}
+
+static void rspq_mem_check(const void *ptr, uint32_t len, const char *func)
+{
+    assertf(rspq_mem_overlay_id, "%s: rspq_mem_init() must be called first", func);
+    assertf(((uint32_t)ptr & 7) == 0, "%s: address %p is not 8-byte aligned", func, ptr);
+    assertf((len & 7) == 0, "%s: length %lx is not a multiple of 8", func, len);
+}
+
+void rspq_memcpy(void *dst, const void *src, uint32_t len)
+{
+    rspq_mem_check(dst, len, __func__);
+    rspq_mem_check(src, len, __func__);
+
+    if (is_cached(src))
+        data_cache_hit_writeback(src, len);
+    if (is_cached(dst))
+        data_cache_hit_writeback_invalidate(dst, len);
+
+    uint32_t dst_addr = PhysicalAddr(dst);
+    uint32_t src_addr = PhysicalAddr(src);
+    while (len > 0) {
+        uint32_t n = MIN(len, MEM_MAX_CMD_LEN);
+        rspq_write(rspq_mem_overlay_id, MEM_CMD_MEMCPY, dst_addr, src_addr, n);
+        dst_addr += n;
+        src_addr += n;
+        len -= n;
+    }
+}
+
+void rspq_memset32(void *dst, uint32_t pattern, uint32_t len)
+{
+    rspq_mem_check(dst, len, __func__);
+
+    if (is_cached(dst))
+        data_cache_hit_writeback_invalidate(dst, len);
+
+    uint32_t dst_addr = PhysicalAddr(dst);
+    while (len > 0) {
+        uint32_t n = MIN(len, MEM_MAX_CMD_LEN);
+        rspq_write(rspq_mem_overlay_id, MEM_CMD_MEMSET, dst_addr, n, pattern);
+        dst_addr += n;
+        len -= n;
+    }
+}
+
+void rspq_memcpy2d(void *dst, uint32_t dst_pitch, const void *src, uint32_t src_pitch,
+    uint32_t width, uint32_t height)
+{
+    rspq_mem_check(dst, width, __func__);
+    rspq_mem_check(src, width, __func__);
+    assertf(((dst_pitch | src_pitch) & 7) == 0, "%s: pitch is not a multiple of 8", __func__);
+    assertf(width <= dst_pitch && width <= src_pitch, "%s: width %lx is larger than pitch", __func__, width);
+    assertf(dst_pitch < 0x10000 && src_pitch < 0x10000, "%s: pitch too large", __func__);
+
+    if (!width || !height)
+        return;
+
+    // The memory touched is the whole range between the first and the last line.
+    uint32_t dst_size = dst_pitch * (height-1) + width;
+    uint32_t src_size = src_pitch * (height-1) + width;
+    if (is_cached(src))
+        data_cache_hit_writeback(src, src_size);
+    if (is_cached(dst))
+        data_cache_hit_writeback_invalidate(dst, dst_size);
+
+    // Lines larger than the DMEM buffer are split into vertical strips. Then,
+    // split the strips in chunks of lines so that each command does not
+    // exceed the maximum length.
+    uint32_t max_lines = MEM_MAX_CMD_LEN / MIN(width, MEM_BUFFER_SIZE);
+    for (uint32_t x = 0; x < width; x += MEM_BUFFER_SIZE) {
+        uint32_t w = MIN(width - x, MEM_BUFFER_SIZE);
+        uint32_t dst_addr = PhysicalAddr(dst) + x;
+        uint32_t src_addr = PhysicalAddr(src) + x;
+
+        // The RSP DMA skips at most 4095 bytes between lines (12-bit field).
+        // With larger gaps, issue one command per line: the skip is then unused.
+        uint32_t strip_lines = max_lines;
+        if (dst_pitch - w >= DMA_MAX_SKIP || src_pitch - w >= DMA_MAX_SKIP)
+            strip_lines = 1;
+
+        for (uint32_t y = 0; y < height; y += strip_lines) {
+            uint32_t h = MIN(height - y, strip_lines);
+            rspq_write(rspq_mem_overlay_id, MEM_CMD_MEMCPY2D, dst_addr, src_addr,
+                (dst_pitch << 16) | src_pitch, (w << 16) | h);
+            dst_addr += dst_pitch * h;
+            src_addr += src_pitch * h;
+        }
+    }
+}
@@ -88,3 +88,314 @@ void test_dfs_rom_addr(TestContext *ctx) {
 
 	ASSERT_EQUAL_MEM(buf1, buf2, 128, "DMA ROM access is different");
 }
+
+void test_dfs_path_table(TestContext *ctx) {
+	uint32_t rom = dfs_rom_addr("counter.dat");
+	ASSERT(rom != 0, "counter.dat not found by dfs_rom_addr");
+
+	// All spellings of the same path must resolve to the same file,
+	// whether they go through the path table or the directory walk.
+	const char *paths[] = { "/counter.dat", "./counter.dat", "//counter.dat", "/./counter.dat", "../counter.dat" };
+	for (int i=0;i<sizeof(paths)/sizeof(paths[0]);i++) {
+		ASSERT_EQUAL_HEX(dfs_rom_addr(paths[i]), rom, "wrong file for path %s", paths[i]);
+
+		int fh = dfs_open(paths[i]);
+		ASSERT(fh >= 0, "%s not found", paths[i]);
+		int size = dfs_size(fh);
+		dfs_close(fh);
+		ASSERT_EQUAL_SIGNED(size, 4096, "wrong size for path %s", paths[i]);
+	}
+
+	ASSERT_EQUAL_SIGNED(dfs_open("nonexisting.dat"), DFS_ENOFILE, "nonexisting file was opened");
+	ASSERT_EQUAL_SIGNED(dfs_open("counter.dat/counter.dat"), DFS_ENOFILE, "file used as directory");
+	ASSERT(dfs_rom_addr("/nonexisting.dat") == 0, "nonexisting file was found");
+}
+
+void test_dfs_read_sequential(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	// Stream the whole file with small odd-sized reads, so that the
+	// block cache is continuously recycled.
+	uint8_t buf[64] __attribute__((aligned(16)));
+	int pos = 0;
+	while (pos < 4096) {
+		int sz = 1 + RANDN(63);
+		int n = dfs_read(buf+1, 1, sz, fh);
+		ASSERT_EQUAL_SIGNED(n, sz < 4096-pos ? sz : 4096-pos, "short read at %d", pos);
+		for (int i=0;i<n;i++)
+			ASSERT_EQUAL_HEX(buf[1+i], (pos+i) & 0xFF, "invalid data at %d", pos+i);
+		pos += n;
+	}
+	ASSERT(dfs_eof(fh), "eof not reached");
+}
+
+void test_dfs_read_async(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	static uint8_t buf[2][1024] __attribute__((aligned(16)));
+
+	// Double-buffered streaming: check each chunk while the next one loads.
+	ASSERT_EQUAL_SIGNED(dfs_read_async(buf[0], 1, 1024, fh), 1024, "invalid async read size");
+	for (int chunk=0; chunk<4; chunk++) {
+		ASSERT_EQUAL_SIGNED(dfs_read_wait(fh), DFS_ESUCCESS, "async read wait failed");
+		ASSERT_EQUAL_SIGNED(dfs_read_poll(fh), 1, "async read not finished after wait");
+		if (chunk < 3)
+			ASSERT_EQUAL_SIGNED(dfs_read_async(buf[(chunk+1)&1], 1, 1024, fh), 1024, "invalid async read size");
+		for (int i=0;i<1024;i++)
+			ASSERT_EQUAL_HEX(buf[chunk&1][i], i & 0xFF, "invalid data in chunk %d at %d", chunk, i);
+	}
+
+	ASSERT_EQUAL_SIGNED(dfs_read_async(buf[0], 1, 16, fh), 0, "read past the end of file");
+
+	// Misaligned async reads are completed synchronously
+	dfs_seek(fh, 3, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(dfs_read_async(buf[0]+1, 1, 16, fh), 16, "invalid misaligned async read size");
+	ASSERT_EQUAL_SIGNED(dfs_read_poll(fh), 1, "misaligned async read not completed");
+	ASSERT_EQUAL_MEM(buf[0]+1, (uint8_t*)"\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12", 16, "invalid misaligned async read");
+}
+
+void test_dfs_compressed(TestContext *ctx) {
+	// compressed.dat is stored compressed by mkdfs (see tests/Makefile).
+	// Byte i of the decompressed file is (i >> 4) & 0xFF.
+	ASSERT(dfs_rom_addr("compressed.dat") == 0, "compressed file has a ROM address");
+
+	int fh = dfs_open("compressed.dat");
+	ASSERT(fh >= 0, "compressed.dat not found");
+	DEFER(dfs_close(fh));
+	ASSERT_EQUAL_SIGNED(dfs_size(fh), 20000, "invalid decompressed size");
+
+	uint8_t buf[512];
+	int pos = 0;
+	while (pos < 20000) {
+		int n = dfs_read(buf, 1, sizeof(buf), fh);
+		ASSERT(n > 0, "short read at %d", pos);
+		for (int i=0;i<n;i++)
+			ASSERT_EQUAL_HEX(buf[i], ((pos+i) >> 4) & 0xFF, "invalid data at %d", pos+i);
+		pos += n;
+	}
+	ASSERT(dfs_eof(fh), "eof not reached");
+
+	// Seeking backward restarts decompression, seeking forward skips data
+	const int offsets[] = { 1000, 16, 15000, 14999, 0 };
+	for (int j=0; j<sizeof(offsets)/sizeof(offsets[0]); j++) {
+		dfs_seek(fh, offsets[j], SEEK_SET);
+		ASSERT_EQUAL_SIGNED(dfs_read(buf, 1, 100, fh), 100, "short read at %d", offsets[j]);
+		for (int i=0;i<100;i++)
+			ASSERT_EQUAL_HEX(buf[i], ((offsets[j]+i) >> 4) & 0xFF, "invalid data at %d", offsets[j]+i);
+	}
+
+	// Compression is transparent through stdio too
+	FILE *f = fopen("rom:/compressed.dat", "rb");
+	ASSERT(f, "rom:/compressed.dat not found");
+	DEFER(fclose(f));
+	fseek(f, 4096, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(fread(buf, 1, 32, f), 32, "short fread");
+	for (int i=0;i<32;i++)
+		ASSERT_EQUAL_HEX(buf[i], ((4096+i) >> 4) & 0xFF, "invalid data at %d", 4096+i);
+}
+
+void test_dfs_trace(TestContext *ctx) {
+	ASSERT_EQUAL_SIGNED(dfs_trace_start(6), DFS_ESUCCESS, "cannot start trace");
+	DEFER(dfs_trace_stop());
+
+	uint8_t buf[16];
+	int fh = dfs_open("/./counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	dfs_read(buf, 1, 16, fh);
+	dfs_read(buf, 1, 16, fh);
+	dfs_close(fh);
+
+	// Relative paths are resolved against the current directory
+	ASSERT_EQUAL_SIGNED(dfs_chdir("sub"), DFS_ESUCCESS, "cannot change directory");
+	DEFER(dfs_chdir("/"));
+	fh = dfs_open("../sub/./hello.txt");
+	ASSERT(fh >= 0, "sub/hello.txt not found");
+	dfs_read(buf, 1, 4, fh);
+	dfs_close(fh);
+	dfs_chdir("/");
+
+	// Events past the maximum are dropped
+	fh = dfs_open("counter.dat");
+	dfs_read(buf, 1, 16, fh);
+	dfs_close(fh);
+
+	ASSERT_EQUAL_SIGNED(dfs_trace_stop(), 6, "invalid number of events");
+
+	const struct { int type; const char *path; uint32_t offset, len; } expected[] = {
+		{ DFS_TRACE_OPEN, "counter.dat",   0,  0 },
+		{ DFS_TRACE_READ, "counter.dat",   0,  16 },
+		{ DFS_TRACE_READ, "counter.dat",   16, 16 },
+		{ DFS_TRACE_OPEN, "sub/hello.txt", 0,  0 },
+		{ DFS_TRACE_READ, "sub/hello.txt", 0,  4 },
+		{ DFS_TRACE_OPEN, "counter.dat",   0,  0 },
+	};
+	const char *paths[6];
+	for (int i=0; i<6; i++) {
+		uint32_t offset, len;
+		ASSERT_EQUAL_SIGNED(dfs_trace_get(i, &paths[i], &offset, &len), expected[i].type, "invalid type of event %d", i);
+		ASSERT(strcmp(paths[i], expected[i].path) == 0, "invalid path of event %d: %s", i, paths[i]);
+		ASSERT_EQUAL_UNSIGNED(offset, expected[i].offset, "invalid offset of event %d", i);
+		ASSERT_EQUAL_UNSIGNED(len, expected[i].len, "invalid length of event %d", i);
+	}
+	ASSERT(paths[0] == paths[5], "the same file was recorded with two paths");
+	ASSERT_EQUAL_SIGNED(dfs_trace_get(6, NULL, NULL, NULL), DFS_EBADINPUT, "event past the end");
+}
+
+static volatile int batch_callbacks;
+static void batch_callback(void *ctx) {
+	batch_callbacks += (int)ctx;
+}
+
+void test_dfs_load_batch(TestContext *ctx) {
+	static uint8_t counter[4096] __attribute__((aligned(16)));
+	static uint8_t random[8192+8] __attribute__((aligned(16)));
+	static uint8_t random_ref[8192];
+	static uint8_t compressed[20000];
+	static uint8_t small[16];
+
+	int fh = dfs_open("random.dat");
+	ASSERT(fh >= 0, "random.dat not found");
+	dfs_read(random_ref, 1, sizeof(random_ref), fh);
+	dfs_close(fh);
+
+	dfs_load_t loads[] = {
+		{ .path = "random.dat", .buf = random+2, .size = 8192 },
+		{ .path = "/compressed.dat", .buf = compressed, .size = sizeof(compressed) },
+		{ .path = "nonexisting.dat", .buf = small, .size = sizeof(small) },
+		{ .path = "counter.dat", .buf = counter, .size = sizeof(counter) },
+		{ .path = "counter.dat", .buf = small, .size = sizeof(small) },
+	};
+	dfs_batch_t batch;
+
+	batch_callbacks = 0;
+	ASSERT_EQUAL_SIGNED(dfs_load_batch(&batch, loads, 5, batch_callback, (void*)1), 3, "invalid number of loads");
+	dfs_load_batch_wait(&batch);
+	ASSERT(dfs_load_batch_done(&batch), "batch not finished after wait");
+	ASSERT_EQUAL_SIGNED(batch_callbacks, 1, "callback not called exactly once");
+
+	ASSERT_EQUAL_SIGNED(loads[0].size, 8192, "invalid size of random.dat");
+	ASSERT_EQUAL_SIGNED(loads[1].size, 20000, "invalid size of compressed.dat");
+	ASSERT_EQUAL_SIGNED(loads[2].size, DFS_ENOFILE, "nonexisting file loaded");
+	ASSERT_EQUAL_SIGNED(loads[3].size, 4096, "invalid size of counter.dat");
+	ASSERT_EQUAL_SIGNED(loads[4].size, DFS_ENOMEM, "file loaded into a small buffer");
+
+	ASSERT_EQUAL_MEM(random+2, random_ref, 8192, "invalid data in random.dat");
+	for (int i=0;i<4096;i++)
+		ASSERT_EQUAL_HEX(counter[i], i & 0xFF, "invalid data in counter.dat at %d", i);
+	for (int i=0;i<20000;i++)
+		ASSERT_EQUAL_HEX(compressed[i], (i >> 4) & 0xFF, "invalid data in compressed.dat at %d", i);
+
+	// An empty batch finishes immediately
+	ASSERT_EQUAL_SIGNED(dfs_load_batch(&batch, NULL, 0, batch_callback, (void*)1), 0, "invalid empty batch");
+	ASSERT_EQUAL_SIGNED(batch_callbacks, 2, "callback not called for empty batch");
+
+	// Compressed files are loaded even when all the file handles are in use
+	int fhs[16], num_fh = 0;
+	while (num_fh < 16 && (fhs[num_fh] = dfs_open("counter.dat")) >= 0)
+		num_fh++;
+	memset(compressed, 0, sizeof(compressed));
+	dfs_load_t cload = { .path = "compressed.dat", .buf = compressed, .size = sizeof(compressed) };
+	int ret = dfs_load_batch(&batch, &cload, 1, NULL, NULL);
+	dfs_load_batch_wait(&batch);
+	for (int i=0;i<num_fh;i++)
+		dfs_close(fhs[i]);
+	ASSERT_EQUAL_SIGNED(ret, 1, "compressed file not loaded with all handles in use");
+	ASSERT_EQUAL_SIGNED(cload.size, 20000, "invalid size of compressed.dat with all handles in use");
+	for (int i=0;i<20000;i++)
+		ASSERT_EQUAL_HEX(compressed[i], (i >> 4) & 0xFF, "invalid data in compressed.dat at %d", i);
+}
+
+void test_dfs_mmap(TestContext *ctx) {
+	int size = 0;
+	const uint8_t *map = dfs_mmap("counter.dat", &size);
+	ASSERT(map, "counter.dat not mapped");
+	ASSERT_EQUAL_SIGNED(size, 4096, "invalid size");
+	ASSERT_EQUAL_HEX((uint32_t)map, dfs_rom_addr("counter.dat"), "invalid mapping address");
+	ASSERT(dfs_mmap("compressed.dat", NULL) == NULL, "compressed file mapped");
+	ASSERT(dfs_mmap("nonexisting.dat", NULL) == NULL, "nonexisting file mapped");
+
+	// Random reads of small records, also crossing pages
+	uint8_t buf[37];
+	for (int j=0; j<64; j++) {
+		int off = RANDN(4096 - sizeof(buf));
+		ASSERT_EQUAL_SIGNED(dfs_mmap_read(map + off, buf, sizeof(buf)), sizeof(buf), "short read");
+		for (int i=0;i<sizeof(buf);i++)
+			ASSERT_EQUAL_HEX(buf[i], (off+i) & 0xFF, "invalid data at %d", off+i);
+	}
+
+	const uint8_t *rec = dfs_mmap_ptr(map + 1024 + 8, 16);
+	ASSERT(rec, "cannot access record");
+	for (int i=0;i<16;i++)
+		ASSERT_EQUAL_HEX(rec[i], (8+i) & 0xFF, "invalid record data at %d", i);
+}
+
+void test_dfs_cache(TestContext *ctx) {
+	ASSERT_EQUAL_SIGNED(dfs_cache_config(1, 1024), DFS_EBADINPUT, "too few blocks accepted");
+	ASSERT_EQUAL_SIGNED(dfs_cache_config(16, 1000), DFS_EBADINPUT, "invalid block size accepted");
+	ASSERT_EQUAL_SIGNED(dfs_cache_config(16, 128), DFS_EBADINPUT, "too small block size accepted");
+
+	// Start from an empty cache
+	ASSERT_EQUAL_SIGNED(dfs_cache_config(16, 1024), DFS_ESUCCESS, "cannot configure cache");
+
+	int fh1 = dfs_open("counter.dat");
+	ASSERT(fh1 >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh1));
+	int fh2 = dfs_open("counter.dat");
+	ASSERT(fh2 >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh2));
+
+	dfs_cache_stats_t stats;
+	uint8_t buf[13];
+
+	// The first small read misses, the same data through another handle hits
+	dfs_cache_reset_stats();
+	dfs_seek(fh1, 100, SEEK_SET);
+	dfs_read(buf, 1, sizeof(buf), fh1);
+	dfs_cache_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, 1, "invalid number of misses");
+	ASSERT_EQUAL_UNSIGNED(stats.hits, 0, "invalid number of hits");
+
+	dfs_seek(fh2, 200, SEEK_SET);
+	dfs_read(buf, 1, sizeof(buf), fh2);
+	dfs_cache_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, 1, "read from another handle missed");
+	ASSERT_EQUAL_UNSIGNED(stats.hits, 1, "read from another handle did not hit");
+	for (int i=0;i<sizeof(buf);i++)
+		ASSERT_EQUAL_HEX(buf[i], (200+i) & 0xFF, "invalid data at %d", 200+i);
+
+	// Memory-mapped accesses share the same cache. The file is only sector
+	// aligned, so pick a record that is still within the block read above.
+	const uint8_t *map = dfs_mmap("counter.dat", NULL);
+	int blk_end = 200 + 1024 - ((uint32_t)(map + 200) & 1023);
+	int off = blk_end - 16 < 300 ? blk_end - 16 : 300;
+	dfs_cache_reset_stats();
+	const uint8_t *rec = dfs_mmap_ptr(map + off, 16);
+	dfs_cache_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.hits, 1, "mapped access did not hit");
+	ASSERT_EQUAL_HEX(rec[0], off & 0xFF, "invalid mapped data");
+
+	// Directory lookups go through the cache too
+	char name[MAX_FILENAME_LEN+1];
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "findfirst failed");
+	dfs_cache_get_stats(&stats);
+	uint32_t misses = stats.misses;
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "findfirst failed");
+	dfs_cache_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, misses, "repeated directory lookup missed");
+
+	// A tiny cache must still return correct data, even with many misses
+	ASSERT_EQUAL_SIGNED(dfs_cache_config(2, 256), DFS_ESUCCESS, "cannot configure cache");
+	DEFER(dfs_cache_config(16, 1024));
+	for (int j=0; j<64; j++) {
+		int fh = (j & 1) ? fh1 : fh2;
+		int off = RANDN(4096 - sizeof(buf));
+		dfs_seek(fh, off, SEEK_SET);
+		ASSERT_EQUAL_SIGNED(dfs_read(buf+1, 1, sizeof(buf)-1, fh), sizeof(buf)-1, "short read");
+		for (int i=0;i<sizeof(buf)-1;i++)
+			ASSERT_EQUAL_HEX(buf[i+1], (off+i) & 0xFF, "invalid data at %d", off+i);
+	}
+}
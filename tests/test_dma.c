@@ -27,3 +27,53 @@ void test_dma_read_misalign(TestContext *ctx) {
 		}
 	}
 }
+
+void test_dma_read_queued(TestContext *ctx) {
+	uint32_t rom = dfs_rom_addr("random.dat");
+	ASSERT(rom != 0, "random.dat not found");
+
+	static uint8_t rom_copy[8192] __attribute__((aligned(16)));
+	static uint8_t big[8192] __attribute__((aligned(16)));
+	static uint8_t small[2][64] __attribute__((aligned(16)));
+
+	data_cache_hit_writeback_invalidate(rom_copy, sizeof(rom_copy));
+	dma_read(rom_copy, rom, sizeof(rom_copy));
+
+	// Record the order of completion through the callbacks
+	volatile int order[4]; volatile int norder = 0;
+	void done(void *ctx) { order[norder++] = (int)ctx; }
+
+	memset(big, 0xAA, sizeof(big));
+	memset(small, 0xAA, sizeof(small));
+	data_cache_hit_writeback_invalidate(big, sizeof(big));
+	data_cache_hit_writeback_invalidate(small, sizeof(small));
+
+	// Queue with interrupts disabled so that everything is queued before
+	// the first chunk completes.
+	dma_request_t req[4] = {0};
+	disable_interrupts();
+	dma_read_queued(&req[0], big, rom, 4096, DMA_PRIORITY_LOW, done, (void*)0);
+	dma_read_queued(&req[1], big+4096, rom+4096, 4096, DMA_PRIORITY_LOW, done, (void*)1);
+	dma_read_queued(&req[2], small[0]+1, rom+1, 33, DMA_PRIORITY_NORMAL, done, (void*)2);
+	dma_read_queued(&req[3], small[1], rom+64, 64, DMA_PRIORITY_HIGH, done, (void*)3);
+	enable_interrupts();
+
+	for (int i=0;i<4;i++)
+		dma_request_wait(&req[i]);
+	for (int i=0;i<4;i++)
+		ASSERT(dma_request_done(&req[i]), "request %d not done", i);
+
+	// The first request was started immediately as the queue was idle;
+	// the others must follow priority order.
+	ASSERT_EQUAL_SIGNED(norder, 4, "wrong number of callbacks");
+	ASSERT_EQUAL_SIGNED(order[0], 0, "wrong completion order");
+	ASSERT_EQUAL_SIGNED(order[1], 3, "wrong completion order");
+	ASSERT_EQUAL_SIGNED(order[2], 2, "wrong completion order");
+	ASSERT_EQUAL_SIGNED(order[3], 1, "wrong completion order");
+
+	ASSERT_EQUAL_MEM(big, rom_copy, sizeof(big), "invalid data in big transfer");
+	ASSERT_EQUAL_MEM(small[0]+1, rom_copy+1, 33, "invalid data in misaligned transfer");
+	ASSERT_EQUAL_HEX(small[0][0], 0xAA, "misaligned transfer underflow");
+	ASSERT_EQUAL_HEX(small[0][34], 0xAA, "misaligned transfer overflow");
+	ASSERT_EQUAL_MEM(small[1], rom_copy+64, 64, "invalid data in high priority transfer");
+}
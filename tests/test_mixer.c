@@ -0,0 +1,194 @@
+// The tests in this file render tone_vadpcm.wav64 (see test_wav64.c) through
+// the mixer, with the same settings as an audiorender64 command line, and
+// compare the checksum of the output with the one printed by audiorender64,
+// which runs the C reference of the ucode (tools/audiorender64/rsp_ref.c).
+//
+// The actual output frequency depends on the DAC clock of the console, while
+// audiorender64 uses exactly the requested one: so the settings are given in
+// a way that does not depend on it (eg: playback frequencies are relative to
+// the output frequency).
+
+// FNV-1a hash of stereo samples, as computed by audiorender64
+static uint32_t mix_checksum(uint32_t h, const int16_t *samples, int nsamples) {
+	for (int i=0; i<nsamples*2; i++) {
+		h = (h ^ (samples[i] & 0xFF)) * 0x01000193;
+		h = (h ^ ((uint16_t)samples[i] >> 8)) * 0x01000193;
+	}
+	return h;
+}
+
+// Run the mixer for the specified number of samples, polling 1024 samples
+// at a time like audiorender64, and return the checksum of the output.
+static uint32_t mix_render(int nsamples) {
+	int16_t *buf = malloc_uncached(1024 * 4);
+	uint32_t h = 0x811c9dc5;
+	for (int pos=0; pos<nsamples; pos+=1024) {
+		int n = nsamples-pos < 1024 ? nsamples-pos : 1024;
+		mixer_poll(buf, n);
+		h = mix_checksum(h, buf, n);
+	}
+	free_uncached(buf);
+	return h;
+}
+
+void test_mixer_fx(TestContext *ctx) {
+	TEST_RSPQ_PROLOG();
+	audio_init(32000, 4);
+	DEFER(audio_close());
+	mixer_init(32);
+	DEFER(mixer_close());
+	int rate = audio_get_frequency();
+
+	// audiorender64 -r 32000 -t 0.25 --filter lowpass:2000 --echo 0.1 tone_vadpcm.wav64
+	// The biquad is given with the 2.14 coefficients computed by
+	// mixer_ch_set_filter for a 2000 Hz lowpass at 32 kHz.
+	for (int ch=0; ch<31; ch++) {
+		mixer_ch_set_biquad(ch, 491/16384.0f, 982/16384.0f, 491/16384.0f,
+			-23826/16384.0f, 9405/16384.0f);
+		mixer_ch_set_send(ch, 0.5f);
+	}
+	// A delay line of 3200 samples (rounded up to a multiple of 4)
+	mixer_ch_play_delay(31, 3198.0f / rate);
+	mixer_ch_set_vol(31, 0.5f, 0.5f);
+	mixer_ch_set_send(31, 0.4f);
+
+	wav64_t wav;
+	wav64_open(&wav, "rom:/tone_vadpcm.wav64");
+	DEFER(wav64_close(&wav));
+	wav64_play(&wav, 0);
+	mixer_ch_set_freq(0, rate);
+
+	uint32_t h = mix_render(8000);
+	ASSERT_EQUAL_HEX(h, 0xe8fd2f39, "mix with filter and echo differs from rsp_ref");
+}
+
+// tone_mono.wav64: 4096 mono samples at 32 kHz (a sawtooth with a period of
+// 50 samples), uncompressed, looping from sample 1024.
+//
+// Render it with the specified interpolation, like audiorender64 -r 44100,
+// and return the checksum of the output. If rspq is built with RSPQ_PROFILE,
+// also return the RSP cycles spent by the mixer.
+static uint32_t mix_interp(mixer_interp_t interp, int nsamples, uint64_t *cycles) {
+	int rate = audio_get_frequency();
+	mixer_init(32);
+	for (int ch=0; ch<32; ch++)
+		mixer_ch_set_interp(ch, interp);
+
+	wav64_t wav;
+	wav64_open(&wav, "rom:/tone_mono.wav64");
+	wav64_play(&wav, 0);
+	mixer_ch_set_freq(0, rate * (32000.0f / 44100.0f));
+
+	rspq_profile_reset();
+	uint32_t h = mix_render(nsamples);
+	rspq_wait();
+
+	// Only the mixer overlay runs during the render (the waveform is
+	// uncompressed), so all the overlay commands are accounted to it.
+	rspq_profile_data_t data;
+	rspq_profile_get_data(&data);
+	*cycles = 0;
+	for (int id=1; id<16; id++)
+		for (int cmd=0; cmd<16; cmd++)
+			*cycles += data.slots[id][cmd].cycles;
+
+	wav64_close(&wav);
+	mixer_close();
+	return h;
+}
+
+void test_mixer_interp(TestContext *ctx) {
+	TEST_RSPQ_PROLOG();
+	audio_init(44100, 4);
+	DEFER(audio_close());
+
+	// audiorender64 -r 44100 -t 0.2 --interp <mode> tone_mono.wav64
+	static const struct { const char *name; uint32_t checksum; } modes[] = {
+		[MIXER_INTERP_NONE] =   { "none",   0x781b1475 },
+		[MIXER_INTERP_LINEAR] = { "linear", 0xbf3ea161 },
+		[MIXER_INTERP_CUBIC] =  { "cubic",  0x31ab18b1 },
+		[MIXER_INTERP_SINC] =   { "sinc",   0xbd3dbc45 },
+	};
+	const int nsamples = 8820;
+	uint64_t base_cycles = 0;
+
+	for (int i=0; i<4; i++) {
+		uint64_t cycles;
+		uint32_t h = mix_interp(i, nsamples, &cycles);
+		ASSERT_EQUAL_HEX(h, modes[i].checksum, "interpolation %s differs from rsp_ref", modes[i].name);
+
+		// Log the cost of each mode, to keep the documentation of
+		// mixer_ch_set_interp up to date.
+		if (RSPQ_PROFILE) {
+			if (i == MIXER_INTERP_NONE)
+				base_cycles = cycles;
+			debugf("mixer interpolation %s: %.1f RSP cycles per sample (%+.1f over none)\n",
+				modes[i].name, (float)cycles / nsamples, ((float)cycles - base_cycles) / nsamples);
+		}
+	}
+}
+
+// Play tone_vadpcm.wav64 (with effects, to exercise all the stages of the
+// mix) and render 4 buffers of 1024 samples, either with mixer_poll or with
+// mixer_poll_async. For the latter, count the buffers for which
+// mixer_poll_done reported the mix as running right after starting it, and
+// then as finished (within 100 ms).
+static void mix_async_render(int16_t *out, bool async, int *running, int *finished) {
+	int rate = audio_get_frequency();
+	mixer_init(32);
+	for (int ch=0; ch<31; ch++) {
+		mixer_ch_set_filter(ch, MIXER_FILTER_LOWPASS, 2000, 0.707f);
+		mixer_ch_set_send(ch, 0.5f);
+	}
+	mixer_ch_play_delay(31, 0.1f);
+	mixer_ch_set_send(31, 0.4f);
+
+	wav64_t wav;
+	wav64_open(&wav, "rom:/tone_vadpcm.wav64");
+	wav64_play(&wav, 0);
+	mixer_ch_set_freq(0, rate * 0.75f);
+
+	*running = *finished = 0;
+	for (int i=0; i<4; i++) {
+		int16_t *buf = out + i*1024*2;
+		if (!async) {
+			mixer_poll(buf, 1024);
+			continue;
+		}
+
+		mixer_poll_async(buf, 1024);
+		if (!mixer_poll_done())
+			(*running)++;
+		uint32_t t0 = TICKS_READ();
+		while (TICKS_DISTANCE(t0, TICKS_READ()) < TICKS_FROM_MS(100)) {
+			if (mixer_poll_done()) {
+				(*finished)++;
+				break;
+			}
+		}
+		mixer_wait();
+	}
+
+	wav64_close(&wav);
+	mixer_close();
+}
+
+void test_mixer_async(TestContext *ctx) {
+	TEST_RSPQ_PROLOG();
+	audio_init(44100, 4);
+	DEFER(audio_close());
+
+	int16_t *sync_out = malloc_uncached(4*1024*4);
+	DEFER(free_uncached(sync_out));
+	int16_t *async_out = malloc_uncached(4*1024*4);
+	DEFER(free_uncached(async_out));
+	memset(async_out, 0, 4*1024*4);
+
+	int running, finished;
+	mix_async_render(sync_out, false, &running, &finished);
+	mix_async_render(async_out, true, &running, &finished);
+
+	ASSERT_EQUAL_SIGNED(running, 4, "mixer_poll_done did not report the mix as running");
+	ASSERT_EQUAL_SIGNED(finished, 4, "mixer_poll_done did not report the end of the mix");
+	ASSERT_EQUAL_MEM((uint8_t*)async_out, (uint8_t*)sync_out, 4*1024*4, "asynchronous mix differs from mixer_poll");
+}
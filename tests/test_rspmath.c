@@ -0,0 +1,87 @@
+#include <malloc.h>
+#include <string.h>
+
+#include <rspq.h>
+#include <rspmath.h>
+
+void test_rspmath(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    rspmath_init();
+    DEFER(rspmath_close());
+
+    // Use a count that spans multiple commands and multiple DMEM chunks,
+    // with a final partial chunk.
+    const int count = 300 + 5;
+    rspmath_vec4x2_t *in = memalign(16, count * sizeof(rspmath_vec4x2_t));
+    DEFER(free(in));
+    rspmath_vec4x2_t *in2 = memalign(16, count * sizeof(rspmath_vec4x2_t));
+    DEFER(free(in2));
+    rspmath_vec4x2_t *out = memalign(16, count * sizeof(rspmath_vec4x2_t));
+    DEFER(free(out));
+    rspmath_vec4x2_t *expected = memalign(16, count * sizeof(rspmath_vec4x2_t));
+    DEFER(free(expected));
+
+    // Random vectors with components in [-8, 8)
+    rand_state = 0x12345678;
+    for (int i=0; i<count; i++) {
+        for (int j=0; j<8; j++) {
+            rspmath_vec4x2_set(&in[i], j, (rand() & 0xFFFFF) - 0x80000);
+            rspmath_vec4x2_set(&in2[i], j, (rand() & 0xFFFFF) - 0x80000);
+        }
+    }
+
+    rspmath_mat4_t mtx;
+    const float m[4][4] = {
+        {  0.5f,   1.25f, -2.0f,  0.0f },
+        { -1.0f,   0.75f,  3.5f,  0.0f },
+        {  2.25f, -0.5f,   1.0f,  0.0f },
+        { 10.0f,  -4.0f,   7.5f,  1.0f },
+    };
+    rspmath_mat4_from_floats(&mtx, m);
+
+    // transform
+    memset(out, 0xAA, count * sizeof(rspmath_vec4x2_t));
+    rspmath_mat4_transform(out, &mtx, in, count);
+    rspq_wait();
+    rspmath_mat4_transform_cpu(expected, &mtx, in, count);
+    for (int i=0; i<count; i++)
+        ASSERT_EQUAL_MEM((uint8_t*)&out[i], (uint8_t*)&expected[i], sizeof(rspmath_vec4x2_t),
+            "transform: invalid result at index %d", i);
+
+    // mat4 mul (in-place)
+    int num_mtx = count / 2;
+    memcpy(out, in, num_mtx * sizeof(rspmath_mat4_t));
+    rspmath_mat4_mul((rspmath_mat4_t*)out, &mtx, (rspmath_mat4_t*)out, num_mtx);
+    rspq_wait();
+    rspmath_mat4_mul_cpu((rspmath_mat4_t*)expected, &mtx, (rspmath_mat4_t*)in, num_mtx);
+    ASSERT_EQUAL_MEM((uint8_t*)out, (uint8_t*)expected, num_mtx * sizeof(rspmath_mat4_t),
+        "mat4 mul: invalid result");
+
+    // dot
+    rspmath_vec4_dot(out, in, in2, count);
+    rspq_wait();
+    rspmath_vec4_dot_cpu(expected, in, in2, count);
+    for (int i=0; i<count; i++)
+        ASSERT_EQUAL_MEM((uint8_t*)&out[i], (uint8_t*)&expected[i], sizeof(rspmath_vec4x2_t),
+            "dot: invalid result at index %d", i);
+
+    // normalize: RSP uses an approximated reciprocal square root, so
+    // allow for a small error. Also check that null vectors are preserved.
+    memset(&in[0], 0, sizeof(rspmath_vec4x2_t));
+    rspmath_vec4_normalize(out, in, count);
+    rspq_wait();
+    rspmath_vec4_normalize_cpu(expected, in, count);
+    for (int i=0; i<count; i++) {
+        for (int j=0; j<8; j++) {
+            int32_t v = rspmath_vec4x2_get(&out[i], j);
+            int32_t e = rspmath_vec4x2_get(&expected[i], j);
+            ASSERT(v - e <= 0x80 && e - v <= 0x80, "normalize: invalid result at index %d:%d (%08lx != %08lx)",
+                i, j, v, e);
+        }
+    }
+    for (int j=0; j<8; j++)
+        ASSERT_EQUAL_SIGNED(rspmath_vec4x2_get(&out[0], j), 0, "normalize: null vector changed");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
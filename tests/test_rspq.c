@@ -3,6 +3,7 @@
 
 #include <rspq.h>
 #include <rspq_constants.h>
+#include <rspq_mem.h>
 
 #define ASSERT_GP_BACKWARD           0xF001   // Also defined in rsp_test.S
 
@@ -183,6 +184,58 @@ void test_rspq_wrap(TestContext *ctx)
     TEST_RSPQ_EPILOG(0, rspq_timeout);
 }
 
+void test_rspq_wrap_fixed(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+
+    // A non-elastic double-buffered ring must still work
+    rspq_set_lowpri_buffers(2, 2);
+
+    uint32_t block_count = RSPQ_DRAM_LOWPRI_BUFFER_SIZE * 8;
+    for (uint32_t i = 0; i < block_count; i++)
+        rspq_noop();
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+    ASSERT_EQUAL_SIGNED(rspq_get_lowpri_buffers(), 2, "ring size changed");
+}
+
+void test_rspq_elastic_ring(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    ASSERT_EQUAL_SIGNED(rspq_get_lowpri_buffers(), RSPQ_LOWPRI_MIN_BUFFERS, "invalid initial ring size");
+
+    // Write slow commands much faster than the RSP can execute them:
+    // the ring must grow instead of blocking.
+    uint32_t count = RSPQ_DRAM_LOWPRI_BUFFER_SIZE * RSPQ_LOWPRI_MAX_BUFFERS / 4;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        rspq_test_8(1);
+        rspq_test_wait(0x400);
+    }
+    ASSERT(rspq_get_lowpri_buffers() > RSPQ_LOWPRI_MIN_BUFFERS, "ring did not grow");
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, count, "Sum is incorrect!");
+
+    // Once the RSP has caught up, going through the ring shrinks it back.
+    for (int i = 0; i < RSPQ_LOWPRI_MAX_BUFFERS * 2; i++)
+    {
+        for (uint32_t j = 0; j < RSPQ_DRAM_LOWPRI_BUFFER_SIZE; j++)
+            rspq_noop();
+        rspq_wait();
+    }
+    ASSERT_EQUAL_SIGNED(rspq_get_lowpri_buffers(), RSPQ_LOWPRI_MIN_BUFFERS, "ring did not shrink");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_signal(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -405,6 +458,252 @@ void test_rspq_wait(TestContext *ctx)
     ASSERT_EQUAL_UNSIGNED(*actual_sum, 100, "Sum is incorrect!");
 }
 
+static void wait_callback(void *ctx)
+{
+    (*(int*)ctx)++;
+}
+
+void test_rspq_wait_callback(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    int calls = 0;
+    rspq_set_wait_callback(wait_callback, &calls);
+    DEFER(rspq_set_wait_callback(NULL, NULL));
+    rspq_reset_wait_stats();
+
+    // Fill the queue with slow commands, so that the CPU also has to wait
+    // for buffers to be executed while writing (use a fixed ring, so that
+    // it cannot grow instead).
+    rspq_set_lowpri_buffers(2, 2);
+    for (uint32_t i = 0; i < RSPQ_DRAM_LOWPRI_BUFFER_SIZE; i++)
+    {
+        rspq_test_8(1);
+        rspq_test_wait(0x100);
+    }
+    rspq_wait();
+
+    ASSERT(calls > 0, "wait callback was never called");
+
+    rspq_wait_stats_t stats;
+    rspq_get_wait_stats(&stats);
+    ASSERT(stats.waits > 1, "buffer switches did not wait (%ld waits)", stats.waits);
+    ASSERT(stats.idle_ticks > 0, "no time spent in the wait callback");
+    ASSERT(stats.idle_ticks <= stats.wait_ticks, "idle time is larger than wait time");
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, RSPQ_DRAM_LOWPRI_BUFFER_SIZE, "Sum is incorrect!");
+}
+
+void test_rspq_fence(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_fence_t *cpu_fence = rspq_fence_new();
+    DEFER(rspq_fence_free(cpu_fence));
+    rspq_fence_t *rsp_fence = rspq_fence_new();
+    DEFER(rspq_fence_free(rsp_fence));
+
+    // RSP -> CPU: wait for a specific command
+    rspq_test_wait(0x100);
+    uint32_t v = rspq_fence_enqueue_signal(rsp_fence);
+    rspq_fence_wait(rsp_fence, v);
+    ASSERT(rspq_fence_check(rsp_fence, v), "fence was not signalled");
+
+    // CPU -> RSP: the lowpri queue is blocked until the CPU signals the fence
+    rspq_test_reset();
+    rspq_fence_enqueue_wait(cpu_fence, 1);
+    rspq_test_4(1);
+    rspq_syncpoint_t sp = rspq_syncpoint_new();
+    rspq_flush();
+    wait_ms(3);
+    ASSERT(!rspq_syncpoint_check(sp), "RSP did not wait for the fence");
+
+    // The highpri queue can still run while the RSP waits
+    rspq_highpri_begin();
+    v = rspq_fence_enqueue_signal(rsp_fence);
+    rspq_highpri_end();
+    rspq_fence_wait(rsp_fence, v);
+    ASSERT(!rspq_syncpoint_check(sp), "RSP did not wait for the fence after highpri");
+
+    rspq_fence_signal(cpu_fence, 1);
+    rspq_syncpoint_wait(sp);
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, 1, "commands after the fence were not run");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_mem(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    rspq_mem_init();
+    DEFER(rspq_mem_close());
+
+    // Use sizes that span multiple commands and multiple DMEM buffers,
+    // with a final partial chunk.
+    const int size = 40*1024 + 72;
+    uint8_t *src = memalign(16, size);
+    DEFER(free(src));
+    uint8_t *dst = memalign(16, size);
+    DEFER(free(dst));
+
+    for (int i=0; i<size; i++) {
+        src[i] = i ^ (i >> 8);
+        dst[i] = 0xAA;
+    }
+
+    // memset: bytes after the filled region must be untouched
+    rspq_memset(dst, 0x5C, size - 8);
+    rspq_wait();
+    for (int i=0; i<size-8; i++)
+        ASSERT_EQUAL_HEX(dst[i], 0x5C, "memset: invalid byte at offset %d", i);
+    for (int i=size-8; i<size; i++)
+        ASSERT_EQUAL_HEX(dst[i], 0xAA, "memset: overflow at offset %d", i);
+
+    rspq_memset32(dst, 0x12345678, size);
+    rspq_wait();
+    for (int i=0; i<size/4; i++)
+        ASSERT_EQUAL_HEX(((uint32_t*)dst)[i], 0x12345678, "memset32: invalid word at offset %d", i*4);
+
+    // memcpy
+    rspq_memcpy(dst, src, size);
+    rspq_wait();
+    ASSERT_EQUAL_MEM(dst, src, size, "memcpy: invalid data");
+
+    // memcpy2d: copy a 3000x5 rect (wider than the DMEM buffer) from a
+    // source with pitch 3200 into a destination with pitch 3008.
+    const int width = 3000, height = 5, src_pitch = 3200, dst_pitch = 3008;
+    memset(dst, 0, size);
+    rspq_memcpy2d(dst + 8, dst_pitch, src + 16, src_pitch, width, height);
+    rspq_wait();
+    for (int y=0; y<height; y++) {
+        ASSERT_EQUAL_MEM(dst + 8 + y*dst_pitch, src + 16 + y*src_pitch, width,
+            "memcpy2d: invalid data in line %d", y);
+        if (y < height-1)
+            ASSERT_EQUAL_HEX(dst[8 + y*dst_pitch + width], 0, "memcpy2d: overflow in line %d", y);
+    }
+    ASSERT_EQUAL_HEX(dst[0], 0, "memcpy2d: underflow");
+
+    // memcpy2d: a source pitch too large for the DMA skip field
+    const int width2 = 40, src_pitch2 = 8000, dst_pitch2 = 48;
+    memset(dst, 0, size);
+    rspq_memcpy2d(dst, dst_pitch2, src, src_pitch2, width2, height);
+    rspq_wait();
+    for (int y=0; y<height; y++) {
+        ASSERT_EQUAL_MEM(dst + y*dst_pitch2, src + y*src_pitch2, width2,
+            "memcpy2d: invalid data in line %d (large pitch)", y);
+        ASSERT_EQUAL_HEX(dst[y*dst_pitch2 + width2], 0, "memcpy2d: overflow in line %d (large pitch)", y);
+    }
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_submitq(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    timer_init();
+    DEFER(timer_close());
+
+    rspq_submitq_t *q = rspq_submitq_new(64);
+    DEFER(rspq_submitq_free(q));
+
+    // Enqueue commands from a timer interrupt, while the main thread
+    // is also enqueuing commands.
+    volatile int cb_written = 0;
+    volatile int cb_failed = 0;
+    void cb(int ovfl) {
+        for (int i = 0; i < 4; i++) {
+            if (rspq_submitq_write(q, test_ovl_id, 0x1, 1, 0x02000000 | SP_WSTATUS_SET_SIG0))
+                cb_written++;
+            else
+                cb_failed++;
+        }
+    }
+
+    rspq_test_reset();
+
+    timer_link_t *t = new_timer(TICKS_FROM_MS(1), TF_CONTINUOUS, cb);
+    DEFER(delete_timer(t));
+
+    int main_written = 0;
+    uint32_t t0 = TICKS_READ();
+    while (TICKS_DISTANCE(t0, TICKS_READ()) < TICKS_FROM_MS(10)) {
+        rspq_test_4(1);
+        main_written++;
+        rspq_flush();
+    }
+    stop_timer(t);
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_flush();
+    rspq_test_output(actual_sum);
+    rspq_wait();
+
+    ASSERT(cb_written > 0, "timer callback did not write any command");
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, main_written + cb_written, "commands were lost (%d failed writes)", cb_failed);
+
+    TEST_RSPQ_EPILOG(SP_STATUS_SIG0, rspq_timeout);
+}
+
+void test_rspq_profile(TestContext *ctx)
+{
+    if (!RSPQ_PROFILE)
+        SKIP("rspq was built without RSPQ_PROFILE");
+
+    TEST_RSPQ_PROLOG();
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_profile_reset();
+
+    // Enough commands to fill many blocks of samples, plus some slow ones
+    for (uint32_t i = 0; i < 200; i++)
+        rspq_test_4(1);
+    for (uint32_t i = 0; i < 4; i++)
+        rspq_test_wait(0x100);
+    rspq_wait();
+
+    rspq_profile_data_t data;
+    rspq_profile_get_data(&data);
+    rspq_profile_dump();
+
+    uint32_t id = test_ovl_id >> 28;
+    ASSERT_EQUAL_UNSIGNED(data.slots[id][0x0].count, 200, "wrong number of samples for command 0x0");
+    ASSERT_EQUAL_UNSIGNED(data.slots[id][0x3].count, 4, "wrong number of samples for command 0x3");
+    uint64_t avg_fast = data.slots[id][0x0].cycles / data.slots[id][0x0].count;
+    uint64_t avg_slow = data.slots[id][0x3].cycles / data.slots[id][0x3].count;
+    ASSERT(avg_slow > avg_fast, "wait command is not slower (%llu vs %llu cycles)", avg_slow, avg_fast);
+    ASSERT_EQUAL_UNSIGNED(data.dropped, 0, "samples were dropped");
+
+    rspq_profile_reset();
+    rspq_profile_get_data(&data);
+    ASSERT_EQUAL_UNSIGNED(data.total_count, 0, "profile data was not reset");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_rapid_sync(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -495,6 +794,83 @@ void test_rspq_block(TestContext *ctx)
     TEST_RSPQ_EPILOG(0, rspq_timeout);
 }
 
+void test_rspq_block_compile(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    // Pretend that the accumulating command is a state command, so that
+    // we can check from the sum which instances were dropped.
+    rspq_overlay_set_state_command(test_ovl_id, 0x1);
+
+    rspq_block_begin();
+    // Consecutive instances: only the last one is kept
+    for (uint32_t i = 0; i < 300; i++)
+        rspq_test_8(1);
+    // No-ops are dropped, but they do not make the commands consecutive
+    rspq_noop();
+    rspq_test_8(2);
+    rspq_test_4(1);
+    rspq_test_8(4);
+    rspq_block_t *block = rspq_block_end();
+    DEFER(rspq_block_free(block));
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+    rspq_block_run(block);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, 8, "redundant commands were not dropped correctly");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_block_batch(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_overlay_set_affinity(test_ovl_id, RSPQ_AFFINITY_BATCH);
+    rspq_overlay_set_affinity(test2_ovl_id, RSPQ_AFFINITY_BATCH);
+
+    // Interleave commands of the two overlays: without batching, each
+    // command would require an overlay switch.
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 16; i++) {
+        rspq_test_4(1);
+        rspq_test2(i, i);
+    }
+    rspq_block_t *block = rspq_block_end();
+    DEFER(rspq_block_free(block));
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+    rspq_wait();
+    rspq_reset_overlay_stats();
+
+    rspq_block_run(block);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+
+    rspq_overlay_stats_t stats;
+    rspq_get_overlay_stats(&stats);
+    ASSERT(stats.switches <= 2, "too many overlay switches: %ld", stats.switches);
+    ASSERT_EQUAL_UNSIGNED(stats.loads[test2_ovl_id >> 28], 1, "wrong number of loads of test2");
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, 16, "batched commands were not run");
+
+    // Commands of the same overlay keep their order: the last one wins.
+    uint32_t *test2_state = UncachedAddr(rspq_overlay_get_state(&rsp_test2));
+    ASSERT_EQUAL_HEX(test2_state[1], 15, "commands of test2 were reordered");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_wait_sync_in_block(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
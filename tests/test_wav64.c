@@ -0,0 +1,261 @@
+#include <math.h>
+
+#include "../include/wav64internal.h"
+
+// tone_vadpcm.wav64: 4096 stereo frames at 32 kHz, compressed with VADPCM,
+// looping from frame 1024. The left channel is a sine with a period of 64
+// samples, the right channel one with a period of 40 samples.
+static int16_t tone_ref(int pos, int ch) {
+	if (ch == 0) return lrintf(12000.0f * sinf(2.0f * (float)M_PI * (pos % 64) / 64.0f));
+	return lrintf(9000.0f * sinf(2.0f * (float)M_PI * (pos % 40) / 40.0f));
+}
+
+// Signal-to-noise ratio (dB) of decoded frames against the original tone
+static float tone_snr(const int16_t *samples, int wpos, int wlen) {
+	float sig = 0, err = 0;
+	for (int i=0; i<wlen; i++) {
+		for (int ch=0; ch<2; ch++) {
+			float ref = tone_ref(wpos+i, ch);
+			float diff = samples[i*2+ch] - ref;
+			sig += ref*ref;
+			err += diff*diff;
+		}
+	}
+	return 10.0f * log10f(sig / (err + 1.0f));
+}
+
+// Decode tone_vadpcm.wav64 on the CPU with the reference decoder, from the
+// beginning to the end. The loop state stored in the header is the state
+// reached here at the loop start, so seeking into the loop must give the
+// same samples.
+static int16_t *tone_vadpcm_decode(void) {
+	int fh = dfs_open("tone_vadpcm.wav64");
+	wav64_header_t head;
+	wav64_header_vadpcm_t vhead;
+	dfs_read(&head, 1, sizeof(head), fh);
+	dfs_read(&vhead, 1, sizeof(vhead), fh);
+
+	int nframes = head.len / VADPCM_FRAME_SAMPLES;
+	uint8_t *frames = malloc(nframes * 2 * VADPCM_FRAME_BYTES);
+	dfs_seek(fh, head.start_offset, SEEK_SET);
+	dfs_read(frames, 1, nframes * 2 * VADPCM_FRAME_BYTES, fh);
+	dfs_close(fh);
+
+	int16_t book[VADPCM_MAX_PREDICTORS][2][8];
+	memcpy(book, vhead.book, sizeof(book));
+	int16_t *out = malloc(head.len * 2 * sizeof(int16_t));
+	int16_t state[2][2] = {0};
+	for (int f=0; f<nframes; f++)
+		for (int ch=0; ch<2; ch++)
+			vadpcm_decode_frame(frames + (f*2+ch) * VADPCM_FRAME_BYTES, book,
+				state[ch], out + f*VADPCM_FRAME_SAMPLES*2 + ch, 2);
+	free(frames);
+	return out;
+}
+
+void test_wav64_vadpcm(TestContext *ctx) {
+	TEST_RSPQ_PROLOG();
+
+	wav64_t wav;
+	wav64_open(&wav, "rom:/tone_vadpcm.wav64");
+	DEFER(wav64_close(&wav));
+	ASSERT_EQUAL_SIGNED(wav.wave.channels, 2, "invalid number of channels");
+	ASSERT_EQUAL_SIGNED(wav.wave.len, 4096, "invalid length");
+	ASSERT_EQUAL_SIGNED(wav.wave.loop_len, 4096-1024, "invalid loop length");
+
+	// The RSP decoder must match the reference decoder exactly. The SNR
+	// against the original tone only checks that the encoder did its job.
+	int16_t *ref = tone_vadpcm_decode();
+	DEFER(free(ref));
+	float snr = tone_snr(ref, 0, 4096);
+	ASSERT(snr > 30.0f, "poor encoding: SNR %.1f dB", snr);
+
+	// A sample buffer of 1200 stereo frames: reading more than that in total
+	// forces it to be compacted while the RSP might still be decoding.
+	const int size = 1200*4;
+	uint8_t *mem = malloc_uncached(size);
+	DEFER(free_uncached(mem));
+	samplebuffer_t sbuf;
+	samplebuffer_init(&sbuf, mem, size);
+	samplebuffer_set_bps(&sbuf, 32);
+	samplebuffer_set_waveform(&sbuf, wav.wave.read, wav.wave.ctx);
+
+	// Sequential reads. Each read spans several RSP commands (at most 256
+	// stereo frames each), and consecutive reads continue from the decoder
+	// state left by the previous one.
+	for (int wpos=0; wpos<4096; wpos+=700) {
+		int len = 4096-wpos < 700 ? 4096-wpos : 700;
+		int wlen = len;
+		int16_t *samples = samplebuffer_get(&sbuf, wpos, &wlen);
+		rspq_wait();
+		ASSERT_EQUAL_SIGNED(wlen, len, "short read at %d", wpos);
+		ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + wpos*2), wlen*4, "invalid decoding at %d", wpos);
+	}
+
+	// Seek within the loop: decoding restarts from the loop state
+	samplebuffer_flush(&sbuf);
+	int wlen = 300;
+	int16_t *samples = samplebuffer_get(&sbuf, 2500, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 300, "short read after seek");
+	ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + 2500*2), wlen*4, "invalid decoding after seek");
+
+	// Seek before the loop: decoding restarts from the beginning
+	samplebuffer_flush(&sbuf);
+	wlen = 300;
+	samples = samplebuffer_get(&sbuf, 500, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 300, "short read before the loop");
+	ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + 500*2), wlen*4, "invalid decoding before the loop");
+
+	// Two reads without waiting, the second of which compacts the buffer
+	// (like the mixer does when a loop wraps around).
+	samplebuffer_flush(&sbuf);
+	wlen = 1000;
+	samplebuffer_get(&sbuf, 0, &wlen);
+	wlen = 1000;
+	samples = samplebuffer_get(&sbuf, 900, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 1000, "short read after compaction");
+	ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + 900*2), wlen*4, "invalid decoding after compaction");
+}
+
+// tone_mdct.wav64: the same tone as tone_vadpcm.wav64, compressed with MDCT
+// (audioconv64 --wav-compress mdct), looping from frame 1024.
+
+// Decode tone_mdct.wav64 on the CPU with the reference implementation of the
+// RSP ucode. Block B is the overlap of frames B and B+1, whatever was decoded
+// before, so the player must produce exactly these samples after any
+// sequence of reads and seeks.
+static int16_t *tone_mdct_decode(void) {
+	const int N = MDCT_FRAME_SAMPLES;
+	int fh = dfs_open("tone_mdct.wav64");
+	wav64_header_t head;
+	wav64_header_mdct_t mhead;
+	dfs_read(&head, 1, sizeof(head), fh);
+	dfs_read(&mhead, 1, sizeof(mhead), fh);
+
+	int nblocks = (head.len + N - 1) / N;
+	int frame_bytes = mhead.frame_bytes;
+	uint8_t *frames = malloc((nblocks+1) * frame_bytes);
+	dfs_seek(fh, head.start_offset, SEEK_SET);
+	dfs_read(frames, 1, (nblocks+1) * frame_bytes, fh);
+	dfs_close(fh);
+
+	mdct_tables_t *tables = malloc(sizeof(mdct_tables_t));
+	mdct_init_tables(tables);
+	int16_t *out = malloc(nblocks * N * 2 * sizeof(int16_t));
+	int16_t ola[2][MDCT_FRAME_SAMPLES], in[MDCT_FRAME_SAMPLES], pcm[MDCT_FRAME_SAMPLES];
+	for (int f=0; f<=nblocks; f++) {
+		int32_t coefs[2][MDCT_FRAME_SAMPLES];
+		mdct_decode_frame(frames + f * frame_bytes, frame_bytes, 2, f, coefs);
+		for (int ch=0; ch<2; ch++) {
+			int shift = mdct_prepare_coefs(coefs[ch], in);
+			mdct_imdct(in, shift, ola[ch], f > 0 ? pcm : NULL, tables);
+			for (int i=0; f>0 && i<N; i++)
+				out[((f-1)*N + i)*2 + ch] = pcm[i];
+		}
+	}
+	free(tables);
+	free(frames);
+	return out;
+}
+
+// Waveform read callback that unrolls the loop of a wav64 as the mixer does:
+// positions past the end continue from the loop start, with a seek.
+static void tone_loop_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking) {
+	wav64_t *wav = (wav64_t*)ctx;
+	int len = wav->wave.len;
+	int loop_start = len - wav->wave.loop_len;
+	if (wpos >= len)
+		wpos = (wpos - len) % wav->wave.loop_len + loop_start;
+	int len1 = wpos + wlen > len ? len - wpos : wlen;
+	wav->wave.read(wav->wave.ctx, sbuf, wpos, len1, seeking);
+	if (wlen > len1)
+		wav->wave.read(wav->wave.ctx, sbuf, loop_start, wlen - len1, true);
+}
+
+// Check decoded samples starting at an unrolled position against the reference
+static bool tone_loop_equal(const int16_t *samples, const int16_t *ref, int wpos, int wlen) {
+	for (int i=0; i<wlen; i++) {
+		int pos = wpos + i;
+		if (pos >= 4096)
+			pos = (pos - 4096) % (4096-1024) + 1024;
+		if (samples[i*2] != ref[pos*2] || samples[i*2+1] != ref[pos*2+1]) {
+			debugf("mismatch at %d: %d,%d != %d,%d\n", wpos+i,
+				samples[i*2], samples[i*2+1], ref[pos*2], ref[pos*2+1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+void test_wav64_mdct(TestContext *ctx) {
+	TEST_RSPQ_PROLOG();
+
+	wav64_t wav;
+	wav64_open(&wav, "rom:/tone_mdct.wav64");
+	DEFER(wav64_close(&wav));
+	ASSERT_EQUAL_SIGNED(wav.wave.channels, 2, "invalid number of channels");
+	ASSERT_EQUAL_SIGNED(wav.wave.len, 4096, "invalid length");
+	ASSERT_EQUAL_SIGNED(wav.wave.loop_len, 4096-1024, "invalid loop length");
+
+	// The RSP decoder must match the reference implementation exactly. The
+	// SNR against the original tone only checks that the encoder did its job.
+	int16_t *ref = tone_mdct_decode();
+	DEFER(free(ref));
+	float snr = tone_snr(ref, 0, 4096);
+	ASSERT(snr > 30.0f, "poor encoding: SNR %.1f dB", snr);
+
+	const int size = 1200*4;
+	uint8_t *mem = malloc_uncached(size);
+	DEFER(free_uncached(mem));
+	samplebuffer_t sbuf;
+	samplebuffer_init(&sbuf, mem, size);
+	samplebuffer_set_bps(&sbuf, 32);
+	samplebuffer_set_waveform(&sbuf, tone_loop_read, &wav);
+
+	// Sequential reads, spanning several blocks, and not aligned to them
+	for (int wpos=0; wpos<4096; wpos+=700) {
+		int len = 4096-wpos < 700 ? 4096-wpos : 700;
+		int wlen = len;
+		int16_t *samples = samplebuffer_get(&sbuf, wpos, &wlen);
+		rspq_wait();
+		ASSERT_EQUAL_SIGNED(wlen, len, "short read at %d", wpos);
+		ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + wpos*2), wlen*4, "invalid decoding at %d", wpos);
+	}
+
+	// Seek within the loop, and before it
+	samplebuffer_flush(&sbuf);
+	int wlen = 300;
+	int16_t *samples = samplebuffer_get(&sbuf, 2500, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 300, "short read after seek");
+	ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + 2500*2), wlen*4, "invalid decoding after seek");
+
+	samplebuffer_flush(&sbuf);
+	wlen = 300;
+	samples = samplebuffer_get(&sbuf, 500, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 300, "short read before the loop");
+	ASSERT_EQUAL_MEM((uint8_t*)samples, (uint8_t*)(ref + 500*2), wlen*4, "invalid decoding before the loop");
+
+	// A read across the end of the loop, which continues from the loop start
+	samplebuffer_flush(&sbuf);
+	wlen = 600;
+	samples = samplebuffer_get(&sbuf, 3700, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 600, "short read across the loop end");
+	ASSERT(tone_loop_equal(samples, ref, 3700, wlen), "invalid decoding across the loop end");
+
+	// Two reads without waiting, the second of which compacts the buffer
+	// while the samples of the first one (across the loop end) are pending.
+	samplebuffer_flush(&sbuf);
+	wlen = 1000;
+	samplebuffer_get(&sbuf, 3700, &wlen);
+	wlen = 500;
+	samples = samplebuffer_get(&sbuf, 4500, &wlen);
+	rspq_wait();
+	ASSERT_EQUAL_SIGNED(wlen, 500, "short read after compaction");
+	ASSERT(tone_loop_equal(samples, ref, 4500, wlen), "invalid decoding after compaction");
+}
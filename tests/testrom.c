@@ -170,6 +170,9 @@ int assert_equal_mem(TestContext *ctx, const char *file, int line, const uint8_t
 #include "test_cop1.c"
 #include "test_constructors.c"
 #include "test_rspq.c"
+#include "test_rspmath.c"
+#include "test_wav64.c"
+#include "test_mixer.c"
 
 /**********************************************************************
  * MAIN
@@ -204,29 +207,53 @@ static const struct Testsuite
 	TEST_FUNC(test_irq_reentrancy,           230, TEST_FLAGS_RESET_COUNT),
 	TEST_FUNC(test_dfs_read,                 948, TEST_FLAGS_IO),
 	TEST_FUNC(test_dfs_rom_addr,              25, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_path_table,             0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_read_sequential,        0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_read_async,             0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_compressed,             0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_trace,                  0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_load_batch,             0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_mmap,                   0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_dfs_cache,                  0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_eepromfs,                   0, TEST_FLAGS_IO),
 	TEST_FUNC(test_cache_invalidate,        1763, TEST_FLAGS_NONE),
 	TEST_FUNC(test_debug_sdfs,                 0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_dma_read_misalign,       7003, TEST_FLAGS_NONE),
+	TEST_FUNC(test_dma_read_queued,             0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_cop1_denormalized_float,    0, TEST_FLAGS_NO_EMULATOR),
 	TEST_FUNC(test_rspq_queue_single,          0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_queue_multiple,        0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_queue_rapid,           0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_wrap,                  0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_wrap_fixed,            0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_elastic_ring,          0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_signal,                0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_high_load,             0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_load_overlay,          0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_switch_overlay,        0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_multiple_flush,        0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_wait,                  0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_wait_callback,         0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_fence,                 0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_submitq,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_mem,                   0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_profile,               0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_rapid_sync,            0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_flush,                 0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_rapid_flush,           0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_block,                 0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_block_compile,         0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_block_batch,           0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_wait_sync_in_block,    0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_basic,         0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_multiple,      0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_overlay,       0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspmath,                    0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_wav64_vadpcm,               0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_wav64_mdct,                 0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_mixer_fx,                   0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_mixer_interp,               0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_mixer_async,                0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
 };
 
 int main() {
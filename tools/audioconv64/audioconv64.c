@@ -73,6 +73,10 @@ void usage(void) {
 	printf("WAV options:\n");
 	printf("   --wav-loop <true|false>   Activate playback loop by default\n");
 	printf("   --wav-loop-offset <N>     Set looping offset (in samples; default: 0)\n");
+	printf("   --wav-compress <none|vadpcm|mdct>  Compress output file (true: vadpcm)\n");
+	printf("                             vadpcm: ~4x smaller, for sound effects\n");
+	printf("                             mdct: ~13x smaller, for music (lossy, 256-sample latency on seek)\n");
+	printf("   --wav-mdct-bitrate <kbps> Bitrate for MDCT compression (default: 40 per channel at 32 kHz)\n");
 	printf("\n");
 	printf("YM options:\n");
 	printf("   --ym-compress <true|false>  Compress output file\n");
@@ -218,6 +222,31 @@ int main(int argc, char *argv[]) {
 					return 1;
 				}
 				flag_wav_looping = true;
+			} else if (!strcmp(argv[i], "--wav-compress")) {
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for --wav-compress\n");
+					return 1;
+				}
+				if (!strcmp(argv[i], "true") || !strcmp(argv[i], "1") || !strcmp(argv[i], "vadpcm"))
+					flag_wav_compress = WAV64_FORMAT_VADPCM;
+				else if (!strcmp(argv[i], "false") || !strcmp(argv[i], "0") || !strcmp(argv[i], "none"))
+					flag_wav_compress = WAV64_FORMAT_RAW;
+				else if (!strcmp(argv[i], "mdct"))
+					flag_wav_compress = WAV64_FORMAT_MDCT;
+				else {
+					fprintf(stderr, "invalid argument for --wav-compress: %s\n", argv[i]);
+					return 1;
+				}
+			} else if (!strcmp(argv[i], "--wav-mdct-bitrate")) {
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for --wav-mdct-bitrate\n");
+					return 1;
+				}
+				char extra;
+				if (sscanf(argv[i], "%d%c", &flag_wav_mdct_bitrate, &extra) != 1 || flag_wav_mdct_bitrate <= 0) {
+					fprintf(stderr, "invalid integer argument for --wav-mdct-bitrate: %s\n", argv[i]);
+					return 1;
+				}
 			} else if (!strcmp(argv[i], "--ym-compress")) {
 				if (++i == argc) {
 					fprintf(stderr, "missing argument for --ym-compress\n");
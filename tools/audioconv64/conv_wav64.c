@@ -1,10 +1,445 @@
 #include "wav64internal.h"
+#include <math.h>
 
 #define DR_WAV_IMPLEMENTATION
 #include "dr_wav.h"
 
 bool flag_wav_looping = false;
 int flag_wav_looping_offset = 0;
+int flag_wav_compress = WAV64_FORMAT_RAW;
+int flag_wav_mdct_bitrate = 0;
+
+/************************************************************************************
+ *  VADPCM ENCODER
+ ************************************************************************************/
+
+// Minimum energy of a frame (sum of squared samples) to be considered
+// for the codebook design. Quieter frames are encoded fine by any predictor.
+#define VADPCM_MIN_FRAME_ENERGY   (16.0 * 16.0 * VADPCM_FRAME_SAMPLES)
+
+// Number of iterations of the k-means clustering used to design the codebook
+#define VADPCM_KMEANS_ITERATIONS  32
+
+typedef struct {
+	double a1, a2;
+} vadpcm_pred_t;
+
+// Expand a second-order predictor x[n] = a1*x[n-1] + a2*x[n-2] + r[n]
+// into the codebook format, by computing its impulse response over 8 samples.
+static void vadpcm_expand_predictor(vadpcm_pred_t p, int16_t book[2][8]) {
+	double g[10];
+	g[0] = 1.0; g[1] = p.a1;
+	for (int k=2; k<10; k++)
+		g[k] = p.a1 * g[k-1] + p.a2 * g[k-2];
+
+	for (int i=0; i<8; i++) {
+		double b0 = p.a2 * g[i] * (1 << VADPCM_BOOK_FRAC_BITS);
+		double b1 = g[i+1] * (1 << VADPCM_BOOK_FRAC_BITS);
+		book[0][i] = vadpcm_clamp16(lround(b0));
+		book[1][i] = vadpcm_clamp16(lround(b1));
+	}
+}
+
+// Compute the optimal (least squares) second-order predictor for a frame.
+// Returns false if the frame is too quiet or the predictor is degenerate.
+static bool vadpcm_frame_predictor(const int16_t *x, int stride, vadpcm_pred_t *p) {
+	double r11=0, r22=0, r12=0, r01=0, r02=0, energy=0;
+	for (int n=0; n<VADPCM_FRAME_SAMPLES; n++) {
+		double x0 = x[n*stride], x1 = x[(n-1)*stride], x2 = x[(n-2)*stride];
+		r11 += x1*x1; r22 += x2*x2; r12 += x1*x2;
+		r01 += x0*x1; r02 += x0*x2;
+		energy += x0*x0;
+	}
+	double det = r11*r22 - r12*r12;
+	if (energy < VADPCM_MIN_FRAME_ENERGY || det <= 1e-6 * r11 * r22)
+		return false;
+
+	p->a1 = (r01*r22 - r02*r12) / det;
+	p->a2 = (r02*r11 - r01*r12) / det;
+
+	// Make sure the predictor is stable, otherwise the expanded codebook
+	// would quickly overflow.
+	if (p->a2 > 0.95) p->a2 = 0.95;
+	if (p->a2 < -0.95) p->a2 = -0.95;
+	double max_a1 = (1.0 - p->a2) * 0.99;
+	if (p->a1 > max_a1) p->a1 = max_a1;
+	if (p->a1 < -max_a1) p->a1 = -max_a1;
+	return true;
+}
+
+// Design a codebook of predictors for the waveform, by clustering the
+// optimal predictors of each frame with k-means.
+static int vadpcm_design_codebook(const int16_t *samples, int cnt, int channels,
+	vadpcm_pred_t preds[VADPCM_MAX_PREDICTORS])
+{
+	int nframes = cnt / VADPCM_FRAME_SAMPLES;
+	vadpcm_pred_t *fp = malloc((nframes * channels + 1) * sizeof(vadpcm_pred_t));
+	int nfp = 0;
+
+	for (int ch=0; ch<channels; ch++) {
+		// Skip the first frame, as it has no history.
+		for (int f=1; f<nframes; f++) {
+			const int16_t *x = samples + (f*VADPCM_FRAME_SAMPLES)*channels + ch;
+			if (vadpcm_frame_predictor(x, channels, &fp[nfp]))
+				nfp++;
+		}
+	}
+
+	// The first predictor is always the null predictor, which is useful
+	// for the start of the waveform and for transients.
+	preds[0] = (vadpcm_pred_t){ 0, 0 };
+	int npreds = 1;
+	if (nfp == 0) {
+		free(fp);
+		return npreds;
+	}
+
+	// Initialize the centroids with the farthest-point heuristic, which is
+	// deterministic and spreads them across the predictor space.
+	while (npreds < VADPCM_MAX_PREDICTORS && npreds <= nfp) {
+		int best = -1; double best_dist = 0;
+		for (int i=0; i<nfp; i++) {
+			double dist = INFINITY;
+			for (int k=0; k<npreds; k++) {
+				double d1 = fp[i].a1 - preds[k].a1, d2 = fp[i].a2 - preds[k].a2;
+				dist = fmin(dist, d1*d1 + d2*d2);
+			}
+			if (dist > best_dist) { best = i; best_dist = dist; }
+		}
+		if (best < 0)
+			break;
+		preds[npreds++] = fp[best];
+	}
+
+	// Refine the centroids (except the null predictor)
+	for (int it=0; it<VADPCM_KMEANS_ITERATIONS; it++) {
+		double sum1[VADPCM_MAX_PREDICTORS] = {0}, sum2[VADPCM_MAX_PREDICTORS] = {0};
+		int count[VADPCM_MAX_PREDICTORS] = {0};
+		for (int i=0; i<nfp; i++) {
+			int best = 0; double best_dist = INFINITY;
+			for (int k=0; k<npreds; k++) {
+				double d1 = fp[i].a1 - preds[k].a1, d2 = fp[i].a2 - preds[k].a2;
+				if (d1*d1 + d2*d2 < best_dist) { best = k; best_dist = d1*d1 + d2*d2; }
+			}
+			sum1[best] += fp[i].a1; sum2[best] += fp[i].a2; count[best]++;
+		}
+		for (int k=1; k<npreds; k++) {
+			if (count[k]) {
+				preds[k].a1 = sum1[k] / count[k];
+				preds[k].a2 = sum2[k] / count[k];
+			}
+		}
+	}
+
+	free(fp);
+	return npreds;
+}
+
+// Encode a frame with a specific predictor and scale, simulating the
+// decoder. Returns the squared error, and fills the residuals.
+static int64_t vadpcm_encode_trial(const int16_t *x, int stride, const int16_t book[2][8],
+	int scale, const int16_t state[2], int8_t q[VADPCM_FRAME_SAMPLES])
+{
+	int64_t err = 0;
+	int16_t p2 = state[0], p1 = state[1];
+	for (int g=0; g<VADPCM_FRAME_SAMPLES; g+=8) {
+		int32_t r[8]; int16_t out[8];
+		for (int i=0; i<8; i++) {
+			int64_t acc = (int64_t)book[0][i] * p2 + (int64_t)book[1][i] * p1;
+			for (int j=0; j<i; j++)
+				acc += (int64_t)book[1][i-1-j] * r[j];
+
+			// Choose the residual that brings the output closest to the target
+			int target = x[(g+i)*stride];
+			double want = target - (double)acc / (1 << VADPCM_BOOK_FRAC_BITS);
+			long qi = lround(want / (1 << scale));
+			if (qi > 7) qi = 7;
+			if (qi < -8) qi = -8;
+			q[g+i] = qi;
+			r[i] = qi * (1 << scale);
+
+			acc += (int64_t)r[i] * (1 << VADPCM_BOOK_FRAC_BITS);
+			out[i] = vadpcm_clamp16(acc >> VADPCM_BOOK_FRAC_BITS);
+			err += (int64_t)(out[i] - target) * (out[i] - target);
+		}
+		p2 = out[6]; p1 = out[7];
+	}
+	return err;
+}
+
+// Encode a frame, choosing the predictor and scale that minimize the error.
+static void vadpcm_encode_frame(const int16_t *x, int stride, 
+	const int16_t book[VADPCM_MAX_PREDICTORS][2][8], int npreds,
+	const int16_t state[2], uint8_t frame[VADPCM_FRAME_BYTES])
+{
+	int64_t best_err = INT64_MAX;
+	int8_t q[VADPCM_FRAME_SAMPLES];
+
+	for (int p=0; p<npreds; p++) {
+		// Find the smallest scale that can represent the residuals without
+		// clipping them, then try also the scales around it.
+		int8_t qtmp[VADPCM_FRAME_SAMPLES];
+		int scale0 = 0;
+		while (scale0 < VADPCM_MAX_SCALE) {
+			vadpcm_encode_trial(x, stride, book[p], scale0, state, qtmp);
+			bool clipped = false;
+			for (int i=0; i<VADPCM_FRAME_SAMPLES; i++)
+				if (qtmp[i] == 7 || qtmp[i] == -8)
+					clipped = true;
+			if (!clipped)
+				break;
+			scale0++;
+		}
+
+		int scale_min = scale0 > 0 ? scale0-1 : 0;
+		int scale_max = scale0 < VADPCM_MAX_SCALE ? scale0+1 : VADPCM_MAX_SCALE;
+		for (int scale=scale_min; scale<=scale_max; scale++) {
+			int64_t err = vadpcm_encode_trial(x, stride, book[p], scale, state, qtmp);
+			if (err < best_err) {
+				best_err = err;
+				memcpy(q, qtmp, sizeof(q));
+				frame[0] = (scale << 4) | p;
+			}
+		}
+	}
+
+	for (int i=0; i<8; i++)
+		frame[1+i] = ((q[i] & 0xF) << 4) | (q[i+8] & 0xF);
+}
+
+static void vadpcm_write(FILE *out, const int16_t *samples, int cnt, int channels, int loop_len) {
+	// Number of frames to encode: round up and add some padding frames,
+	// as the player might overread a few samples past the end.
+	const int PADDING_FRAMES = 2;
+	int nframes = (cnt + VADPCM_FRAME_SAMPLES - 1) / VADPCM_FRAME_SAMPLES + PADDING_FRAMES;
+
+	// Copy the samples into a zero-padded buffer, with 2 samples of
+	// history before the first one (used for the codebook design).
+	int16_t *padded = calloc((nframes * VADPCM_FRAME_SAMPLES + 2) * channels, sizeof(int16_t));
+	memcpy(padded + 2*channels, samples, cnt * channels * sizeof(int16_t));
+	int16_t *x = padded + 2*channels;
+
+	vadpcm_pred_t preds[VADPCM_MAX_PREDICTORS];
+	int npreds = vadpcm_design_codebook(x, cnt, channels, preds);
+
+	wav64_header_vadpcm_t vhead;
+	memset(&vhead, 0, sizeof(vhead));
+	int16_t book[VADPCM_MAX_PREDICTORS][2][8] = {0};
+	for (int p=0; p<npreds; p++)
+		vadpcm_expand_predictor(preds[p], book[p]);
+
+	// Encode all frames, keeping track of the decoder state.
+	uint8_t *frames = malloc(nframes * channels * VADPCM_FRAME_BYTES);
+	int16_t state[2][2] = {0};
+	int loop_frame = loop_len ? (cnt - loop_len) / VADPCM_FRAME_SAMPLES : -1;
+	for (int f=0; f<nframes; f++) {
+		for (int ch=0; ch<channels; ch++) {
+			if (f == loop_frame) {
+				vhead.loop_state[ch][0] = HOST_TO_BE16(state[ch][0]);
+				vhead.loop_state[ch][1] = HOST_TO_BE16(state[ch][1]);
+			}
+
+			const int16_t *fx = x + f*VADPCM_FRAME_SAMPLES*channels + ch;
+			uint8_t *frame = frames + (f*channels + ch) * VADPCM_FRAME_BYTES;
+			vadpcm_encode_frame(fx, channels, book, npreds, state[ch], frame);
+
+			// Advance the state by running the reference decoder, so that
+			// the encoder is always in sync with the player.
+			int16_t dec[VADPCM_FRAME_SAMPLES];
+			vadpcm_decode_frame(frame, book, state[ch], dec, 1);
+		}
+	}
+
+	vhead.npredictors = npreds;
+	for (int p=0; p<VADPCM_MAX_PREDICTORS; p++)
+		for (int i=0; i<8; i++) {
+			vhead.book[p][0][i] = HOST_TO_BE16(book[p][0][i]);
+			vhead.book[p][1][i] = HOST_TO_BE16(book[p][1][i]);
+		}
+
+	fwrite(&vhead, 1, sizeof(vhead), out);
+	fwrite(frames, 1, nframes * channels * VADPCM_FRAME_BYTES, out);
+
+	if (flag_verbose)
+		fprintf(stderr, "  VADPCM: %d predictors, %d frames\n", npreds, nframes);
+
+	free(frames);
+	free(padded);
+}
+
+/************************************************************************************
+ *  MDCT ENCODER
+ ************************************************************************************/
+
+// Default bitrate of the MDCT encoder, in bits per sample (per channel).
+// 1.25 bits per sample means 40 kbit/s per channel at 32 kHz (12.8x compression).
+#define MDCT_DEFAULT_BITS_PER_SAMPLE   1.25
+
+typedef struct {
+	uint8_t *buf;
+	int pos;
+} mdct_bitwriter_t;
+
+static void mdct_write_bits(mdct_bitwriter_t *bw, uint32_t v, int n) {
+	for (int i=n-1; i>=0; i--, bw->pos++)
+		if ((v >> i) & 1)
+			bw->buf[bw->pos >> 3] |= 0x80 >> (bw->pos & 7);
+}
+
+// Forward MDCT of 2N windowed samples. The input is folded into N samples,
+// which are then transformed with a (direct) DCT-IV.
+static void mdct_forward(const double *z, double *X) {
+	const int N = MDCT_FRAME_SAMPLES;
+	static double costab[MDCT_FRAME_SAMPLES][MDCT_FRAME_SAMPLES];
+	static bool costab_init = false;
+	if (!costab_init) {
+		for (int k=0; k<N; k++)
+			for (int n=0; n<N; n++)
+				costab[k][n] = cos(M_PI / N * (n + 0.5) * (k + 0.5));
+		costab_init = true;
+	}
+
+	double v[MDCT_FRAME_SAMPLES];
+	for (int n=0; n<N/2; n++) {
+		v[n] = -z[3*N/2-1-n] - z[3*N/2+n];
+		v[N/2+n] = z[n] - z[N-1-n];
+	}
+	for (int k=0; k<N; k++) {
+		double acc = 0;
+		for (int n=0; n<N; n++)
+			acc += v[n] * costab[k][n];
+		X[k] = acc;
+	}
+}
+
+// Number of bits required to encode a scale factor as a difference from the previous one
+static int mdct_sf_delta_bits(int prev, int sf) {
+	int d = abs(sf - prev);
+	return d == 0 ? 1 : d < 4 ? d + 2 : 4 + MDCT_SF_BITS;
+}
+
+static void mdct_encode_frame(double X[2][MDCT_FRAME_SAMPLES], int channels, int frame_bytes, uint8_t *frame) {
+	uint8_t sf[2][MDCT_NUM_BANDS];
+	uint8_t bits[2][MDCT_NUM_BANDS];
+	int sf_bits = 0;
+
+	// Compute the scale factors, so that the amplitude of each band covers
+	// its largest coefficient.
+	for (int c=0; c<channels; c++) {
+		for (int b=0; b<MDCT_NUM_BANDS; b++) {
+			double peak = 0;
+			for (int k=mdct_band_start[b]; k<mdct_band_start[b+1]; k++)
+				peak = fmax(peak, fabs(X[c][k]));
+			int s = 0;
+			if (peak >= 1.0) {
+				s = (int)ceil(2.0 * log2(peak));
+				if (s < 1) s = 1;
+				if (s > MDCT_MAX_SF) s = MDCT_MAX_SF;
+				while (s < MDCT_MAX_SF && mdct_sf_amplitude(s) < peak)
+					s++;
+			}
+			sf[c][b] = s;
+			sf_bits += b == 0 ? MDCT_SF_BITS : mdct_sf_delta_bits(sf[c][b-1], s);
+		}
+	}
+
+	memset(frame, 0, frame_bytes);
+	mdct_bitwriter_t bw = { frame, 0 };
+	for (int c=0; c<channels; c++) {
+		mdct_write_bits(&bw, sf[c][0], MDCT_SF_BITS);
+		for (int b=1; b<MDCT_NUM_BANDS; b++) {
+			int d = sf[c][b] - sf[c][b-1];
+			int n = abs(d);
+			if (n >= 4) {
+				mdct_write_bits(&bw, 0xF, 4);
+				mdct_write_bits(&bw, sf[c][b], MDCT_SF_BITS);
+			} else {
+				mdct_write_bits(&bw, (1 << (n+1)) - 2, n+1);
+				if (n) mdct_write_bits(&bw, d < 0, 1);
+			}
+		}
+	}
+	assert(bw.pos == sf_bits);
+
+	mdct_allocate_bits(sf, channels, frame_bytes*8 - sf_bits, bits);
+
+	for (int c=0; c<channels; c++) {
+		for (int b=0; b<MDCT_NUM_BANDS; b++) {
+			int nbits = bits[c][b];
+			if (!nbits) continue;
+			double amp = mdct_sf_amplitude(sf[c][b]);
+			int levels = 1 << nbits;
+			for (int k=mdct_band_start[b]; k<mdct_band_start[b+1]; k++) {
+				int q = (int)floor((X[c][k] / amp + 1.0) * levels / 2);
+				if (q < 0) q = 0;
+				if (q > levels-1) q = levels-1;
+				mdct_write_bits(&bw, q, nbits);
+			}
+		}
+	}
+	assert(bw.pos <= frame_bytes*8);
+}
+
+static void mdct_write(FILE *out, const int16_t *samples, int cnt, int channels, int freq) {
+	const int N = MDCT_FRAME_SAMPLES;
+
+	// Frame size in bytes: enough for the scale factors of all channels
+	int frame_bytes = flag_wav_mdct_bitrate ?
+		lround(flag_wav_mdct_bitrate * 1000.0 / 8 * N / freq) :
+		lround(MDCT_DEFAULT_BITS_PER_SAMPLE * channels * N / 8);
+	if (frame_bytes < channels * 24)
+		frame_bytes = channels * 24;
+	if (frame_bytes > 0xFFFF)
+		frame_bytes = 0xFFFF;
+
+	// Number of frames: decoding block B requires frames B and B+1. Add
+	// a padding frame, as the player might overread a few samples past the end.
+	int nblocks = (cnt + N - 1) / N;
+	int nframes = nblocks + 2;
+
+	// Copy the samples into a zero-padded buffer (one frame of silence before
+	// the first sample), converting stereo to mid/side.
+	int padlen = (nframes + 1) * N;
+	double *pad = calloc(padlen * channels, sizeof(double));
+	for (int i=0; i<cnt; i++) {
+		if (channels == 2) {
+			double l = samples[i*2+0], r = samples[i*2+1];
+			pad[0*padlen + N + i] = (l + r) * 0.5;
+			pad[1*padlen + N + i] = (l - r) * 0.5;
+		} else {
+			pad[N + i] = samples[i];
+		}
+	}
+
+	double window[2*MDCT_FRAME_SAMPLES];
+	for (int n=0; n<2*N; n++)
+		window[n] = sin(M_PI * (n + 0.5) / (2*N));
+
+	wav64_header_mdct_t mhead;
+	memset(&mhead, 0, sizeof(mhead));
+	mhead.frame_bytes = HOST_TO_BE16(frame_bytes);
+	fwrite(&mhead, 1, sizeof(mhead), out);
+
+	uint8_t *frame = malloc(frame_bytes);
+	for (int f=0; f<nframes; f++) {
+		double X[2][MDCT_FRAME_SAMPLES];
+		for (int c=0; c<channels; c++) {
+			double z[2*MDCT_FRAME_SAMPLES];
+			for (int n=0; n<2*N; n++)
+				z[n] = pad[c*padlen + f*N + n] * window[n];
+			mdct_forward(z, X[c]);
+		}
+		mdct_encode_frame(X, channels, frame_bytes, frame);
+		fwrite(frame, 1, frame_bytes, out);
+	}
+
+	if (flag_verbose)
+		fprintf(stderr, "  MDCT: %d frames of %d bytes (%.1f kbit/s)\n", nframes, frame_bytes,
+			frame_bytes * 8.0 * freq / N / 1000);
+
+	free(frame);
+	free(pad);
+}
 
 int wav_convert(const char *infn, const char *outfn) {
 	drwav wav;
@@ -31,15 +466,26 @@ int wav_convert(const char *infn, const char *outfn) {
 
 	// Decode the samples as 16bit big-endian. This will decode everything including
 	// compressed formats so that we're able to read any kind of WAV file, though
-	// it will end up as an uncompressed file.
+	// it will end up as an uncompressed file. Compression instead
+	// works on native-endian samples.
 	int16_t* samples = malloc(wav.totalPCMFrameCount * wav.channels * sizeof(int16_t));
-	size_t cnt = drwav_read_pcm_frames_s16be(&wav, wav.totalPCMFrameCount, samples);
+	size_t cnt = flag_wav_compress != WAV64_FORMAT_RAW ?
+		drwav_read_pcm_frames_s16(&wav, wav.totalPCMFrameCount, samples) :
+		drwav_read_pcm_frames_s16be(&wav, wav.totalPCMFrameCount, samples);
 	if (cnt != wav.totalPCMFrameCount) {
 		fprintf(stderr, "WARNING: %s: %llu frames found, but only %zu decoded\n", infn, wav.totalPCMFrameCount, cnt);
 	}
 
 	// Keep 8 bits file if original is 8 bit, otherwise expand to 16 bit.
-	int nbits = wav.bitsPerSample == 8 ? 8 : 16;
+	// Compressed formats always decode to 16 bit.
+	int nbits = wav.bitsPerSample == 8 && flag_wav_compress == WAV64_FORMAT_RAW ? 8 : 16;
+
+	if (flag_wav_compress == WAV64_FORMAT_MDCT && wav.channels > 2) {
+		fprintf(stderr, "ERROR: %s: MDCT compression only supports mono or stereo files\n", infn);
+		free(samples);
+		drwav_uninit(&wav);
+		return 1;
+	}
 
 	int loop_len = flag_wav_looping ? cnt - flag_wav_looping_offset : 0;
 	if (loop_len < 0) {
@@ -59,13 +505,15 @@ int wav_convert(const char *infn, const char *outfn) {
 
 	memcpy(head.id, "WV64", 4);
 	head.version = WAV64_FILE_VERSION;
-	head.format = 0;
+	head.format = flag_wav_compress;
 	head.channels = wav.channels;
 	head.nbits = nbits;
 	head.freq = HOST_TO_BE32(wav.sampleRate);
 	head.len = HOST_TO_BE32(cnt);
 	head.loop_len = HOST_TO_BE32(loop_len);
-	head.start_offset = HOST_TO_BE32(sizeof(wav64_header_t));
+	head.start_offset = HOST_TO_BE32(sizeof(wav64_header_t) +
+		(flag_wav_compress == WAV64_FORMAT_VADPCM ? sizeof(wav64_header_vadpcm_t) :
+		 flag_wav_compress == WAV64_FORMAT_MDCT ? sizeof(wav64_header_mdct_t) : 0));
 
 	if (flag_verbose)
 		fprintf(stderr, "Converting: %s => %s\n", infn, outfn);
@@ -80,6 +528,17 @@ int wav_convert(const char *infn, const char *outfn) {
 
 	fwrite(&head, 1, sizeof(wav64_header_t), out);
 
+	if (flag_wav_compress != WAV64_FORMAT_RAW) {
+		if (flag_wav_compress == WAV64_FORMAT_VADPCM)
+			vadpcm_write(out, samples, cnt, wav.channels, loop_len);
+		else
+			mdct_write(out, samples, cnt, wav.channels, wav.sampleRate);
+		fclose(out);
+		free(samples);
+		drwav_uninit(&wav);
+		return 0;
+	}
+
 	int16_t *sptr = samples;
 	for (int i=0;i<cnt*wav.channels;i++) {
 		// Write the sample as 16bit or 8bit. Since *sptr is 16-bit big-endian,
@@ -2,6 +2,8 @@
 // and simplified for our use case.
 // TODO(rasky): still not a proper library, it will call fatal_error + exit(1)
 // when something isn't right.
+// All the state of the encoder is thread-local, so that multiple files can be
+// compressed in parallel (as done by mkdfs).
 
 #include "lzh5_compress.h"
 #include <stdlib.h>
@@ -25,14 +27,14 @@
 #define ULONG_MAX ((1<<(sizeof(unsigned long)*8))-1)
 #endif
 
-static short bitbuf;
-static unsigned char *text;
-static unsigned short dicbit;
-static unsigned short maxmatch;
-static int unpackable;
-static off_t origsize, compsize;
-static FILE *infile, *outfile;
-static unsigned short left[], right[];
+static __thread short bitbuf;
+static __thread unsigned char *text;
+static __thread unsigned short dicbit;
+static __thread unsigned short maxmatch;
+static __thread int unpackable;
+static __thread off_t origsize, compsize;
+static __thread FILE *infile, *outfile;
+static __thread unsigned short left[], right[];
 
 static void __attribute__((noreturn, format(printf, 1, 2))) fatal_error(const char *str, ...) {
     va_list va;
@@ -303,7 +305,7 @@ static void __attribute__((noreturn, format(printf, 1, 2))) fatal_error(const ch
 /*  Ver. 1.14   Source All chagned              1995.01.14  N.Watazaki      */
 /* ------------------------------------------------------------------------ */
 
-static unsigned int crctable[UCHAR_MAX + 1];
+static __thread unsigned int crctable[UCHAR_MAX + 1];
 
 /* ------------------------------------------------------------------------ */
 static void
@@ -364,7 +366,7 @@ fread_crc(crcp, p, n, fp)
 /*              Separated from crcio.c          2002.10.26  Koji Arai       */
 /* ------------------------------------------------------------------------ */
 
-static unsigned char subbitbuf, bitcount;
+static __thread unsigned char subbitbuf, bitcount;
 
 void
 fillbuf(n)          /* Shift bitbuf n bits left, read n bits */
@@ -634,28 +636,28 @@ make_tree(nchar, freq, bitlen, code)
 #include <stdlib.h>
 
 /* ------------------------------------------------------------------------ */
-static unsigned short left[2 * NC - 1], right[2 * NC - 1];
+static __thread unsigned short left[2 * NC - 1], right[2 * NC - 1];
 
-static unsigned short c_code[NC];      /* encode */
-static unsigned short pt_code[NPT];    /* encode */
+static __thread unsigned short c_code[NC];      /* encode */
+static __thread unsigned short pt_code[NPT];    /* encode */
 
 // static unsigned short c_table[4096];   /* decode */
 // static unsigned short pt_table[256];   /* decode */
 
-static unsigned short c_freq[2 * NC - 1]; /* encode */
-static unsigned short p_freq[2 * NP - 1]; /* encode */
-static unsigned short t_freq[2 * NT - 1]; /* encode */
+static __thread unsigned short c_freq[2 * NC - 1]; /* encode */
+static __thread unsigned short p_freq[2 * NP - 1]; /* encode */
+static __thread unsigned short t_freq[2 * NT - 1]; /* encode */
 
-static unsigned char  c_len[NC];
-static unsigned char  pt_len[NPT];
+static __thread unsigned char  c_len[NC];
+static __thread unsigned char  pt_len[NPT];
 
-static unsigned char *buf;      /* encode */
-static unsigned int bufsiz;     /* encode */
+static __thread unsigned char *buf;      /* encode */
+static __thread unsigned int bufsiz;     /* encode */
 // static unsigned short blocksize; /* decode */
-static unsigned short output_pos, output_mask; /* encode */
+static __thread unsigned short output_pos, output_mask; /* encode */
 
-static int pbit;
-static int np;
+static __thread int pbit;
+static __thread int np;
 /* ------------------------------------------------------------------------ */
 /*                              Encording                                   */
 /* ------------------------------------------------------------------------ */
@@ -852,7 +854,7 @@ output_st1(c, p)
     unsigned short  c;
     unsigned short  p;
 {
-    static unsigned short cpos;
+    static __thread unsigned short cpos;
 
     output_mask >>= 1;
     if (output_mask == 0) {
@@ -956,8 +958,9 @@ static int noslide = 1;
 struct hash {
     unsigned int pos;
     int too_flag;               /* if 1, matching candidate is too many */
-} *hash;
-static unsigned int *prev;      /* previous posiion associated with hash */
+};
+static __thread struct hash *hash;
+static __thread unsigned int *prev;      /* previous posiion associated with hash */
 
 /* hash function: it represents 3 letters from `pos' on `text' */
 #define INIT_HASH(pos) \
@@ -973,9 +976,9 @@ static unsigned int *prev;      /* previous posiion associated with hash */
 #define NIL 0
 #define LIMIT 0x100             /* limit of hash chain */
 
-static unsigned int txtsiz;
-static unsigned long dicsiz;
-static unsigned int remain;
+static __thread unsigned int txtsiz;
+static __thread unsigned long dicsiz;
+static __thread unsigned int remain;
 
 struct matchdata {
     int len;
@@ -1014,9 +1017,11 @@ encode_alloc(method)
     dicsiz = (((unsigned long)1) << dicbit);
     txtsiz = dicsiz*2+maxmatch;
 
-    if (hash) return method;
+    /* buf is freed at the end of each encode, so allocate it again
+       when the encoder is reused for another file */
+    if (!buf) alloc_buf();
 
-    alloc_buf();
+    if (hash) return method;
 
     hash = (struct hash*)malloc(HSHSIZ * sizeof(struct hash));
     prev = (unsigned int*)malloc(MAX_DICSIZ * sizeof(unsigned int));
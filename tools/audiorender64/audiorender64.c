@@ -0,0 +1,299 @@
+/*
+ * audiorender64 -- Offline renderer of libdragon audio files
+ *
+ * This tool runs the libdragon audio library (mixer and players) on the host,
+ * with a C reference of the RSP ucodes, and renders WAV64, XM64 and YM64
+ * files to WAV. Output is bit-exact with what the N64 would produce, so
+ * it can be used for regression tests and benchmarks of the audio pipeline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <libdragon.h>
+
+/** @brief Number of samples generated by each call to mixer_poll */
+#define POLL_SAMPLES    1024
+/** @brief Number of mixer channels (the last one is used for the echo delay line) */
+#define NUM_CHANNELS    32
+/** @brief Send level of each channel to the echo delay line */
+#define ECHO_SEND       0.5f
+/** @brief Feedback of the echo delay line */
+#define ECHO_FEEDBACK   0.4f
+/** @brief Volume of the echo delay line */
+#define ECHO_VOLUME     0.5f
+
+bool flag_verbose = false;
+int flag_freq = 44100;
+float flag_max_secs = 0;
+const char *flag_output_dir = NULL;
+mixer_interp_t flag_interp = MIXER_INTERP_NONE;
+mixer_filter_t flag_filter = MIXER_FILTER_NONE;
+float flag_filter_freq = 0;
+float flag_echo_secs = 0;
+
+void usage(void) {
+	printf("audiorender64 -- Offline renderer of libdragon audio files\n");
+	printf("\n");
+	printf("Usage:\n");
+	printf("   audiorender64 [flags] <file> [<file>..]\n");
+	printf("\n");
+	printf("Supported formats: WAV64, XM64, YM64 (as created by audioconv64)\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("   -o / --output <dir>       Write a WAV file for each input into the specified directory\n");
+	printf("   -r / --freq <N>           Output frequency (default: 44100)\n");
+	printf("   -t / --time <secs>        Maximum length to render (default: until the end, or duration of YM64)\n");
+	printf("   -v / --verbose            Verbose mode (also show debug output of the library)\n");
+	printf("   --interp <mode>           Interpolation of all channels (none, linear, cubic, sinc)\n");
+	printf("   --filter <type>:<freq>    Apply a filter to all channels (type: lowpass, highpass, bandpass)\n");
+	printf("   --echo <secs>             Add an echo with the specified delay (played on the last channel)\n");
+	printf("\n");
+	printf("For each file, a checksum of the rendered samples is printed.\n");
+}
+
+static void w16(FILE *f, uint16_t v) { fputc(v & 0xFF, f); fputc(v >> 8, f); }
+static void w32(FILE *f, uint32_t v) { w16(f, v & 0xFFFF); w16(f, v >> 16); }
+
+/** @brief Write a 16-bit stereo WAV file */
+static bool wav_write(const char *fn, const int16_t *samples, int nsamples, int freq) {
+	FILE *f = fopen(fn, "wb");
+	if (!f) return false;
+
+	uint32_t data_size = nsamples * 4;
+	fwrite("RIFF", 1, 4, f); w32(f, 36 + data_size);
+	fwrite("WAVE", 1, 4, f);
+	fwrite("fmt ", 1, 4, f); w32(f, 16);
+	w16(f, 1); w16(f, 2); w32(f, freq); w32(f, freq * 4); w16(f, 4); w16(f, 16);
+	fwrite("data", 1, 4, f); w32(f, data_size);
+	for (int i=0; i<nsamples*2; i++)
+		w16(f, samples[i]);
+
+	fclose(f);
+	return true;
+}
+
+/** @brief FNV-1a hash of the samples (in little-endian order) */
+static uint32_t checksum(const int16_t *samples, int nsamples) {
+	uint32_t h = 0x811c9dc5;
+	for (int i=0; i<nsamples*2; i++) {
+		h = (h ^ (samples[i] & 0xFF)) * 0x01000193;
+		h = (h ^ ((uint16_t)samples[i] >> 8)) * 0x01000193;
+	}
+	return h;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int render(const char *infn) {
+	const char *ext = strrchr(infn, '.');
+	if (!ext) {
+		fprintf(stderr, "ERROR: unknown file type: %s\n", infn);
+		return 1;
+	}
+
+	char romfn[4096];
+	snprintf(romfn, sizeof(romfn), "rom:/%s", infn);
+
+	wav64_t wav;
+	xm64player_t xm;
+	ym64player_t ym;
+	int max_samples = flag_max_secs > 0 ? flag_max_secs * flag_freq : 0;
+
+	mixer_init(NUM_CHANNELS);
+
+	// Configure interpolation and effects on all channels before playback
+	// starts, as players might allocate any of them. The settings are kept
+	// by the mixer across calls to mixer_ch_play.
+	int num_play_channels = flag_echo_secs > 0 ? NUM_CHANNELS-1 : NUM_CHANNELS;
+	for (int ch=0; ch<num_play_channels; ch++) {
+		mixer_ch_set_interp(ch, flag_interp);
+		if (flag_filter != MIXER_FILTER_NONE)
+			mixer_ch_set_filter(ch, flag_filter, flag_filter_freq, 0.707f);
+		if (flag_echo_secs > 0)
+			mixer_ch_set_send(ch, ECHO_SEND);
+	}
+	if (flag_echo_secs > 0) {
+		mixer_ch_play_delay(NUM_CHANNELS-1, flag_echo_secs);
+		mixer_ch_set_vol(NUM_CHANNELS-1, ECHO_VOLUME, ECHO_VOLUME);
+		mixer_ch_set_send(NUM_CHANNELS-1, ECHO_FEEDBACK);
+	}
+
+	if (strcasecmp(ext, ".wav64") == 0) {
+		wav64_open(&wav, romfn);
+		wav64_play(&wav, 0);
+	} else if (strcasecmp(ext, ".xm64") == 0) {
+		xm64player_open(&xm, romfn);
+		xm64player_set_loop(&xm, false);
+		xm64player_play(&xm, 0);
+	} else if (strcasecmp(ext, ".ym64") == 0) {
+		ym64player_open(&ym, romfn, NULL);
+		ym64player_play(&ym, 0);
+		// YM64 always loop, so stop after one playback.
+		float secs;
+		ym64player_duration(&ym, NULL, &secs);
+		if (!max_samples || secs * flag_freq < max_samples)
+			max_samples = secs * flag_freq;
+	} else {
+		fprintf(stderr, "ERROR: unknown file type: %s\n", infn);
+		mixer_close();
+		return 1;
+	}
+
+	// The mixer output must be in RDRAM (as audio buffers), so poll into
+	// an uncached buffer, and then accumulate the samples.
+	int16_t *buf = malloc_uncached(POLL_SAMPLES * 4);
+	int16_t *out = NULL;
+	int nsamples = 0, cap = 0;
+	double t0 = now();
+	while (!max_samples || nsamples < max_samples) {
+		if (strcasecmp(ext, ".wav64") == 0 && !mixer_ch_playing(0))
+			break;
+		if (strcasecmp(ext, ".xm64") == 0 && !xm.playing)
+			break;
+
+		int n = POLL_SAMPLES;
+		if (max_samples && n > max_samples - nsamples)
+			n = max_samples - nsamples;
+		if (nsamples + n > cap) {
+			cap = (cap + n) * 2;
+			out = realloc(out, cap * 4);
+		}
+		mixer_poll(buf, n);
+		memcpy(out + nsamples*2, buf, n * 4);
+		nsamples += n;
+	}
+	double elapsed = now() - t0;
+	free_uncached(buf);
+
+	if (strcasecmp(ext, ".wav64") == 0)
+		wav64_close(&wav);
+	else if (strcasecmp(ext, ".xm64") == 0)
+		xm64player_close(&xm);
+	else
+		ym64player_close(&ym);
+	mixer_close();
+
+	float secs = (float)nsamples / flag_freq;
+	printf("%s: %08x (%d samples, %.2f s, %.0fx realtime)\n", infn,
+		checksum(out, nsamples), nsamples, secs, elapsed > 0 ? secs / elapsed : 0);
+
+	int ret = 0;
+	if (flag_output_dir) {
+		const char *basename = strrchr(infn, '/');
+		basename = basename ? basename+1 : infn;
+		char outfn[4096];
+		snprintf(outfn, sizeof(outfn), "%s/%.*s.wav", flag_output_dir, (int)(ext - basename), basename);
+		if (flag_verbose)
+			fprintf(stderr, "writing %s\n", outfn);
+		if (!wav_write(outfn, out, nsamples, flag_freq)) {
+			fprintf(stderr, "ERROR: cannot create file: %s\n", outfn);
+			ret = 1;
+		}
+	}
+
+	free(out);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	int i;
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage();
+			return 0;
+		} else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+			flag_verbose = true;
+			host_debug = true;
+		} else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			flag_output_dir = argv[i];
+		} else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--freq")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			flag_freq = atoi(argv[i]);
+			if (flag_freq < 8000 || flag_freq > 96000) {
+				fprintf(stderr, "invalid output frequency: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--time")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			flag_max_secs = atof(argv[i]);
+		} else if (!strcmp(argv[i], "--interp")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			if (!strcmp(argv[i], "none")) flag_interp = MIXER_INTERP_NONE;
+			else if (!strcmp(argv[i], "linear")) flag_interp = MIXER_INTERP_LINEAR;
+			else if (!strcmp(argv[i], "cubic")) flag_interp = MIXER_INTERP_CUBIC;
+			else if (!strcmp(argv[i], "sinc")) flag_interp = MIXER_INTERP_SINC;
+			else {
+				fprintf(stderr, "invalid interpolation mode: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--filter")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			char type[16];
+			if (sscanf(argv[i], "%15[a-z]:%f", type, &flag_filter_freq) != 2) {
+				fprintf(stderr, "invalid filter: %s\n", argv[i]);
+				return 1;
+			}
+			if (!strcmp(type, "lowpass")) flag_filter = MIXER_FILTER_LOWPASS;
+			else if (!strcmp(type, "highpass")) flag_filter = MIXER_FILTER_HIGHPASS;
+			else if (!strcmp(type, "bandpass")) flag_filter = MIXER_FILTER_BANDPASS;
+			else {
+				fprintf(stderr, "invalid filter type: %s\n", type);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--echo")) {
+			if (++i == argc) {
+				fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+				return 1;
+			}
+			flag_echo_secs = atof(argv[i]);
+			if (flag_echo_secs <= 0) {
+				fprintf(stderr, "invalid echo delay: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "invalid flag: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (i == argc) {
+		fprintf(stderr, "missing input file\n");
+		return 1;
+	}
+
+	audio_init(flag_freq, 4);
+
+	int ret = 0;
+	for (; i<argc; i++)
+		ret |= render(argv[i]);
+	return ret;
+}
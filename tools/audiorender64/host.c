@@ -0,0 +1,354 @@
+/*
+ * Host implementation of the libdragon subsystems used by the audio
+ * library: RDRAM, RSP command queue, DMA, DragonFS and audio.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include "n64sys.h"
+#include "rsp.h"
+#include "rspq.h"
+#include "dma.h"
+#include "dragonfs.h"
+#include "debug.h"
+#include "audio.h"
+#include "rsp_ref.h"
+
+bool host_debug = false;
+
+void host_assert_fail(const char *file, int line, const char *expr, const char *msg, ...) {
+	va_list args;
+	fprintf(stderr, "ASSERTION FAILED: %s\n%s:%d\n", expr, file, line);
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+/************************************************************************************
+ *  RDRAM
+ ************************************************************************************/
+
+/*
+ * Memory accessed by the RSP must be within the first 16 MiB of the address
+ * space. Globals are there because the executable is not position independent,
+ * but heap memory is not, so uncached memory (and memalign, which is used
+ * for RSP buffers) is allocated from an arena in the BSS. It is a simple
+ * first-fit allocator: allocations are few and long-lived.
+ */
+#define ARENA_SIZE      (8*1024*1024)
+#define ARENA_ALIGN     16
+
+typedef struct {
+	uint32_t size;      ///< Size of the block (including this header)
+	uint32_t used;      ///< True if the block is allocated
+	uint32_t pad[2];
+} arena_block_t;
+
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static bool arena_initialized;
+
+static bool arena_contains(void *ptr) {
+	return (uint8_t*)ptr >= arena && (uint8_t*)ptr < arena + ARENA_SIZE;
+}
+
+static void *arena_alloc(size_t align, size_t size) {
+	if (!arena_initialized) {
+		assertf((uintptr_t)(arena + ARENA_SIZE) <= HOST_RDRAM_LIMIT,
+			"RDRAM arena is not in the first 16 MiB (%p): the executable must be linked with -no-pie", arena);
+		*(arena_block_t*)arena = (arena_block_t){ .size = ARENA_SIZE };
+		arena_initialized = true;
+	}
+	assertf(align <= ARENA_ALIGN, "unsupported alignment: %zu", align);
+
+	size = (size + sizeof(arena_block_t) + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1);
+	for (uint8_t *cur = arena; cur < arena + ARENA_SIZE; ) {
+		arena_block_t *b = (arena_block_t*)cur;
+		if (!b->used) {
+			// Coalesce with the following free blocks
+			arena_block_t *next;
+			while (cur + b->size < arena + ARENA_SIZE && !(next = (arena_block_t*)(cur + b->size))->used)
+				b->size += next->size;
+			if (b->size >= size) {
+				if (b->size > size) {
+					*(arena_block_t*)(cur + size) = (arena_block_t){ .size = b->size - size };
+					b->size = size;
+				}
+				b->used = 1;
+				return b + 1;
+			}
+		}
+		cur += b->size;
+	}
+	assertf(0, "out of emulated RDRAM (allocating %zu bytes)", size);
+	return NULL;
+}
+
+static void arena_free(void *ptr) {
+	arena_block_t *b = (arena_block_t*)ptr - 1;
+	assert(b->used);
+	b->used = 0;
+}
+
+void *malloc_uncached(size_t size) {
+	return arena_alloc(ARENA_ALIGN, size);
+}
+
+void free_uncached(void *buf) {
+	arena_free(buf);
+}
+
+void *__real_memalign(size_t align, size_t size);
+void __real_free(void *ptr);
+
+// memalign is used by the audio library for buffers accessed by RSP.
+void *__wrap_memalign(size_t align, size_t size) {
+	return arena_alloc(align, size);
+}
+
+void __wrap_free(void *ptr) {
+	if (arena_contains(ptr))
+		arena_free(ptr);
+	else
+		__real_free(ptr);
+}
+
+/************************************************************************************
+ *  VIRTUAL ROM (DRAGONFS AND DMA)
+ ************************************************************************************/
+
+#define MAX_ROM_FILES   64
+#define MAX_OPEN_FILES  4
+
+typedef struct {
+	char *path;         ///< Path of the file in the host filesystem
+	uint32_t addr;      ///< PI address of the file
+	uint32_t size;      ///< Size of the file
+} rom_file_t;
+
+static uint8_t *rom;
+static uint32_t rom_size;
+static rom_file_t rom_files[MAX_ROM_FILES];
+static int rom_num_files;
+
+static struct {
+	rom_file_t *file;   ///< File (NULL if the handle is free)
+	uint32_t pos;       ///< Current position
+} open_files[MAX_OPEN_FILES];
+
+/** @brief Find a file in the virtual ROM, loading it from the host if required */
+static rom_file_t *rom_file(const char *path) {
+	for (int i=0; i<rom_num_files; i++)
+		if (strcmp(rom_files[i].path, path) == 0)
+			return &rom_files[i];
+
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	uint32_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	// As in DragonFS, files are only guaranteed to be 2-byte aligned.
+	assertf(rom_num_files < MAX_ROM_FILES, "too many files in virtual ROM");
+	uint32_t offset = (rom_size + 1) & ~1;
+	rom = realloc(rom, offset + size);
+	if (fread(rom + offset, 1, size, f) != size)
+		assertf(0, "cannot read file: %s", path);
+	fclose(f);
+	rom_size = offset + size;
+
+	rom_file_t *file = &rom_files[rom_num_files++];
+	*file = (rom_file_t){ .path = strdup(path), .addr = HOST_ROM_BASE + offset, .size = size };
+	return file;
+}
+
+static void *rom_ptr(uint32_t pi_address, uint32_t len) {
+	assertf(pi_address >= HOST_ROM_BASE && pi_address + len <= HOST_ROM_BASE + rom_size,
+		"DMA out of virtual ROM: %08x-%08x", pi_address, pi_address + len);
+	return rom + (pi_address - HOST_ROM_BASE);
+}
+
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len) {
+	memcpy(ram_address, rom_ptr(pi_address, len), len);
+}
+
+void dma_read_queued(dma_request_t *req, void *ram_address, unsigned long pi_address, unsigned long len,
+	dma_priority_t priority, dma_callback_t callback, void *ctx)
+{
+	dma_read(ram_address, pi_address, len);
+	req->done = true;
+	if (callback)
+		callback(ctx);
+}
+
+int dfs_open(const char * const path) {
+	rom_file_t *file = rom_file(path);
+	if (!file) return DFS_ENOFILE;
+	for (int i=0; i<MAX_OPEN_FILES; i++) {
+		if (!open_files[i].file) {
+			open_files[i].file = file;
+			open_files[i].pos = 0;
+			return i;
+		}
+	}
+	return DFS_ENOMEM;
+}
+
+int dfs_read(void * const buf, int size, int count, uint32_t handle) {
+	if (handle >= MAX_OPEN_FILES || !open_files[handle].file)
+		return DFS_EBADHANDLE;
+	rom_file_t *file = open_files[handle].file;
+	int len = size * count;
+	if (len > file->size - open_files[handle].pos)
+		len = file->size - open_files[handle].pos;
+	dma_read(buf, file->addr + open_files[handle].pos, len);
+	open_files[handle].pos += len;
+	return len;
+}
+
+int dfs_seek(uint32_t handle, int offset, int origin) {
+	if (handle >= MAX_OPEN_FILES || !open_files[handle].file)
+		return DFS_EBADHANDLE;
+	int base = origin == SEEK_SET ? 0 : origin == SEEK_CUR ? open_files[handle].pos : open_files[handle].file->size;
+	if (base + offset < 0 || base + offset > open_files[handle].file->size)
+		return DFS_EBADINPUT;
+	open_files[handle].pos = base + offset;
+	return DFS_ESUCCESS;
+}
+
+int dfs_tell(uint32_t handle) {
+	if (handle >= MAX_OPEN_FILES || !open_files[handle].file)
+		return DFS_EBADHANDLE;
+	return open_files[handle].pos;
+}
+
+int dfs_size(uint32_t handle) {
+	if (handle >= MAX_OPEN_FILES || !open_files[handle].file)
+		return DFS_EBADHANDLE;
+	return open_files[handle].file->size;
+}
+
+int dfs_close(uint32_t handle) {
+	if (handle >= MAX_OPEN_FILES || !open_files[handle].file)
+		return DFS_EBADHANDLE;
+	open_files[handle].file = NULL;
+	return DFS_ESUCCESS;
+}
+
+uint32_t dfs_rom_addr(const char *path) {
+	rom_file_t *file = rom_file(path);
+	return file ? file->addr : 0;
+}
+
+FILE *__real_fopen(const char *path, const char *mode);
+
+// Players open files with the rom:/ prefix, which is mapped to the current
+// directory of the host filesystem.
+FILE *__wrap_fopen(const char *path, const char *mode) {
+	if (strncmp(path, "rom:/", 5) == 0)
+		path += 5;
+	return __real_fopen(path, mode);
+}
+
+/************************************************************************************
+ *  AUDIO
+ ************************************************************************************/
+
+static int audio_freq;
+
+void audio_init(const int frequency, int numbuffers) {
+	audio_freq = frequency;
+}
+
+void audio_close(void) {
+	audio_freq = 0;
+}
+
+int audio_get_frequency(void) {
+	return audio_freq;
+}
+
+/************************************************************************************
+ *  RSP COMMAND QUEUE
+ ************************************************************************************/
+
+#define MAX_OVERLAYS    8
+
+static struct {
+	rsp_ucode_t *ucode;         ///< Registered ucode (NULL if the slot is free)
+	rsp_ref_command_t exec;     ///< C reference of the commands of the ucode
+} overlays[MAX_OVERLAYS];
+
+struct rspq_fence_s {
+	uint32_t value;             ///< Last value signalled
+};
+
+void rspq_init(void) {}
+
+void rspq_close(void) {}
+
+uint32_t rspq_overlay_register(rsp_ucode_t *overlay_ucode) {
+	rsp_ref_command_t exec = rsp_ref_lookup(overlay_ucode->name);
+	assertf(exec, "no C reference for ucode: %s", overlay_ucode->name);
+	for (int i=0; i<MAX_OVERLAYS; i++) {
+		if (!overlays[i].ucode) {
+			overlays[i].ucode = overlay_ucode;
+			overlays[i].exec = exec;
+			// Use the same encoding of real overlay IDs (top nibble).
+			return (i+1) << 28;
+		}
+	}
+	assertf(0, "too many overlays");
+	return 0;
+}
+
+void rspq_overlay_unregister(uint32_t overlay_id) {
+	int idx = (overlay_id >> 28) - 1;
+	assert(idx >= 0 && idx < MAX_OVERLAYS && overlays[idx].ucode);
+	overlays[idx].ucode = NULL;
+}
+
+void* rspq_overlay_get_state(rsp_ucode_t *overlay_ucode) {
+	return overlay_ucode->state;
+}
+
+void rspq_host_exec(uint32_t ovl_id, uint32_t cmd_id, const uint32_t *args, int nargs) {
+	int idx = (ovl_id >> 28) - 1;
+	assertf(idx >= 0 && idx < MAX_OVERLAYS && overlays[idx].ucode, "invalid overlay ID: %08x", ovl_id);
+
+	// Like on RSP, the first argument word also contains the command ID.
+	uint32_t a[4] = {0};
+	for (int i=0; i<nargs && i<4; i++)
+		a[i] = args[i];
+	a[0] = (a[0] & 0x00FFFFFF) | ((ovl_id | (cmd_id << 24)) & 0xFF000000);
+	overlays[idx].exec(overlays[idx].ucode, cmd_id, a);
+}
+
+rspq_fence_t* rspq_fence_new(void) {
+	rspq_fence_t *f = malloc(sizeof(rspq_fence_t));
+	f->value = 0;
+	return f;
+}
+
+void rspq_fence_free(rspq_fence_t *f) {
+	free(f);
+}
+
+uint32_t rspq_fence_enqueue_signal(rspq_fence_t *f) {
+	// Commands run synchronously, so the fence is signalled right away.
+	return ++f->value;
+}
+
+bool rspq_fence_check(rspq_fence_t *f, uint32_t value) {
+	return (int32_t)(f->value - value) >= 0;
+}
+
+void rspq_fence_wait(rspq_fence_t *f, uint32_t value) {
+	assertf(rspq_fence_check(f, value), "waiting for a fence that was never enqueued");
+}
@@ -0,0 +1,473 @@
+/*
+ * C reference of the audio RSP ucodes (rsp_mixer.S, rsp_vadpcm.S, rsp_mdct.S).
+ *
+ * These are bit-exact implementations of the ucodes: they reproduce the
+ * same fixed-point arithmetic (rounding, clamping and wrapping of the vector
+ * unit), and also the same DMA patterns where they affect the output
+ * (eg: which samples the mixer fetches before wrapping a loop).
+ *
+ * Data structures written by the CPU are in host endianness, while samples
+ * are big-endian as seen by RSP in RDRAM. The only exception is the
+ * output of the mixer, which is in host endianness as it is directly
+ * consumed by the host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "n64sys.h"
+#include "debug.h"
+#include "rsp_ref.h"
+#include "wav64internal.h"
+
+/** @brief Convert a RSP address (24-bit) into a host pointer */
+static inline void *rdram(uint32_t addr) {
+	return (void*)(uintptr_t)(addr & 0xFFFFFF);
+}
+
+static inline int16_t rd16be(const uint8_t *p) {
+	return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void wr16be(uint8_t *p, int16_t v) {
+	p[0] = (uint16_t)v >> 8;
+	p[1] = v & 0xFF;
+}
+
+static inline int16_t clamp16(int64_t x) {
+	if (x > 32767) return 32767;
+	if (x < -32768) return -32768;
+	return x;
+}
+
+/************************************************************************************
+ *  MIXER (rsp_mixer.S)
+ ************************************************************************************/
+
+#define MIXER_MAX_CHANNELS      32
+#define MIXER_MAX_SAMPLES       32      ///< MAX_SAMPLES_PER_LOOP
+#define MIXER_SAMPLE_CACHE      64      ///< SAMPLE_CACHE_SIZE
+#define MIXER_POS_FRAC          12      ///< WAVEFORM_POS_FRAC_BITS
+#define MIXER_FLAGS_16BIT       (1<<2)
+#define MIXER_FLAGS_STEREO      (1<<3)
+#define MIXER_FLAGS_FX_DELAY    (1<<5)
+#define MIXER_FLAGS_INTERP      (3<<6)
+#define MIXER_INTERP_SHIFT      6
+#define MIXER_FX_FILTERS        0x0F
+#define MIXER_FX_BUS            0x10
+#define MIXER_LOOP_OVERREAD     64
+#define MIXER_ALPHA             0xe076
+#define MIXER_1MALPHA           0x1f8a
+
+/** @brief Channel settings (rsp_mixer_channel_t in mixer.c) */
+typedef struct {
+	uint32_t pos, step, len, loop_len, ptr, flags;
+} mixer_ref_channel_t;
+
+/** @brief Mixer settings (rsp_mixer_settings_t in mixer.c) */
+typedef struct {
+	int16_t lvol[MIXER_MAX_CHANNELS];
+	int16_t rvol[MIXER_MAX_CHANNELS];
+	mixer_ref_channel_t channels[MIXER_MAX_CHANNELS];
+} mixer_ref_settings_t;
+
+/** @brief Biquad filters of a group of 8 channels (rsp_mixer_biquad_t in mixer.c) */
+typedef struct {
+	int16_t b0[8], b1[8], b2[8], na1[8], na2[8];
+	int16_t x1[8], x2[8], y1[8], y2[8];
+} mixer_ref_biquad_t;
+
+/** @brief Effects settings, following the settings (rsp_mixer_fx_t in mixer.c) */
+typedef struct {
+	int16_t send[MIXER_MAX_CHANNELS];
+	mixer_ref_biquad_t filter[MIXER_MAX_CHANNELS/8];
+	int16_t interp[3][4][8];
+} mixer_ref_fx_t;
+
+/** @brief Saved state of the ucode */
+typedef struct {
+	int16_t xvol_l[MIXER_MAX_CHANNELS];
+	int16_t xvol_r[MIXER_MAX_CHANNELS];
+} mixer_ref_state_t;
+
+/**
+ * @brief Compute an interpolated sample (WaveInterpKernel)
+ *
+ * The coefficients are cubic polynomials of the fractional position
+ * (3.13), evaluated in the accumulator (VMUDL, VMUDM, VMADM, VMADH).
+ * The dot product is accumulated 4 times (VMULF + 3x VMACF), and
+ * the lanes are then summed pairwise with saturation (VADD).
+ *
+ * This follows the instruction sequence of the ucode, but it has not been
+ * verified against the output of real hardware.
+ */
+static int16_t mixer_ref_interp(const int16_t k[4][8], const int16_t taps[8], uint16_t f) {
+	uint16_t f2 = ((uint32_t)f * f) >> 16;
+	uint16_t f3 = ((uint32_t)f2 * f) >> 16;
+	int16_t y[8];
+	for (int i=0; i<8; i++) {
+		int64_t acc = (int64_t)k[0][i] * f3 + (int64_t)k[1][i] * f2 +
+			(int64_t)k[2][i] * f + ((int64_t)k[3][i] << 16);
+		int16_t coeff = clamp16(acc >> 16);
+		y[i] = clamp16(((int64_t)taps[i] * coeff * 8 + 0x8000) >> 16);
+	}
+	for (int i=0; i<4; i++) y[i*2] = clamp16(y[i*2] + y[i*2+1]);
+	for (int i=0; i<2; i++) y[i*4] = clamp16(y[i*4] + y[i*4+2]);
+	return clamp16(y[0] + y[4]);
+}
+
+/** @brief Resample a channel into the channel buffer (UpdateAndFetch) */
+static void mixer_ref_fetch(mixer_ref_channel_t *ch, int c, int num,
+	const mixer_ref_fx_t *fx, int16_t buf[MIXER_MAX_SAMPLES][MIXER_MAX_CHANNELS])
+{
+	bool stereo = ch->flags & MIXER_FLAGS_STEREO;
+	bool is16 = ch->flags & MIXER_FLAGS_16BIT;
+	int align = (stereo ? 2 : 1) * (is16 ? 2 : 1) - 1;
+	int mode = (ch->flags & MIXER_FLAGS_INTERP) >> MIXER_INTERP_SHIFT;
+	// Interpolation fetches 3 samples before the position, and needs 4 after
+	uint32_t back = mode ? (is16 ? 6 : 3) : 0;
+	int32_t end = (MIXER_SAMPLE_CACHE - (mode ? 8 : 0)) << MIXER_POS_FRAC;
+	uint32_t pos = ch->pos;
+	int ticks = num, i = 0;
+
+	while (ticks > 0) {
+		// WaveStart: check for the end of the waveform, and apply the loop
+		if (pos >= ch->len) {
+			if (!ch->loop_len) break;
+			pos -= ch->loop_len;
+			continue;
+		}
+
+		// Fetch SAMPLE_CACHE_SIZE bytes starting from the 8-byte aligned
+		// address containing the current sample. The resampling loop
+		// then uses a position relative to the cached area.
+		uint32_t s2 = pos >> MIXER_POS_FRAC;
+		uint32_t s0 = ch->ptr + s2 - back;
+		uint32_t base = (s2 - back - (s0 & 7)) << MIXER_POS_FRAC;
+		const uint8_t *cache = rdram(s0 & ~7);
+		int32_t rel = pos - base;
+
+		while (ticks > 0 && rel < end) {
+			const uint8_t *s = cache + ((rel >> MIXER_POS_FRAC) & ~align);
+			if (mode) {
+				int16_t taps[8];
+				for (int j=0; j<8; j++)
+					taps[j] = is16 ? rd16be(s + (j-3)*2) : (int16_t)(s[j-3] << 8);
+				uint16_t f = rel << (is16 ? 3 : 4);
+				buf[i][c] = mixer_ref_interp(fx->interp[mode-1], taps, f);
+			} else if (!stereo) {
+				buf[i][c] = is16 ? rd16be(s) : (int16_t)(s[0] << 8);
+			} else if (!is16) {
+				buf[i][c] = (int16_t)(s[0] << 8);
+				buf[i][c+1] = (int16_t)(s[1] << 8);
+			} else {
+				buf[i][c] = rd16be(s);
+				buf[i][c+1] = rd16be(s+2);
+			}
+			rel += ch->step;
+			ticks--; i++;
+		}
+		pos = base + rel;
+	}
+
+	// The rest of the buffer is silence (the ucode clears it in advance)
+	for (; i<num; i++) {
+		buf[i][c] = 0;
+		if (stereo) buf[i][c+1] = 0;
+	}
+	ch->pos = pos;
+}
+
+/**
+ * @brief Apply the biquad filters to a group of 8 channels (FxFilter)
+ *
+ * Each product is accumulated twice (VMULF + VMACF), as the coefficients
+ * are 2.14; the rounding constant is added once.
+ */
+static void mixer_ref_filter(mixer_ref_biquad_t *bq, int g, int num,
+	int16_t buf[MIXER_MAX_SAMPLES][MIXER_MAX_CHANNELS])
+{
+	for (int l=0; l<8; l++) {
+		int c = g*8 + l;
+		int16_t x1 = bq->x1[l], x2 = bq->x2[l], y1 = bq->y1[l], y2 = bq->y2[l];
+		for (int j=0; j<num; j++) {
+			int16_t x = buf[j][c];
+			int64_t acc = 0x8000 + 4 * ((int64_t)bq->b0[l]*x + (int64_t)bq->b1[l]*x1 + (int64_t)bq->b2[l]*x2 +
+				(int64_t)bq->na1[l]*y1 + (int64_t)bq->na2[l]*y2);
+			int16_t y = clamp16(acc >> 16);
+			x2 = x1; x1 = x;
+			y2 = y1; y1 = y;
+			buf[j][c] = y;
+		}
+		bq->x1[l] = x1; bq->x2[l] = x2; bq->y1[l] = y1; bq->y2[l] = y2;
+	}
+}
+
+/**
+ * @brief Write the effects bus into a delay line (FxDelayWrite)
+ *
+ * The bus is written where the channel has just read from, and the first
+ * MIXER_LOOP_OVERREAD bytes of the line are mirrored after its end.
+ */
+static void mixer_ref_delay_write(mixer_ref_channel_t *ch, int num, const int16_t *bus) {
+	int32_t start = (int32_t)ch->pos - (num << (MIXER_POS_FRAC+1));
+	if (start < 0) start += ch->len;
+	uint32_t off = start >> MIXER_POS_FRAC;
+	uint32_t len = ch->len >> MIXER_POS_FRAC;
+	uint8_t *line = rdram(ch->ptr);
+
+	for (int j=0; j<num; j++) {
+		wr16be(line + off, bus[j]);
+		if (off < MIXER_LOOP_OVERREAD)
+			wr16be(line + len + off, bus[j]);
+		off += 2;
+		if (off == len) off = 0;
+	}
+}
+
+/**
+ * @brief Mix the channel buffer into the output (Mixer)
+ *
+ * Only the lanes in the @p active list were written by the fetch step
+ * (or by the filters): the others are silent, so they would only add zero
+ * products. If @p send is not NULL, the effects bus is also mixed into @p bus.
+ */
+static void mixer_ref_mix(mixer_ref_state_t *st, const int16_t chvol_l[MIXER_MAX_CHANNELS],
+	const int16_t chvol_r[MIXER_MAX_CHANNELS], int nlanes, const uint8_t *active, int nactive,
+	int num, int16_t buf[MIXER_MAX_SAMPLES][MIXER_MAX_CHANNELS], int16_t *out,
+	const int16_t *send, int16_t *bus)
+{
+	// Accumulator lanes that receive at least one product. The others
+	// only contain the rounding constant, so they add zero to the output.
+	uint8_t lanes = 0;
+	for (int k=0; k<nactive; k++)
+		lanes |= 1 << (active[k] & 7);
+
+	for (int i=0; i<num; i+=8) {
+		for (int j=i; j<i+8 && j<num; j++) {
+			// VMULF/VMACF: products are doubled, rounding is added once
+			int64_t acc_l[8], acc_r[8], acc_s[8];
+			for (int l=0; l<8; l++)
+				acc_l[l] = acc_r[l] = acc_s[l] = 0x8000;
+			for (int k=0; k<nactive; k++) {
+				int g = active[k];
+				int32_t s = buf[j][g];
+				acc_l[g&7] += 2 * (int64_t)(s * st->xvol_l[g]);
+				acc_r[g&7] += 2 * (int64_t)(s * st->xvol_r[g]);
+				if (send)
+					acc_s[g&7] += 2 * (int64_t)(s * send[g]);
+			}
+
+			// VADDC: lanes are summed without saturation (so the order
+			// of the additions does not matter)
+			int16_t o_l = 0, o_r = 0, o_s = 0;
+			for (int l=0; l<8; l++) {
+				if (!(lanes & (1 << l))) continue;
+				o_l += clamp16(acc_l[l] >> 16);
+				o_r += clamp16(acc_r[l] >> 16);
+				o_s += clamp16(acc_s[l] >> 16);
+			}
+			out[j*2+0] = o_l;
+			out[j*2+1] = o_r;
+			if (send)
+				bus[j] = o_s;
+		}
+
+		// Volume filter (VMUDM/VMADM): signed volume by unsigned constant
+		for (int l=0; l<nlanes; l++) {
+			st->xvol_l[l] = clamp16(((int64_t)st->xvol_l[l] * MIXER_ALPHA + (int64_t)chvol_l[l] * MIXER_1MALPHA) >> 16);
+			st->xvol_r[l] = clamp16(((int64_t)st->xvol_r[l] * MIXER_ALPHA + (int64_t)chvol_r[l] * MIXER_1MALPHA) >> 16);
+		}
+	}
+}
+
+static void rsp_mixer_ref(rsp_ucode_t *ucode, uint32_t cmd_id, const uint32_t *args) {
+	assertf(cmd_id == 0, "rsp_mixer: invalid command %lx", (unsigned long)cmd_id);
+
+	mixer_ref_state_t *st = (mixer_ref_state_t*)ucode->state;
+	uint16_t glvol = args[0] & 0xFFFF;
+	int fx_flags = (args[0] >> 16) & 0xFF;
+	int num_samples = (int16_t)(args[1] >> 16);
+	int nch = args[1] & 0xFFFF;
+	uint32_t out = args[2];
+	mixer_ref_settings_t *settings = rdram(args[3]);
+	mixer_ref_fx_t *fx = (mixer_ref_fx_t*)(settings + 1);
+	const int16_t *send = (fx_flags & MIXER_FX_BUS) ? fx->send : NULL;
+
+	// Apply the global volume (VMUDL)
+	int16_t chvol_l[MIXER_MAX_CHANNELS], chvol_r[MIXER_MAX_CHANNELS];
+	for (int c=0; c<MIXER_MAX_CHANNELS; c++) {
+		chvol_l[c] = ((uint32_t)(uint16_t)settings->lvol[c] * glvol) >> 16;
+		chvol_r[c] = ((uint32_t)(uint16_t)settings->rvol[c] * glvol) >> 16;
+	}
+
+	// The 8-channel mixing core only processes (and filters) the first 8 channels
+	int nlanes = nch <= 8 ? 8 : MIXER_MAX_CHANNELS;
+
+	while (num_samples > 0) {
+		// Keep the output DMA 8-byte aligned after the first loop
+		int num = MIXER_MAX_SAMPLES - ((out & 7) != 0);
+		if (num > num_samples) num = num_samples;
+		num_samples -= num;
+
+		int16_t buf[MIXER_MAX_SAMPLES][MIXER_MAX_CHANNELS];
+		uint32_t written = 0;
+		for (int c=0; c<nch; c++) {
+			mixer_ref_channel_t *ch = &settings->channels[c];
+			if (!ch->ptr) continue;
+			mixer_ref_fetch(ch, c, num, fx, buf);
+			written |= 1u << c;
+			if (ch->flags & MIXER_FLAGS_STEREO)
+				written |= 1u << ++c;
+		}
+
+		// Filters run on all the lanes of a group, including the silent ones
+		for (int g=0; g<MIXER_MAX_CHANNELS/8; g++) {
+			if (!(fx_flags & MIXER_FX_FILTERS & (1 << g))) continue;
+			for (int c=g*8; c<g*8+8; c++) {
+				if (written & (1u << c)) continue;
+				for (int j=0; j<num; j++)
+					buf[j][c] = 0;
+			}
+			mixer_ref_filter(&fx->filter[g], g, num, buf);
+			written |= 0xFFu << (g*8);
+		}
+
+		uint8_t active[MIXER_MAX_CHANNELS];
+		int nactive = 0;
+		for (int c=0; c<nlanes; c++)
+			if (written & (1u << c)) active[nactive++] = c;
+
+		int16_t bus[MIXER_MAX_SAMPLES];
+		mixer_ref_mix(st, chvol_l, chvol_r, nlanes, active, nactive, num, buf, rdram(out), send, bus);
+		out += num * 4;
+
+		if (send) {
+			for (int c=0; c<nch; c++) {
+				mixer_ref_channel_t *ch = &settings->channels[c];
+				if ((ch->flags & MIXER_FLAGS_FX_DELAY) && ch->ptr)
+					mixer_ref_delay_write(ch, num, bus);
+			}
+		}
+	}
+}
+
+/************************************************************************************
+ *  VADPCM DECODER (rsp_vadpcm.S)
+ ************************************************************************************/
+
+#define VADPCM_FLAG_STEREO      (1<<3)
+#define VADPCM_FLAG_RESET       (1<<4)
+#define VADPCM_FLAG_LOOP        (1<<5)
+#define VADPCM_FLAG_NO_OUTPUT   (1<<6)
+
+/** @brief Decoder context (vadpcm_rsp_ctx_t in wav64.c) */
+typedef struct {
+	int16_t state[2][2];
+	int16_t loop_state[2][2];
+	int16_t book[VADPCM_MAX_PREDICTORS][32];
+} vadpcm_ref_ctx_t;
+
+static void rsp_vadpcm_ref(rsp_ucode_t *ucode, uint32_t cmd_id, const uint32_t *args) {
+	assertf(cmd_id == 0, "rsp_vadpcm: invalid command %lx", (unsigned long)cmd_id);
+
+	uint8_t *dst = rdram(args[0]);
+	const uint8_t *src = rdram(args[1]);
+	vadpcm_ref_ctx_t *ctx = rdram(args[2]);
+	int flags = args[2] >> 24;
+	int skip = args[3] >> 16;
+	int n = args[3] & 0xFFFF;
+	int nch = flags & VADPCM_FLAG_STEREO ? 2 : 1;
+
+	// Convert the expanded codebook back to the format of the file
+	int16_t book[VADPCM_MAX_PREDICTORS][2][8];
+	for (int p=0; p<VADPCM_MAX_PREDICTORS; p++) {
+		for (int i=0; i<8; i++) {
+			book[p][0][i] = ctx->book[p][i];
+			book[p][1][i] = ctx->book[p][17+i];
+		}
+	}
+
+	int16_t state[2][2];
+	if (flags & VADPCM_FLAG_RESET)
+		memset(state, 0, sizeof(state));
+	else if (flags & VADPCM_FLAG_LOOP)
+		memcpy(state, ctx->loop_state, sizeof(state));
+	else
+		memcpy(state, ctx->state, sizeof(state));
+
+	// The state saved in the context is the one at the start of the
+	// frame containing the next sample to decode.
+	int nframes = (skip + n + VADPCM_FRAME_SAMPLES - 1) / VADPCM_FRAME_SAMPLES;
+	int complete = (skip + n) / VADPCM_FRAME_SAMPLES;
+	int16_t saved[2][2];
+	memcpy(saved, state, sizeof(saved));
+
+	int16_t pcm[32 * VADPCM_FRAME_SAMPLES * 2];
+	assert(nframes * nch <= 32);
+	for (int f=0; f<nframes; f++) {
+		for (int c=0; c<nch; c++)
+			vadpcm_decode_frame(src + (f*nch + c) * VADPCM_FRAME_BYTES, book, state[c],
+				pcm + f*VADPCM_FRAME_SAMPLES*nch + c, nch);
+		if (f == complete-1)
+			memcpy(saved, state, sizeof(saved));
+	}
+	memcpy(ctx->state, saved, sizeof(saved));
+
+	if (!(flags & VADPCM_FLAG_NO_OUTPUT)) {
+		for (int i=0; i<n*nch; i++)
+			wr16be(dst + i*2, pcm[skip*nch + i]);
+	}
+}
+
+/************************************************************************************
+ *  MDCT DECODER (rsp_mdct.S)
+ ************************************************************************************/
+
+#define MDCT_CMD_IMDCT          0x0
+#define MDCT_CMD_OUTPUT         0x1
+#define MDCT_CMD_SET_TABLES     0x2
+#define MDCT_FLAG_NO_OUTPUT     (1<<24)
+
+/** @brief Saved state of the ucode */
+typedef struct {
+	uint32_t tables;        ///< RDRAM address of the tables
+} mdct_ref_state_t;
+
+static void rsp_mdct_ref(rsp_ucode_t *ucode, uint32_t cmd_id, const uint32_t *args) {
+	mdct_ref_state_t *st = (mdct_ref_state_t*)ucode->state;
+
+	switch (cmd_id) {
+	case MDCT_CMD_IMDCT: {
+		assertf(st->tables, "rsp_mdct: tables not set");
+		const int16_t *in = rdram(args[0]);
+		int16_t *out = rdram(args[1]);
+		int16_t *ola = rdram(args[2]);
+		mdct_imdct(in, (int32_t)args[3], ola, args[2] & MDCT_FLAG_NO_OUTPUT ? NULL : out,
+			rdram(st->tables));
+	}	break;
+	case MDCT_CMD_OUTPUT: {
+		uint8_t *dst = rdram(args[0]);
+		const int16_t *pcm0 = rdram(args[1]);
+		const int16_t *pcm1 = rdram(args[2]);
+		int n = args[3] & 0xFFFF;
+		bool stereo = args[3] >> 16;
+		for (int i=0; i<n; i++) {
+			wr16be(dst, pcm0[i]); dst += 2;
+			if (stereo) { wr16be(dst, pcm1[i]); dst += 2; }
+		}
+	}	break;
+	case MDCT_CMD_SET_TABLES:
+		st->tables = args[0] & 0xFFFFFF;
+		break;
+	default:
+		assertf(0, "rsp_mdct: invalid command %lx", (unsigned long)cmd_id);
+	}
+}
+
+rsp_ref_command_t rsp_ref_lookup(const char *name) {
+	if (strcmp(name, "rsp_mixer") == 0)  return rsp_mixer_ref;
+	if (strcmp(name, "rsp_vadpcm") == 0) return rsp_vadpcm_ref;
+	if (strcmp(name, "rsp_mdct") == 0)   return rsp_mdct_ref;
+	return NULL;
+}
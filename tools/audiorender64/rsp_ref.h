@@ -0,0 +1,20 @@
+#ifndef __AUDIORENDER64_RSP_REF_H
+#define __AUDIORENDER64_RSP_REF_H
+
+#include <stdint.h>
+#include "rsp.h"
+
+/**
+ * @brief C reference of the commands of a RSP ucode.
+ *
+ * @param ucode     Ucode (whose saved state can be accessed)
+ * @param cmd_id    Command ID within the overlay
+ * @param args      The four argument words of the command, as seen by
+ *                  the RSP (the first one contains the command ID in the top byte)
+ */
+typedef void (*rsp_ref_command_t)(rsp_ucode_t *ucode, uint32_t cmd_id, const uint32_t *args);
+
+/** @brief Find the C reference of a ucode by name (NULL if not available) */
+rsp_ref_command_t rsp_ref_lookup(const char *name);
+
+#endif
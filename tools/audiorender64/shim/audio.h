@@ -0,0 +1,15 @@
+/**
+ * @file audio.h
+ * @brief Audio Subsystem (host shim for audiorender64)
+ *
+ * There is no audio output on the host: the output frequency is just
+ * recorded, and samples are produced by calling mixer_poll.
+ */
+#ifndef __LIBDRAGON_AUDIO_H
+#define __LIBDRAGON_AUDIO_H
+
+void audio_init(const int frequency, int numbuffers);
+void audio_close(void);
+int audio_get_frequency(void);
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file debug.h
+ * @brief Debugging support (host shim for audiorender64)
+ */
+#ifndef __LIBDRAGON_DEBUG_H
+#define __LIBDRAGON_DEBUG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/** @brief True if debug logs must be written to stderr */
+extern bool host_debug;
+
+#define debugf(msg, ...) ({ \
+	if (host_debug) fprintf(stderr, msg, ##__VA_ARGS__); \
+})
+
+/** @brief Report a failed assertion and abort */
+void host_assert_fail(const char *file, int line, const char *expr, const char *msg, ...)
+	__attribute__((noreturn, format(printf, 4, 5)));
+
+#define assertf(expr, msg, ...) ({ \
+	if (!(expr)) host_assert_fail(__FILE__, __LINE__, #expr, msg, ##__VA_ARGS__); \
+})
+
+#endif
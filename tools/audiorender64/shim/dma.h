@@ -0,0 +1,34 @@
+/**
+ * @file dma.h
+ * @brief PI DMA (host shim for audiorender64)
+ *
+ * Transfers copy data from the virtual ROM (see dragonfs.h), and complete
+ * immediately.
+ */
+#ifndef __LIBDRAGON_DMA_H
+#define __LIBDRAGON_DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+	DMA_PRIORITY_LOW = 0,
+	DMA_PRIORITY_NORMAL,
+	DMA_PRIORITY_HIGH,
+	DMA_PRIORITY_COUNT
+} dma_priority_t;
+
+typedef void (*dma_callback_t)(void *ctx);
+
+/** @brief A queued DMA request (always completed on the host) */
+typedef struct dma_request_s {
+	bool done;              ///< True when the transfer is done
+} dma_request_t;
+
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_read_queued(dma_request_t *req, void *ram_address, unsigned long pi_address, unsigned long len,
+	dma_priority_t priority, dma_callback_t callback, void *ctx);
+static inline bool dma_request_done(dma_request_t *req) { return true; }
+static inline void dma_request_wait(dma_request_t *req) {}
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file dragonfs.h
+ * @brief DragonFS (host shim for audiorender64)
+ *
+ * Files are read from the host filesystem (paths are relative to the current
+ * directory). Each opened file is also loaded into a virtual ROM, so that
+ * it can be accessed via DMA.
+ */
+#ifndef __LIBDRAGON_DRAGONFS_H
+#define __LIBDRAGON_DRAGONFS_H
+
+#include <stdint.h>
+
+/** @brief Base PI address of the virtual ROM */
+#define HOST_ROM_BASE       0x10101000
+
+#define DFS_ESUCCESS        0
+#define DFS_EBADINPUT       -1
+#define DFS_ENOFILE         -2
+#define DFS_EBADFS          -3
+#define DFS_ENOMEM          -4
+#define DFS_EBADHANDLE      -5
+
+int dfs_open(const char * const path);
+int dfs_read(void * const buf, int size, int count, uint32_t handle);
+int dfs_seek(uint32_t handle, int offset, int origin);
+int dfs_tell(uint32_t handle);
+int dfs_close(uint32_t handle);
+int dfs_size(uint32_t handle);
+uint32_t dfs_rom_addr(const char *path);
+
+#endif
@@ -0,0 +1,24 @@
+/**
+ * @file hostcompat.h
+ * @brief Functions of newlib that are not available on all hosts
+ *
+ * This file is force-included in all the sources of audiorender64.
+ */
+#ifndef __AUDIORENDER64_HOSTCOMPAT_H
+#define __AUDIORENDER64_HOSTCOMPAT_H
+
+#include <string.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+static inline size_t strlcpy(char *dst, const char *src, size_t size) {
+	size_t len = strlen(src);
+	if (size) {
+		size_t n = len < size-1 ? len : size-1;
+		memcpy(dst, src, n);
+		dst[n] = 0;
+	}
+	return len;
+}
+#endif
+
+#endif
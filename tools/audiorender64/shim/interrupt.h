@@ -0,0 +1,11 @@
+/**
+ * @file interrupt.h
+ * @brief Interrupt Controller (host shim for audiorender64: no interrupts)
+ */
+#ifndef __LIBDRAGON_INTERRUPT_H
+#define __LIBDRAGON_INTERRUPT_H
+
+static inline void disable_interrupts(void) {}
+static inline void enable_interrupts(void) {}
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file libdragon.h
+ * @brief Main include file (host shim for audiorender64)
+ *
+ * Only the audio subsystem is available on the host.
+ */
+#ifndef __LIBDRAGON_LIBDRAGON_H
+#define __LIBDRAGON_LIBDRAGON_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "n64sys.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "dma.h"
+#include "dragonfs.h"
+#include "rspq.h"
+#include "audio.h"
+#include "mixer.h"
+#include "samplebuffer.h"
+#include "wav64.h"
+#include "xm64.h"
+#include "ym64.h"
+
+#endif
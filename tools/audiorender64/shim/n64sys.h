@@ -0,0 +1,54 @@
+/**
+ * @file n64sys.h
+ * @brief N64 System Interface (host shim for audiorender64)
+ *
+ * RDRAM is emulated by the host memory: a "physical address" is just the
+ * host pointer. This requires all the memory seen by the RSP to be below
+ * 16 MiB (as RSP commands pack flags in the top byte of addresses), which is
+ * guaranteed by linking a non-PIE executable, and by allocating uncached
+ * memory from an arena in the BSS (see host.c).
+ */
+#ifndef __LIBDRAGON_N64SYS_H
+#define __LIBDRAGON_N64SYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+/** @brief Size of the emulated RDRAM reachable by the RSP */
+#define HOST_RDRAM_LIMIT    0x1000000
+
+/** @brief Return the physical address of a host pointer */
+#define PhysicalAddr(_addr) ({ \
+	const volatile void *_addrp = (_addr); \
+	assert((uintptr_t)_addrp < HOST_RDRAM_LIMIT); \
+	(uint32_t)(uintptr_t)_addrp; \
+})
+
+/** @brief Uncached segment: there are no caches on the host */
+#define UncachedAddr(_addr)     ((void *)(_addr))
+/** @brief Cached segment: there are no caches on the host */
+#define CachedAddr(_addr)       ((void *)(_addr))
+
+/** @brief Memory barrier (compiler only) */
+#define MEMORY_BARRIER()        asm volatile ("" : : : "memory")
+
+/** @brief Number of ticks per second (as the N64 COP0 counter) */
+#define TICKS_PER_SECOND        (93750000/2)
+
+/** @brief Read the tick counter, emulated with the host monotonic clock */
+#define TICKS_READ() ({ \
+	struct timespec _ts; clock_gettime(CLOCK_MONOTONIC, &_ts); \
+	(uint32_t)(_ts.tv_sec * TICKS_PER_SECOND + _ts.tv_nsec / 1000 * (TICKS_PER_SECOND / 1000000)); \
+})
+
+static inline void data_cache_hit_writeback(volatile const void *addr, unsigned long length) {}
+static inline void data_cache_hit_invalidate(volatile void *addr, unsigned long length) {}
+static inline void data_cache_hit_writeback_invalidate(volatile void *addr, unsigned long length) {}
+
+void *malloc_uncached(size_t size);
+void free_uncached(void *buf);
+
+#endif
@@ -0,0 +1,7 @@
+/**
+ * @file regsinternal.h
+ * @brief Register definitions (host shim for audiorender64: no hardware registers)
+ */
+#ifndef __LIBDRAGON_REGSINTERNAL_H
+#define __LIBDRAGON_REGSINTERNAL_H
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file rsp.h
+ * @brief RSP ucodes (host shim for audiorender64)
+ *
+ * A ucode is identified by its name, which is used to look up the C
+ * reference implementation of its commands (see rsp_ref.c).
+ */
+#ifndef __LIBDRAGON_RSP_H
+#define __LIBDRAGON_RSP_H
+
+#include <stdint.h>
+
+/** @brief Maximum size of the saved state of an emulated overlay */
+#define HOST_UCODE_STATE_SIZE   256
+
+/** @brief A RSP ucode, emulated by C code */
+typedef struct {
+	const char *name;       ///< Name of the ucode
+	/** @brief Saved state of the overlay (see #rspq_overlay_get_state) */
+	uint8_t state[HOST_UCODE_STATE_SIZE] __attribute__((aligned(16)));
+} rsp_ucode_t;
+
+/** @brief Define a ucode, emulated by the reference with the same name */
+#define DEFINE_RSP_UCODE(ucode_name, ...) \
+	rsp_ucode_t ucode_name = (rsp_ucode_t){ .name = #ucode_name }
+
+#endif
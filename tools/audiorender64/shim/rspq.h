@@ -0,0 +1,44 @@
+/**
+ * @file rspq.h
+ * @brief RSP Command queue (host shim for audiorender64)
+ *
+ * Commands are executed synchronously by the C reference of the overlay
+ * as soon as they are written, so all the synchronization primitives
+ * return immediately.
+ */
+#ifndef __LIBDRAGON_RSPQ_H
+#define __LIBDRAGON_RSPQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "rsp.h"
+
+typedef struct rspq_fence_s rspq_fence_t;
+
+void rspq_init(void);
+void rspq_close(void);
+uint32_t rspq_overlay_register(rsp_ucode_t *overlay_ucode);
+void rspq_overlay_unregister(uint32_t overlay_id);
+void* rspq_overlay_get_state(rsp_ucode_t *overlay_ucode);
+
+/** @brief Execute a command of an overlay (see #rspq_write) */
+void rspq_host_exec(uint32_t ovl_id, uint32_t cmd_id, const uint32_t *args, int nargs);
+
+/** @brief Write a command: it is executed immediately */
+#define rspq_write(ovl_id, cmd_id, ...) \
+	rspq_host_exec(ovl_id, cmd_id, (const uint32_t[]){ __VA_ARGS__ }, \
+		sizeof((const uint32_t[]){ __VA_ARGS__ }) / sizeof(uint32_t))
+
+static inline void rspq_flush(void) {}
+static inline void rspq_wait(void) {}
+static inline void rspq_highpri_begin(void) {}
+static inline void rspq_highpri_end(void) {}
+static inline void rspq_highpri_sync(void) {}
+
+rspq_fence_t* rspq_fence_new(void);
+void rspq_fence_free(rspq_fence_t *f);
+uint32_t rspq_fence_enqueue_signal(rspq_fence_t *f);
+bool rspq_fence_check(rspq_fence_t *f, uint32_t value);
+void rspq_fence_wait(rspq_fence_t *f, uint32_t value);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
+#include "../../src/audio/lzh5.h"
 
 #if BYTE_ORDER == BIG_ENDIAN
 #define SWAPLONG(i) (i)
@@ -530,7 +531,7 @@ int dfs_open(const char * const path)
     file->size = get_size(&t_node);
     file->loc = 0;
     file->cart_start_loc = t_node.file_pointer;
-    file->cached_loc = 0xFFFFFFFF;
+    file->compressed = get_flags(&t_node) & FLAGS_COMPRESSED;
 
     return file->handle;
 }
@@ -546,12 +547,78 @@ int dfs_close(uint32_t handle)
         return DFS_EBADHANDLE;
     }
 
+    free(file->decoder);
+
     /* Closing the handle is easy as zeroing out the file */
     memset(file, 0, sizeof(open_file_t));
 
     return DFS_ESUCCESS;
 }
 
+/* Feed the decompressor with compressed data straight from the image */
+static size_t decoder_read(void *buf, size_t buf_len, void *ctx)
+{
+    open_file_t *file = ctx;
+
+    if(buf_len > file->data_size - file->decoder_data_loc)
+    {
+        buf_len = file->data_size - file->decoder_data_loc;
+    }
+
+    memcpy(buf, get_file_location(file->cart_start_loc, file->decoder_data_loc), buf_len);
+    file->decoder_data_loc += buf_len;
+
+    return buf_len;
+}
+
+/* Decompress data at the current location, restarting the decompressor on backward seeks */
+static int read_compressed(open_file_t *file, uint8_t *buf, int len)
+{
+    if(!file->decoder || file->loc < file->decoder_loc)
+    {
+        compressed_header_t *header = (compressed_header_t *)get_file_location(file->cart_start_loc, 0);
+
+        if(SWAPLONG(header->algorithm) != COMPRESS_LZH5)
+        {
+            return DFS_EBADFS;
+        }
+
+        if(!file->decoder)
+        {
+            file->decoder = malloc(sizeof(LHANewDecoder));
+        }
+
+        lha_lh_new_init(file->decoder, decoder_read, file);
+        file->data_size = sizeof(compressed_header_t) + SWAPLONG(header->compressed_size);
+        file->decoder_data_loc = sizeof(compressed_header_t);
+        file->decoder_loc = 0;
+    }
+
+    while(file->decoder_loc < file->loc)
+    {
+        uint8_t skip[128];
+        int sz = file->loc - file->decoder_loc;
+        if(sz > sizeof(skip)) { sz = sizeof(skip); }
+
+        if(lha_lh_new_read(file->decoder, skip, sz) != sz)
+        {
+            return DFS_EBADFS;
+        }
+
+        file->decoder_loc += sz;
+    }
+
+    if(lha_lh_new_read(file->decoder, buf, len) != len)
+    {
+        return DFS_EBADFS;
+    }
+
+    file->decoder_loc += len;
+    file->loc += len;
+
+    return len;
+}
+
 int dfs_seek(uint32_t handle, int offset, int origin)
 {
     open_file_t *file = find_open_file(handle);
@@ -652,6 +719,11 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
         to_read = file->size - file->loc;
     }
 
+    if(file->compressed)
+    {
+        return read_compressed(file, buf, to_read);
+    }
+
     memcpy(buf, get_file_location(file->cart_start_loc, file->loc), to_read);
     file->loc += to_read;
 
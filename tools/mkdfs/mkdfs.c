@@ -7,8 +7,12 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
+#include "../audioconv64/lzh5_compress.h"
 
 #if BYTE_ORDER == BIG_ENDIAN
 #define SWAPLONG(i) (i)
@@ -16,114 +20,1299 @@
 #define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
 #endif
 
+/* Maximum number of threads used to load files */
+#define MAX_THREADS 64
+
 uint8_t *dfs = NULL;
 uint32_t fs_size = 0;
+uint32_t fs_capacity = 0;
+
+/* A file to store in the image, collected while scanning directories */
+typedef struct
+{
+    char *path;         /* Path of the file on disk */
+    char *relpath;      /* Path of the file within the filesystem */
+    uint32_t dirent;    /* Offset of its directory entry */
+    uint32_t size;      /* Size of the file */
+    uint64_t srchash;   /* Hash of the contents of the file on disk */
+    int compress;       /* Stored compressed */
+    uint8_t *cdata;     /* Compressed stream, if compressed */
+    uint32_t csize;     /* Size of the compressed stream */
+    uint64_t hash;      /* Hash of the data as stored in the image */
+    int dup;            /* Index of the file whose data is shared, or -1 */
+    uint32_t blob;      /* Offset of the data in the image */
+    uint32_t capacity;  /* Space available for the data in the image */
+    struct manifest_entry *old; /* Entry of the file in the manifest of the previous build */
+    int reuse;          /* Unchanged since the previous build: keep its data */
+    int patch;          /* Changed, and rewritten in place of its previous data */
+    int loaded;         /* Data of a reused blob read back from the previous image */
+    int error;          /* Set by parallel steps on failure */
+    int index;          /* Position in directory order */
+    int rank;           /* Position of the first access in the access trace */
+} file_entry_t;
+
+file_entry_t *files = NULL;
+int file_count = 0;
+
+int num_cpus = 1;
+int load_duplicates = 0;
+
+/* Path table being collected while adding files */
+path_table_entry_t *path_table = NULL;
+char **path_table_paths = NULL;
+int path_table_count = 0;
+
+/* Patterns of the files to store compressed */
+const char **compress_patterns = NULL;
+int compress_pattern_count = 0;
+
+/* Offset from start of filesystem */
+inline uint32_t sector_offset(void *sector)
+{
+    uint32_t x = (uint8_t *)sector - dfs;
+
+    return x;
+}
+
+inline void *sector_to_memory(uint32_t offset)
+{
+    return (void *)(dfs + offset);
+}
+
+/* Make sure the image can grow up to size bytes without being reallocated */
+int dfs_reserve(uint32_t size)
+{
+    if(size <= fs_capacity)
+    {
+        return 1;
+    }
+
+    uint8_t *mem = realloc(dfs, size);
+
+    if(!mem)
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return 0;
+    }
+
+    dfs = mem;
+    fs_capacity = size;
+    return 1;
+}
+
+uint32_t dfs_alloc(int size)
+{
+    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+
+    /* Grow geometrically, to avoid copying the image over and over */
+    if(fs_size + rsize > fs_capacity &&
+       !dfs_reserve(MAX(fs_size + rsize, fs_capacity * 2)))
+    {
+        exit(1);
+    }
+
+    void *end = dfs + fs_size;
+    fs_size += rsize;
+
+    /* Zero out last bytes */
+    memset(end, 0, rsize);
+
+    return sector_offset(end);    
+}
+
+/* Add a new sector to the filesystem, return that sector pointer */
+uint32_t new_sector(void)
+{
+    return dfs_alloc(SECTOR_SIZE);
+}
+
+uint32_t new_blob(int size)
+{
+    return dfs_alloc(size);    
+}
+
+void free_manifest(void);
+void free_trace(void);
+
+void kill_fs()
+{
+    if(dfs)
+    {
+        free(dfs);
+    }
+
+    for(int i = 0; i < path_table_count; i++)
+    {
+        free(path_table_paths[i]);
+    }
+
+    free(path_table);
+    free(path_table_paths);
+    free(compress_patterns);
+
+    for(int i = 0; i < file_count; i++)
+    {
+        free(files[i].path);
+        free(files[i].relpath);
+        free(files[i].cdata);
+    }
+
+    free(files);
+    free_manifest();
+    free_trace();
+}
+
+void print_help(const char * const prog_name)
+{
+    fprintf(stderr, "Usage: %s [flags] <File> <Directory>\n", prog_name);
+    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
+    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Flags:\n");
+    fprintf(stderr, "  --no-index            Do not write the path table used by dfs_init to open files without walking directories\n");
+    fprintf(stderr, "  --incremental         Keep a manifest next to <File>, to only patch what changed on the next build\n");
+    fprintf(stderr, "  --trace <file>        Lay out files in the order they were accessed in a trace saved with dfs_trace_dump\n");
+    fprintf(stderr, "  --compress <pattern>  Store compressed the files matching <pattern> (can be repeated)\n");
+    fprintf(stderr, "                        Patterns support * and ?. Patterns without a / are matched against\n");
+    fprintf(stderr, "                        the file name, otherwise against the full path (eg: 'levels/*.map')\n");
+}
+
+/* Match a string against a simple wildcard pattern (* and ?) */
+int pattern_match(const char *pattern, const char *str)
+{
+    while(*pattern)
+    {
+        if(*pattern == '*')
+        {
+            /* Try every possible length for the star */
+            pattern++;
+
+            do
+            {
+                if(pattern_match(pattern, str))
+                {
+                    return 1;
+                }
+            } while(*str++);
+
+            return 0;
+        }
+
+        if(!*str || (*pattern != '?' && *pattern != *str))
+        {
+            return 0;
+        }
+
+        pattern++;
+        str++;
+    }
+
+    return !*str;
+}
+
+/* Check whether a file must be compressed, given its path within the filesystem */
+int must_compress(const char * const relpath)
+{
+    const char *name = strrchr(relpath, '/');
+    name = name ? name + 1 : relpath;
+
+    for(int i = 0; i < compress_pattern_count; i++)
+    {
+        const char *pattern = compress_patterns[i];
+
+        if(pattern_match(pattern, strchr(pattern, '/') ? relpath : name))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Remember a file for the path table */
+int path_table_add(const char * const relpath, uint32_t dirent)
+{
+    path_table_entry_t *table = realloc(path_table, (path_table_count + 1) * sizeof(path_table_entry_t));
+    char **paths = realloc(path_table_paths, (path_table_count + 1) * sizeof(char *));
+
+    if(table) { path_table = table; }
+    if(paths) { path_table_paths = paths; }
+
+    if(!table || !paths)
+    {
+        return 0;
+    }
+
+    path_table_paths[path_table_count] = strdup(relpath);
+    if(!path_table_paths[path_table_count])
+    {
+        return 0;
+    }
+
+    path_table_entry_t *entry = &path_table[path_table_count++];
+    entry->hash = path_table_hash(relpath);
+    entry->path_offset = 0;
+    entry->dirent = dirent;
+
+    return 1;
+}
+
+int path_table_compare(const void *a, const void *b)
+{
+    const path_table_entry_t *ea = a;
+    const path_table_entry_t *eb = b;
+
+    if(ea->hash != eb->hash)
+    {
+        return ea->hash < eb->hash ? -1 : 1;
+    }
+
+    /* Keep collisions ordered by path, so that images are reproducible */
+    return strcmp(path_table_paths[ea->path_offset], path_table_paths[eb->path_offset]);
+}
+
+/* Append the path table to the image, and return its offset */
+uint32_t write_path_table(void)
+{
+    uint32_t size = sizeof(path_table_header_t) + path_table_count * sizeof(path_table_entry_t);
+    uint32_t strings = size;
+
+    /* Temporarily use path_offset as an index into the collected paths, for sorting */
+    for(int i = 0; i < path_table_count; i++)
+    {
+        path_table[i].path_offset = i;
+        size += strlen(path_table_paths[i]) + 1;
+    }
+
+    qsort(path_table, path_table_count, sizeof(path_table_entry_t), path_table_compare);
+
+    /* Keep the table 8-byte aligned in size, so that it can be DMA'd as a whole */
+    size = (size + 7) & ~7;
+
+    uint32_t table = new_blob(size);
+    uint8_t *data = sector_to_memory(table);
+
+    path_table_header_t *header = (path_table_header_t *)data;
+    header->magic = SWAPLONG(PATH_TABLE_MAGIC);
+    header->num_entries = SWAPLONG(path_table_count);
+    header->size = SWAPLONG(size);
+
+    path_table_entry_t *entries = (path_table_entry_t *)(data + sizeof(path_table_header_t));
+
+    for(int i = 0; i < path_table_count; i++)
+    {
+        const char *path = path_table_paths[path_table[i].path_offset];
+        int len = strlen(path) + 1;
+
+        memcpy(data + strings, path, len);
+
+        entries[i].hash = SWAPLONG(path_table[i].hash);
+        entries[i].path_offset = SWAPLONG(strings);
+        entries[i].dirent = SWAPLONG(path_table[i].dirent);
+        /* The directory entry is final by now, and already byte-swapped */
+        directory_entry_t *dirent = sector_to_memory(path_table[i].dirent);
+        entries[i].flags = dirent->flags;
+        entries[i].file_pointer = dirent->file_pointer;
+
+        strings += len;
+    }
+
+    return table;
+}
+
+/* Compress a file with LZH5. Returns the compressed stream in a temporary file, or NULL on error. */
+FILE *compress_file(FILE *in, uint32_t *csize)
+{
+    FILE *out = tmpfile();
+
+    if(!out)
+    {
+        return NULL;
+    }
+
+    unsigned int crc, compressed, decompressed;
+    lzh5_init(LZHUFF5_METHOD_NUM);
+    lzh5_encode(in, out, &crc, &compressed, &decompressed);
+
+    /* The encoder might not have counted the final bits it flushed */
+    fflush(out);
+    *csize = ftell(out);
+    fseek(out, 0, SEEK_SET);
+
+    return out;
+}
+
+/* Hash a chunk of data (64-bit FNV-1a), continuing from a previous hash */
+uint64_t content_hash(uint64_t hash, const uint8_t *data, uint32_t size)
+{
+    for(uint32_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/* Initial value for content_hash */
+#define CONTENT_HASH_INIT   0xCBF29CE484222325ULL
+
+/* Hash the whole contents of a file, which must be at the beginning */
+uint64_t hash_file(FILE *fp, uint32_t size)
+{
+    static __thread uint8_t chunk[65536];
+    uint64_t hash = CONTENT_HASH_INIT;
+
+    while(size)
+    {
+        uint32_t sz = size < sizeof(chunk) ? size : sizeof(chunk);
+
+        if(fread(chunk, 1, sz, fp) != sz)
+        {
+            break;
+        }
+
+        hash = content_hash(hash, chunk, sz);
+        size -= sz;
+    }
+
+    return hash;
+}
+
+/* Run a function on every index from 0 to count-1, using all the CPUs */
+typedef struct
+{
+    void (*func)(int index);
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} parallel_job_t;
+
+void *parallel_worker(void *arg)
+{
+    parallel_job_t *job = arg;
+
+    while(1)
+    {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(index >= job->count)
+        {
+            return NULL;
+        }
+
+        job->func(index);
+    }
+}
+
+void parallel_for(void (*func)(int index), int count)
+{
+    parallel_job_t job = { func, count, 0 };
+    pthread_t threads[MAX_THREADS];
+    /* The calling thread works too */
+    int num_threads = MIN(num_cpus - 1, count);
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        pthread_create(&threads[i], NULL, parallel_worker, &job);
+    }
+
+    /* Help with the work */
+    parallel_worker(&job);
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+}
+
+/* Collect a file to add to the image. Its data is loaded later by write_files. */
+int add_file(const char * const file, const char * const relpath, uint32_t dirent, struct stat *stats, int compress)
+{
+    file_entry_t *list = realloc(files, (file_count + 1) * sizeof(file_entry_t));
+
+    if(!list)
+    {
+        return 0;
+    }
+
+    files = list;
+
+    file_entry_t *entry = &files[file_count++];
+    memset(entry, 0, sizeof(file_entry_t));
+
+    entry->path = strdup(file);
+    entry->relpath = strdup(relpath);
+    entry->dirent = dirent;
+    entry->size = stats->st_size;
+    entry->compress = compress;
+    entry->dup = -1;
+
+    return entry->path && entry->relpath;
+}
+
+/* Hash the contents of a file on disk, to find out whether it changed. Runs in parallel. */
+void hash_source(int index)
+{
+    file_entry_t *entry = &files[index];
+    FILE *fp = fopen(entry->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", entry->path);
+        entry->error = 1;
+        return;
+    }
+
+    entry->srchash = hash_file(fp, entry->size);
+    fclose(fp);
+}
+
+/* Compress a file, if requested, and compute the hash of its data as stored. Runs in parallel. */
+void scan_file(int index)
+{
+    file_entry_t *entry = &files[index];
+
+    if(entry->reuse)
+    {
+        return;
+    }
+
+    if(!entry->compress)
+    {
+        /* Stored as is: same hash as the file on disk */
+        entry->hash = entry->srchash;
+        return;
+    }
+
+    FILE *fp = fopen(entry->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", entry->path);
+        entry->error = 1;
+        return;
+    }
+
+    /* The state of the compressor is thread-local, so this runs in parallel too */
+    uint32_t csize = 0;
+    FILE *cfp = compress_file(fp, &csize);
+
+    /* Keep the compressed version only if it is actually smaller */
+    if(cfp && csize + sizeof(compressed_header_t) < entry->size)
+    {
+        entry->csize = csize;
+        entry->cdata = malloc(csize);
+
+        if(!entry->cdata || fread(entry->cdata, 1, csize, cfp) != csize)
+        {
+            fprintf(stderr, "Cannot compress file '%s'!\n", entry->path);
+            entry->error = 1;
+            fclose(cfp);
+            fclose(fp);
+            return;
+        }
+
+        entry->hash = content_hash(CONTENT_HASH_INIT, entry->cdata, csize);
+        fclose(cfp);
+        fclose(fp);
+        return;
+    }
+
+    if(cfp)
+    {
+        fclose(cfp);
+    }
+
+    entry->compress = 0;
+    entry->hash = entry->srchash;
+    fclose(fp);
+}
+
+/* Size of the data of a file, as stored in the image */
+uint32_t stored_size(file_entry_t *entry)
+{
+    return entry->compress ? sizeof(compressed_header_t) + entry->csize : entry->size;
+}
+
+/* Load the data of a file into the image, or check that a duplicate matches it. Runs in parallel. */
+void load_file(int index)
+{
+    file_entry_t *entry = &files[index];
+    uint8_t *data = sector_to_memory(entry->blob);
+
+    if(entry->reuse || (entry->dup >= 0) != load_duplicates)
+    {
+        return;
+    }
+
+    if(entry->compress)
+    {
+        if(entry->dup >= 0)
+        {
+            entry->error = memcmp(data + sizeof(compressed_header_t), entry->cdata, entry->csize) != 0;
+            return;
+        }
+
+        compressed_header_t *header = (compressed_header_t *)data;
+        header->algorithm = SWAPLONG(COMPRESS_LZH5);
+        header->compressed_size = SWAPLONG(entry->csize);
+        memcpy(header + 1, entry->cdata, entry->csize);
+        return;
+    }
+
+    FILE *fp = fopen(entry->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", entry->path);
+        entry->error = 1;
+        return;
+    }
+
+    if(entry->dup >= 0)
+    {
+        /* Make sure this is a real duplicate and not a hash collision */
+        uint8_t *copy = malloc(entry->size);
+
+        entry->error = !copy || fread(copy, 1, entry->size, fp) != entry->size ||
+                       memcmp(copy, data, entry->size) != 0;
+
+        free(copy);
+    }
+    else if(fread(data, 1, entry->size, fp) != entry->size)
+    {
+        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", entry->path);
+        entry->error = 1;
+    }
+
+    fclose(fp);
+}
+
+/* Check for errors reported by a parallel step */
+int files_ok(void)
+{
+    for(int i = 0; i < file_count; i++)
+    {
+        if(files[i].error)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* A file found in an access trace, with the position of its first access */
+typedef struct
+{
+    char *relpath;
+    int rank;
+} trace_entry_t;
+
+/* Files of the access trace, in the order they were first read */
+trace_entry_t *trace = NULL;
+int trace_count = 0;
+
+void free_trace(void)
+{
+    for(int i = 0; i < trace_count; i++)
+    {
+        free(trace[i].relpath);
+    }
+
+    free(trace);
+    trace = NULL;
+    trace_count = 0;
+}
+
+int trace_compare_path(const void *a, const void *b)
+{
+    return strcmp(((const trace_entry_t *)a)->relpath, ((const trace_entry_t *)b)->relpath);
+}
+
+/* Add a file to the access trace, unless it is already there */
+int trace_add(const char * const relpath)
+{
+    for(int i = 0; i < trace_count; i++)
+    {
+        if(!strcmp(trace[i].relpath, relpath))
+        {
+            return 1;
+        }
+    }
+
+    trace_entry_t *list = realloc(trace, (trace_count + 1) * sizeof(trace_entry_t));
+
+    if(!list)
+    {
+        return 0;
+    }
+
+    trace = list;
+    trace[trace_count].relpath = strdup(relpath);
+    trace[trace_count].rank = trace_count;
+
+    return trace[trace_count++].relpath != NULL;
+}
+
+/*
+ * Load an access trace, as dumped by dfs_trace_dump. Lines not starting with
+ * "DFSTRACE" are ignored, so a whole debug log can be used. Files are ranked
+ * by their first read; files that were opened but never read come after.
+ */
+int load_trace(const char * const trace_file)
+{
+    FILE *fp = fopen(trace_file, "r");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open trace '%s'!\n", trace_file);
+        return 0;
+    }
+
+    char line[MAX_FILENAME_LEN * 4];
+    char **opened = NULL;
+    int num_opened = 0;
+    int ok = 1;
+
+    while(ok && fgets(line, sizeof(line), fp))
+    {
+        char *ev = strstr(line, "DFSTRACE ");
+        unsigned int offset, size;
+        int pos = 0;
+
+        if(!ev)
+        {
+            continue;
+        }
+
+        line[strcspn(line, "\r\n")] = 0;
+
+        if(sscanf(ev, "DFSTRACE read %u %u %n", &offset, &size, &pos) == 2 && pos)
+        {
+            ok = trace_add(ev + pos);
+        }
+        else if(sscanf(ev, "DFSTRACE open %n", &pos) == 0 && pos)
+        {
+            char **list = realloc(opened, (num_opened + 1) * sizeof(char *));
+
+            if(list)
+            {
+                opened = list;
+                opened[num_opened] = strdup(ev + pos);
+            }
+
+            ok = list && opened[num_opened++];
+        }
+    }
+
+    fclose(fp);
+
+    for(int i = 0; i < num_opened; i++)
+    {
+        ok = ok && trace_add(opened[i]);
+        free(opened[i]);
+    }
+
+    free(opened);
+
+    /* Sort by path for lookups, the rank keeps the order */
+    qsort(trace, trace_count, sizeof(trace_entry_t), trace_compare_path);
+
+    if(!ok)
+    {
+        fprintf(stderr, "Cannot load trace '%s'!\n", trace_file);
+    }
+
+    return ok;
+}
+
+/* Position of the first access to a file in the trace, or INT_MAX if not in the trace */
+int trace_rank(const char * const relpath)
+{
+    trace_entry_t key = { (char *)relpath, 0 };
+    trace_entry_t *entry = bsearch(&key, trace, trace_count, sizeof(trace_entry_t), trace_compare_path);
+
+    return entry ? entry->rank : INT_MAX;
+}
+
+int file_compare_rank(const void *a, const void *b)
+{
+    const file_entry_t *ea = a;
+    const file_entry_t *eb = b;
+
+    if(ea->rank != eb->rank)
+    {
+        return ea->rank < eb->rank ? -1 : 1;
+    }
+
+    /* Keep files not in the trace in directory order */
+    return ea->index < eb->index ? -1 : 1;
+}
+
+/* Lay out files in the order they were accessed, so that files loaded together are contiguous */
+void order_files(void)
+{
+    int traced = 0;
+
+    for(int i = 0; i < file_count; i++)
+    {
+        files[i].index = i;
+        files[i].rank = trace_rank(files[i].relpath);
+
+        if(files[i].rank != INT_MAX)
+        {
+            traced++;
+        }
+    }
+
+    qsort(files, file_count, sizeof(file_entry_t), file_compare_rank);
+
+    printf("Ordered %d files from the access trace.\n", traced);
+}
+
+/* Entry of the manifest written by the previous incremental build */
+typedef struct manifest_entry
+{
+    char *relpath;      /* Path of the file within the filesystem */
+    uint64_t srchash;   /* Hash of the contents of the file on disk */
+    uint32_t size;      /* Size of the file */
+    uint64_t hash;      /* Hash of the data as stored in the image */
+    uint32_t offset;    /* Offset of the data in the image */
+    uint32_t capacity;  /* Space available for the data in the image */
+    int compress;       /* Stored compressed */
+    uint32_t csize;     /* Size of the compressed stream */
+    int refs;           /* Number of unchanged files still using the blob */
+    int claimed;        /* Blob rewritten by a changed file */
+} manifest_entry_t;
+
+manifest_entry_t *manifest = NULL;
+int manifest_count = 0;
+
+/* Manifest indices sorted by path, for lookups */
+int *manifest_by_path = NULL;
+
+/* Previous image being patched, if the manifest could be used */
+FILE *old_image = NULL;
+uint32_t old_image_end = 0;
+
+int manifest_compare_offset(const void *a, const void *b)
+{
+    const manifest_entry_t *ea = a;
+    const manifest_entry_t *eb = b;
+
+    if(ea->offset != eb->offset)
+    {
+        return ea->offset < eb->offset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int manifest_compare_path(const void *a, const void *b)
+{
+    return strcmp(manifest[*(const int *)a].relpath, manifest[*(const int *)b].relpath);
+}
+
+/* Hash of the options affecting the contents of the image */
+uint64_t options_hash(int write_index)
+{
+    uint64_t hash = content_hash(CONTENT_HASH_INIT, (const uint8_t *)&write_index, sizeof(write_index));
+
+    for(int i = 0; i < compress_pattern_count; i++)
+    {
+        hash = content_hash(hash, (const uint8_t *)compress_patterns[i], strlen(compress_patterns[i]) + 1);
+    }
+
+    /* A different trace means a different layout */
+    for(int i = 0; i < trace_count; i++)
+    {
+        hash = content_hash(hash, (const uint8_t *)trace[i].relpath, strlen(trace[i].relpath) + 1);
+        hash = content_hash(hash, (const uint8_t *)&trace[i].rank, sizeof(trace[i].rank));
+    }
+
+    return hash;
+}
+
+void free_manifest(void)
+{
+    for(int i = 0; i < manifest_count; i++)
+    {
+        free(manifest[i].relpath);
+    }
+
+    free(manifest);
+    free(manifest_by_path);
+    manifest = NULL;
+    manifest_by_path = NULL;
+    manifest_count = 0;
+
+    if(old_image)
+    {
+        fclose(old_image);
+        old_image = NULL;
+    }
+}
+
+/*
+ * Load the manifest of the previous build of the image. It can be used only if the
+ * options and the directory structure did not change, as directory sectors come
+ * first in the image and blobs can then stay where they are. Returns 1 if the
+ * previous image will be patched, 0 if it must be rebuilt from scratch.
+ */
+int load_manifest(const char * const manifest_file, const char * const out_file, uint64_t options)
+{
+    FILE *fp = fopen(manifest_file, "r");
+
+    if(!fp)
+    {
+        return 0;
+    }
+
+    char line[MAX_FILENAME_LEN * 4];
+    unsigned long long hash;
+    uint32_t dir_size, end, waste;
+    int ok = fgets(line, sizeof(line), fp) &&
+             sscanf(line, "mkdfs-manifest 2 %llx %u %u %u", &hash, &dir_size, &end, &waste) == 4 &&
+             hash == options && dir_size == fs_size && waste <= end / 4;
+
+    while(ok && fgets(line, sizeof(line), fp))
+    {
+        manifest_entry_t entry = { 0 };
+        unsigned long long srchash;
+        int pos = 0;
+
+        if(sscanf(line, "%llx %u %llx %u %u %d %u %n", &hash, &entry.size, &srchash, &entry.offset,
+                  &entry.capacity, &entry.compress, &entry.csize, &pos) < 7 || !pos)
+        {
+            ok = 0;
+            break;
+        }
+
+        line[strcspn(line, "\n")] = 0;
+        entry.hash = hash;
+        entry.srchash = srchash;
+        entry.relpath = strdup(line + pos);
+
+        manifest_entry_t *list = realloc(manifest, (manifest_count + 1) * sizeof(manifest_entry_t));
+
+        if(!list || !entry.relpath)
+        {
+            free(entry.relpath);
+            ok = 0;
+            break;
+        }
+
+        manifest = list;
+        manifest[manifest_count++] = entry;
+    }
+
+    fclose(fp);
 
-/* Offset from start of filesystem */
-inline uint32_t sector_offset(void *sector)
+    if(ok)
+    {
+        /* The manifest is only valid together with the image it was written with */
+        old_image = fopen(out_file, "r+b");
+        ok = old_image && !fseek(old_image, 0, SEEK_END) && ftell(old_image) >= end;
+    }
+
+    if(ok)
+    {
+        qsort(manifest, manifest_count, sizeof(manifest_entry_t), manifest_compare_offset);
+
+        manifest_by_path = malloc(manifest_count * sizeof(int));
+        ok = manifest_by_path != NULL;
+    }
+
+    if(!ok)
+    {
+        free_manifest();
+        return 0;
+    }
+
+    for(int i = 0; i < manifest_count; i++)
+    {
+        manifest_by_path[i] = i;
+    }
+
+    qsort(manifest_by_path, manifest_count, sizeof(int), manifest_compare_path);
+
+    /* Blobs follow the directory sectors: keep them, and append after them */
+    old_image_end = end;
+
+    if(!dfs_reserve(end))
+    {
+        free_manifest();
+        return 0;
+    }
+
+    fs_size = end;
+    return 1;
+}
+
+/* Find the manifest entry of a file, or NULL */
+manifest_entry_t *manifest_lookup(const char * const relpath)
 {
-    uint32_t x = (uint8_t *)sector - dfs;
+    int lo = 0, hi = manifest_count - 1;
 
-    return x;
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(relpath, manifest[manifest_by_path[mid]].relpath);
+
+        if(!cmp)
+        {
+            return &manifest[manifest_by_path[mid]];
+        }
+
+        if(cmp < 0) { hi = mid - 1; } else { lo = mid + 1; }
+    }
+
+    return NULL;
 }
 
-inline void *sector_to_memory(uint32_t offset)
+/* Return the first manifest entry using the same blob, which tracks its users */
+manifest_entry_t *manifest_blob(manifest_entry_t *entry)
 {
-    return (void *)(dfs + offset);
+    while(entry > manifest && entry[-1].offset == entry->offset)
+    {
+        entry--;
+    }
+
+    return entry;
 }
 
-uint32_t dfs_alloc(int size)
+/* Reuse the blob of a file that did not change since the previous build */
+void manifest_reuse(file_entry_t *entry)
 {
-    void *end;
-    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    manifest_entry_t *old = manifest_lookup(entry->relpath);
 
-    if(!dfs)
-    {
-        dfs = malloc(rsize);
-        fs_size = rsize;
+    entry->old = old;
 
-        end = dfs;
-    }
-    else
+    if(!old || old->srchash != entry->srchash || old->size != entry->size)
     {
-        dfs = realloc(dfs, fs_size + rsize);
+        return;
+    }
 
-        end = dfs + fs_size;
-        fs_size += rsize;
+    entry->reuse = 1;
+    entry->hash = old->hash;
+    entry->compress = old->compress;
+    entry->csize = old->csize;
+    entry->blob = old->offset;
+    entry->capacity = old->capacity;
+
+    manifest_blob(old)->refs++;
+}
+
+/* Rewrite a changed file in place, if its old blob is large enough and not shared */
+int manifest_patch(file_entry_t *entry)
+{
+    if(!entry->old)
+    {
+        return 0;
     }
 
-    /* Zero out last bytes */
-    memset(end, 0, rsize);
+    manifest_entry_t *blob = manifest_blob(entry->old);
 
-    return sector_offset(end);    
+    if(blob->refs || blob->claimed || blob->capacity < stored_size(entry))
+    {
+        return 0;
+    }
+
+    blob->claimed = 1;
+    entry->patch = 1;
+    entry->blob = blob->offset;
+    entry->capacity = blob->capacity;
+    return 1;
 }
 
-/* Add a new sector to the filesystem, return that sector pointer */
-uint32_t new_sector(void)
+int file_compare_blob(const void *a, const void *b)
 {
-    return dfs_alloc(SECTOR_SIZE);
+    const file_entry_t *ea = *(const file_entry_t **)a;
+    const file_entry_t *eb = *(const file_entry_t **)b;
+
+    if(ea->blob != eb->blob)
+    {
+        return ea->blob < eb->blob ? -1 : 1;
+    }
+
+    return 0;
 }
 
-uint32_t new_blob(int size)
+/* Write the manifest used by the next incremental build */
+int write_manifest(const char * const manifest_file, uint64_t options, uint32_t dir_size, uint32_t end)
 {
-    return dfs_alloc(size);    
+    /* Space in the blob area not used by any file, which grows with each incremental build */
+    file_entry_t **sorted = malloc(file_count * sizeof(file_entry_t *));
+
+    if(!sorted)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < file_count; i++)
+    {
+        sorted[i] = &files[i];
+    }
+
+    qsort(sorted, file_count, sizeof(file_entry_t *), file_compare_blob);
+
+    uint32_t waste = end - dir_size;
+
+    for(int i = 0; i < file_count; i++)
+    {
+        if(!i || sorted[i]->blob != sorted[i - 1]->blob)
+        {
+            waste -= sorted[i]->capacity;
+        }
+    }
+
+    free(sorted);
+
+    FILE *fp = fopen(manifest_file, "w");
+
+    if(!fp)
+    {
+        return 0;
+    }
+
+    fprintf(fp, "mkdfs-manifest 2 %016llx %u %u %u\n", (unsigned long long)options, dir_size, end, waste);
+
+    for(int i = 0; i < file_count; i++)
+    {
+        file_entry_t *entry = &files[i];
+
+        fprintf(fp, "%016llx %u %016llx %u %u %d %u %s\n", (unsigned long long)entry->hash, entry->size,
+                (unsigned long long)entry->srchash, entry->blob, entry->capacity, entry->compress, entry->csize, entry->relpath);
+    }
+
+    return fclose(fp) == 0;
 }
 
-void kill_fs()
+/* Write the parts of the previous image that changed: directory sectors, patched blobs and new data */
+int patch_image(uint32_t dir_size)
 {
-    if(dfs)
+    int ok = !fseek(old_image, 0, SEEK_SET) && fwrite(dfs, 1, dir_size, old_image) == dir_size;
+
+    for(int i = 0; ok && i < file_count; i++)
     {
-        free(dfs);
+        file_entry_t *entry = &files[i];
+
+        if(entry->patch)
+        {
+            ok = !fseek(old_image, entry->blob, SEEK_SET) &&
+                 fwrite(dfs + entry->blob, 1, stored_size(entry), old_image) == stored_size(entry);
+        }
     }
+
+    ok = ok && !fseek(old_image, old_image_end, SEEK_SET) &&
+         fwrite(dfs + old_image_end, 1, fs_size - old_image_end, old_image) == fs_size - old_image_end;
+
+    /* Drop the old path table, which was past the end of the blobs */
+    ok = ok && !fflush(old_image) && !ftruncate(fileno(old_image), fs_size);
+
+    return ok;
 }
 
-void print_help(const char * const prog_name)
+/* Read back from the previous image the data of a blob that is kept as-is */
+int fault_in_blob(file_entry_t *entry)
 {
-    fprintf(stderr, "Usage: %s <File> <Directory>\n", prog_name);
-    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
-    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    if(entry->loaded)
+    {
+        return 1;
+    }
+
+    entry->loaded = 1;
+
+    return fseek(old_image, entry->blob, SEEK_SET) == 0 &&
+           fread(sector_to_memory(entry->blob), 1, stored_size(entry), old_image) == stored_size(entry);
 }
 
-uint32_t add_file(const char * const file, uint32_t *size)
+/* Place the data of all the collected files in the image, sharing blobs between identical files */
+int write_files(void)
 {
-    FILE *fp;
+    /* Modification times are too coarse to tell whether a file changed: hash the contents */
+    parallel_for(hash_source, file_count);
+
+    if(!files_ok())
+    {
+        return 0;
+    }
 
-    printf("Adding '%s' to filesystem image.\n", file);
+    /* Files unchanged since the previous build keep their blob, and are not rewritten */
+    for(int i = 0; i < file_count; i++)
+    {
+        manifest_reuse(&files[i]);
+    }
 
-    fp = fopen(file, "rb");
+    /* Compress all other files */
+    parallel_for(scan_file, file_count);
 
-    if(!fp)
+    if(!files_ok())
     {
-        fprintf(stderr, "Cannot open file '%s' for read!\n", file);
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    *size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    /* Open-addressing hash table from content hash to first file with that content */
+    int table_size = 1;
+    while(table_size < file_count * 2) { table_size *= 2; }
 
-    if (*size > 0x0FFFFFFF)
+    int *table = malloc(table_size * sizeof(int));
+    if(!table)
     {
-        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
         return 0;
     }
 
-    uint32_t blob = new_blob(*size);
-    uint8_t *data = sector_to_memory(blob);
+    memset(table, 0xFF, table_size * sizeof(int));
 
-    int read = fread(data, 1, *size, fp);
-    if (read < 0) {
-        /* Wat? */
-        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", file);
-        fclose(fp);
-        return 0;    
+    /* Find duplicates, and compute the size of the image so that it is allocated only once.
+       Reused blobs go first, so that new files can share them. */
+    uint32_t total = fs_size;
+    uint32_t saved = 0;
+    int dups = 0;
+
+    for(int pass = 0; pass < 2; pass++)
+    {
+        for(int i = 0; i < file_count; i++)
+        {
+            file_entry_t *entry = &files[i];
+
+            if(entry->reuse != !pass)
+            {
+                continue;
+            }
+
+            int slot = entry->hash & (table_size - 1);
+            int found = -1;
+
+            while(table[slot] >= 0)
+            {
+                file_entry_t *other = &files[table[slot]];
+
+                if(other->hash == entry->hash && other->compress == entry->compress &&
+                   stored_size(other) == stored_size(entry))
+                {
+                    found = table[slot];
+                    break;
+                }
+
+                slot = (slot + 1) & (table_size - 1);
+            }
+
+            if(found < 0)
+            {
+                table[slot] = i;
+            }
+
+            if(entry->reuse)
+            {
+                /* Keep the blob it already has, even if shared */
+                continue;
+            }
+
+            if(found >= 0)
+            {
+                entry->dup = found;
+                saved += stored_size(entry);
+                dups++;
+                continue;
+            }
+
+            if(!manifest_patch(entry))
+            {
+                entry->capacity = (stored_size(entry) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+                total += entry->capacity;
+            }
+        }
     }
 
-    fclose(fp);
-    return blob;
+    free(table);
+
+    if(!dfs_reserve(total))
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < file_count; i++)
+    {
+        file_entry_t *entry = &files[i];
+
+        if(entry->dup >= 0)
+        {
+            entry->blob = files[entry->dup].blob;
+            entry->capacity = files[entry->dup].capacity;
+
+            /* Duplicates are checked against the data they share */
+            if(files[entry->dup].reuse && !fault_in_blob(&files[entry->dup]))
+            {
+                fprintf(stderr, "Cannot read previous image!\n");
+                return 0;
+            }
+        }
+        else if(!entry->reuse && !entry->patch)
+        {
+            entry->blob = new_blob(stored_size(entry));
+        }
+    }
+
+    /* Load all data, then check duplicates against the data they share */
+    for(load_duplicates = 0; load_duplicates < 2; load_duplicates++)
+    {
+        parallel_for(load_file, file_count);
+    }
+
+    /* Files whose hash collided with a different content get their own blob */
+    for(int i = 0; i < file_count; i++)
+    {
+        file_entry_t *entry = &files[i];
+
+        if(entry->error && entry->dup >= 0)
+        {
+            saved -= stored_size(entry);
+            dups--;
+
+            entry->dup = -1;
+            entry->error = 0;
+            entry->blob = new_blob(stored_size(entry));
+            entry->capacity = (stored_size(entry) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+
+            load_duplicates = 0;
+            load_file(i);
+        }
+    }
+
+    if(!files_ok())
+    {
+        return 0;
+    }
+
+    /* Point the directory entries to the data */
+    for(int i = 0; i < file_count; i++)
+    {
+        file_entry_t *entry = &files[i];
+        directory_entry_t *dirent = sector_to_memory(entry->dirent);
+        uint32_t flags = FLAGS_FILE | (entry->compress ? FLAGS_COMPRESSED : 0);
+
+        dirent->file_pointer = SWAPLONG(entry->blob);
+        dirent->flags = SWAPLONG((flags << 28) | (entry->size & 0x0FFFFFFF));
+    }
+
+    if(dups)
+    {
+        printf("Deduplicated %d files, saving %u bytes.\n", dups, saved);
+    }
+
+    return 1;
 }
 
-uint32_t add_directory(const char * const path)
+uint32_t add_directory(const char * const path, const char * const relpath)
 {
     directory_entry_t *tmp_entry;
     uint32_t first_entry = 0;
@@ -168,13 +1357,31 @@ uint32_t add_directory(const char * const path)
 
                 strcat(file, dp->d_name);
 
+                /* Path of the entry within the filesystem, for the path table */
+                char *relfile = malloc(strlen(relpath) + strlen(dp->d_name) + 2);
+
+                if(!relfile)
+                {
+                    /* Out of memory */
+                    free(file);
+                    return 0;
+                }
+
+                strcpy(relfile, relpath);
+
+                if(relpath[0])
+                {
+                    strcat(relfile, "/");
+                }
+
+                strcat(relfile, dp->d_name);
+
                 /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
                 stat( file, &stats );
 
                 if(S_ISREG(stats.st_mode))
                 {
                     uint32_t new_entry = new_sector();
-                    uint32_t file_size = 0;
 
                     tmp_entry = sector_to_memory(new_entry);
                     tmp_entry->next_entry = 0;
@@ -183,17 +1390,25 @@ uint32_t add_directory(const char * const path)
                     strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
                     tmp_entry->path[MAX_FILENAME_LEN] = 0;
 
-                    uint32_t new_file = add_file(file, &file_size);
+                    printf("Adding '%s' to filesystem image.\n", file);
 
-                    if(!new_file)
+                    if(stats.st_size > 0x0FFFFFFF)
                     {
+                        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
+                        free(relfile);
                         free(file);
                         return 0;
                     }
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_file);
-                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
+                    /* File data is added later by write_files, so that it can be loaded in parallel */
+                    if(!add_file(file, relfile, new_entry, &stats, must_compress(relfile)) ||
+                       !path_table_add(relfile, new_entry))
+                    {
+                        /* Out of memory */
+                        free(relfile);
+                        free(file);
+                        return 0;
+                    }
 
                     if(cur_entry)
                     {
@@ -217,11 +1432,12 @@ uint32_t add_directory(const char * const path)
                     strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
                     tmp_entry->path[MAX_FILENAME_LEN] = 0;
 
-                    uint32_t new_directory = add_directory(file);
+                    uint32_t new_directory = add_directory(file, relfile);
 
                     if(!new_directory)
                     {
                         fprintf(stderr, "Skipping empty directory: %s\n", file);
+                        free(relfile);
                         free(file);
                         continue;
                     }
@@ -240,6 +1456,7 @@ uint32_t add_directory(const char * const path)
                     cur_entry = new_entry;
                 }
 
+                free(relfile);
                 free(file);
 
                 if(!first_entry)
@@ -259,12 +1476,47 @@ uint32_t add_directory(const char * const path)
 
 int main(int argc, char *argv[])
 {
-    if(argc != 3)
+    int write_index = 1;
+    int incremental = 0;
+    const char *trace_file = NULL;
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-'; i++)
+    {
+        if(!strcmp(argv[i], "--no-index"))
+        {
+            write_index = 0;
+        }
+        else if(!strcmp(argv[i], "--incremental"))
+        {
+            incremental = 1;
+        }
+        else if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--compress") && i + 1 < argc)
+        {
+            compress_patterns = realloc(compress_patterns, (compress_pattern_count + 1) * sizeof(char *));
+            compress_patterns[compress_pattern_count++] = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Unknown flag: %s\n", argv[i]);
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - i != 2)
     {
         print_help(argv[0]);
         return -1;
     }
 
+    const char *out_file = argv[i];
+    const char *in_dir = argv[i + 1];
+
     /* Add in identifier */
     directory_entry_t *id = sector_to_memory(new_sector());
 
@@ -279,32 +1531,110 @@ int main(int argc, char *argv[])
     id->next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
     strcpy(id->path, ROOT_PATH);
 
-    if(!add_directory(argv[2]))
+    if(!add_directory(in_dir, ""))
     {
         /* Error adding directory */
-        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", argv[2]);
+        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", in_dir);
 
         kill_fs();
 
         return -1;
     }
 
-    /* Write out filesystem */
-    FILE *fp = fopen(argv[1], "wb");
+#ifdef _SC_NPROCESSORS_ONLN
+    num_cpus = MAX(1, MIN(MAX_THREADS, sysconf(_SC_NPROCESSORS_ONLN)));
+#endif
 
-    if(!fp)
+    if(trace_file)
+    {
+        if(!load_trace(trace_file))
+        {
+            kill_fs();
+
+            return -1;
+        }
+
+        order_files();
+    }
+
+    /* Directory sectors come first, blobs follow */
+    uint32_t dir_size = fs_size;
+    uint64_t options = options_hash(write_index);
+
+    char *manifest_file = malloc(strlen(out_file) + sizeof(".manifest"));
+    strcpy(manifest_file, out_file);
+    strcat(manifest_file, ".manifest");
+
+    if(incremental && load_manifest(manifest_file, out_file, options))
+    {
+        printf("Patching previous image.\n");
+    }
+
+    /* A stale manifest must never be trusted: it is written again once the image is complete */
+    remove(manifest_file);
+
+    if(!write_files())
     {
-        /* Error writing file out */
-        fprintf(stderr, "Error opening '%s' for writing.\n", argv[1]);
+        fprintf(stderr, "Error creating filesystem: cannot add files\n");
 
+        free(manifest_file);
         kill_fs();
 
         return -1;
     }
 
-    fwrite(dfs, 1, fs_size, fp);
-    fclose(fp);
+    uint32_t end = fs_size;
+
+    if(write_index)
+    {
+        /* Point the root sector to the path table. Old readers ignore this field. */
+        uint32_t table = write_path_table();
+
+        id = sector_to_memory(0);
+        id->file_pointer = SWAPLONG(table);
+    }
+
+    if(old_image)
+    {
+        /* Only write what changed */
+        if(!patch_image(dir_size))
+        {
+            fprintf(stderr, "Error writing '%s'.\n", out_file);
+
+            free(manifest_file);
+            kill_fs();
+
+            return -1;
+        }
+    }
+    else
+    {
+        /* Write out filesystem */
+        FILE *fp = fopen(out_file, "wb");
+
+        if(!fp)
+        {
+            /* Error writing file out */
+            fprintf(stderr, "Error opening '%s' for writing.\n", out_file);
+
+            free(manifest_file);
+            kill_fs();
+
+            return -1;
+        }
+
+        fwrite(dfs, 1, fs_size, fp);
+        fclose(fp);
+    }
+
+    if(incremental && !write_manifest(manifest_file, options, dir_size, end))
+    {
+        /* Not fatal: the next build will be a full one */
+        fprintf(stderr, "Cannot write manifest '%s'.\n", manifest_file);
+        remove(manifest_file);
+    }
 
+    free(manifest_file);
     kill_fs();
 
     return 0;